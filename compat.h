@@ -6,6 +6,8 @@
 #ifndef COMPAT_H
 #define COMPAT_H
 
+#include <stdint.h>
+
 #ifdef _MSC_VER
 /* MSVC-specific definitions */
 
@@ -40,6 +42,12 @@ static inline long compat_timer_elapsed_ms(compat_timer *t) {
     return (long)((end.QuadPart - t->start.QuadPart) * 1000 / t->freq.QuadPart);
 }
 
+static inline uint64_t compat_timer_elapsed_us(compat_timer *t) {
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    return (uint64_t)((end.QuadPart - t->start.QuadPart) * 1000000 / t->freq.QuadPart);
+}
+
 #else
 /* GCC/Clang definitions */
 
@@ -69,6 +77,13 @@ static inline long compat_timer_elapsed_ms(compat_timer *t) {
             (t->start.tv_sec * 1000000L + t->start.tv_usec)) / 1000;
 }
 
+static inline uint64_t compat_timer_elapsed_us(compat_timer *t) {
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    return (uint64_t)((end.tv_sec - t->start.tv_sec) * 1000000L +
+                      (end.tv_usec - t->start.tv_usec));
+}
+
 #endif /* _MSC_VER */
 
 #endif /* COMPAT_H */
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pigletvm.h"
+
+#define STACK_MAX 256
+
+/*
+ * Static bytecode analysis: reachability, stack depths and basic blocks
+ * */
+
+typedef enum flow_kind {
+    /* control goes to the next instruction */
+    FLOW_NEXT,
+    /* control goes to the target address only */
+    FLOW_JUMP,
+    /* control goes either to the target address or to the next instruction */
+    FLOW_BRANCH,
+    /* execution stops */
+    FLOW_STOP,
+    /* control goes to the target address, then returns to the next instruction */
+    FLOW_CALL,
+    /* control goes back to the instruction after the call */
+    FLOW_RETURN,
+} flow_kind;
+
+typedef struct analysis_opinfo {
+    bool is_known;
+    bool has_arg;
+    uint8_t pops;
+    uint8_t pushes;
+    flow_kind flow;
+} analysis_opinfo;
+
+static const analysis_opinfo analysis_opcode_to_opinfo[OP_NUMBER_OF_OPS] = {
+    [OP_ABORT] = {true, false, 0, 0, FLOW_STOP},
+    [OP_PUSHI] = {true, true, 0, 1, FLOW_NEXT},
+    [OP_LOADI] = {true, true, 0, 1, FLOW_NEXT},
+    [OP_LOADADDI] = {true, true, 1, 1, FLOW_NEXT},
+    [OP_STOREI] = {true, true, 1, 0, FLOW_NEXT},
+    [OP_LOAD] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_STORE] = {true, false, 2, 0, FLOW_NEXT},
+    [OP_DUP] = {true, false, 1, 2, FLOW_NEXT},
+    [OP_DISCARD] = {true, false, 1, 0, FLOW_NEXT},
+    [OP_ADD] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_ADDI] = {true, true, 1, 1, FLOW_NEXT},
+    [OP_SUB] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_DIV] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_MUL] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_JUMP] = {true, true, 0, 0, FLOW_JUMP},
+    [OP_JUMP_IF_TRUE] = {true, true, 1, 0, FLOW_BRANCH},
+    [OP_JUMP_IF_FALSE] = {true, true, 1, 0, FLOW_BRANCH},
+    [OP_EQUAL] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_LESS] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_LESS_OR_EQUAL] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_GREATER] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_GREATER_OR_EQUAL] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_GREATER_OR_EQUALI] = {true, true, 1, 1, FLOW_NEXT},
+    [OP_POP_RES] = {true, false, 1, 0, FLOW_NEXT},
+    [OP_DONE] = {true, false, 0, 0, FLOW_STOP},
+    [OP_PRINT] = {true, false, 1, 0, FLOW_NEXT},
+    [OP_CALL] = {true, true, 0, 0, FLOW_CALL},
+    [OP_RET] = {true, false, 0, 0, FLOW_RETURN},
+    [OP_LOAD8] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_LOAD16] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_LOAD32] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_STORE8] = {true, false, 2, 0, FLOW_NEXT},
+    [OP_STORE16] = {true, false, 2, 0, FLOW_NEXT},
+    [OP_STORE32] = {true, false, 2, 0, FLOW_NEXT},
+    [OP_BIT_TEST] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_BIT_SET] = {true, false, 1, 0, FLOW_NEXT},
+    [OP_MEMSET] = {true, false, 3, 0, FLOW_NEXT},
+    [OP_MEMCPY] = {true, false, 3, 0, FLOW_NEXT},
+    [OP_MEMSUM] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_MEMMIN] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_MEMMAX] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_MEMCOUNT] = {true, false, 2, 1, FLOW_NEXT},
+    /* pops the arguments of the function, see below */
+    [OP_CALLNATIVE] = {true, true, 0, 1, FLOW_NEXT},
+    [OP_YIELD] = {true, false, 0, 0, FLOW_NEXT},
+    [OP_PUSHK] = {true, true, 0, 1, FLOW_NEXT},
+    [OP_AND] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_OR] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_XOR] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_NOT] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_SHL] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_SHR] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_SAR] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_MOD] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_LESS_SIGNED] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_LESS_OR_EQUAL_SIGNED] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_GREATER_SIGNED] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_GREATER_OR_EQUAL_SIGNED] = {true, false, 2, 1, FLOW_NEXT},
+    [OP_ALLOC] = {true, false, 1, 1, FLOW_NEXT},
+    [OP_FREE] = {true, false, 1, 0, FLOW_NEXT},
+};
+
+static const analysis_opinfo unknown_opinfo = {false, false, 0, 0, FLOW_STOP};
+
+static const analysis_opinfo *opinfo_at_pc(uint8_t *bytecode, size_t pc)
+{
+    uint8_t op = bytecode[pc];
+    if (op >= OP_NUMBER_OF_OPS || !analysis_opcode_to_opinfo[op].is_known)
+        return &unknown_opinfo;
+    return &analysis_opcode_to_opinfo[op];
+}
+
+size_t vm_instruction_len(uint8_t *bytecode, size_t pc)
+{
+    return opinfo_at_pc(bytecode, pc)->has_arg ? 3 : 1;
+}
+
+uint16_t vm_instruction_arg(uint8_t *bytecode, size_t pc)
+{
+    return opinfo_at_pc(bytecode, pc)->has_arg ? ARG_AT_PC(bytecode, pc) : 0;
+}
+
+void vm_instruction_stack_effect(uint8_t *bytecode, size_t pc, int *pops, int *pushes)
+{
+    const analysis_opinfo *info = opinfo_at_pc(bytecode, pc);
+    *pops = info->pops;
+    *pushes = info->pushes;
+    /* Unknown native functions stop execution, their arity does not matter */
+    if (bytecode[pc] == OP_CALLNATIVE) {
+        const vm_native *native = vm_native_at(ARG_AT_PC(bytecode, pc));
+        *pops = native ? native->arity : 0;
+    }
+}
+
+static analysis_result fail_at(vm_analysis *analysis, analysis_result error, size_t pc)
+{
+    analysis->error_pc = pc;
+    return error;
+}
+
+/* The walk state. Every reachable pc belongs to a function, i.e. the entry point of the function's
+ * code. The main code is the function at pc 0.
+ *
+ * Functions are walked on their own: depths are relative to the depth the function is entered
+ * with, going below zero for arguments taken off the caller's stack. Once the walk is done, the
+ * lowest depth reached turns into the function's argument count and depths start counting from
+ * the first argument. */
+typedef struct walker {
+    uint8_t *bytecode;
+    vm_analysis *analysis;
+    /* Every reachable pc gets queued exactly once */
+    uint16_t worklist[MAX_CODE_LEN];
+    size_t worklist_len;
+    bool is_reached[MAX_CODE_LEN];
+    /* stack depth after returning from a function, valid once some RET is processed */
+    bool has_ret[MAX_CODE_LEN];
+    int16_t ret_depth[MAX_CODE_LEN];
+    /* the lowest and the highest depth a function's code and its callees reach */
+    int16_t low[MAX_CODE_LEN];
+    int16_t high[MAX_CODE_LEN];
+} walker;
+
+/* Record the depth expected at pc, queue pc for processing if it was not seen before */
+static analysis_result visit(walker *w, size_t pc, int16_t depth, uint16_t func)
+{
+    vm_analysis *analysis = w->analysis;
+    if (pc >= MAX_CODE_LEN)
+        return fail_at(analysis, ANALYSIS_ERROR_CODE_OVERFLOW, pc);
+
+    if (!w->is_reached[pc]) {
+        w->is_reached[pc] = true;
+        analysis->depth[pc] = depth;
+        analysis->func[pc] = func;
+        w->worklist[w->worklist_len++] = pc;
+    } else if (analysis->depth[pc] != depth) {
+        return fail_at(analysis, ANALYSIS_ERROR_STACK_MISMATCH, pc);
+    } else if (analysis->func[pc] != func) {
+        return fail_at(analysis, ANALYSIS_ERROR_CALL_MISMATCH, pc);
+    }
+
+    return ANALYSIS_OK;
+}
+
+/* Continue after a call as soon as the callee's depth after returning is known */
+static analysis_result visit_return_site(walker *w, size_t call_pc)
+{
+    size_t callee = ARG_AT_PC(w->bytecode, call_pc);
+    if (callee >= MAX_CODE_LEN || !w->has_ret[callee])
+        return ANALYSIS_OK;
+
+    /* Whatever the callee took and left on the stack, counted from the call's depth */
+    size_t return_pc = call_pc + 3;
+    int16_t return_depth = w->analysis->depth[call_pc] + w->ret_depth[callee];
+    if (return_depth > STACK_MAX)
+        return fail_at(w->analysis, ANALYSIS_ERROR_STACK_OVERFLOW, call_pc);
+    analysis_result res = visit(w, return_pc, return_depth, w->analysis->func[call_pc]);
+    if (res == ANALYSIS_OK)
+        w->analysis->is_block_start[return_pc] = w->analysis->is_jump_target[return_pc] = true;
+    return res;
+}
+
+static bool is_reached_call(walker *w, size_t pc)
+{ return w->is_reached[pc] && w->bytecode[pc] == OP_CALL; }
+
+/* Callees reach into their callers' stack, a call at depth d lowers the caller's lowest depth to d
+ * plus the callee's one. Calls keep being applied until nothing changes: recursion digging ever
+ * deeper into the stack underflows any real stack eventually, and so does reaching below the main
+ * code's stack. */
+static analysis_result propagate_low_depths(walker *w)
+{
+    vm_analysis *analysis = w->analysis;
+    bool is_changed = true;
+    while (is_changed) {
+        is_changed = false;
+        for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+            if (!is_reached_call(w, pc))
+                continue;
+            uint16_t func = analysis->func[pc];
+            int low = analysis->depth[pc] + w->low[ARG_AT_PC(w->bytecode, pc)];
+            if (low >= w->low[func])
+                continue;
+            if (low < -STACK_MAX || (func == 0 && low < 0))
+                return fail_at(analysis, ANALYSIS_ERROR_STACK_UNDERFLOW, pc);
+            w->low[func] = (int16_t)low;
+            is_changed = true;
+        }
+    }
+    return ANALYSIS_OK;
+}
+
+/* The same for the highest depth, with depths counted from the first argument already: a callee's
+ * frame starts at the call's depth less its arguments. Recursion growing the stack overflows. */
+static analysis_result propagate_high_depths(walker *w)
+{
+    vm_analysis *analysis = w->analysis;
+    bool is_changed = true;
+    while (is_changed) {
+        is_changed = false;
+        for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+            if (!is_reached_call(w, pc))
+                continue;
+            uint16_t func = analysis->func[pc];
+            size_t callee = ARG_AT_PC(w->bytecode, pc);
+            int high = analysis->depth[pc] - analysis->depth[callee] + w->high[callee];
+            if (high <= w->high[func])
+                continue;
+            if (high > STACK_MAX)
+                return fail_at(analysis, ANALYSIS_ERROR_STACK_OVERFLOW, pc);
+            w->high[func] = (int16_t)high;
+            is_changed = true;
+        }
+    }
+    return ANALYSIS_OK;
+}
+
+/* Count depths from the first argument of each function, find out how deep the stack gets */
+static analysis_result settle_depths(walker *w)
+{
+    vm_analysis *analysis = w->analysis;
+    analysis_result res = propagate_low_depths(w);
+    if (res != ANALYSIS_OK)
+        return res;
+
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+        if (!w->is_reached[pc]) {
+            analysis->depth[pc] = VM_UNREACHABLE;
+            continue;
+        }
+        analysis->depth[pc] -= w->low[analysis->func[pc]];
+    }
+    for (size_t func = 0; func < MAX_CODE_LEN; func++)
+        w->high[func] -= w->low[func];
+
+    res = propagate_high_depths(w);
+    analysis->max_depth = w->high[0];
+    return res;
+}
+
+analysis_result vm_analyze(uint8_t *bytecode, vm_analysis *analysis)
+{
+    memset(analysis, 0, sizeof(*analysis));
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++)
+        analysis->depth[pc] = VM_UNREACHABLE;
+
+    walker *w = calloc(1, sizeof(*w));
+    if (!w) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    w->bytecode = bytecode;
+    w->analysis = analysis;
+
+    analysis->is_block_start[0] = true;
+    analysis_result res = visit(w, 0, 0, 0);
+
+    while (res == ANALYSIS_OK && w->worklist_len > 0) {
+        size_t pc = w->worklist[--w->worklist_len];
+        int16_t depth = analysis->depth[pc];
+        uint16_t func = analysis->func[pc];
+        const analysis_opinfo *info = opinfo_at_pc(bytecode, pc);
+
+        if (info->has_arg && pc + 2 >= MAX_CODE_LEN) {
+            res = fail_at(analysis, ANALYSIS_ERROR_CODE_OVERFLOW, pc);
+            break;
+        }
+        int pops, pushes;
+        vm_instruction_stack_effect(bytecode, pc, &pops, &pushes);
+
+        /* Only the main code is known to start with an empty stack */
+        int low = depth - pops;
+        if (low < -STACK_MAX || (func == 0 && low < 0)) {
+            res = fail_at(analysis, ANALYSIS_ERROR_STACK_UNDERFLOW, pc);
+            break;
+        }
+        if (low < w->low[func])
+            w->low[func] = (int16_t)low;
+
+        int16_t next_depth = depth - pops + pushes;
+        if (next_depth > STACK_MAX) {
+            res = fail_at(analysis, ANALYSIS_ERROR_STACK_OVERFLOW, pc);
+            break;
+        }
+        if (next_depth > w->high[func])
+            w->high[func] = next_depth;
+
+        size_t next_pc = pc + (info->has_arg ? 3 : 1);
+        switch (info->flow) {
+        case FLOW_NEXT:
+            res = visit(w, next_pc, next_depth, func);
+            break;
+        case FLOW_JUMP:{
+            size_t target = ARG_AT_PC(bytecode, pc);
+            res = visit(w, target, next_depth, func);
+            if (res == ANALYSIS_OK)
+                analysis->is_block_start[target] = analysis->is_jump_target[target] = true;
+            break;
+        }
+        case FLOW_BRANCH:{
+            size_t target = ARG_AT_PC(bytecode, pc);
+            res = visit(w, target, next_depth, func);
+            if (res != ANALYSIS_OK)
+                break;
+            analysis->is_block_start[target] = analysis->is_jump_target[target] = true;
+
+            res = visit(w, next_pc, next_depth, func);
+            if (res == ANALYSIS_OK)
+                analysis->is_block_start[next_pc] = true;
+            break;
+        }
+        case FLOW_CALL:{
+            /* The callee's code is a function of its own, walked relative to the call's depth */
+            size_t target = ARG_AT_PC(bytecode, pc);
+            res = visit(w, target, 0, target);
+            if (res != ANALYSIS_OK)
+                break;
+            analysis->is_block_start[target] = analysis->is_jump_target[target] = true;
+
+            res = visit_return_site(w, pc);
+            break;
+        }
+        case FLOW_RETURN:{
+            if (w->has_ret[func]) {
+                if (w->ret_depth[func] != next_depth)
+                    res = fail_at(analysis, ANALYSIS_ERROR_STACK_MISMATCH, pc);
+                break;
+            }
+
+            /* The first RET of the function seen, calls processed so far can continue now */
+            w->has_ret[func] = true;
+            w->ret_depth[func] = next_depth;
+            for (size_t call_pc = 0; call_pc < MAX_CODE_LEN && res == ANALYSIS_OK; call_pc++) {
+                if (is_reached_call(w, call_pc) && call_pc + 2 < MAX_CODE_LEN &&
+                    ARG_AT_PC(bytecode, call_pc) == func)
+                    res = visit_return_site(w, call_pc);
+            }
+            break;
+        }
+        case FLOW_STOP:
+            break;
+        }
+    }
+
+    if (res == ANALYSIS_OK)
+        res = settle_depths(w);
+
+    free(w);
+    return res;
+}
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BULK_SSE2 1
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define BULK_SSE42 1
+#endif
+
+#include "pigletvm.h"
+
+/*
+ * Bulk memory kernels
+ *
+ * Range checks are done by the engines once per op, kernels just work on cell pointers. SSE2 covers
+ * fill, sum and count on every x86-64 host, unsigned 64-bit comparisons need SSE4.2. Scalar loops
+ * are left for the rest and the tails, the compiler vectorizes them where it can.
+ * */
+
+void vm_memory_fill(uint64_t *cells, uint64_t count, uint64_t val)
+{
+    uint64_t i = 0;
+#ifdef BULK_SSE2
+    __m128i v = _mm_set1_epi64x((long long)val);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *)(cells + i), v);
+        _mm_storeu_si128((__m128i *)(cells + i + 2), v);
+    }
+#endif
+    for (; i < count; i++)
+        cells[i] = val;
+}
+
+void vm_memory_copy(uint64_t *dst, const uint64_t *src, uint64_t count)
+{
+    /* libc already has the best vectorized copy for the host, ranges may overlap */
+    memmove(dst, src, count * sizeof(*dst));
+}
+
+uint64_t vm_memory_sum(const uint64_t *cells, uint64_t count)
+{
+    uint64_t i = 0;
+    uint64_t sum = 0;
+#ifdef BULK_SSE2
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_epi64(acc0, _mm_loadu_si128((const __m128i *)(cells + i)));
+        acc1 = _mm_add_epi64(acc1, _mm_loadu_si128((const __m128i *)(cells + i + 2)));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < count; i++)
+        sum += cells[i];
+    return sum;
+}
+
+#ifdef BULK_SSE42
+/* SSE4.2 only has signed 64-bit comparisons, flipping the sign bit makes them unsigned */
+static inline __m128i greater_epu64(__m128i a, __m128i b)
+{
+    const __m128i sign = _mm_set1_epi64x((long long)0x8000000000000000ull);
+    return _mm_cmpgt_epi64(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+}
+
+static inline __m128i select_epi64(__m128i mask, __m128i if_set, __m128i if_clear)
+{
+    return _mm_or_si128(_mm_and_si128(mask, if_set), _mm_andnot_si128(mask, if_clear));
+}
+#endif
+
+uint64_t vm_memory_min(const uint64_t *cells, uint64_t count)
+{
+    uint64_t i = 0;
+    uint64_t min = UINT64_MAX;
+#ifdef BULK_SSE42
+    __m128i acc = _mm_set1_epi64x(-1);
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(cells + i));
+        acc = select_epi64(greater_epu64(acc, v), v, acc);
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+#endif
+    for (; i < count; i++)
+        min = cells[i] < min ? cells[i] : min;
+    return min;
+}
+
+uint64_t vm_memory_max(const uint64_t *cells, uint64_t count)
+{
+    uint64_t i = 0;
+    uint64_t max = 0;
+#ifdef BULK_SSE42
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(cells + i));
+        acc = select_epi64(greater_epu64(v, acc), v, acc);
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+#endif
+    for (; i < count; i++)
+        max = cells[i] > max ? cells[i] : max;
+    return max;
+}
+
+uint64_t vm_memory_count(const uint64_t *cells, uint64_t count)
+{
+    uint64_t i = 0;
+    uint64_t zeros = 0;
+#ifdef BULK_SSE2
+    /* No 64-bit compare in SSE2: a cell is zero if both of its 32-bit halves are. Zero cells
+     * become all ones, i.e. -1, so subtracting them counts zeros. */
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 2 <= count; i += 2) {
+        __m128i halves = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(cells + i)), zero);
+        __m128i swapped = _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128i cells_zero = _mm_and_si128(halves, swapped);
+        acc = _mm_sub_epi64(acc, cells_zero);
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    zeros = lanes[0] + lanes[1];
+#endif
+    for (; i < count; i++)
+        zeros += cells[i] == 0;
+    return count - zeros;
+}
@@ -0,0 +1,972 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pigletvm.h"
+
+#define STACK_MAX 256
+
+/* Rounds of passes before giving up on reaching a fixed point */
+#define PASS_ROUNDS_MAX 16
+
+/*
+ * Control flow graphs
+ *
+ * Lifting takes the blocks and stack depths vm_analyze finds, so only verified, reachable code
+ * makes it into the graph. Jumps leave the block bodies and become block exits pointing to blocks,
+ * plain fallthroughs included; lowering turns exits back into jumps wherever the layout needs them,
+ * and flips the condition of a branch whose taken side is the block that follows. Lowered code goes
+ * through vm_analyze again.
+ *
+ * Block weights are guessed from loops: a jump backwards in the code closes a loop made of the
+ * blocks reaching the jump without going through its target, unless the function's entry is one of
+ * them. Every loop around a block makes it 8 times heavier. Calls are not followed, a function's
+ * blocks are weighed on their own.
+ *
+ * Dataflow sets are bitsets, solved by iterating over the blocks until nothing changes. Block exits
+ * are part of the blocks: a call reads and may write every cell, stopping or returning reads every
+ * cell, since the host or the caller gets to see memory afterwards.
+ *
+ * Passes keep blocks valid for the analysis: everything a block does to the stack stays the same,
+ * so entry depths never change.
+ * */
+
+static void *checked_malloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void *checked_calloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count ? count : 1, size);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static size_t op_len(uint8_t op)
+{
+    return vm_instruction_len(&op, 0);
+}
+
+static void instr_stack_effect(const vm_cfg_instr *instr, int *pops, int *pushes)
+{
+    uint8_t bytes[3] = {instr->op, (uint8_t)(instr->arg >> 8), (uint8_t)instr->arg};
+    vm_instruction_stack_effect(bytes, 0, pops, pushes);
+}
+
+static bool exit_is_stop(uint8_t exit_op)
+{
+    return exit_op != OP_JUMP && exit_op != OP_JUMP_IF_TRUE && exit_op != OP_JUMP_IF_FALSE &&
+        exit_op != OP_CALL;
+}
+
+static void block_insert(vm_cfg_block *block, size_t instr_i, uint8_t op, uint16_t arg)
+{
+    if (block->instr_num == block->instr_cap) {
+        block->instr_cap = block->instr_cap ? 2 * block->instr_cap : 8;
+        vm_cfg_instr *instrs = realloc(block->instrs, block->instr_cap * sizeof(*instrs));
+        if (!instrs) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        block->instrs = instrs;
+    }
+    memmove(&block->instrs[instr_i + 1], &block->instrs[instr_i],
+            (block->instr_num - instr_i) * sizeof(*block->instrs));
+    block->instrs[instr_i] = (vm_cfg_instr) {op, arg};
+    block->instr_num++;
+}
+
+static void block_remove(vm_cfg_block *block, size_t instr_i)
+{
+    memmove(&block->instrs[instr_i], &block->instrs[instr_i + 1],
+            (block->instr_num - instr_i - 1) * sizeof(*block->instrs));
+    block->instr_num--;
+}
+
+size_t vm_cfg_successors(const vm_cfg *cfg, size_t block_i, size_t successors[2])
+{
+    const vm_cfg_block *block = &cfg->blocks[block_i];
+    if (exit_is_stop(block->exit_op))
+        return 0;
+
+    size_t successor_num = 0;
+    successors[successor_num++] = block->target;
+    if (block->exit_op != OP_JUMP && block->next != VM_CFG_NONE)
+        successors[successor_num++] = block->next;
+    return successor_num;
+}
+
+/* Successors within the block's function, return sites rather than callees */
+static size_t flow_successors(const vm_cfg *cfg, size_t block_i, size_t successors[2])
+{
+    const vm_cfg_block *block = &cfg->blocks[block_i];
+    if (block->exit_op != OP_CALL)
+        return vm_cfg_successors(cfg, block_i, successors);
+
+    if (block->next == VM_CFG_NONE)
+        return 0;
+    successors[0] = block->next;
+    return 1;
+}
+
+static void estimate_weights(vm_cfg *cfg)
+{
+    size_t block_num = cfg->block_num;
+    size_t *loop_num = checked_calloc(block_num, sizeof(*loop_num));
+    bool *is_in_loop = checked_calloc(block_num, sizeof(*is_in_loop));
+    size_t *worklist = checked_calloc(block_num, sizeof(*worklist));
+
+    /* Predecessor lists, all of them in one array */
+    size_t *pred_start = checked_calloc(block_num + 1, sizeof(*pred_start));
+    size_t *preds = checked_calloc(2 * block_num, sizeof(*preds));
+    size_t successors[2];
+    for (size_t block_i = 0; block_i < block_num; block_i++) {
+        size_t successor_num = flow_successors(cfg, block_i, successors);
+        for (size_t succ_i = 0; succ_i < successor_num; succ_i++)
+            pred_start[successors[succ_i] + 1]++;
+    }
+    /* The main code and every callee start a function */
+    bool *is_entry = checked_calloc(block_num, sizeof(*is_entry));
+    is_entry[0] = true;
+    for (size_t block_i = 0; block_i < block_num; block_i++)
+        if (cfg->blocks[block_i].exit_op == OP_CALL)
+            is_entry[cfg->blocks[block_i].target] = true;
+    for (size_t block_i = 0; block_i < block_num; block_i++)
+        pred_start[block_i + 1] += pred_start[block_i];
+    size_t *pred_fill = checked_calloc(block_num, sizeof(*pred_fill));
+    for (size_t block_i = 0; block_i < block_num; block_i++) {
+        size_t successor_num = flow_successors(cfg, block_i, successors);
+        for (size_t succ_i = 0; succ_i < successor_num; succ_i++) {
+            size_t succ = successors[succ_i];
+            preds[pred_start[succ] + pred_fill[succ]++] = block_i;
+        }
+    }
+
+    for (size_t block_i = 0; block_i < block_num; block_i++) {
+        size_t successor_num = flow_successors(cfg, block_i, successors);
+        for (size_t succ_i = 0; succ_i < successor_num; succ_i++) {
+            size_t header = successors[succ_i];
+            if (cfg->blocks[header].pc > cfg->blocks[block_i].pc)
+                continue;
+
+            /* Walk back from the jump to the loop header. Getting to where the function starts
+             * instead means the jump just goes back, it does not close a loop. */
+            memset(is_in_loop, 0, block_num * sizeof(*is_in_loop));
+            is_in_loop[header] = true;
+            size_t worklist_len = 0;
+            if (!is_in_loop[block_i]) {
+                is_in_loop[block_i] = true;
+                worklist[worklist_len++] = block_i;
+            }
+            bool is_loop = true;
+            while (worklist_len > 0 && is_loop) {
+                size_t loop_block = worklist[--worklist_len];
+                is_loop = !is_entry[loop_block];
+                for (size_t pred_i = pred_start[loop_block]; pred_i < pred_start[loop_block + 1];
+                     pred_i++) {
+                    if (!is_in_loop[preds[pred_i]]) {
+                        is_in_loop[preds[pred_i]] = true;
+                        worklist[worklist_len++] = preds[pred_i];
+                    }
+                }
+            }
+            for (size_t loop_block = 0; is_loop && loop_block < block_num; loop_block++)
+                loop_num[loop_block] += is_in_loop[loop_block];
+        }
+    }
+
+    for (size_t block_i = 0; block_i < block_num; block_i++) {
+        size_t nesting = loop_num[block_i] < 20 ? loop_num[block_i] : 20;
+        cfg->blocks[block_i].weight = UINT64_C(1) << (3 * nesting);
+    }
+
+    free(is_entry);
+    free(pred_fill);
+    free(preds);
+    free(pred_start);
+    free(worklist);
+    free(is_in_loop);
+    free(loop_num);
+}
+
+analysis_result vm_cfg_lift(uint8_t *bytecode, vm_cfg *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    memcpy(cfg->bytecode, bytecode, MAX_CODE_LEN);
+
+    vm_analysis *analysis = checked_malloc(sizeof(*analysis));
+    analysis_result res = vm_analyze(bytecode, analysis);
+    if (res != ANALYSIS_OK) {
+        free(analysis);
+        return res;
+    }
+
+    size_t *block_at = checked_malloc(MAX_CODE_LEN * sizeof(*block_at));
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+        bool is_block = analysis->is_block_start[pc] && analysis->depth[pc] != VM_UNREACHABLE;
+        block_at[pc] = is_block ? cfg->block_num++ : VM_CFG_NONE;
+    }
+    cfg->blocks = checked_calloc(cfg->block_num, sizeof(*cfg->blocks));
+    cfg->order = checked_calloc(cfg->block_num, sizeof(*cfg->order));
+
+    for (size_t start_pc = 0; start_pc < MAX_CODE_LEN; start_pc++) {
+        if (block_at[start_pc] == VM_CFG_NONE)
+            continue;
+
+        vm_cfg_block *block = &cfg->blocks[block_at[start_pc]];
+        block->pc = (uint16_t)start_pc;
+        block->depth = analysis->depth[start_pc];
+        block->target = block->next = VM_CFG_NONE;
+        block->is_reachable = true;
+        cfg->order[cfg->order_len++] = block_at[start_pc];
+
+        for (size_t pc = start_pc;;) {
+            uint8_t op = bytecode[pc];
+            size_t len = vm_instruction_len(bytecode, pc);
+            uint16_t arg = vm_instruction_arg(bytecode, pc);
+            size_t next_pc = pc + len;
+
+            if (op == OP_JUMP || op == OP_JUMP_IF_TRUE || op == OP_JUMP_IF_FALSE || op == OP_CALL) {
+                block->exit_op = op;
+                block->target = block_at[arg];
+                /* Callees that never return have no return site */
+                if (op != OP_JUMP && analysis->depth[next_pc] != VM_UNREACHABLE)
+                    block->next = block_at[next_pc];
+                break;
+            }
+            if (op == OP_RET || op == OP_DONE || op == OP_ABORT || op >= OP_NUMBER_OF_OPS) {
+                block->exit_op = op;
+                break;
+            }
+
+            block_insert(block, block->instr_num, op, arg);
+            pc = next_pc;
+            if (block_at[pc] != VM_CFG_NONE) {
+                block->exit_op = OP_JUMP;
+                block->target = block_at[pc];
+                break;
+            }
+        }
+    }
+
+    estimate_weights(cfg);
+
+    free(block_at);
+    free(analysis);
+    return ANALYSIS_OK;
+}
+
+void vm_cfg_free(vm_cfg *cfg)
+{
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++)
+        free(cfg->blocks[block_i].instrs);
+    free(cfg->blocks);
+    free(cfg->order);
+    cfg->blocks = NULL;
+    cfg->order = NULL;
+    cfg->block_num = cfg->order_len = 0;
+}
+
+typedef struct lowering {
+    uint8_t *out;
+    size_t out_len;
+    bool is_overflown;
+    /* Block starts in the output, VM_CFG_NONE for blocks left out */
+    size_t *new_pc;
+    /* Output positions of jump arguments and the blocks they go to */
+    size_t *patch_pos;
+    size_t *patch_block;
+    size_t patch_num;
+} lowering;
+
+static void emit_byte(lowering *l, uint8_t byte)
+{
+    if (l->out_len == MAX_CODE_LEN) {
+        l->is_overflown = true;
+        return;
+    }
+    l->out[l->out_len++] = byte;
+}
+
+static void emit_instr(lowering *l, uint8_t op, uint16_t arg)
+{
+    emit_byte(l, op);
+    if (op_len(op) == 3) {
+        emit_byte(l, (uint8_t)(arg >> 8));
+        emit_byte(l, (uint8_t)arg);
+    }
+}
+
+static void emit_jump(lowering *l, uint8_t op, size_t block_i)
+{
+    if (l->out_len + 3 <= MAX_CODE_LEN) {
+        l->patch_pos[l->patch_num] = l->out_len + 1;
+        l->patch_block[l->patch_num] = block_i;
+        l->patch_num++;
+    }
+    emit_instr(l, op, 0);
+}
+
+static void lower_exit(lowering *l, const vm_cfg_block *block, size_t layout_next)
+{
+    switch (block->exit_op) {
+    case OP_JUMP:
+        if (block->target != layout_next)
+            emit_jump(l, OP_JUMP, block->target);
+        break;
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+        if (block->next == layout_next) {
+            emit_jump(l, block->exit_op, block->target);
+        } else if (block->target == layout_next) {
+            bool is_true = block->exit_op == OP_JUMP_IF_TRUE;
+            emit_jump(l, is_true ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE, block->next);
+        } else {
+            emit_jump(l, block->exit_op, block->target);
+            emit_jump(l, OP_JUMP, block->next);
+        }
+        break;
+    case OP_CALL:
+        /* Returns land right after the call, a jump there goes on to the return site */
+        emit_jump(l, OP_CALL, block->target);
+        if (block->next != VM_CFG_NONE && block->next != layout_next)
+            emit_jump(l, OP_JUMP, block->next);
+        break;
+    default:
+        emit_byte(l, block->exit_op);
+        break;
+    }
+}
+
+analysis_result vm_cfg_lower(const vm_cfg *cfg, uint8_t *bytecode, size_t *code_len,
+                             size_t *consts_len)
+{
+    lowering l = {
+        .out = bytecode,
+        .new_pc = checked_malloc(cfg->block_num * sizeof(size_t)),
+        .patch_pos = checked_malloc(2 * cfg->order_len * sizeof(size_t)),
+        .patch_block = checked_malloc(2 * cfg->order_len * sizeof(size_t)),
+    };
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++)
+        l.new_pc[block_i] = VM_CFG_NONE;
+
+    /* Constants keep their indices */
+    size_t pool_len = 0;
+    for (size_t order_i = 0; order_i < cfg->order_len; order_i++) {
+        const vm_cfg_block *block = &cfg->blocks[cfg->order[order_i]];
+        for (size_t instr_i = 0; instr_i < block->instr_num; instr_i++) {
+            if (block->instrs[instr_i].op != OP_PUSHK)
+                continue;
+            size_t const_i = block->instrs[instr_i].arg & (VM_CONSTS_MAX - 1);
+            if (const_i + 1 > pool_len)
+                pool_len = const_i + 1;
+        }
+    }
+
+    memset(bytecode, 0, MAX_CODE_LEN);
+    for (size_t order_i = 0; order_i < cfg->order_len; order_i++) {
+        size_t block_i = cfg->order[order_i];
+        const vm_cfg_block *block = &cfg->blocks[block_i];
+        l.new_pc[block_i] = l.out_len;
+        for (size_t instr_i = 0; instr_i < block->instr_num; instr_i++)
+            emit_instr(&l, block->instrs[instr_i].op, block->instrs[instr_i].arg);
+        lower_exit(&l, block, order_i + 1 < cfg->order_len ? cfg->order[order_i + 1] : VM_CFG_NONE);
+    }
+
+    analysis_result res = ANALYSIS_OK;
+    if (l.is_overflown || l.out_len > MAX_CODE_LEN - pool_len * 8) {
+        res = ANALYSIS_ERROR_CODE_OVERFLOW;
+        goto out;
+    }
+
+    for (size_t patch_i = 0; patch_i < l.patch_num; patch_i++) {
+        /* A jump to a block left out would go nowhere */
+        size_t target = l.new_pc[l.patch_block[patch_i]];
+        if (target == VM_CFG_NONE) {
+            res = ANALYSIS_ERROR_CODE_OVERFLOW;
+            goto out;
+        }
+        bytecode[l.patch_pos[patch_i]] = (uint8_t)(target >> 8);
+        bytecode[l.patch_pos[patch_i] + 1] = (uint8_t)target;
+    }
+    for (size_t const_i = 0; const_i < pool_len; const_i++)
+        vm_const_set(bytecode, const_i, vm_const_at(cfg->bytecode, const_i));
+
+    vm_analysis *analysis = checked_malloc(sizeof(*analysis));
+    res = vm_analyze(bytecode, analysis);
+    free(analysis);
+    if (res != ANALYSIS_OK)
+        goto out;
+
+    if (code_len)
+        *code_len = l.out_len;
+    if (consts_len)
+        *consts_len = pool_len;
+
+out:
+    free(l.patch_block);
+    free(l.patch_pos);
+    free(l.new_pc);
+    return res;
+}
+
+
+/*
+ * Dataflow over memory cells
+ * */
+
+#define SET_WORDS(bit_num) (((bit_num) + 63) / 64)
+
+static bool set_has(const uint64_t *set, size_t bit)
+{
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void set_add(uint64_t *set, size_t bit)
+{
+    set[bit / 64] |= UINT64_C(1) << (bit % 64);
+}
+
+static void set_remove(uint64_t *set, size_t bit)
+{
+    set[bit / 64] &= ~(UINT64_C(1) << (bit % 64));
+}
+
+/* Sets the first bit_num bits */
+static void set_fill(uint64_t *set, size_t bit_num)
+{
+    for (size_t bit = 0; bit < bit_num; bit++)
+        set_add(set, bit);
+}
+
+/* Adds the source to the set, true if that changed it */
+static bool set_union(uint64_t *set, const uint64_t *source, size_t words)
+{
+    bool is_changed = false;
+    for (size_t word_i = 0; word_i < words; word_i++) {
+        uint64_t word = set[word_i] | source[word_i];
+        is_changed |= word != set[word_i];
+        set[word_i] = word;
+    }
+    return is_changed;
+}
+
+/* Ops reading or writing cells they do not name */
+static bool reads_any_cell(uint8_t op)
+{
+    switch (op) {
+    case OP_LOAD: case OP_LOAD8: case OP_LOAD16: case OP_LOAD32:
+    case OP_BIT_TEST: case OP_BIT_SET:
+    case OP_MEMCPY: case OP_MEMSUM: case OP_MEMMIN: case OP_MEMMAX: case OP_MEMCOUNT:
+    case OP_YIELD:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool writes_any_cell(uint8_t op)
+{
+    switch (op) {
+    case OP_STORE: case OP_STORE8: case OP_STORE16: case OP_STORE32:
+    case OP_BIT_SET: case OP_MEMSET: case OP_MEMCPY:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool names_cell(uint8_t op)
+{
+    return op == OP_LOADI || op == OP_LOADADDI || op == OP_STOREI;
+}
+
+/* Cells named in the graph in address order */
+static uint16_t *collect_cells(const vm_cfg *cfg, size_t *cell_num)
+{
+    bool *is_named = checked_calloc(MEMORY_SIZE, sizeof(*is_named));
+    *cell_num = 0;
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++) {
+        const vm_cfg_block *block = &cfg->blocks[block_i];
+        for (size_t instr_i = 0; instr_i < block->instr_num; instr_i++) {
+            const vm_cfg_instr *instr = &block->instrs[instr_i];
+            if (names_cell(instr->op) && !is_named[instr->arg]) {
+                is_named[instr->arg] = true;
+                (*cell_num)++;
+            }
+        }
+    }
+
+    uint16_t *cells = checked_malloc(*cell_num * sizeof(*cells));
+    size_t cell_i = 0;
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++)
+        if (is_named[addr])
+            cells[cell_i++] = (uint16_t)addr;
+    free(is_named);
+    return cells;
+}
+
+static size_t cell_index(const uint16_t *cells, size_t cell_num, uint16_t addr)
+{
+    size_t low = 0, high = cell_num;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (cells[mid] < addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < cell_num && cells[low] == addr ? low : VM_CFG_NONE;
+}
+
+/* Live cells before the instruction given the ones live after it */
+static void live_before(const vm_cfg_liveness *liveness, const vm_cfg_instr *instr, uint64_t *live)
+{
+    if (reads_any_cell(instr->op))
+        set_fill(live, liveness->cell_num);
+    else if (instr->op == OP_LOADI || instr->op == OP_LOADADDI)
+        set_add(live, cell_index(liveness->cells, liveness->cell_num, instr->arg));
+    else if (instr->op == OP_STOREI)
+        set_remove(live, cell_index(liveness->cells, liveness->cell_num, instr->arg));
+}
+
+void vm_cfg_liveness_compute(const vm_cfg *cfg, vm_cfg_liveness *liveness)
+{
+    liveness->cells = collect_cells(cfg, &liveness->cell_num);
+    size_t words = liveness->set_words = SET_WORDS(liveness->cell_num);
+    liveness->live_in = checked_calloc(cfg->block_num * words, sizeof(uint64_t));
+    liveness->live_out = checked_calloc(cfg->block_num * words, sizeof(uint64_t));
+    uint64_t *live = checked_calloc(words, sizeof(uint64_t));
+
+    /* Blocks stopping or calling read everything, the rest gets added until nothing changes */
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++)
+        if (cfg->blocks[block_i].exit_op == OP_CALL || exit_is_stop(cfg->blocks[block_i].exit_op))
+            set_fill(&liveness->live_out[block_i * words], liveness->cell_num);
+
+    for (bool is_changed = true; is_changed;) {
+        is_changed = false;
+        for (size_t block_i = cfg->block_num; block_i-- > 0;) {
+            const vm_cfg_block *block = &cfg->blocks[block_i];
+            uint64_t *live_out = &liveness->live_out[block_i * words];
+            size_t successors[2];
+            size_t successor_num = vm_cfg_successors(cfg, block_i, successors);
+            for (size_t succ_i = 0; succ_i < successor_num; succ_i++)
+                is_changed |= set_union(live_out, &liveness->live_in[successors[succ_i] * words],
+                                        words);
+
+            memcpy(live, live_out, words * sizeof(uint64_t));
+            for (size_t instr_i = block->instr_num; instr_i-- > 0;)
+                live_before(liveness, &block->instrs[instr_i], live);
+            is_changed |= set_union(&liveness->live_in[block_i * words], live, words);
+        }
+    }
+
+    free(live);
+}
+
+void vm_cfg_liveness_free(vm_cfg_liveness *liveness)
+{
+    free(liveness->cells);
+    free(liveness->live_in);
+    free(liveness->live_out);
+    memset(liveness, 0, sizeof(*liveness));
+}
+
+bool vm_cfg_is_live_out(const vm_cfg_liveness *liveness, size_t block_i, uint16_t addr)
+{
+    size_t cell_i = cell_index(liveness->cells, liveness->cell_num, addr);
+    return cell_i == VM_CFG_NONE ||
+        set_has(&liveness->live_out[block_i * liveness->set_words], cell_i);
+}
+
+/* Definitions reaching past the instruction given the ones reaching it */
+static void reach_past(const vm_cfg_reaching *reaching, size_t block_i, size_t instr_i,
+                       const vm_cfg_instr *instr, uint64_t *reach)
+{
+    if (writes_any_cell(instr->op)) {
+        set_fill(reach, reaching->cell_num);
+    } else if (instr->op == OP_STOREI) {
+        for (size_t def_i = 0; def_i < reaching->def_num; def_i++) {
+            const vm_cfg_def *def = &reaching->defs[def_i];
+            if (def->addr != instr->arg)
+                continue;
+            if (def->block_i == block_i && def->instr_i == instr_i)
+                set_add(reach, def_i);
+            else
+                set_remove(reach, def_i);
+        }
+    }
+}
+
+void vm_cfg_reaching_compute(const vm_cfg *cfg, vm_cfg_reaching *reaching)
+{
+    reaching->cells = collect_cells(cfg, &reaching->cell_num);
+
+    reaching->def_num = reaching->cell_num;
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++)
+        for (size_t instr_i = 0; instr_i < cfg->blocks[block_i].instr_num; instr_i++)
+            reaching->def_num += cfg->blocks[block_i].instrs[instr_i].op == OP_STOREI;
+    reaching->defs = checked_malloc(reaching->def_num * sizeof(*reaching->defs));
+    size_t def_i = 0;
+    for (size_t cell_i = 0; cell_i < reaching->cell_num; cell_i++)
+        reaching->defs[def_i++] = (vm_cfg_def) {reaching->cells[cell_i], VM_CFG_NONE, VM_CFG_NONE};
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++) {
+        const vm_cfg_block *block = &cfg->blocks[block_i];
+        for (size_t instr_i = 0; instr_i < block->instr_num; instr_i++) {
+            const vm_cfg_instr *instr = &block->instrs[instr_i];
+            if (instr->op == OP_STOREI)
+                reaching->defs[def_i++] = (vm_cfg_def) {instr->arg, block_i, instr_i};
+        }
+    }
+
+    size_t words = reaching->set_words = SET_WORDS(reaching->def_num);
+    reaching->reach_in = checked_calloc(cfg->block_num * words, sizeof(uint64_t));
+    reaching->reach_out = checked_calloc(cfg->block_num * words, sizeof(uint64_t));
+    uint64_t *reach = checked_calloc(words, sizeof(uint64_t));
+
+    if (cfg->block_num > 0)
+        set_fill(reaching->reach_in, reaching->cell_num);
+
+    for (bool is_changed = true; is_changed;) {
+        is_changed = false;
+        for (size_t block_i = 0; block_i < cfg->block_num; block_i++) {
+            const vm_cfg_block *block = &cfg->blocks[block_i];
+            memcpy(reach, &reaching->reach_in[block_i * words], words * sizeof(uint64_t));
+            for (size_t instr_i = 0; instr_i < block->instr_num; instr_i++)
+                reach_past(reaching, block_i, instr_i, &block->instrs[instr_i], reach);
+            /* The callee may store anywhere */
+            if (block->exit_op == OP_CALL)
+                set_fill(reach, reaching->cell_num);
+
+            uint64_t *reach_out = &reaching->reach_out[block_i * words];
+            is_changed |= set_union(reach_out, reach, words);
+            size_t successors[2];
+            size_t successor_num = vm_cfg_successors(cfg, block_i, successors);
+            for (size_t succ_i = 0; succ_i < successor_num; succ_i++)
+                is_changed |= set_union(&reaching->reach_in[successors[succ_i] * words], reach_out,
+                                        words);
+        }
+    }
+
+    free(reach);
+}
+
+void vm_cfg_reaching_free(vm_cfg_reaching *reaching)
+{
+    free(reaching->cells);
+    free(reaching->defs);
+    free(reaching->reach_in);
+    free(reaching->reach_out);
+    memset(reaching, 0, sizeof(*reaching));
+}
+
+size_t vm_cfg_reaching_at(const vm_cfg *cfg, const vm_cfg_reaching *reaching, size_t block_i,
+                          size_t instr_i, uint16_t addr, size_t *defs_out, size_t def_max)
+{
+    const vm_cfg_block *block = &cfg->blocks[block_i];
+    size_t words = reaching->set_words;
+    uint64_t *reach = checked_malloc(words * sizeof(uint64_t));
+    memcpy(reach, &reaching->reach_in[block_i * words], words * sizeof(uint64_t));
+    for (size_t past_i = 0; past_i < instr_i && past_i < block->instr_num; past_i++)
+        reach_past(reaching, block_i, past_i, &block->instrs[past_i], reach);
+
+    size_t def_num = 0;
+    for (size_t def_i = 0; def_i < reaching->def_num; def_i++) {
+        if (reaching->defs[def_i].addr != addr || !set_has(reach, def_i))
+            continue;
+        if (def_num < def_max)
+            defs_out[def_num] = def_i;
+        def_num++;
+    }
+
+    free(reach);
+    return def_num;
+}
+
+
+/*
+ * Passes
+ * */
+
+bool vm_cfg_remove_unreachable(vm_cfg *cfg)
+{
+    if (cfg->block_num == 0)
+        return false;
+
+    bool *is_reached = checked_calloc(cfg->block_num, sizeof(*is_reached));
+    size_t *worklist = checked_calloc(cfg->block_num, sizeof(*worklist));
+    size_t worklist_len = 0;
+    is_reached[0] = true;
+    worklist[worklist_len++] = 0;
+    while (worklist_len > 0) {
+        size_t successors[2];
+        size_t successor_num = vm_cfg_successors(cfg, worklist[--worklist_len], successors);
+        for (size_t succ_i = 0; succ_i < successor_num; succ_i++) {
+            if (!is_reached[successors[succ_i]]) {
+                is_reached[successors[succ_i]] = true;
+                worklist[worklist_len++] = successors[succ_i];
+            }
+        }
+    }
+
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++)
+        cfg->blocks[block_i].is_reachable = is_reached[block_i];
+    size_t order_len = 0;
+    for (size_t order_i = 0; order_i < cfg->order_len; order_i++)
+        if (is_reached[cfg->order[order_i]])
+            cfg->order[order_len++] = cfg->order[order_i];
+    bool is_changed = order_len != cfg->order_len;
+    cfg->order_len = order_len;
+
+    free(worklist);
+    free(is_reached);
+    return is_changed;
+}
+
+/* Ops without side effects that cannot fail: nobody misses them if their results are discarded */
+static bool is_pure(uint8_t op)
+{
+    switch (op) {
+    case OP_PUSHI: case OP_PUSHK: case OP_LOADI: case OP_LOADADDI: case OP_DUP:
+    case OP_LOAD: case OP_LOAD8: case OP_LOAD16: case OP_LOAD32: case OP_BIT_TEST:
+    case OP_ADD: case OP_ADDI: case OP_SUB: case OP_MUL:
+    case OP_AND: case OP_OR: case OP_XOR: case OP_NOT: case OP_SHL: case OP_SHR: case OP_SAR:
+    case OP_EQUAL: case OP_LESS: case OP_LESS_OR_EQUAL: case OP_GREATER: case OP_GREATER_OR_EQUAL:
+    case OP_GREATER_OR_EQUALI:
+    case OP_LESS_SIGNED: case OP_LESS_OR_EQUAL_SIGNED: case OP_GREATER_SIGNED:
+    case OP_GREATER_OR_EQUAL_SIGNED:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Finds a DISCARD of a value some pure op of the block pushed, and drops both. The op's operands
+ * get discarded in its place, so that later rounds can go after their producers. */
+static bool eliminate_discarded(vm_cfg_block *block)
+{
+    /* Instructions that pushed the values on top of the stack, values from before the block are
+     * nobody's */
+    size_t producers[STACK_MAX + 1];
+    size_t producer_num = 0;
+
+    for (size_t instr_i = 0; instr_i < block->instr_num; instr_i++) {
+        const vm_cfg_instr *instr = &block->instrs[instr_i];
+        if (instr->op == OP_DISCARD && producer_num > 0) {
+            size_t producer_i = producers[producer_num - 1];
+            if (is_pure(block->instrs[producer_i].op)) {
+                int pops, pushes;
+                instr_stack_effect(&block->instrs[producer_i], &pops, &pushes);
+                block_remove(block, instr_i);
+                block_remove(block, producer_i);
+                for (int discard_i = 0; discard_i < pops - pushes + 1; discard_i++)
+                    block_insert(block, producer_i, OP_DISCARD, 0);
+                return true;
+            }
+        }
+
+        int pops, pushes;
+        instr_stack_effect(instr, &pops, &pushes);
+        for (int pop_i = 0; pop_i < pops && producer_num > 0; pop_i++)
+            producer_num--;
+        for (int push_i = 0; push_i < pushes && producer_num < STACK_MAX + 1; push_i++)
+            producers[producer_num++] = instr_i;
+    }
+    return false;
+}
+
+bool vm_cfg_eliminate_dead_code(vm_cfg *cfg)
+{
+    bool is_changed = false;
+
+    /* Branches on constants */
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++) {
+        vm_cfg_block *block = &cfg->blocks[block_i];
+        if ((block->exit_op != OP_JUMP_IF_TRUE && block->exit_op != OP_JUMP_IF_FALSE) ||
+            block->instr_num == 0)
+            continue;
+
+        const vm_cfg_instr *last = &block->instrs[block->instr_num - 1];
+        if (last->op != OP_PUSHI && last->op != OP_PUSHK)
+            continue;
+        uint64_t cond = last->op == OP_PUSHI ? last->arg : vm_const_at(cfg->bytecode, last->arg);
+        if ((cond != 0) != (block->exit_op == OP_JUMP_IF_TRUE))
+            block->target = block->next;
+        block->exit_op = OP_JUMP;
+        block->next = VM_CFG_NONE;
+        block_remove(block, block->instr_num - 1);
+        is_changed = true;
+    }
+
+    /* Stores nothing reads */
+    vm_cfg_liveness liveness;
+    vm_cfg_liveness_compute(cfg, &liveness);
+    uint64_t *live = checked_calloc(liveness.set_words, sizeof(uint64_t));
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++) {
+        vm_cfg_block *block = &cfg->blocks[block_i];
+        memcpy(live, &liveness.live_out[block_i * liveness.set_words],
+               liveness.set_words * sizeof(uint64_t));
+        for (size_t instr_i = block->instr_num; instr_i-- > 0;) {
+            vm_cfg_instr *instr = &block->instrs[instr_i];
+            if (instr->op == OP_STOREI &&
+                !set_has(live, cell_index(liveness.cells, liveness.cell_num, instr->arg))) {
+                *instr = (vm_cfg_instr) {OP_DISCARD, 0};
+                is_changed = true;
+            }
+            live_before(&liveness, instr, live);
+        }
+    }
+    free(live);
+    vm_cfg_liveness_free(&liveness);
+
+    /* Values nobody uses */
+    for (size_t block_i = 0; block_i < cfg->block_num; block_i++)
+        while (eliminate_discarded(&cfg->blocks[block_i]))
+            is_changed = true;
+
+    return is_changed;
+}
+
+typedef struct layout_edge {
+    size_t from;
+    size_t to;
+    uint64_t weight;
+    /* the blocks follow each other already */
+    bool is_fallthrough;
+} layout_edge;
+
+/* Heaviest first, then fallthroughs so that ties keep the layout */
+static int compare_edges(const void *left, const void *right)
+{
+    const layout_edge *left_edge = left, *right_edge = right;
+    if (left_edge->weight != right_edge->weight)
+        return left_edge->weight < right_edge->weight ? 1 : -1;
+    if (left_edge->is_fallthrough != right_edge->is_fallthrough)
+        return left_edge->is_fallthrough ? -1 : 1;
+    return (left_edge->from > right_edge->from) - (left_edge->from < right_edge->from);
+}
+
+static size_t chain_head(const size_t *chain_prev, size_t block_i)
+{
+    while (chain_prev[block_i] != VM_CFG_NONE)
+        block_i = chain_prev[block_i];
+    return block_i;
+}
+
+/* Bottom-up chaining: edges glue blocks into chains heaviest first, as long as the source ends a
+ * chain and the destination starts another. Chains go one after another, the entry's first and the
+ * rest in the order of their first blocks. */
+bool vm_cfg_reorder_blocks(vm_cfg *cfg)
+{
+    if (cfg->order_len < 2)
+        return false;
+
+    size_t block_num = cfg->block_num;
+    bool *is_placed = checked_calloc(block_num, sizeof(*is_placed));
+    bool *is_ordered = checked_calloc(block_num, sizeof(*is_ordered));
+    size_t *chain_prev = checked_malloc(block_num * sizeof(*chain_prev));
+    size_t *chain_next = checked_malloc(block_num * sizeof(*chain_next));
+    layout_edge *edges = checked_malloc(2 * cfg->order_len * sizeof(*edges));
+    size_t *order = checked_malloc(cfg->order_len * sizeof(*order));
+
+    for (size_t block_i = 0; block_i < block_num; block_i++)
+        chain_prev[block_i] = chain_next[block_i] = VM_CFG_NONE;
+    for (size_t order_i = 0; order_i < cfg->order_len; order_i++)
+        is_ordered[cfg->order[order_i]] = true;
+
+    size_t edge_num = 0;
+    for (size_t order_i = 0; order_i < cfg->order_len; order_i++) {
+        size_t from = cfg->order[order_i];
+        size_t successors[2];
+        size_t successor_num = flow_successors(cfg, from, successors);
+        for (size_t succ_i = 0; succ_i < successor_num; succ_i++) {
+            size_t to = successors[succ_i];
+            if (to == from || to == cfg->order[0] || !is_ordered[to])
+                continue;
+            uint64_t from_weight = cfg->blocks[from].weight, to_weight = cfg->blocks[to].weight;
+            edges[edge_num++] = (layout_edge) {
+                .from = from,
+                .to = to,
+                .weight = from_weight < to_weight ? from_weight : to_weight,
+                .is_fallthrough = order_i + 1 < cfg->order_len && cfg->order[order_i + 1] == to,
+            };
+        }
+    }
+    qsort(edges, edge_num, sizeof(*edges), compare_edges);
+
+    for (size_t edge_i = 0; edge_i < edge_num; edge_i++) {
+        size_t from = edges[edge_i].from, to = edges[edge_i].to;
+        if (chain_next[from] != VM_CFG_NONE || chain_prev[to] != VM_CFG_NONE ||
+            chain_head(chain_prev, from) == to)
+            continue;
+        chain_next[from] = to;
+        chain_prev[to] = from;
+    }
+
+    size_t order_len = 0;
+    for (size_t order_i = 0; order_i < cfg->order_len; order_i++) {
+        size_t block_i = cfg->order[order_i];
+        if (chain_prev[block_i] != VM_CFG_NONE || is_placed[block_i])
+            continue;
+        for (; block_i != VM_CFG_NONE; block_i = chain_next[block_i]) {
+            is_placed[block_i] = true;
+            order[order_len++] = block_i;
+        }
+    }
+
+    bool is_changed = memcmp(order, cfg->order, order_len * sizeof(*order)) != 0;
+    memcpy(cfg->order, order, order_len * sizeof(*order));
+
+    free(order);
+    free(edges);
+    free(chain_next);
+    free(chain_prev);
+    free(is_ordered);
+    free(is_placed);
+    return is_changed;
+}
+
+bool vm_cfg_run_passes(vm_cfg *cfg, vm_cfg_pass *const *passes, size_t pass_num)
+{
+    bool is_changed = false;
+    for (size_t round_i = 0; round_i < PASS_ROUNDS_MAX; round_i++) {
+        bool is_round_changed = false;
+        for (size_t pass_i = 0; pass_i < pass_num; pass_i++)
+            is_round_changed |= passes[pass_i](cfg);
+        if (!is_round_changed)
+            break;
+        is_changed = true;
+    }
+    return is_changed;
+}
+
+analysis_result vm_optimize(uint8_t *bytecode, uint8_t *optimized, size_t *code_len,
+                            size_t *consts_len)
+{
+    static vm_cfg_pass *const passes[] = {
+        vm_cfg_eliminate_dead_code,
+        vm_cfg_remove_unreachable,
+        vm_cfg_reorder_blocks,
+    };
+
+    vm_cfg *cfg = checked_malloc(sizeof(*cfg));
+    analysis_result res = vm_cfg_lift(bytecode, cfg);
+    if (res == ANALYSIS_OK) {
+        vm_cfg_run_passes(cfg, passes, sizeof(passes) / sizeof(passes[0]));
+        res = vm_cfg_lower(cfg, optimized, code_len, consts_len);
+    }
+    vm_cfg_free(cfg);
+    free(cfg);
+    return res;
+}
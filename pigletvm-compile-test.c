@@ -0,0 +1,45 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pigletvm.h"
+
+
+/* The function generated by 'pigletvm compile' */
+int pvm_compiled(uint64_t *memory, vm_paged_memory *paged, uint64_t *result);
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <path/to/bytecode>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    vm_image image;
+    if (vm_image_map(argv[1], &image) != IMAGE_OK) {
+        fprintf(stderr, "Failed to load: %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *bytecode = image.code;
+    vm_register_standard_natives();
+
+    /* The compiled program should behave exactly like the interpreted one */
+    interpret_result expected_res = vm_interpret(bytecode);
+    uint64_t expected_value = vm_get_result();
+
+    uint64_t *memory = calloc(MEMORY_SIZE, sizeof(*memory));
+    vm_paged_memory *paged = calloc(1, sizeof(*paged));
+    assert(memory && paged);
+
+    uint64_t value = 0;
+    int res = pvm_compiled(memory, paged, &value);
+    assert(res == (int)expected_res);
+    assert(value == expected_value);
+
+    vm_paged_reset(paged);
+    free(paged);
+    free(memory);
+    vm_image_unmap(&image);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,586 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "pigletvm.h"
+
+/*
+ * Ahead-of-time bytecode to C compiler
+ *
+ * Every reachable instruction has a known stack depth (see vm_analyze), so stack slots become plain
+ * local variables s0..sN, jump targets become labels and the VM memory is passed in by the caller.
+ * Depths count from a function's arguments, so a function's code gets emitted once for every
+ * depth its frame starts at, the slots shifted by that base. Return addresses are pushed as
+ * bytecode addresses plus the caller's base, RET switches over all the possible ones.
+ * */
+
+#define LABEL_LEN 32
+
+/* A function called with its frame at some depth, the main code's frame starts at 0 */
+typedef struct code_frame {
+    uint16_t func;
+    int base;
+} code_frame;
+
+typedef struct code_frames {
+    code_frame *frames;
+    size_t len;
+    size_t capacity;
+} code_frames;
+
+/* Generated code is standalone, so it gets its own copy of the sized memory access functions from
+ * pigletvm.h */
+static const char *sized_memory_functions =
+    "static inline uint64_t memory_load8(uint64_t *memory, uint64_t index)\n"
+    "{\n"
+    "    return ((uint8_t *)memory)[index & (MEMORY_BYTES - 1)];\n"
+    "}\n\n"
+    "static inline uint64_t memory_load16(uint64_t *memory, uint64_t index)\n"
+    "{\n"
+    "    uint8_t *bytes = (uint8_t *)memory + ((index * 2) & (MEMORY_BYTES - 1));\n"
+    "    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8;\n"
+    "}\n\n"
+    "static inline uint64_t memory_load32(uint64_t *memory, uint64_t index)\n"
+    "{\n"
+    "    uint8_t *bytes = (uint8_t *)memory + ((index * 4) & (MEMORY_BYTES - 1));\n"
+    "    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8 | (uint64_t)bytes[2] << 16 |\n"
+    "        (uint64_t)bytes[3] << 24;\n"
+    "}\n\n"
+    "static inline void memory_store8(uint64_t *memory, uint64_t index, uint64_t val)\n"
+    "{\n"
+    "    ((uint8_t *)memory)[index & (MEMORY_BYTES - 1)] = (uint8_t)val;\n"
+    "}\n\n"
+    "static inline void memory_store16(uint64_t *memory, uint64_t index, uint64_t val)\n"
+    "{\n"
+    "    uint8_t *bytes = (uint8_t *)memory + ((index * 2) & (MEMORY_BYTES - 1));\n"
+    "    bytes[0] = (uint8_t)val;\n"
+    "    bytes[1] = (uint8_t)(val >> 8);\n"
+    "}\n\n"
+    "static inline void memory_store32(uint64_t *memory, uint64_t index, uint64_t val)\n"
+    "{\n"
+    "    uint8_t *bytes = (uint8_t *)memory + ((index * 4) & (MEMORY_BYTES - 1));\n"
+    "    bytes[0] = (uint8_t)val;\n"
+    "    bytes[1] = (uint8_t)(val >> 8);\n"
+    "    bytes[2] = (uint8_t)(val >> 16);\n"
+    "    bytes[3] = (uint8_t)(val >> 24);\n"
+    "}\n\n"
+    "static inline uint64_t memory_bit_test(uint64_t *memory, uint64_t index)\n"
+    "{\n"
+    "    index &= MEMORY_BYTES * 8 - 1;\n"
+    "    return (((uint8_t *)memory)[index >> 3] >> (index & 7)) & 1;\n"
+    "}\n\n"
+    "static inline void memory_bit_set(uint64_t *memory, uint64_t index)\n"
+    "{\n"
+    "    index &= MEMORY_BYTES * 8 - 1;\n"
+    "    ((uint8_t *)memory)[index >> 3] |= (uint8_t)(1u << (index & 7));\n"
+    "}\n\n";
+
+/* Cells past the flat memory are the runtime's, see vm_paged_load */
+static const char *paged_memory_functions =
+    "uint64_t vm_paged_load(vm_paged_memory *paged, uint32_t addr);\n"
+    "void vm_paged_store(vm_paged_memory *paged, uint32_t addr, uint64_t val);\n\n"
+    "static inline uint64_t memory_load(uint64_t *memory, vm_paged_memory *paged, uint64_t addr)\n"
+    "{\n"
+    "    uint32_t cell = (uint32_t)addr;\n"
+    "    return cell < MEMORY_SIZE ? memory[cell] : vm_paged_load(paged, cell);\n"
+    "}\n\n"
+    "static inline void memory_store(uint64_t *memory, vm_paged_memory *paged, uint64_t addr,\n"
+    "                                uint64_t val)\n"
+    "{\n"
+    "    uint32_t cell = (uint32_t)addr;\n"
+    "    if (cell < MEMORY_SIZE)\n"
+    "        memory[cell] = val;\n"
+    "    else\n"
+    "        vm_paged_store(paged, cell, val);\n"
+    "}\n\n";
+
+static const char *heap_functions =
+    "uint64_t vm_heap_alloc(vm_paged_memory *paged, uint64_t cells);\n"
+    "_Bool vm_heap_free(vm_paged_memory *paged, uint64_t addr);\n\n";
+
+/* Bulk ops become plain loops the C compiler is free to vectorize, the range check is the
+ * caller's */
+static const char *bulk_memory_functions =
+    "static inline int memory_range_is_valid(uint64_t addr, uint64_t count)\n"
+    "{\n"
+    "    return addr <= MEMORY_SIZE && count <= MEMORY_SIZE - addr;\n"
+    "}\n\n"
+    "static inline uint64_t memory_sum(const uint64_t *cells, uint64_t count)\n"
+    "{\n"
+    "    uint64_t sum = 0;\n"
+    "    for (uint64_t i = 0; i < count; i++)\n"
+    "        sum += cells[i];\n"
+    "    return sum;\n"
+    "}\n\n"
+    "static inline uint64_t memory_min(const uint64_t *cells, uint64_t count)\n"
+    "{\n"
+    "    uint64_t min = UINT64_MAX;\n"
+    "    for (uint64_t i = 0; i < count; i++)\n"
+    "        min = cells[i] < min ? cells[i] : min;\n"
+    "    return min;\n"
+    "}\n\n"
+    "static inline uint64_t memory_max(const uint64_t *cells, uint64_t count)\n"
+    "{\n"
+    "    uint64_t max = 0;\n"
+    "    for (uint64_t i = 0; i < count; i++)\n"
+    "        max = cells[i] > max ? cells[i] : max;\n"
+    "    return max;\n"
+    "}\n\n"
+    "static inline uint64_t memory_count(const uint64_t *cells, uint64_t count)\n"
+    "{\n"
+    "    uint64_t nonzero = 0;\n"
+    "    for (uint64_t i = 0; i < count; i++)\n"
+    "        nonzero += cells[i] != 0;\n"
+    "    return nonzero;\n"
+    "}\n\n";
+
+static bool is_sized_memory_op(uint8_t op)
+{
+    return op >= OP_LOAD8 && op <= OP_BIT_SET;
+}
+
+static bool is_dynamic_memory_op(uint8_t op)
+{
+    return op == OP_LOAD || op == OP_STORE;
+}
+
+static bool is_heap_op(uint8_t op)
+{
+    return op == OP_ALLOC || op == OP_FREE;
+}
+
+static bool is_call_op(uint8_t op)
+{
+    return op == OP_CALL || op == OP_RET;
+}
+
+static bool is_native_call_op(uint8_t op)
+{
+    return op == OP_CALLNATIVE;
+}
+
+static bool is_bulk_memory_op(uint8_t op)
+{
+    return op >= OP_MEMSET && op <= OP_MEMCOUNT;
+}
+
+/* Is there a reachable instruction the predicate holds for? */
+static bool uses_op(uint8_t *bytecode, vm_analysis *analysis, bool (*pred)(uint8_t op))
+{
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++)
+        if (analysis->depth[pc] != VM_UNREACHABLE && pred(bytecode[pc]))
+            return true;
+    return false;
+}
+
+/* Frames starting above the bottom of the stack get their base in their labels */
+static const char *label_name(char *name, size_t pc, int base)
+{
+    if (base)
+        snprintf(name, LABEL_LEN, "L%zu_%d", pc, base);
+    else
+        snprintf(name, LABEL_LEN, "L%zu", pc);
+    return name;
+}
+
+/* What gets pushed on calls: the return address and the caller's base */
+static size_t return_id(size_t return_pc, int base)
+{
+    return (size_t)base * MAX_CODE_LEN + return_pc;
+}
+
+/* The base of the callee's frame for a call at pc made in a frame starting at base */
+static int callee_base(uint8_t *bytecode, vm_analysis *analysis, size_t pc, int base)
+{
+    return base + analysis->depth[pc] - analysis->depth[ARG_AT_PC(bytecode, pc)];
+}
+
+static bool is_reachable_call(uint8_t *bytecode, vm_analysis *analysis, size_t pc, uint16_t func)
+{
+    return analysis->depth[pc] != VM_UNREACHABLE && analysis->func[pc] == func &&
+        bytecode[pc] == OP_CALL;
+}
+
+static void add_frame(code_frames *frames, uint16_t func, int base)
+{
+    for (size_t frame_i = 0; frame_i < frames->len; frame_i++)
+        if (frames->frames[frame_i].func == func && frames->frames[frame_i].base == base)
+            return;
+
+    if (frames->len == frames->capacity) {
+        size_t capacity = frames->capacity ? frames->capacity * 2 : 16;
+        code_frame *grown = realloc(frames->frames, capacity * sizeof(*grown));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        frames->frames = grown;
+        frames->capacity = capacity;
+    }
+    frames->frames[frames->len++] = (code_frame){.func = func, .base = base};
+}
+
+/* Every frame calls can start, the analysis keeps them all within the stack */
+static void collect_frames(uint8_t *bytecode, vm_analysis *analysis, code_frames *frames)
+{
+    add_frame(frames, 0, 0);
+    for (size_t frame_i = 0; frame_i < frames->len; frame_i++) {
+        code_frame frame = frames->frames[frame_i];
+        for (size_t pc = 0; pc < MAX_CODE_LEN; pc++)
+            if (is_reachable_call(bytecode, analysis, pc, frame.func))
+                add_frame(frames, ARG_AT_PC(bytecode, pc),
+                          callee_base(bytecode, analysis, pc, frame.base));
+    }
+}
+
+static void emit_return(FILE *out, uint8_t *bytecode, vm_analysis *analysis,
+                        const code_frames *frames, uint16_t func, int base)
+{
+    char label[LABEL_LEN];
+    fprintf(out, "    if (call_depth == 0)\n        return %d;\n", ERROR_CALL_STACK_UNDERFLOW);
+    fprintf(out, "    switch (call_stack[--call_depth]) {\n");
+    for (size_t frame_i = 0; frame_i < frames->len; frame_i++) {
+        code_frame caller = frames->frames[frame_i];
+        for (size_t call_pc = 0; call_pc + 3 < MAX_CODE_LEN; call_pc++) {
+            if (!is_reachable_call(bytecode, analysis, call_pc, caller.func) ||
+                ARG_AT_PC(bytecode, call_pc) != func ||
+                callee_base(bytecode, analysis, call_pc, caller.base) != base ||
+                analysis->depth[call_pc + 3] == VM_UNREACHABLE)
+                continue;
+            fprintf(out, "    case %zu: goto %s;\n", return_id(call_pc + 3, caller.base),
+                    label_name(label, call_pc + 3, caller.base));
+        }
+    }
+    /* only pushed addresses get popped, the default keeps C compilers happy */
+    fprintf(out, "    default: return %d;\n", ERROR_RUNTIME_EXCEPTION);
+    fprintf(out, "    }\n");
+}
+
+static void emit_instruction(FILE *out, uint8_t *bytecode, vm_analysis *analysis,
+                             const code_frames *frames, size_t pc, int base)
+{
+    uint8_t op = bytecode[pc];
+    uint16_t arg = vm_instruction_arg(bytecode, pc);
+    int depth = base + analysis->depth[pc];
+    char label[LABEL_LEN];
+
+    /* stack slots relative to the depth before the instruction */
+    int top = depth - 1;
+    int below = depth - 2;
+
+    switch (op) {
+    case OP_PUSHI:
+        fprintf(out, "    s%d = %" PRIu16 ";\n", depth, arg);
+        break;
+    case OP_PUSHK:
+        /* constants get inlined */
+        fprintf(out, "    s%d = UINT64_C(%" PRIu64 ");\n", depth, vm_const_at(bytecode, arg));
+        break;
+    case OP_LOADI:
+        fprintf(out, "    s%d = memory[%" PRIu16 "];\n", depth, arg);
+        break;
+    case OP_LOADADDI:
+        fprintf(out, "    s%d += memory[%" PRIu16 "];\n", top, arg);
+        break;
+    case OP_STOREI:
+        fprintf(out, "    memory[%" PRIu16 "] = s%d;\n", arg, top);
+        break;
+    case OP_LOAD:
+        fprintf(out, "    s%d = memory_load(memory, paged, s%d);\n", top, top);
+        break;
+    case OP_STORE:
+        fprintf(out, "    memory_store(memory, paged, s%d, s%d);\n", below, top);
+        break;
+    case OP_DUP:
+        fprintf(out, "    s%d = s%d;\n", depth, top);
+        break;
+    case OP_DISCARD:
+        break;
+    case OP_ADD:
+        fprintf(out, "    s%d += s%d;\n", below, top);
+        break;
+    case OP_ADDI:
+        fprintf(out, "    s%d += %" PRIu16 ";\n", top, arg);
+        break;
+    case OP_SUB:
+        fprintf(out, "    s%d -= s%d;\n", below, top);
+        break;
+    case OP_DIV:
+        fprintf(out, "    if (s%d == 0)\n        return %d;\n", top, ERROR_DIVISION_BY_ZERO);
+        fprintf(out, "    s%d /= s%d;\n", below, top);
+        break;
+    case OP_MUL:
+        fprintf(out, "    s%d *= s%d;\n", below, top);
+        break;
+    case OP_JUMP:
+        fprintf(out, "    goto %s;\n", label_name(label, arg, base));
+        break;
+    case OP_JUMP_IF_TRUE:
+        fprintf(out, "    if (s%d)\n        goto %s;\n", top, label_name(label, arg, base));
+        break;
+    case OP_JUMP_IF_FALSE:
+        fprintf(out, "    if (!s%d)\n        goto %s;\n", top, label_name(label, arg, base));
+        break;
+    case OP_EQUAL:
+        fprintf(out, "    s%d = s%d == s%d;\n", below, below, top);
+        break;
+    case OP_LESS:
+        fprintf(out, "    s%d = s%d < s%d;\n", below, below, top);
+        break;
+    case OP_LESS_OR_EQUAL:
+        fprintf(out, "    s%d = s%d <= s%d;\n", below, below, top);
+        break;
+    case OP_GREATER:
+        fprintf(out, "    s%d = s%d > s%d;\n", below, below, top);
+        break;
+    case OP_GREATER_OR_EQUAL:
+        fprintf(out, "    s%d = s%d >= s%d;\n", below, below, top);
+        break;
+    case OP_GREATER_OR_EQUALI:
+        fprintf(out, "    s%d = s%d >= %" PRIu16 ";\n", top, top, arg);
+        break;
+    case OP_MOD:
+        fprintf(out, "    if (s%d == 0)\n        return %d;\n", top, ERROR_DIVISION_BY_ZERO);
+        fprintf(out, "    s%d %%= s%d;\n", below, top);
+        break;
+    case OP_AND:
+        fprintf(out, "    s%d &= s%d;\n", below, top);
+        break;
+    case OP_OR:
+        fprintf(out, "    s%d |= s%d;\n", below, top);
+        break;
+    case OP_XOR:
+        fprintf(out, "    s%d ^= s%d;\n", below, top);
+        break;
+    case OP_NOT:
+        fprintf(out, "    s%d = ~s%d;\n", top, top);
+        break;
+    case OP_SHL:
+        fprintf(out, "    s%d <<= s%d & 63;\n", below, top);
+        break;
+    case OP_SHR:
+        fprintf(out, "    s%d >>= s%d & 63;\n", below, top);
+        break;
+    case OP_SAR:
+        fprintf(out, "    s%d = (uint64_t)((int64_t)s%d >> (s%d & 63));\n", below, below, top);
+        break;
+    case OP_LESS_SIGNED:
+        fprintf(out, "    s%d = (int64_t)s%d < (int64_t)s%d;\n", below, below, top);
+        break;
+    case OP_LESS_OR_EQUAL_SIGNED:
+        fprintf(out, "    s%d = (int64_t)s%d <= (int64_t)s%d;\n", below, below, top);
+        break;
+    case OP_GREATER_SIGNED:
+        fprintf(out, "    s%d = (int64_t)s%d > (int64_t)s%d;\n", below, below, top);
+        break;
+    case OP_GREATER_OR_EQUAL_SIGNED:
+        fprintf(out, "    s%d = (int64_t)s%d >= (int64_t)s%d;\n", below, below, top);
+        break;
+    case OP_ALLOC:
+        fprintf(out, "    s%d = vm_heap_alloc(paged, s%d);\n", top, top);
+        break;
+    case OP_FREE:
+        fprintf(out, "    if (!vm_heap_free(paged, s%d))\n        return %d;\n", top,
+                ERROR_INVALID_FREE);
+        break;
+    case OP_POP_RES:
+        fprintf(out, "    *result = s%d;\n", top);
+        break;
+    case OP_DONE:
+        fprintf(out, "    return %d;\n", SUCCESS);
+        break;
+    case OP_PRINT:
+        fprintf(out, "    printf(\"%%\" PRIu64 \"\\n\", s%d);\n", top);
+        break;
+    case OP_LOAD8:
+    case OP_LOAD16:
+    case OP_LOAD32:
+        fprintf(out, "    s%d = memory_load%d(memory, s%d);\n", top,
+                op == OP_LOAD8 ? 8 : op == OP_LOAD16 ? 16 : 32, top);
+        break;
+    case OP_STORE8:
+    case OP_STORE16:
+    case OP_STORE32:
+        fprintf(out, "    memory_store%d(memory, s%d, s%d);\n",
+                op == OP_STORE8 ? 8 : op == OP_STORE16 ? 16 : 32, below, top);
+        break;
+    case OP_BIT_TEST:
+        fprintf(out, "    s%d = memory_bit_test(memory, s%d);\n", top, top);
+        break;
+    case OP_BIT_SET:
+        fprintf(out, "    memory_bit_set(memory, s%d);\n", top);
+        break;
+    case OP_MEMSET:
+        fprintf(out, "    if (!memory_range_is_valid(s%d, s%d))\n        return %d;\n",
+                depth - 3, top, ERROR_MEMORY_OUT_OF_BOUNDS);
+        fprintf(out, "    for (uint64_t i = 0; i < s%d; i++)\n        memory[s%d + i] = s%d;\n",
+                top, depth - 3, below);
+        break;
+    case OP_MEMCPY:
+        fprintf(out, "    if (!memory_range_is_valid(s%d, s%d) || "
+                "!memory_range_is_valid(s%d, s%d))\n"
+                "        return %d;\n", depth - 3, top, below, top, ERROR_MEMORY_OUT_OF_BOUNDS);
+        fprintf(out, "    memmove(memory + s%d, memory + s%d, s%d * sizeof(uint64_t));\n",
+                depth - 3, below, top);
+        break;
+    case OP_MEMSUM:
+    case OP_MEMMIN:
+    case OP_MEMMAX:
+    case OP_MEMCOUNT:
+        fprintf(out, "    if (!memory_range_is_valid(s%d, s%d))\n        return %d;\n",
+                below, top, ERROR_MEMORY_OUT_OF_BOUNDS);
+        fprintf(out, "    s%d = memory_%s(memory + s%d, s%d);\n", below,
+                op == OP_MEMSUM ? "sum" : op == OP_MEMMIN ? "min" :
+                op == OP_MEMMAX ? "max" : "count", below, top);
+        break;
+    case OP_CALLNATIVE: {
+        /* Natives are resolved at compile time, the same ones have to be registered at run time */
+        const vm_native *native = vm_native_at(arg);
+        if (!native) {
+            fprintf(out, "    return %d;\n", ERROR_UNKNOWN_NATIVE);
+            break;
+        }
+        int first = depth - native->arity;
+        fprintf(out, "    {\n        uint64_t args[] = {");
+        for (int slot = first; slot < depth; slot++)
+            fprintf(out, "%ss%d", slot > first ? ", " : "", slot);
+        /* empty initializers are not C11 */
+        fprintf(out, "%s};\n", native->arity ? "" : "0");
+        fprintf(out, "        s%d = vm_call_native(%" PRIu16 ", args);\n    }\n", first, arg);
+        break;
+    }
+    case OP_YIELD:
+        /* compiled code runs to completion */
+        break;
+    case OP_CALL:
+        fprintf(out, "    if (call_depth == %d)\n        return %d;\n", CALL_STACK_MAX,
+                ERROR_CALL_STACK_OVERFLOW);
+        fprintf(out, "    call_stack[call_depth++] = %zu;\n", return_id(pc + 3, base));
+        fprintf(out, "    goto %s;\n",
+                label_name(label, arg, callee_base(bytecode, analysis, pc, base)));
+        break;
+    case OP_RET:
+        emit_return(out, bytecode, analysis, frames, analysis->func[pc], base);
+        break;
+    case OP_ABORT:
+        fprintf(out, "    return %d;\n", ERROR_END_OF_STREAM);
+        break;
+    default:
+        fprintf(out, "    return %d;\n", ERROR_UNKNOWN_OPCODE);
+        break;
+    }
+}
+
+static bool falls_through(uint8_t op)
+{
+    return op < OP_NUMBER_OF_OPS && op != OP_JUMP && op != OP_DONE && op != OP_ABORT &&
+        op != OP_CALL && op != OP_RET;
+}
+
+analysis_result vm_compile_to_c(uint8_t *bytecode, const char *func_name, FILE *out)
+{
+    vm_analysis *analysis = malloc(sizeof(*analysis));
+    if (!analysis) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    analysis_result res = vm_analyze(bytecode, analysis);
+    if (res != ANALYSIS_OK) {
+        free(analysis);
+        return res;
+    }
+
+    fprintf(out, "/* Generated by pigletvm compile, do not edit */\n\n");
+    fprintf(out, "#include <stdio.h>\n");
+    fprintf(out, "#include <inttypes.h>\n");
+    fprintf(out, "#include <string.h>\n\n");
+    fprintf(out, "typedef struct vm_paged_memory vm_paged_memory;\n\n");
+    bool uses_paged_memory = uses_op(bytecode, analysis, is_dynamic_memory_op);
+    bool uses_bulk_memory = uses_op(bytecode, analysis, is_bulk_memory_op);
+    if (uses_paged_memory || uses_bulk_memory)
+        fprintf(out, "#define MEMORY_SIZE %d\n\n", MEMORY_SIZE);
+    if (uses_paged_memory)
+        fputs(paged_memory_functions, out);
+    bool uses_heap = uses_op(bytecode, analysis, is_heap_op);
+    if (uses_heap)
+        fputs(heap_functions, out);
+    if (uses_op(bytecode, analysis, is_sized_memory_op)) {
+        fprintf(out, "#define MEMORY_BYTES %d\n\n", VM_MEMORY_BYTES);
+        fputs(sized_memory_functions, out);
+    }
+    if (uses_op(bytecode, analysis, is_native_call_op))
+        fprintf(out, "uint64_t vm_call_native(uint16_t index, const uint64_t *args);\n\n");
+    if (uses_bulk_memory)
+        fputs(bulk_memory_functions, out);
+    fprintf(out, "/*\n");
+    fprintf(out, " * memory: %d cells of VM memory, paged: the cells past them,\n", MEMORY_SIZE);
+    fprintf(out, " * result: the POP_RES register\n");
+    fprintf(out, " * returns an interpret_result value, 0 on success\n");
+    fprintf(out, " * */\n");
+    fprintf(out, "int %s(uint64_t *memory, vm_paged_memory *paged, uint64_t *result)\n{\n",
+            func_name);
+    if (!uses_paged_memory && !uses_heap)
+        fprintf(out, "    (void) paged;\n");
+
+    if (analysis->max_depth > 0) {
+        fprintf(out, "    uint64_t");
+        for (int slot = 0; slot < analysis->max_depth; slot++)
+            fprintf(out, "%s s%d = 0", slot ? "," : "", slot);
+        fprintf(out, ";\n");
+    }
+    fprintf(out, "    *result = 0;\n");
+
+    if (uses_op(bytecode, analysis, is_call_op)) {
+        fprintf(out, "    uint32_t call_stack[%d];\n", CALL_STACK_MAX);
+        fprintf(out, "    int call_depth = 0;\n");
+    }
+
+    /* Instructions are emitted in address order, so an instruction falling through to something
+     * other than the next emitted one (overlapping code) needs an explicit goto */
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+        if (analysis->depth[pc] == VM_UNREACHABLE || !falls_through(bytecode[pc]))
+            continue;
+        size_t next_pc = pc + vm_instruction_len(bytecode, pc);
+        for (size_t skipped = pc + 1; skipped < next_pc; skipped++)
+            if (analysis->depth[skipped] != VM_UNREACHABLE)
+                analysis->is_jump_target[next_pc] = true;
+    }
+
+    /* The main code comes first, a function's code never falls through into another's */
+    code_frames frames = {0};
+    collect_frames(bytecode, analysis, &frames);
+    char label[LABEL_LEN];
+    for (size_t frame_i = 0; frame_i < frames.len; frame_i++) {
+        code_frame frame = frames.frames[frame_i];
+        for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+            if (analysis->depth[pc] == VM_UNREACHABLE || analysis->func[pc] != frame.func)
+                continue;
+
+            /* Only jump targets need labels, fall-through blocks are just marked */
+            if (analysis->is_jump_target[pc])
+                fprintf(out, "\n%s:\n", label_name(label, pc, frame.base));
+            else if (analysis->is_block_start[pc] && pc != 0)
+                fprintf(out, "\n    /* block %zu */\n", pc);
+
+            emit_instruction(out, bytecode, analysis, &frames, pc, frame.base);
+
+            size_t next_pc = pc + vm_instruction_len(bytecode, pc);
+            if (!falls_through(bytecode[pc]))
+                continue;
+            for (size_t skipped = pc + 1; skipped < next_pc; skipped++) {
+                if (analysis->depth[skipped] != VM_UNREACHABLE) {
+                    fprintf(out, "    goto %s;\n", label_name(label, next_pc, frame.base));
+                    break;
+                }
+            }
+        }
+    }
+
+    fprintf(out, "}\n");
+
+    free(frames.frames);
+    free(analysis);
+    return ANALYSIS_OK;
+}
@@ -8,6 +8,14 @@
 #include "compat.h"
 #include "pigletvm.h"
 
+#ifdef _MSC_VER
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
 #define MAX_LINE_LEN 256
 
 #define TIMER_DEF(timer_var) compat_timer timer_var; compat_timer_init(&timer_var)
@@ -23,6 +31,34 @@ static char *error_to_msg[] = {
     [ERROR_DIVISION_BY_ZERO] = "division by zero",
     [ERROR_UNKNOWN_OPCODE] = "unknown opcode",
     [ERROR_END_OF_STREAM] = "end of stream",
+    [ERROR_INVALID_BYTECODE] = "invalid bytecode",
+    [ERROR_CALL_STACK_OVERFLOW] = "call stack overflow",
+    [ERROR_CALL_STACK_UNDERFLOW] = "return without a call",
+    [ERROR_MEMORY_OUT_OF_BOUNDS] = "memory range out of bounds",
+    [ERROR_UNKNOWN_NATIVE] = "unknown native function",
+    [ERROR_BUDGET_EXHAUSTED] = "budget exhausted",
+    [ERROR_STACK_OVERFLOW] = "stack overflow",
+    [ERROR_STACK_UNDERFLOW] = "stack underflow",
+    [ERROR_INVALID_FREE] = "free of an address not allocated",
+};
+
+static char *analysis_error_to_msg[] = {
+    [ANALYSIS_OK] = "ok",
+    [ANALYSIS_ERROR_STACK_MISMATCH] = "inconsistent stack depth",
+    [ANALYSIS_ERROR_STACK_UNDERFLOW] = "stack underflow",
+    [ANALYSIS_ERROR_STACK_OVERFLOW] = "stack overflow",
+    [ANALYSIS_ERROR_CODE_OVERFLOW] = "control flow leaves the code area",
+    [ANALYSIS_ERROR_CALL_MISMATCH] = "code shared between functions",
+};
+
+static char *image_error_to_msg[] = {
+    [IMAGE_OK] = "ok",
+    [IMAGE_ERROR_IO] = "failed to read the file",
+    [IMAGE_ERROR_MAGIC] = "not a program image, reassemble it",
+    [IMAGE_ERROR_VERSION] = "unsupported image version",
+    [IMAGE_ERROR_TRUNCATED] = "truncated image",
+    [IMAGE_ERROR_CHECKSUM] = "checksum mismatch",
+    [IMAGE_ERROR_SECTION] = "missing or malformed section",
 };
 
 typedef struct opinfo {
@@ -58,52 +94,41 @@ opinfo opcode_to_disinfo[] = {
     [OP_POP_RES] = {0, "POP_RES", 0},
     [OP_DONE] = {0, "DONE", 0},
     [OP_PRINT] = {0, "PRINT", 0},
+    [OP_CALL] = {1, "CALL", 1},
+    [OP_RET] = {0, "RET", 0},
+    [OP_LOAD8] = {0, "LOAD8", 0},
+    [OP_LOAD16] = {0, "LOAD16", 0},
+    [OP_LOAD32] = {0, "LOAD32", 0},
+    [OP_STORE8] = {0, "STORE8", 0},
+    [OP_STORE16] = {0, "STORE16", 0},
+    [OP_STORE32] = {0, "STORE32", 0},
+    [OP_BIT_TEST] = {0, "BIT_TEST", 0},
+    [OP_BIT_SET] = {0, "BIT_SET", 0},
+    [OP_MEMSET] = {0, "MEMSET", 0},
+    [OP_MEMCPY] = {0, "MEMCPY", 0},
+    [OP_MEMSUM] = {0, "MEMSUM", 0},
+    [OP_MEMMIN] = {0, "MEMMIN", 0},
+    [OP_MEMMAX] = {0, "MEMMAX", 0},
+    [OP_MEMCOUNT] = {0, "MEMCOUNT", 0},
+    [OP_CALLNATIVE] = {1, "CALLNATIVE", 0},
+    [OP_YIELD] = {0, "YIELD", 0},
+    [OP_PUSHK] = {1, "PUSHK", 0},
+    [OP_AND] = {0, "AND", 0},
+    [OP_OR] = {0, "OR", 0},
+    [OP_XOR] = {0, "XOR", 0},
+    [OP_NOT] = {0, "NOT", 0},
+    [OP_SHL] = {0, "SHL", 0},
+    [OP_SHR] = {0, "SHR", 0},
+    [OP_SAR] = {0, "SAR", 0},
+    [OP_MOD] = {0, "MOD", 0},
+    [OP_LESS_SIGNED] = {0, "LESS_SIGNED", 0},
+    [OP_LESS_OR_EQUAL_SIGNED] = {0, "LESS_OR_EQUAL_SIGNED", 0},
+    [OP_GREATER_SIGNED] = {0, "GREATER_SIGNED", 0},
+    [OP_GREATER_OR_EQUAL_SIGNED] = {0, "GREATER_OR_EQUAL_SIGNED", 0},
+    [OP_ALLOC] = {0, "ALLOC", 0},
+    [OP_FREE] = {0, "FREE", 0},
 };
 
-typedef struct labelinfo {
-    char *name;
-    uint16_t address;
-    struct labelinfo *next;
-} labelinfo;
-
-typedef struct asm_line {
-    enum kind {OP_KIND, JUMP_KIND, LABEL_KIND} kind;
-    union {
-        /* a usual op, with an arg or without it */
-        struct op {
-            uint8_t opcode;
-            bool has_arg;
-            uint16_t arg;
-        } op;
-        /* a jump op, with a name of a label to jump to */
-        struct {
-            uint8_t opcode;
-            char *label_name;
-            uint16_t target_address;
-        } jump;
-        /* a label to be used in jumps */
-        struct {
-            char *label_name;
-        } label;
-    } as;
-
-    /* a list of lines */
-    struct asm_line *next;
-} asm_line;
-
-static opinfo *opname_to_opcode_info(const char *opname, uint8_t *op)
-{
-    for (int i = 0; i < OP_NUMBER_OF_OPS; i++) {
-        if (strcasecmp(opcode_to_disinfo[i].name, opname) == 0) {
-            *op = i;
-            return &opcode_to_disinfo[i];
-        }
-    }
-
-    fprintf(stderr, "Unknown operation name: %s\n", opname);
-    exit(EXIT_FAILURE);
-}
-
 static size_t print_instruction(uint8_t *bytecode, size_t offset)
 {
     printf("%zu ", offset);
@@ -115,18 +140,22 @@ static size_t print_instruction(uint8_t *bytecode, size_t offset)
     if (has_arg) {
         uint16_t arg = bytecode[offset++] << 8;
         arg += bytecode[offset++];
-        printf(" %" PRIu16, arg);
+        /* constants the way the assembler takes them */
+        if (op == OP_PUSHK)
+            printf(" %" PRIu64, vm_const_at(bytecode, arg));
+        else
+            printf(" %" PRIu16, arg);
     }
     printf("\n");
 
     return offset;
 }
 
-static int disassemble(uint8_t *bytecode)
+static int disassemble(vm_image *image)
 {
     size_t offset = 0;
-    while (bytecode[offset])
-        offset = print_instruction(bytecode, offset);
+    while (offset < image->code_len)
+        offset = print_instruction(image->code, offset);
     return EXIT_SUCCESS;
 }
 
@@ -226,6 +255,331 @@ static int run_rcache_trace(uint8_t *bytecode)
     return EXIT_SUCCESS;
 }
 
+static int run_register_threaded(uint8_t *bytecode)
+{
+    interpret_result res = vm_register_interpret_threaded(bytecode);
+    if (res != SUCCESS) {
+        fprintf(stderr, "Runtime error: %s\n", error_to_msg[res]);
+        return EXIT_FAILURE;
+    }
+    uint64_t result_value = vm_register_get_result();
+    printf("Result value: %" PRIu64 "\n", result_value);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Server mode: jobs come in on stdin and results go out on stdout, both in host byte order.
+ *
+ * A job is a uint32 program id (the position of the program on the command line), a uint32 number
+ * of input cells and the input cells themselves (uint64) to be put at the start of memory. A result
+ * is a uint32 status (an interpret_result or SERVE_UNKNOWN_PROGRAM) and a uint64 result value.
+ * Programs are verified once at startup and run on a library context, so a job only pays for the
+ * run itself. Results get the original stdout to themselves, whatever programs print goes to
+ * stderr.
+ * */
+
+#define SERVE_UNKNOWN_PROGRAM UINT32_MAX
+
+/* Exits on failure */
+static FILE *serve_replies(void)
+{
+    fflush(stdout);
+    int reply_fd = dup(fileno(stdout));
+    FILE *replies = reply_fd >= 0 ? fdopen(reply_fd, "wb") : NULL;
+    if (!replies || dup2(fileno(stderr), fileno(stdout)) < 0) {
+        fprintf(stderr, "Failed to set up the reply stream\n");
+        exit(EXIT_FAILURE);
+    }
+#ifdef _MSC_VER
+    _setmode(reply_fd, _O_BINARY);
+#endif
+    return replies;
+}
+
+static int serve(pvm_program **programs, uint32_t program_num, FILE *replies)
+{
+    pvm_context *context = pvm_context_new();
+    uint64_t *memory = pvm_context_memory(context);
+
+    int res = EXIT_SUCCESS;
+    uint32_t header[2];
+    while (fread(header, sizeof(header), 1, stdin) == 1) {
+        uint32_t program_id = header[0];
+        uint32_t input_len = header[1];
+        if (input_len > MEMORY_SIZE) {
+            fprintf(stderr, "Job input too large: %" PRIu32 " cells\n", input_len);
+            res = EXIT_FAILURE;
+            break;
+        }
+        /* Every job starts with zeroed memory, the input at its start */
+        memset(memory, 0, MEMORY_SIZE * sizeof(*memory));
+        if (fread(memory, sizeof(*memory), input_len, stdin) != input_len) {
+            fprintf(stderr, "Truncated job input\n");
+            res = EXIT_FAILURE;
+            break;
+        }
+
+        uint32_t status = SERVE_UNKNOWN_PROGRAM;
+        uint64_t result_value = 0;
+        if (program_id < program_num) {
+            vm_paged_reset(pvm_context_paged_memory(context));
+            status = pvm_run(context, programs[program_id], PVM_ENGINE_THREADED);
+            if (status == SUCCESS)
+                result_value = pvm_context_result(context);
+        }
+
+        fwrite(&status, sizeof(status), 1, replies);
+        fwrite(&result_value, sizeof(result_value), 1, replies);
+        fflush(replies);
+    }
+
+    pvm_context_free(context);
+    return res;
+}
+
+static int compile(uint8_t *bytecode, const char *output_path, const char *func_name)
+{
+    FILE *file = fopen(output_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open a file: %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    analysis_result res = vm_compile_to_c(bytecode, func_name, file);
+    fclose(file);
+    if (res != ANALYSIS_OK) {
+        fprintf(stderr, "Compilation error: %s\n", analysis_error_to_msg[res]);
+        remove(output_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Assembler
+ *
+ * One pass over the source, a line at a time: instructions go straight into the code area. Opcode
+ * names, labels and wide constants are found with hash tables. A jump to a label not defined yet
+ * gets a placeholder argument and is queued on the label, defining the label patches the queued
+ * jumps. Label names and queue entries come from an arena freed in one go.
+ * */
+
+#define OPCODE_TABLE_SIZE 128
+#define CONST_TABLE_SIZE (2 * VM_CONSTS_MAX)
+#define ARENA_CHUNK_WORDS 8192
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    /* words keep allocations aligned */
+    uint64_t words[];
+} arena_chunk;
+
+typedef struct arena {
+    arena_chunk *chunks;
+} arena;
+
+typedef struct label_patch {
+    uint16_t pc;
+    struct label_patch *next;
+} label_patch;
+
+typedef struct label {
+    /* NULL for an empty slot */
+    const char *name;
+    uint64_t hash;
+    bool is_defined;
+    uint16_t address;
+    /* arguments of jumps waiting for the label to be defined */
+    label_patch *patches;
+} label;
+
+typedef struct const_pool {
+    uint64_t consts[VM_CONSTS_MAX];
+    size_t len;
+    /* constant index + 1, 0 for an empty slot */
+    uint16_t table[CONST_TABLE_SIZE];
+} const_pool;
+
+typedef struct assembler {
+    const char *path;
+    size_t line_num;
+
+    uint8_t *bytecode;
+    size_t pc;
+    const_pool pool;
+
+    /* open addressing, never more than half full */
+    label *labels;
+    size_t label_cap;
+    size_t label_num;
+
+    arena arena;
+} assembler;
+
+/* opcode + 1, 0 for an empty slot */
+static uint8_t opcode_table[OPCODE_TABLE_SIZE];
+
+static void assembler_fail(assembler *as, const char *msg, const char *what)
+{
+    fprintf(stderr, "%s:%zu: %s: %s\n", as->path, as->line_num, msg, what);
+    exit(EXIT_FAILURE);
+}
+
+static void *arena_alloc(arena *arena, size_t size)
+{
+    size_t word_num = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    arena_chunk *chunk = arena->chunks;
+    if (!chunk || chunk->used + word_num > chunk->size) {
+        size_t chunk_words = word_num > ARENA_CHUNK_WORDS ? word_num : ARENA_CHUNK_WORDS;
+        chunk = malloc(sizeof(*chunk) + chunk_words * sizeof(uint64_t));
+        if (!chunk) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->used = 0;
+        chunk->size = chunk_words;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *ptr = &chunk->words[chunk->used];
+    chunk->used += word_num;
+    return ptr;
+}
+
+static void arena_free(arena *arena)
+{
+    while (arena->chunks) {
+        arena_chunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+/* FNV-1a, opcode names are case insensitive */
+static uint64_t name_hash(const char *name, bool is_case_blind)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name; name++) {
+        unsigned char c = (unsigned char)*name;
+        hash = (hash ^ (is_case_blind ? (unsigned char)tolower(c) : c)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void opcode_table_init(void)
+{
+    static bool is_ready = false;
+    if (is_ready)
+        return;
+    is_ready = true;
+
+    for (int op = 0; op < OP_NUMBER_OF_OPS; op++) {
+        size_t slot = name_hash(opcode_to_disinfo[op].name, true) & (OPCODE_TABLE_SIZE - 1);
+        while (opcode_table[slot])
+            slot = (slot + 1) & (OPCODE_TABLE_SIZE - 1);
+        opcode_table[slot] = (uint8_t)(op + 1);
+    }
+}
+
+static uint8_t opname_to_opcode(assembler *as, const char *opname)
+{
+    size_t slot = name_hash(opname, true) & (OPCODE_TABLE_SIZE - 1);
+    for (; opcode_table[slot]; slot = (slot + 1) & (OPCODE_TABLE_SIZE - 1)) {
+        uint8_t op = opcode_table[slot] - 1;
+        if (strcasecmp(opcode_to_disinfo[op].name, opname) == 0)
+            return op;
+    }
+    assembler_fail(as, "Unknown operation name", opname);
+    return OP_ABORT;
+}
+
+/* The label of the name, a new undefined one if there is none yet */
+static label *label_find(assembler *as, const char *name)
+{
+    if (2 * (as->label_num + 1) > as->label_cap) {
+        size_t old_cap = as->label_cap;
+        label *old_labels = as->labels;
+        as->label_cap = old_cap ? 2 * old_cap : 1024;
+        as->labels = calloc(as->label_cap, sizeof(*as->labels));
+        if (!as->labels) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t old_i = 0; old_i < old_cap; old_i++) {
+            if (!old_labels[old_i].name)
+                continue;
+            size_t slot = old_labels[old_i].hash & (as->label_cap - 1);
+            while (as->labels[slot].name)
+                slot = (slot + 1) & (as->label_cap - 1);
+            as->labels[slot] = old_labels[old_i];
+        }
+        free(old_labels);
+    }
+
+    uint64_t hash = name_hash(name, false);
+    size_t slot = hash & (as->label_cap - 1);
+    for (; as->labels[slot].name; slot = (slot + 1) & (as->label_cap - 1))
+        if (as->labels[slot].hash == hash && strcmp(as->labels[slot].name, name) == 0)
+            return &as->labels[slot];
+
+    size_t name_len = strlen(name) + 1;
+    char *name_copy = arena_alloc(&as->arena, name_len);
+    memcpy(name_copy, name, name_len);
+    as->labels[slot] = (label) {.name = name_copy, .hash = hash};
+    as->label_num++;
+    return &as->labels[slot];
+}
+
+static void emit_byte(assembler *as, uint8_t byte)
+{
+    if (as->pc == MAX_CODE_LEN) {
+        fprintf(stderr, "Code and constants do not fit into %d bytes: %s\n", MAX_CODE_LEN,
+                as->path);
+        exit(EXIT_FAILURE);
+    }
+    as->bytecode[as->pc++] = byte;
+}
+
+static void emit_arg(assembler *as, uint16_t arg)
+{
+    emit_byte(as, (arg & 0xff00) >> 8);
+    emit_byte(as, (arg & 0x00ff));
+}
+
+static void define_label(assembler *as, const char *name)
+{
+    label *label = label_find(as, name);
+    if (label->is_defined)
+        assembler_fail(as, "Label defined twice", name);
+
+    label->is_defined = true;
+    label->address = (uint16_t)as->pc;
+    for (label_patch *patch = label->patches; patch; patch = patch->next) {
+        as->bytecode[patch->pc] = (label->address & 0xff00) >> 8;
+        as->bytecode[patch->pc + 1] = (label->address & 0x00ff);
+    }
+    label->patches = NULL;
+}
+
+/* Equal constants share a pool entry */
+static uint16_t pool_constant(const_pool *pool, uint64_t val)
+{
+    size_t slot = (size_t)((val * 0x9e3779b97f4a7c15ULL) >> 54) & (CONST_TABLE_SIZE - 1);
+    for (; pool->table[slot]; slot = (slot + 1) & (CONST_TABLE_SIZE - 1))
+        if (pool->consts[pool->table[slot] - 1] == val)
+            return (uint16_t)(pool->table[slot] - 1);
+
+    if (pool->len == VM_CONSTS_MAX) {
+        fprintf(stderr, "Too many constants\n");
+        exit(EXIT_FAILURE);
+    }
+    pool->consts[pool->len] = val;
+    pool->table[slot] = (uint16_t)(pool->len + 1);
+    return (uint16_t)pool->len++;
+}
+
 static void strip_line(char *source, char *target)
 {
     do
@@ -247,312 +601,558 @@ static bool is_label_name(char *name)
     return true;
 }
 
-static void parse_jump_argument(asm_line *parsed_line, char *arg_raw)
+/* The next token of the line with whitespace stripped, false if there is none */
+static bool next_token(char **saveptr, char *token)
 {
-    char *arg = calloc(strlen(arg_raw), 1);
-    strip_line(arg_raw, arg);
-    if (is_label_name(arg)) {
-        parsed_line->as.jump.label_name = strdup(arg);
-    } else {
-        uint16_t arg_val = 0;
-        if (sscanf(arg, "%" SCNu16, &arg_val) != 1) {
-            fprintf(stderr, "Invalid address supplied: %s\n", arg);
-            exit(EXIT_FAILURE);
-        }
-        parsed_line->as.jump.target_address = arg_val;
+    for (;;) {
+        char *raw = strtok_r(NULL, " ", saveptr);
+        if (!raw)
+            return false;
+        strip_line(raw, token);
+        if (token[0])
+            return true;
     }
 }
 
-static void parse_op_argument(asm_line *parsed_line, char *arg)
+static void assemble_jump(assembler *as, uint8_t op, char *arg)
 {
-    uint16_t arg_val = 0;
-    if (sscanf(arg, "%" SCNu16, &arg_val) != 1) {
-        fprintf(stderr, "Invalid argument supplied: %s\n", arg);
-        exit(EXIT_FAILURE);
+    emit_byte(as, op);
+    if (!is_label_name(arg)) {
+        uint16_t arg_val = 0;
+        if (sscanf(arg, "%" SCNu16, &arg_val) != 1)
+            assembler_fail(as, "Invalid address supplied", arg);
+        emit_arg(as, arg_val);
+        return;
     }
 
-    parsed_line->as.op.arg = arg_val;
+    label *label = label_find(as, arg);
+    if (!label->is_defined && as->pc + 2 <= MAX_CODE_LEN) {
+        label_patch *patch = arena_alloc(&as->arena, sizeof(*patch));
+        patch->pc = (uint16_t)as->pc;
+        patch->next = label->patches;
+        label->patches = patch;
+    }
+    emit_arg(as, label->address);
+}
+
+static void assemble_op(assembler *as, uint8_t op, char *arg)
+{
+    uint64_t arg_val = 0;
+    if (sscanf(arg, "%" SCNu64, &arg_val) != 1)
+        assembler_fail(as, "Invalid argument supplied", arg);
+
+    /* Wide PUSHI immediates go to the constant pool */
+    if (arg_val > UINT16_MAX && op == OP_PUSHI)
+        op = OP_PUSHK;
+    if (arg_val > UINT16_MAX && op != OP_PUSHK)
+        assembler_fail(as, "Argument does not fit into 16 bits", arg);
+
+    emit_byte(as, op);
+    emit_arg(as, op == OP_PUSHK ? pool_constant(&as->pool, arg_val) : (uint16_t)arg_val);
 }
 
-static asm_line *parse_line(char *raw_line)
+static void assemble_line(assembler *as, char *raw_line)
 {
     /* Ignore comments and empty lines*/
     if (raw_line[0] == '#' || raw_line[0] == '\n')
-        return NULL;
+        return;
 
     char *saveptr = NULL;
     char *opname_raw = strtok_r(raw_line, " ", &saveptr);
-    if (!opname_raw) {
-        fprintf(stderr, "Cannot parse string: %s\n", raw_line);
+    if (!opname_raw)
+        return;
+
+    char opname[MAX_LINE_LEN];
+    strip_line(opname_raw, opname);
+    size_t opname_len = strlen(opname);
+    if (opname_len == 0)
+        return;
+
+    char arg[MAX_LINE_LEN], extra[MAX_LINE_LEN];
+    bool has_arg = next_token(&saveptr, arg);
+
+    /* Label? */
+    if (opname[opname_len - 1] == ':') {
+        if (has_arg)
+            assembler_fail(as, "Labels do not have arguments", opname);
+        opname[opname_len - 1] = '\0';
+        define_label(as, opname);
+        return;
+    }
+
+    uint8_t op = opname_to_opcode(as, opname);
+    const opinfo *info = &opcode_to_disinfo[op];
+    if (info->has_arg && !has_arg)
+        assembler_fail(as, "Not enough arguments supplied", opname);
+    if ((!info->has_arg && has_arg) || (has_arg && next_token(&saveptr, extra)))
+        assembler_fail(as, "Too many arguments supplied", opname);
+
+    if (info->is_jump)
+        assemble_jump(as, op, arg);
+    else if (info->has_arg)
+        assemble_op(as, op, arg);
+    else
+        emit_byte(as, op);
+}
+
+/* Constants go to the end of the MAX_CODE_LEN bytes of bytecode, returns the number of lines */
+static size_t assemble(const char *path, uint8_t *bytecode, size_t *bytecode_len,
+                       size_t *consts_len)
+{
+    opcode_table_init();
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "File does not exist: %s\n", path);
         exit(EXIT_FAILURE);
     }
 
-    /* Allocate the target line */
-    asm_line *parsed_line = calloc(sizeof(*parsed_line), 1);
-    if (!parsed_line) {
-        fprintf(stderr, "Memory allocation failure\n ");
+    assembler *as = calloc(1, sizeof(*as));
+    if (!as) {
+        fprintf(stderr, "Memory allocation failure\n");
         exit(EXIT_FAILURE);
     }
+    as->path = path;
+    as->bytecode = bytecode;
 
-    /* Strip opname, find it's info, put it into bytecode */
-    char opname[MAX_LINE_LEN];
-    strip_line(opname_raw, opname);
+    char line_buf[MAX_LINE_LEN];
+    while (fgets(line_buf, MAX_LINE_LEN, file)) {
+        as->line_num++;
+        assemble_line(as, line_buf);
+    }
+    fclose(file);
 
-    /* Label? */
-    size_t opname_len = strlen(opname) - 1;
-    if (opname[opname_len] == ':') {
-        /* Cannot have any more args */
-        char *arg = strtok_r(NULL, " ", &saveptr);
-        if (arg) {
-            fprintf(stderr, "Labels do not have arguments: %s\n", raw_line);
+    for (size_t label_i = 0; label_i < as->label_cap; label_i++) {
+        if (as->labels[label_i].name && !as->labels[label_i].is_defined) {
+            fprintf(stderr, "Cannot resolve a label: %s\n", as->labels[label_i].name);
             exit(EXIT_FAILURE);
         }
+    }
 
-        /* Strip the colon */
-        opname[opname_len] = '\0';
+    if (as->pc + as->pool.len * 8 > MAX_CODE_LEN) {
+        fprintf(stderr, "Code and constants do not fit into %d bytes: %s\n", MAX_CODE_LEN, path);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t const_i = 0; const_i < as->pool.len; const_i++)
+        vm_const_set(bytecode, const_i, as->pool.consts[const_i]);
+    *bytecode_len = as->pc;
+    *consts_len = as->pool.len;
+
+    size_t line_num = as->line_num;
+    free(as->labels);
+    arena_free(&as->arena);
+    free(as);
+    return line_num;
+}
 
-        parsed_line->kind = LABEL_KIND;
-        parsed_line->as.label.label_name = strdup(opname);
+/* Exits on failure, the code stays valid until the image is unmapped */
+static uint8_t *map_image(const char *path, vm_image *image)
+{
+    image_result res = vm_image_map(path, image);
+    if (res != IMAGE_OK) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, image_error_to_msg[res]);
+        exit(EXIT_FAILURE);
+    }
+    return image->code;
+}
 
-    } else {
-        /* Either an op or a jump */
-
-        /* Get info */
-        uint8_t op;
-        const opinfo *info = opname_to_opcode_info(opname, &op);
-
-        if (info->is_jump) {
-            parsed_line->kind = JUMP_KIND;
-            parsed_line->as.jump.opcode = op;
-
-            /* See if there an immediate arg left on the line to be put into bytecode */
-            bool should_get_arg = true;
-            for (;;) {
-                char *arg = strtok_r(NULL, " ", &saveptr);
-                if (!arg && should_get_arg) {
-                    fprintf(stderr, "Not enough arguments supplied: %s\n", raw_line);
-                    exit(EXIT_FAILURE);
-                } else if (arg && !should_get_arg) {
-                    fprintf(stderr, "Too many arguments supplied: %s\n", raw_line);
-                    exit(EXIT_FAILURE);
-                } else if (!arg && !should_get_arg) {
-                    /* This is fine */
-                    break;
-                }
-                parse_jump_argument(parsed_line, arg);
-
-                should_get_arg = false;
-            }
-        }  else {
-            parsed_line->kind = OP_KIND;
-            parsed_line->as.op.opcode = op;
-            parsed_line->as.op.has_arg = info->has_arg;
-
-            /* See if there an immediate arg left on the line to be put into bytecode */
-            bool should_get_arg = info->has_arg;
-            for (;;) {
-                char *arg = strtok_r(NULL, " ", &saveptr);
-                if (!arg && should_get_arg) {
-                    fprintf(stderr, "Not enough arguments supplied: %s\n", raw_line);
-                    exit(EXIT_FAILURE);
-                } else if (arg && !should_get_arg) {
-                    fprintf(stderr, "Too many arguments supplied: %s\n", raw_line);
-                    exit(EXIT_FAILURE);
-                } else if (!arg && !should_get_arg) {
-                    /* This is fine */
-                    break;
-                }
-
-                parse_op_argument(parsed_line, arg);
-
-                should_get_arg = false;
-            }
-        }
+static void write_image(const uint8_t *bytecode, const size_t bytecode_len, size_t consts_len,
+                        const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to open a file: %s\n", path);
+        exit(EXIT_FAILURE);
     }
 
-    return parsed_line;
+    analysis_result res = vm_image_write(bytecode, bytecode_len, consts_len, file);
+    if (res != ANALYSIS_OK)
+        fprintf(stderr, "Unverified code, no metadata written: %s\n", analysis_error_to_msg[res]);
+    fclose(file);
 }
 
-static void collect_labelinfo(asm_line *line_list, labelinfo **list)
+static int specialize(uint8_t *bytecode, char **cell_args, int cell_num, const char *output_path)
 {
-    size_t pc = 0;
-    for (asm_line *line = line_list; line; line = line->next) {
-        switch (line->kind) {
-        case OP_KIND:{
-            pc++;
-            if (line->as.op.has_arg)
-                pc += 2;
-            break;
-        }
-        case LABEL_KIND:{
-            labelinfo * label = calloc(sizeof(*label), 1);
-            label->name = line->as.label.label_name;
-            label->address = pc;
-            *list = label;
-            list = &label->next;
-            break;
-        }
-        case JUMP_KIND:{
-            pc += 3;
-            break;
-        }
-        default:{
-            fprintf(stderr, "Unknown kind: %d\n", line->kind);;
-            exit(EXIT_FAILURE);
-        }
+    vm_const_cell *cells = malloc((cell_num ? cell_num : 1) * sizeof(*cells));
+    if (!cells) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int cell_i = 0; cell_i < cell_num; cell_i++) {
+        if (sscanf(cell_args[cell_i], "%" SCNu32 "=%" SCNu64, &cells[cell_i].addr,
+                   &cells[cell_i].value) != 2) {
+            fprintf(stderr, "Invalid constant cell, <address>=<value> expected: %s\n",
+                    cell_args[cell_i]);
+            free(cells);
+            return EXIT_FAILURE;
         }
     }
+
+    uint8_t specialized[MAX_CODE_LEN];
+    size_t code_len = 0, consts_len = 0;
+    analysis_result res = vm_specialize(bytecode, cells, (size_t)cell_num, specialized, &code_len,
+                                        &consts_len);
+    free(cells);
+    if (res != ANALYSIS_OK) {
+        fprintf(stderr, "Specialization error: %s\n", analysis_error_to_msg[res]);
+        return EXIT_FAILURE;
+    }
+
+    write_image(specialized, code_len, consts_len, output_path);
+    return EXIT_SUCCESS;
 }
 
-static void resolve_jumps(asm_line *line_list, labelinfo *labelinfo_list)
+static int optimize(uint8_t *bytecode, const char *output_path)
 {
-    /* Look for jumps and get label addresses for 'em */
-    for (asm_line *line = line_list; line; line = line->next) {
-        if (line->kind != JUMP_KIND)
-            continue;
+    uint8_t optimized[MAX_CODE_LEN];
+    size_t code_len = 0, consts_len = 0;
+    analysis_result res = vm_optimize(bytecode, optimized, &code_len, &consts_len);
+    if (res != ANALYSIS_OK) {
+        fprintf(stderr, "Optimization error: %s\n", analysis_error_to_msg[res]);
+        return EXIT_FAILURE;
+    }
 
-        /* only resolve jumps that have labels as addresses */
-        if (line->as.jump.label_name == NULL)
-            continue;
+    write_image(optimized, code_len, consts_len, output_path);
+    return EXIT_SUCCESS;
+}
 
-        /* Search through the list */
-        char *target_label_name = line->as.jump.label_name;
-        labelinfo *target_info = NULL;
-        for (target_info = labelinfo_list; target_info; target_info = target_info->next)
-            if (strcmp(target_label_name, target_info->name) == 0)
-                break;
+/*
+ * Batches: every program of a directory or a manifest run on a worker pool
+ *
+ * A program gets assembled or loaded, verified and handed to the pool once, however many inputs it
+ * runs with. A manifest line is a program path followed by the input cells of one job, paths being
+ * relative to the manifest; a directory holds *.pvm sources and *.bin images run once each.
+ * */
+
+#define MANIFEST_LINE_LEN 4096
+
+typedef struct batch_program {
+    char *path;
+    pvm_program *program;
+    pvm_pool_program *pool_program;
+
+    /* Summed up over the jobs of the program */
+    size_t job_num;
+    size_t failed_num;
+    uint64_t total_us;
+    uint64_t min_us;
+    uint64_t max_us;
+} batch_program;
+
+typedef struct batch_job {
+    size_t program;
+    size_t input;
+} batch_job;
+
+typedef struct batch {
+    pvm_pool *pool;
+
+    batch_program *programs;
+    size_t program_num;
+    size_t program_cap;
+
+    pvm_job *jobs;
+    /* Programs of the jobs and where their inputs start in cells */
+    batch_job *job_infos;
+    size_t job_num;
+    size_t job_cap;
+
+    /* Input cells of all the jobs back to back */
+    uint64_t *cells;
+    size_t cell_num;
+    size_t cell_cap;
+} batch;
+
+static void *batch_grow(void *array, size_t *cap, size_t num, size_t size)
+{
+    if (num < *cap)
+        return array;
+    *cap = *cap ? *cap * 2 : 16;
+    array = realloc(array, *cap * size);
+    if (!array) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
 
-        /* Did not find anything, fail */
-        if (!target_info) {
-            fprintf(stderr, "Cannot resolve a label: %s\n", target_label_name);
+/* Sources get assembled, anything else is an image; exits on failure */
+static pvm_program *batch_load(const char *path)
+{
+    size_t path_len = strlen(path);
+    analysis_result res;
+    pvm_program *program;
+    if (path_len > 4 && 0 == strcmp(path + path_len - 4, ".pvm")) {
+        uint8_t *bytecode = calloc(MAX_CODE_LEN, 1);
+        if (!bytecode) {
+            fprintf(stderr, "Failed to allocate memory\n");
             exit(EXIT_FAILURE);
         }
+        size_t bytecode_len = 0, consts_len = 0;
+        assemble(path, bytecode, &bytecode_len, &consts_len);
+        /* Constants are at the end of the code area */
+        program = pvm_program_new(bytecode, MAX_CODE_LEN, &res);
+        free(bytecode);
+    } else {
+        vm_image image;
+        map_image(path, &image);
+        program = pvm_program_from_image(&image, &res);
+        vm_image_unmap(&image);
+    }
 
-        line->as.jump.target_address = target_info->address;
+    if (!program) {
+        fprintf(stderr, "Invalid bytecode: %s: %s\n", path, analysis_error_to_msg[res]);
+        exit(EXIT_FAILURE);
     }
+    return program;
 }
 
-static size_t assemble_line(asm_line *line, uint8_t *bytecode, size_t pc)
+/* Programs listed more than once are loaded the first time only */
+static size_t batch_program_find(batch *batch, const char *path)
 {
-    switch (line->kind) {
-    case OP_KIND:{
-        bytecode[pc++] = line->as.op.opcode;
-        if (line->as.op.has_arg) {
-            uint16_t arg = line->as.op.arg;
-            bytecode[pc++] = (arg & 0xff00) >> 8;
-            bytecode[pc++] = (arg & 0x00ff);
-        }
-        break;
-    }
-    case LABEL_KIND:{
-        break;
-    }
-    case JUMP_KIND:{
-        bytecode[pc++] = line->as.jump.opcode;
-        uint16_t target = line->as.jump.target_address;
-        bytecode[pc++] = (target & 0xff00) >> 8;
-        bytecode[pc++] = (target & 0x00ff);
-        break;
-    }
-    default:{
-        fprintf(stderr, "Unknown op kind: %d\n", line->kind);
+    for (size_t program_i = 0; program_i < batch->program_num; program_i++)
+        if (0 == strcmp(batch->programs[program_i].path, path))
+            return program_i;
+
+    batch->programs = batch_grow(batch->programs, &batch->program_cap, batch->program_num,
+                                 sizeof(*batch->programs));
+    batch_program *program = &batch->programs[batch->program_num];
+    *program = (batch_program) {0};
+    program->path = strdup(path);
+    if (!program->path) {
+        fprintf(stderr, "Memory allocation failure\n");
         exit(EXIT_FAILURE);
     }
-    }
-    return pc;
+    program->program = batch_load(path);
+    program->pool_program = pvm_pool_program_new(batch->pool, program->program);
+    return batch->program_num++;
 }
 
-static void assemble(const char *path, uint8_t *bytecode, size_t *bytecode_len)
+static void batch_add_job(batch *batch, const char *path)
 {
-    asm_line *lines = NULL;
+    size_t program_i = batch_program_find(batch, path);
+
+    /* The pool takes jobs on their own, what the report needs goes alongside */
+    size_t job_cap = batch->job_cap;
+    batch->jobs = batch_grow(batch->jobs, &batch->job_cap, batch->job_num, sizeof(*batch->jobs));
+    batch->job_infos = batch_grow(batch->job_infos, &job_cap, batch->job_num,
+                                  sizeof(*batch->job_infos));
+
+    batch->jobs[batch->job_num] = (pvm_job) {
+        .program = batch->programs[program_i].pool_program,
+        .engine = PVM_ENGINE_THREADED,
+    };
+    batch->job_infos[batch->job_num] = (batch_job) {program_i, batch->cell_num};
+    batch->job_num++;
+}
 
-    /* Parse the flie */
-    {
-        FILE *file = fopen(path, "r");
-        if (file == NULL) {
-            fprintf(stderr, "File does not exist: %s\n", path);
-            exit(EXIT_FAILURE);
-        }
+static void batch_add_cell(batch *batch, uint64_t cell)
+{
+    batch->cells = batch_grow(batch->cells, &batch->cell_cap, batch->cell_num,
+                              sizeof(*batch->cells));
+    batch->cells[batch->cell_num++] = cell;
+    batch->jobs[batch->job_num - 1].input_len++;
+}
 
-        /* Parse lines */
-        char line_buf[MAX_LINE_LEN];
-        asm_line **list_tail = &lines;
-        while (fgets(line_buf, MAX_LINE_LEN, file)) {
-            asm_line *line = parse_line(line_buf);
-            if (!line)
-                continue;
-            *list_tail = line;
-            list_tail = &line->next;
-        }
-        fclose(file);
-    }
+static int batch_compare_names(const void *left, const void *right)
+{
+    return strcmp(*(char *const *)left, *(char *const *)right);
+}
 
-    /* Collect label addresses */
-    {
-        labelinfo *labelinfo_list = NULL;
-        collect_labelinfo(lines, &labelinfo_list);
+static bool batch_is_program_name(const char *name)
+{
+    size_t name_len = strlen(name);
+    return name_len > 4 && (0 == strcmp(name + name_len - 4, ".pvm") ||
+                            0 == strcmp(name + name_len - 4, ".bin"));
+}
 
-        /* Add proper addresses to jumps */
-        resolve_jumps(lines, labelinfo_list);
-    }
+/* Programs of the directory in name order, false for paths not naming a directory */
+static bool batch_read_dir(batch *batch, const char *dir_path)
+{
+    char **names = NULL;
+    size_t name_num = 0, name_cap = 0;
 
-    /* Compile lines to bytecode*/
-    {
-        size_t pc = 0;
-        for (asm_line *line = lines; line; line = line->next)
-            pc = assemble_line(line, bytecode, pc);
-        *bytecode_len = pc;
+#ifndef _MSC_VER
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return false;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+#else
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", dir_path);
+    WIN32_FIND_DATAA found;
+    HANDLE dir = FindFirstFileA(pattern, &found);
+    if (dir == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        const char *name = found.cFileName;
+#endif
+        if (!batch_is_program_name(name))
+            continue;
+        names = batch_grow(names, &name_cap, name_num, sizeof(*names));
+        names[name_num] = malloc(strlen(dir_path) + strlen(name) + 2);
+        if (!names[name_num]) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(names[name_num++], "%s/%s", dir_path, name);
+#ifndef _MSC_VER
     }
+    closedir(dir);
+#else
+    } while (FindNextFileA(dir, &found));
+    FindClose(dir);
+#endif
+
+    qsort(names, name_num, sizeof(*names), batch_compare_names);
+    for (size_t name_i = 0; name_i < name_num; name_i++) {
+        batch_add_job(batch, names[name_i]);
+        free(names[name_i]);
+    }
+    free(names);
+    return true;
 }
 
-static uint8_t *read_file(const char *path)
+/* A job per line: a program path and input cells, # starts a comment; exits on failure */
+static void batch_read_manifest(batch *batch, const char *manifest_path)
 {
-    FILE *file = fopen(path, "rb");
+    FILE *file = fopen(manifest_path, "r");
     if (!file) {
-        fprintf(stderr, "File does not exist: %s\n", path);
+        fprintf(stderr, "File does not exist: %s\n", manifest_path);
         exit(EXIT_FAILURE);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = (size_t)ftell(file);
-    rewind(file);
+    /* Program paths are relative to the manifest */
+    const char *base_end = strrchr(manifest_path, '/');
+    size_t base_len = base_end ? (size_t)(base_end - manifest_path) + 1 : 0;
+
+    char line[MANIFEST_LINE_LEN];
+    char path[MANIFEST_LINE_LEN * 2];
+    size_t line_num = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_num++;
+        if (!strchr(line, '\n') && !feof(file)) {
+            fprintf(stderr, "%s:%zu: line too long\n", manifest_path, line_num);
+            exit(EXIT_FAILURE);
+        }
+
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
 
-    uint8_t *buf = malloc(file_size + 1);
-    if (!buf) {
-        fprintf(stderr, "Memory allocation failure: %s\n", path);
-        exit(EXIT_FAILURE);
+        char *saveptr = NULL;
+        char *token = strtok_r(line, " \t\r\n", &saveptr);
+        if (!token)
+            continue;
+        if (token[0] == '/')
+            snprintf(path, sizeof(path), "%s", token);
+        else
+            snprintf(path, sizeof(path), "%.*s%s", (int)base_len, manifest_path, token);
+        batch_add_job(batch, path);
+
+        while ((token = strtok_r(NULL, " \t\r\n", &saveptr))) {
+            char *end;
+            uint64_t cell = strtoull(token, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "%s:%zu: invalid input cell: %s\n", manifest_path, line_num, token);
+                exit(EXIT_FAILURE);
+            }
+            batch_add_cell(batch, cell);
+        }
+        if (batch->jobs[batch->job_num - 1].input_len > MEMORY_SIZE) {
+            fprintf(stderr, "%s:%zu: more than %d input cells\n", manifest_path, line_num,
+                    MEMORY_SIZE);
+            exit(EXIT_FAILURE);
+        }
     }
+    fclose(file);
+}
 
-    size_t bytes_read = fread(buf, sizeof(uint8_t), file_size, file);
-    if (bytes_read < file_size) {
-        fprintf(stderr, "Failed to read: %s\n", path);
-        exit(EXIT_FAILURE);
+/* Jobs in the order listed, then a line per program and the totals */
+static int batch_report(batch *batch, uint64_t wall_us)
+{
+    printf("# job program worker us result status\n");
+    uint64_t run_us = 0;
+    size_t failed_num = 0;
+    for (size_t job_i = 0; job_i < batch->job_num; job_i++) {
+        pvm_job *job = &batch->jobs[job_i];
+        batch_program *program = &batch->programs[batch->job_infos[job_i].program];
+        printf("%zu %s %zu %" PRIu64 " %" PRIu64 " %s\n", job_i, program->path, job->worker,
+               job->elapsed_us, job->result, error_to_msg[job->status]);
+
+        if (program->job_num == 0 || job->elapsed_us < program->min_us)
+            program->min_us = job->elapsed_us;
+        if (job->elapsed_us > program->max_us)
+            program->max_us = job->elapsed_us;
+        program->total_us += job->elapsed_us;
+        program->job_num++;
+        run_us += job->elapsed_us;
+        if (job->status != SUCCESS) {
+            program->failed_num++;
+            failed_num++;
+        }
     }
 
-    buf[bytes_read] = '\0';
-    fclose(file);
-    return buf;
+    printf("# program jobs failed total_us min_us max_us\n");
+    for (size_t program_i = 0; program_i < batch->program_num; program_i++) {
+        batch_program *program = &batch->programs[program_i];
+        printf("%s %zu %zu %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", program->path, program->job_num,
+               program->failed_num, program->total_us, program->min_us, program->max_us);
+    }
+
+    printf("# %zu jobs of %zu programs, %zu failed, %zu workers, %" PRIu64 "us run, %" PRIu64
+           "us wall\n", batch->job_num, batch->program_num, failed_num,
+           pvm_pool_worker_num(batch->pool), run_us, wall_us);
+    return failed_num ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-static void write_file(const uint8_t *bytecode, const size_t bytecode_len, const char *path)
+static int batch_run(const char *path, size_t worker_num)
 {
-    FILE *file = fopen(path, "wb");
-    if (fwrite(bytecode, bytecode_len, 1, file) != 1) {
-        fprintf(stderr, "Failed to write to a file: %s\n", path);
-        exit(EXIT_FAILURE);
+    batch batch = {0};
+    batch.pool = pvm_pool_new(worker_num);
+
+    if (!batch_read_dir(&batch, path))
+        batch_read_manifest(&batch, path);
+
+    /* Inputs are in place once no more cells get added */
+    for (size_t job_i = 0; job_i < batch.job_num; job_i++)
+        batch.jobs[job_i].input = batch.cells ? batch.cells + batch.job_infos[job_i].input : NULL;
+
+    compat_timer timer;
+    compat_timer_init(&timer);
+    compat_timer_start(&timer);
+    pvm_pool_run(batch.pool, batch.jobs, batch.job_num);
+    uint64_t wall_us = compat_timer_elapsed_us(&timer);
+
+    int res = batch_report(&batch, wall_us);
+
+    pvm_pool_free(batch.pool);
+    for (size_t program_i = 0; program_i < batch.program_num; program_i++) {
+        pvm_program_free(batch.programs[program_i].program);
+        free(batch.programs[program_i].path);
     }
-    fclose(file);
+    free(batch.programs);
+    free(batch.jobs);
+    free(batch.job_infos);
+    free(batch.cells);
+    return res;
 }
 
 int main(int argc, char *argv[])
 {
     if (argc < 3) {
-        fprintf(stderr, "Usage: <asm|dis|run|runtimes> [arg1 [arg2 ...]]\n");
+        fprintf(stderr, "Usage: <asm|asmtimes|dis|run|runtimes|fibers|serve|batch|compile|specialize|optimize> [arg1 [arg2 ...]]\n");
         exit(EXIT_FAILURE);
     }
 
     const char *cmd = argv[1];
 
+    /* Programs run by the tool can use the standard host functions */
+    vm_register_standard_natives();
+
     int res;
     if (0 == strcmp(cmd, "dis")) {
         if (argc != 3) {
@@ -561,11 +1161,12 @@ int main(int argc, char *argv[])
         }
 
         const char *path = argv[2];
-        uint8_t *bytecode = read_file(path);
+        vm_image image;
+        map_image(path, &image);
 
-        res = disassemble(bytecode);
+        res = disassemble(&image);
 
-        free(bytecode);
+        vm_image_unmap(&image);
     } else if (0 == strcmp(cmd, "run")) {
         if (argc != 3) {
             fprintf(stderr, "Usage: run <path/to/bytecode>\n");
@@ -573,7 +1174,8 @@ int main(int argc, char *argv[])
         }
 
         const char *path = argv[2];
-        uint8_t *bytecode = read_file(path);
+        vm_image image;
+        uint8_t *bytecode = map_image(path, &image);
 
         TIMER_DEF(timer);
 
@@ -609,7 +1211,11 @@ int main(int argc, char *argv[])
         res = run_rcache_trace(bytecode);
         TIMER_END(timer, "trace code (reg cache) finished");
 
-        free(bytecode);
+        TIMER_START(timer);
+        res = run_register_threaded(bytecode);
+        TIMER_END(timer, "threaded register code finished");
+
+        vm_image_unmap(&image);
     } else if (0 == strcmp(cmd, "runtimes")) {
         if (argc != 4) {
             fprintf(stderr, "Usage: runtimes <path/to/bytecode> <number of iterations>\n");
@@ -617,7 +1223,8 @@ int main(int argc, char *argv[])
         }
 
         const char *path = argv[2];
-        uint8_t *bytecode = read_file(path);
+        vm_image image;
+        uint8_t *bytecode = map_image(path, &image);
 
         int num_iterations = 0;
         if (sscanf(argv[3], "%d", &num_iterations) != 1) {
@@ -667,7 +1274,92 @@ int main(int argc, char *argv[])
             res = run_rcache_trace(bytecode);
         TIMER_END(timer, "trace code (reg cache) finished");
 
-        free(bytecode);
+        TIMER_START(timer);
+        for (int i = 0; i < num_iterations; i++)
+            res = run_register_threaded(bytecode);
+        TIMER_END(timer, "threaded register code finished");
+
+        vm_image_unmap(&image);
+    } else if (0 == strcmp(cmd, "fibers")) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: fibers <path/to/bytecode> <number of fibers>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char *path = argv[2];
+        vm_image image;
+        uint8_t *bytecode = map_image(path, &image);
+
+        int num_fibers = 0;
+        if (sscanf(argv[3], "%d", &num_fibers) != 1 || num_fibers < 1) {
+            fprintf(stderr, "Failed to parse number of fibers: %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+        };
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *last = NULL;
+        for (int i = 0; i < num_fibers; i++)
+            last = vm_fiber_spawn(scheduler, bytecode);
+
+        TIMER_DEF(timer);
+
+        TIMER_START(timer);
+        vm_scheduler_run(scheduler);
+        TIMER_END(timer, "fibers finished");
+
+        /* All the fibers run the same code, the last one is as good as any */
+        if (vm_fiber_status(last) != SUCCESS) {
+            fprintf(stderr, "Runtime error: %s\n", error_to_msg[vm_fiber_status(last)]);
+            res = EXIT_FAILURE;
+        } else {
+            printf("Result value: %" PRIu64 "\n", vm_fiber_result(last));
+            res = EXIT_SUCCESS;
+        }
+
+        vm_scheduler_free(scheduler);
+        vm_image_unmap(&image);
+    } else if (0 == strcmp(cmd, "serve")) {
+        uint32_t program_num = (uint32_t)(argc - 2);
+        pvm_program **programs = malloc(program_num * sizeof(*programs));
+        if (!programs) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (uint32_t i = 0; i < program_num; i++) {
+            const char *path = argv[i + 2];
+            vm_image image;
+            map_image(path, &image);
+            analysis_result analysis_res;
+            programs[i] = pvm_program_from_image(&image, &analysis_res);
+            if (!programs[i]) {
+                fprintf(stderr, "Invalid bytecode: %s: %s\n", path,
+                        analysis_error_to_msg[analysis_res]);
+                exit(EXIT_FAILURE);
+            }
+            vm_image_unmap(&image);
+        }
+
+#ifdef _MSC_VER
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        FILE *replies = serve_replies();
+
+        res = serve(programs, program_num, replies);
+
+        fclose(replies);
+        for (uint32_t i = 0; i < program_num; i++)
+            pvm_program_free(programs[i]);
+        free(programs);
+    } else if (0 == strcmp(cmd, "batch")) {
+        if (argc != 3 && argc != 4) {
+            fprintf(stderr, "Usage: batch <path/to/dir|path/to/manifest> [number of workers]\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* A worker per CPU by default */
+        size_t worker_num = argc == 4 ? (size_t)strtoul(argv[3], NULL, 10) : 0;
+        res = batch_run(argv[2], worker_num);
     } else if (0 == strcmp(cmd, "asm")) {
         if (argc != 4) {
             fprintf(stderr, "Usage: asm <path/to/asm> <path/to/output/bytecode>\n");
@@ -678,17 +1370,94 @@ int main(int argc, char *argv[])
         const char *output_path = argv[3];
 
         size_t bytecode_len = 0;
+        size_t consts_len = 0;
         uint8_t *bytecode = calloc(MAX_CODE_LEN, 1);
         if (!bytecode) {
             fprintf(stderr, "Failed to allocate memory\n");
             exit(EXIT_FAILURE);
         }
 
-        assemble(input_path, bytecode, &bytecode_len);
-        write_file(bytecode, bytecode_len, output_path);
+        assemble(input_path, bytecode, &bytecode_len, &consts_len);
+        write_image(bytecode, bytecode_len, consts_len, output_path);
 
         res = EXIT_SUCCESS;
         free(bytecode);
+    } else if (0 == strcmp(cmd, "asmtimes")) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: asmtimes <path/to/asm> <number of iterations>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char *input_path = argv[2];
+        int num_iterations = 0;
+        if (sscanf(argv[3], "%d", &num_iterations) != 1) {
+            fprintf(stderr, "Failed to parse number of iterations: %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+        };
+
+        uint8_t *bytecode = calloc(MAX_CODE_LEN, 1);
+        if (!bytecode) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        TIMER_DEF(timer);
+
+        TIMER_START(timer);
+        size_t line_num = 0, bytecode_len = 0, consts_len = 0;
+        for (int i = 0; i < num_iterations; i++)
+            line_num += assemble(input_path, bytecode, &bytecode_len, &consts_len);
+        TIMER_END(timer, "assembler finished");
+
+        long elapsed_ms = compat_timer_elapsed_ms(&timer);
+        fprintf(stderr, "PROFILE: %.0f lines/s\n",
+                (double)line_num * 1000.0 / (double)(elapsed_ms > 0 ? elapsed_ms : 1));
+
+        free(bytecode);
+        res = EXIT_SUCCESS;
+    } else if (0 == strcmp(cmd, "compile")) {
+        if (argc != 4 && argc != 5) {
+            fprintf(stderr, "Usage: compile <path/to/bytecode> <path/to/output.c> [function name]\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char *input_path = argv[2];
+        const char *output_path = argv[3];
+        const char *func_name = argc == 5 ? argv[4] : "pvm_compiled";
+        vm_image image;
+        uint8_t *bytecode = map_image(input_path, &image);
+
+        res = compile(bytecode, output_path, func_name);
+
+        vm_image_unmap(&image);
+    } else if (0 == strcmp(cmd, "specialize")) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: specialize <path/to/bytecode> <path/to/output> [cell=value ...]\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char *input_path = argv[2];
+        const char *output_path = argv[3];
+        vm_image image;
+        uint8_t *bytecode = map_image(input_path, &image);
+
+        res = specialize(bytecode, argv + 4, argc - 4, output_path);
+
+        vm_image_unmap(&image);
+    } else if (0 == strcmp(cmd, "optimize")) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: optimize <path/to/bytecode> <path/to/output>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const char *input_path = argv[2];
+        const char *output_path = argv[3];
+        vm_image image;
+        uint8_t *bytecode = map_image(input_path, &image);
+
+        res = optimize(bytecode, output_path);
+
+        vm_image_unmap(&image);
     } else {
         fprintf(stderr, "Unknown cmd: %s\n", cmd);;
         res = EXIT_FAILURE;
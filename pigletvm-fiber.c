@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "compat.h"
+#include "pigletvm.h"
+
+#define FIBER_STACK_MAX 256
+
+/*
+ * Fibers
+ *
+ * A fiber is the state of a register-cached switch interpreter moved out of the interpreter: the
+ * instruction pointer, the stack pointer and the accumulator, plus the stacks themselves. Resuming
+ * a fiber loads these three into locals, YIELD stores them back and returns to the scheduler, so a
+ * context switch is a couple of plain loads and stores with no syscalls or signal masks involved.
+ * Fibers never yielding get preempted after a slice of backward jumps instead.
+ * */
+
+struct vm_fiber {
+    uint8_t *bytecode;
+
+    /* Registers saved while the fiber is suspended */
+    uint8_t *ip;
+    uint64_t *stack_top;
+    uint64_t acc;
+
+    /* Return addresses of active calls */
+    uint8_t **call_stack_top;
+
+    /* The result register and the way the fiber finished */
+    uint64_t result;
+    bool is_finished;
+    interpret_result status;
+
+    uint64_t stack[FIBER_STACK_MAX];
+    uint8_t *call_stack[CALL_STACK_MAX];
+};
+
+struct vm_scheduler {
+    /* Memory shared by all the fibers */
+    uint64_t *memory;
+    vm_paged_memory paged;
+
+    /* Every fiber spawned, finished ones included */
+    vm_fiber **fibers;
+    size_t fibers_len;
+    size_t fibers_capacity;
+
+    /* Fibers to be resumed, in round-robin order */
+    vm_fiber **live;
+    size_t live_len;
+
+    /* Backward jumps a fiber may take before being preempted */
+    uint64_t slice;
+};
+
+#ifdef _MSC_VER
+/* MSVC-compatible versions without GCC statement expressions */
+#define LOAD_REGS()                             \
+    uint8_t *ip = fiber->ip;                    \
+    uint64_t *stack_top = fiber->stack_top;     \
+    uint64_t acc = fiber->acc
+#else
+/* GCC/Clang version with register hints */
+#define LOAD_REGS()                                     \
+    register uint8_t *ip = fiber->ip;                   \
+    register uint64_t *stack_top = fiber->stack_top;    \
+    register uint64_t acc = fiber->acc
+#endif
+
+#define STORE_REGS()                            \
+    fiber->ip = ip;                             \
+    fiber->stack_top = stack_top;               \
+    fiber->acc = acc
+#define FINISH(res)                             \
+    do {                                        \
+        STORE_REGS();                           \
+        fiber->is_finished = true;              \
+        fiber->status = (res);                  \
+        return false;                           \
+    } while (0)
+#define NEXT_OP()                               \
+    (*ip++)
+#define NEXT_ARG()                                      \
+    ((void)(ip += 2), (ip[-2] << 8) + ip[-1])
+/* A fiber that used up its slice of backward jumps and calls gets preempted right before the next
+ * one */
+#define CHARGE_JUMP(target)                             \
+    do {                                                \
+        if (bytecode + (target) <= ip - 3) {            \
+            if (slice == 0) {                           \
+                ip -= 3;                                \
+                STORE_REGS();                           \
+                return true;                            \
+            }                                           \
+            slice--;                                    \
+        }                                               \
+    } while (0)
+
+#ifdef _MSC_VER
+static uint64_t _pop_tmp;
+#define POP() (_pop_tmp = acc, acc = *(--stack_top), _pop_tmp)
+#else
+#define POP()                                   \
+    ({ uint64_t tmp = acc; acc = *(--stack_top); tmp; })
+#endif
+
+#define PUSH(val)                               \
+    (*stack_top = acc, stack_top++, acc = (val))
+#define TOP()                                  \
+    (acc)
+/* Spill the accumulator so that all arguments are in place, the result replaces them */
+#define CALL_NATIVE(native)                                     \
+    do {                                                        \
+        *stack_top = acc;                                       \
+        uint64_t *args = stack_top + 1 - (native)->arity;       \
+        acc = (native)->function(args);                         \
+        stack_top = args;                                       \
+    } while (0)
+/* Policies of pigletvm-ops.h: the stack-cached engine with memory shared by the fibers */
+#define IP ip
+#define STATE (*fiber)
+#define MEMORY memory
+#define PAGED paged
+#define EXIT(res) FINISH(res)
+/* the fiber continues with the next instruction when resumed */
+#define YIELD()                                 \
+    do {                                        \
+        STORE_REGS();                           \
+        return true;                            \
+    } while (0)
+
+/* Fibers are not run guarded, so division by zero is always checked */
+#undef VM_TRAP_DIVISION
+#define VM_TRAP_DIVISION 0
+
+/* Run the fiber until it yields or gets preempted (true) or finishes (false) */
+static bool fiber_resume(vm_fiber *fiber, uint64_t *memory, vm_paged_memory *paged,
+                         uint64_t slice)
+{
+    uint8_t *bytecode = fiber->bytecode;
+
+    LOAD_REGS();
+
+    for (;;) {
+        uint8_t instruction = NEXT_OP();
+        switch (instruction) {
+#include "pigletvm-ops.h"
+        default:
+            FINISH(ERROR_UNKNOWN_OPCODE);
+        }
+    }
+
+    FINISH(ERROR_END_OF_STREAM);
+}
+
+#undef LOAD_REGS
+#undef STORE_REGS
+#undef FINISH
+#undef NEXT_OP
+#undef NEXT_ARG
+#undef CHARGE_JUMP
+#undef POP
+#undef PUSH
+#undef TOP
+#undef CALL_NATIVE
+#undef IP
+#undef STATE
+#undef MEMORY
+#undef PAGED
+#undef EXIT
+#undef YIELD
+
+static void *checked_calloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+vm_scheduler *vm_scheduler_new(void)
+{
+    vm_scheduler *scheduler = checked_calloc(1, sizeof(*scheduler));
+    scheduler->memory = checked_calloc(MEMORY_SIZE, sizeof(*scheduler->memory));
+    scheduler->slice = VM_BUDGET_UNLIMITED;
+    return scheduler;
+}
+
+void vm_scheduler_free(vm_scheduler *scheduler)
+{
+    for (size_t fiber_i = 0; fiber_i < scheduler->fibers_len; fiber_i++)
+        free(scheduler->fibers[fiber_i]);
+    free(scheduler->fibers);
+    free(scheduler->live);
+    free(scheduler->memory);
+    vm_paged_reset(&scheduler->paged);
+    free(scheduler);
+}
+
+uint64_t *vm_scheduler_memory(vm_scheduler *scheduler)
+{
+    return scheduler->memory;
+}
+
+void vm_scheduler_set_slice(vm_scheduler *scheduler, uint64_t slice)
+{
+    scheduler->slice = slice ? slice : 1;
+}
+
+vm_fiber *vm_fiber_spawn(vm_scheduler *scheduler, uint8_t *bytecode)
+{
+    if (scheduler->fibers_len == scheduler->fibers_capacity) {
+        size_t capacity = scheduler->fibers_capacity ? scheduler->fibers_capacity * 2 : 64;
+        vm_fiber **fibers = realloc(scheduler->fibers, capacity * sizeof(*fibers));
+        vm_fiber **live = realloc(scheduler->live, capacity * sizeof(*live));
+        if (!fibers || !live) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        scheduler->fibers = fibers;
+        scheduler->live = live;
+        scheduler->fibers_capacity = capacity;
+    }
+
+    vm_fiber *fiber = checked_calloc(1, sizeof(*fiber));
+    fiber->bytecode = bytecode;
+    fiber->ip = bytecode;
+    fiber->stack_top = fiber->stack;
+    fiber->call_stack_top = fiber->call_stack;
+
+    scheduler->fibers[scheduler->fibers_len++] = fiber;
+    scheduler->live[scheduler->live_len++] = fiber;
+    return fiber;
+}
+
+size_t vm_scheduler_step(vm_scheduler *scheduler)
+{
+    /* Finished fibers drop out of the queue, the rest keep their order */
+    size_t live_len = 0;
+    for (size_t fiber_i = 0; fiber_i < scheduler->live_len; fiber_i++) {
+        vm_fiber *fiber = scheduler->live[fiber_i];
+        if (fiber_resume(fiber, scheduler->memory, &scheduler->paged, scheduler->slice))
+            scheduler->live[live_len++] = fiber;
+    }
+    scheduler->live_len = live_len;
+    return live_len;
+}
+
+void vm_scheduler_run(vm_scheduler *scheduler)
+{
+    while (vm_scheduler_step(scheduler))
+        ;
+}
+
+bool vm_fiber_is_finished(vm_fiber *fiber)
+{
+    return fiber->is_finished;
+}
+
+interpret_result vm_fiber_status(vm_fiber *fiber)
+{
+    return fiber->status;
+}
+
+uint64_t vm_fiber_result(vm_fiber *fiber)
+{
+    return fiber->result;
+}
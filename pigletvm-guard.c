@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+#ifndef _MSC_VER
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "pigletvm.h"
+
+/*
+ * Guarded stacks
+ *
+ * A stack is mapped between two PROT_NONE pages, so an engine pushing past its end or popping
+ * below its bottom touches a guard page and faults. The fault handler finds the stack the address
+ * belongs to and jumps back to vm_guarded_run with the error. Anything else faulting is not ours:
+ * the handler puts the previous action back and returns, so the fault happens again and gets
+ * handled the usual way.
+ *
+ * Division by zero is caught the same way when built with PIGLETVM_TRAP_DIVISION.
+ *
+ * Hosts without mmap and signals get plain heap stacks, unchecked as before.
+ * */
+
+/* stack engines of the process: vm, vm_trace, vm_rcache and vm_rcache_trace */
+#define GUARDED_STACK_MAX 8
+
+static struct {
+    uint8_t *begin;
+    uint8_t *end;
+} guarded_stacks[GUARDED_STACK_MAX];
+
+static size_t guarded_stack_num;
+
+/* The run to stop on a guard page hit or an engine failure */
+static jmp_buf *recovery;
+
+static interpret_result recovery_error;
+
+#ifndef _MSC_VER
+
+static struct sigaction prev_segv_action;
+static struct sigaction prev_bus_action;
+static struct sigaction prev_fpe_action;
+
+static void guard_handler(int signo, siginfo_t *info, void *context)
+{
+    (void) context;
+
+    if (signo == SIGFPE) {
+        if (recovery && info->si_code == FPE_INTDIV) {
+            recovery_error = ERROR_DIVISION_BY_ZERO;
+            longjmp(*recovery, 1);
+        }
+        sigaction(SIGFPE, &prev_fpe_action, NULL);
+        return;
+    }
+
+    uint8_t *addr = info->si_addr;
+    for (size_t stack_i = 0; recovery && stack_i < guarded_stack_num; stack_i++) {
+        uint8_t *begin = guarded_stacks[stack_i].begin;
+        uint8_t *end = guarded_stacks[stack_i].end;
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+        if (addr >= begin - page_size && addr < begin) {
+            recovery_error = ERROR_STACK_UNDERFLOW;
+            longjmp(*recovery, 1);
+        }
+        if (addr >= end && addr < end + page_size) {
+            recovery_error = ERROR_STACK_OVERFLOW;
+            longjmp(*recovery, 1);
+        }
+    }
+
+    sigaction(signo, signo == SIGSEGV ? &prev_segv_action : &prev_bus_action, NULL);
+}
+
+static void install_guard_handler(void)
+{
+    /* The handler never returns to a fault of ours, leaving it has to keep the signal unblocked
+     * without saving and restoring the signal mask on every run */
+    struct sigaction action = {0};
+    action.sa_sigaction = guard_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGSEGV, &action, &prev_segv_action);
+    /* some systems raise SIGBUS for PROT_NONE pages */
+    sigaction(SIGBUS, &action, &prev_bus_action);
+    if (VM_TRAP_DIVISION)
+        sigaction(SIGFPE, &action, &prev_fpe_action);
+}
+
+uint64_t *vm_guarded_stack_new(size_t cells)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t stack_size = (cells * sizeof(uint64_t) + page_size - 1) / page_size * page_size;
+
+    if (guarded_stack_num == GUARDED_STACK_MAX) {
+        fprintf(stderr, "Too many guarded stacks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *region = mmap(NULL, stack_size + 2 * page_size, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *begin = region + page_size;
+    if (mprotect(begin, stack_size, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (guarded_stack_num == 0)
+        install_guard_handler();
+    guarded_stacks[guarded_stack_num].begin = begin;
+    guarded_stacks[guarded_stack_num].end = begin + stack_size;
+    guarded_stack_num++;
+
+    return (uint64_t *)begin;
+}
+
+#else
+
+uint64_t *vm_guarded_stack_new(size_t cells)
+{
+    uint64_t *stack = calloc(cells, sizeof(uint64_t));
+    if (!stack) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return stack;
+}
+
+#endif /* _MSC_VER */
+
+interpret_result vm_guarded_run(interpret_result (*run)(void))
+{
+    jmp_buf run_recovery;
+    jmp_buf *outer_recovery = recovery;
+    interpret_result res;
+
+    recovery = &run_recovery;
+    if (!setjmp(run_recovery))
+        res = run();
+    else
+        res = recovery_error;
+    recovery = outer_recovery;
+
+    return res;
+}
+
+void vm_guarded_fail(interpret_result error)
+{
+    recovery_error = error;
+    longjmp(*recovery, 1);
+}
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "pigletvm.h"
+
+/*
+ * Program images
+ *
+ * Layout, all numbers little-endian:
+ *
+ *   0   magic "PIGLETVM"
+ *   8   u64 checksum, FNV-1a of every byte from offset 16 to the end
+ *   16  u32 version
+ *   20  u32 image size
+ *   24  u32 flags
+ *   28  u16 code length
+ *   30  u16 maximum stack depth
+ *   32  u32 number of sections
+ *   36  u32 number of constants
+ *   40  section table: u32 kind, u32 offset, u32 size, u32 reserved per section
+ *
+ * Sections start at 8-byte aligned offsets, so they can be used right where the file is mapped.
+ * The code section always holds the whole MAX_CODE_LEN code area, the code padded with ABORT and
+ * the constant pool at its end, so that engines can run it in place. Block starts and jump targets
+ * are bitmaps of MAX_CODE_LEN bits. Readers skip sections of unknown kinds.
+ * */
+
+#define IMAGE_MAGIC "PIGLETVM"
+#define IMAGE_MAGIC_LEN 8
+#define IMAGE_CHECKSUM_OFFSET 8
+#define IMAGE_CHECKED_OFFSET 16
+#define IMAGE_HEADER_LEN 40
+#define IMAGE_SECTION_ENTRY_LEN 16
+
+#define IMAGE_BITMAP_LEN (MAX_CODE_LEN / 8)
+
+typedef enum image_section_kind {
+    SECTION_CODE = 1,
+    /* 2 is retired, constants are a part of the code area */
+    SECTION_BLOCK_STARTS = 3,
+    SECTION_JUMP_TARGETS = 4,
+} image_section_kind;
+
+static uint64_t checksum(const uint8_t *bytes, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t read_le(const uint8_t *bytes, size_t len)
+{
+    uint64_t val = 0;
+    for (size_t i = 0; i < len; i++)
+        val |= (uint64_t)bytes[i] << (i * 8);
+    return val;
+}
+
+static void write_le(uint8_t *bytes, size_t len, uint64_t val)
+{
+    for (size_t i = 0; i < len; i++)
+        bytes[i] = (uint8_t)(val >> (i * 8));
+}
+
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~(size_t)7;
+}
+
+static void bitmap_from_flags(uint8_t *bitmap, const bool *flags)
+{
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++)
+        if (flags[pc])
+            bitmap[pc / 8] |= (uint8_t)(1u << (pc % 8));
+}
+
+analysis_result vm_image_write(const uint8_t *bytecode, size_t code_len, size_t consts_len,
+                               FILE *out)
+{
+    if (code_len > MAX_CODE_LEN || consts_len > (MAX_CODE_LEN - code_len) / 8)
+        return ANALYSIS_ERROR_CODE_OVERFLOW;
+
+    struct {
+        image_section_kind kind;
+        size_t size;
+    } sections[] = {
+        {SECTION_CODE, MAX_CODE_LEN},
+        {SECTION_BLOCK_STARTS, IMAGE_BITMAP_LEN},
+        {SECTION_JUMP_TARGETS, IMAGE_BITMAP_LEN},
+    };
+    size_t section_num = sizeof(sections) / sizeof(sections[0]);
+
+    size_t offsets[sizeof(sections) / sizeof(sections[0])];
+    size_t size = align8(IMAGE_HEADER_LEN + section_num * IMAGE_SECTION_ENTRY_LEN);
+    for (size_t section_i = 0; section_i < section_num; section_i++) {
+        offsets[section_i] = size;
+        size = align8(size + sections[section_i].size);
+    }
+
+    uint8_t *image = calloc(size, 1);
+    vm_analysis *analysis = calloc(1, sizeof(*analysis));
+    if (!image || !analysis) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *code = image + offsets[0];
+    memcpy(code, bytecode, code_len);
+    memcpy(code + MAX_CODE_LEN - consts_len * 8, bytecode + MAX_CODE_LEN - consts_len * 8,
+           consts_len * 8);
+
+    /* Unverified code gets no metadata, loaders will have to check it themselves */
+    analysis_result res = vm_analyze(code, analysis);
+    uint32_t flags = 0;
+    if (res == ANALYSIS_OK) {
+        flags |= VM_IMAGE_VERIFIED;
+        bitmap_from_flags(image + offsets[1], analysis->is_block_start);
+        bitmap_from_flags(image + offsets[2], analysis->is_jump_target);
+    }
+
+    memcpy(image, IMAGE_MAGIC, IMAGE_MAGIC_LEN);
+    write_le(image + 16, 4, VM_IMAGE_VERSION);
+    write_le(image + 20, 4, size);
+    write_le(image + 24, 4, flags);
+    write_le(image + 28, 2, code_len);
+    write_le(image + 30, 2, res == ANALYSIS_OK ? (uint64_t)analysis->max_depth : 0);
+    write_le(image + 32, 4, section_num);
+    write_le(image + 36, 4, consts_len);
+    for (size_t section_i = 0; section_i < section_num; section_i++) {
+        uint8_t *entry = image + IMAGE_HEADER_LEN + section_i * IMAGE_SECTION_ENTRY_LEN;
+        write_le(entry, 4, sections[section_i].kind);
+        write_le(entry + 4, 4, offsets[section_i]);
+        write_le(entry + 8, 4, sections[section_i].size);
+    }
+    write_le(image + IMAGE_CHECKSUM_OFFSET, 8,
+             checksum(image + IMAGE_CHECKED_OFFSET, size - IMAGE_CHECKED_OFFSET));
+
+    if (fwrite(image, size, 1, out) != 1) {
+        fprintf(stderr, "Failed to write an image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(analysis);
+    free(image);
+    return res;
+}
+
+image_result vm_image_parse(uint8_t *data, size_t size, vm_image *image)
+{
+    memset(image, 0, sizeof(*image));
+
+    if (size < IMAGE_HEADER_LEN || memcmp(data, IMAGE_MAGIC, IMAGE_MAGIC_LEN) != 0)
+        return IMAGE_ERROR_MAGIC;
+    if (read_le(data + 16, 4) != VM_IMAGE_VERSION)
+        return IMAGE_ERROR_VERSION;
+    if (read_le(data + 20, 4) != size)
+        return IMAGE_ERROR_TRUNCATED;
+    if (read_le(data + IMAGE_CHECKSUM_OFFSET, 8) !=
+        checksum(data + IMAGE_CHECKED_OFFSET, size - IMAGE_CHECKED_OFFSET))
+        return IMAGE_ERROR_CHECKSUM;
+
+    image->flags = (uint32_t)read_le(data + 24, 4);
+    image->code_len = read_le(data + 28, 2);
+    image->max_depth = (uint16_t)read_le(data + 30, 2);
+    image->consts_len = read_le(data + 36, 4);
+
+    size_t section_num = read_le(data + 32, 4);
+    if (section_num > (size - IMAGE_HEADER_LEN) / IMAGE_SECTION_ENTRY_LEN)
+        return IMAGE_ERROR_TRUNCATED;
+
+    for (size_t section_i = 0; section_i < section_num; section_i++) {
+        uint8_t *entry = data + IMAGE_HEADER_LEN + section_i * IMAGE_SECTION_ENTRY_LEN;
+        uint64_t kind = read_le(entry, 4);
+        uint64_t offset = read_le(entry + 4, 4);
+        uint64_t section_size = read_le(entry + 8, 4);
+        if (offset > size || section_size > size - offset || offset % 8 != 0)
+            return IMAGE_ERROR_TRUNCATED;
+
+        uint8_t *section = data + offset;
+        switch (kind) {
+        case SECTION_CODE:
+            if (section_size != MAX_CODE_LEN)
+                return IMAGE_ERROR_SECTION;
+            image->code = section;
+            break;
+        case SECTION_BLOCK_STARTS:
+            if (section_size != IMAGE_BITMAP_LEN)
+                return IMAGE_ERROR_SECTION;
+            image->block_starts = section;
+            break;
+        case SECTION_JUMP_TARGETS:
+            if (section_size != IMAGE_BITMAP_LEN)
+                return IMAGE_ERROR_SECTION;
+            image->jump_targets = section;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!image->code || !image->block_starts || !image->jump_targets ||
+        image->code_len > MAX_CODE_LEN || image->consts_len > (MAX_CODE_LEN - image->code_len) / 8)
+        return IMAGE_ERROR_SECTION;
+
+    return IMAGE_OK;
+}
+
+#ifndef _MSC_VER
+
+image_result vm_image_map(const char *path, vm_image *image)
+{
+    memset(image, 0, sizeof(*image));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return IMAGE_ERROR_IO;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return IMAGE_ERROR_IO;
+    }
+    /* mmap refuses empty files */
+    if (file_stat.st_size == 0) {
+        close(fd);
+        return IMAGE_ERROR_MAGIC;
+    }
+
+    /* Private and writable, so that the code can be handed to engines taking plain pointers. Pages
+     * stay shared with the page cache unless someone writes to them. */
+    size_t size = (size_t)file_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return IMAGE_ERROR_IO;
+
+    image_result res = vm_image_parse(mapping, size, image);
+    if (res != IMAGE_OK) {
+        munmap(mapping, size);
+        return res;
+    }
+
+    image->mapping = mapping;
+    image->mapping_size = size;
+    return IMAGE_OK;
+}
+
+void vm_image_unmap(vm_image *image)
+{
+    if (image->mapping)
+        munmap(image->mapping, image->mapping_size);
+    memset(image, 0, sizeof(*image));
+}
+
+#else
+
+/* No mmap, the file gets read into the heap instead */
+image_result vm_image_map(const char *path, vm_image *image)
+{
+    memset(image, 0, sizeof(*image));
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return IMAGE_ERROR_IO;
+
+    fseek(file, 0L, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    rewind(file);
+
+    uint8_t *data = malloc(size ? size : 1);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failure: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(data, 1, size, file) != size) {
+        fclose(file);
+        free(data);
+        return IMAGE_ERROR_IO;
+    }
+    fclose(file);
+
+    image_result res = vm_image_parse(data, size, image);
+    if (res != IMAGE_OK) {
+        free(data);
+        return res;
+    }
+
+    image->mapping = data;
+    image->mapping_size = size;
+    return IMAGE_OK;
+}
+
+void vm_image_unmap(vm_image *image)
+{
+    free(image->mapping);
+    memset(image, 0, sizeof(*image));
+}
+
+#endif /* _MSC_VER */
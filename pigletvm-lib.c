@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "compat.h"
+#include "pigletvm.h"
+
+#define STACK_MAX 256
+
+/*
+ * Embedding
+ *
+ * A program is bytecode copied once, padded with ABORT and verified with vm_analyze. Verification
+ * bounds stack depths, so contexts run programs on plain fixed stacks: no guard pages, no signal
+ * handlers and no other process-wide state, which is what lets threads run contexts concurrently.
+ * Engines are the stack-cached ones of pigletvm-ops.h with the registers kept in the context
+ * between runs, the same way fibers keep them.
+ * */
+
+struct pvm_program {
+    uint8_t bytecode[MAX_CODE_LEN];
+};
+
+struct pvm_context {
+    const pvm_program *program;
+    pvm_engine engine;
+
+    /* Either the caller's cells or owned_memory */
+    uint64_t *memory;
+    uint64_t *owned_memory;
+    /* Cells past MEMORY_SIZE, always the context's own */
+    vm_paged_memory paged;
+
+    /* Backward jumps and calls left */
+    uint64_t budget;
+
+    /* Registers saved between runs */
+    const uint8_t *ip;
+    uint64_t *stack_top;
+    uint64_t acc;
+
+    /* Return addresses of active calls */
+    const uint8_t **call_stack_top;
+
+    uint64_t result;
+
+    /* verified code never goes deeper, the extra cell is where the accumulator spills */
+    uint64_t stack[STACK_MAX + 1];
+    const uint8_t *call_stack[CALL_STACK_MAX];
+};
+
+static void *checked_calloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+pvm_program *pvm_program_new(const uint8_t *bytecode, size_t len, analysis_result *error)
+{
+    analysis_result res = ANALYSIS_ERROR_CODE_OVERFLOW;
+    pvm_program *program = NULL;
+
+    if (len <= MAX_CODE_LEN) {
+        program = checked_calloc(1, sizeof(*program));
+        memcpy(program->bytecode, bytecode, len);
+
+        vm_analysis *analysis = checked_calloc(1, sizeof(*analysis));
+        res = vm_analyze(program->bytecode, analysis);
+        free(analysis);
+    }
+
+    if (error)
+        *error = res;
+    if (res != ANALYSIS_OK) {
+        free(program);
+        return NULL;
+    }
+    return program;
+}
+
+pvm_program *pvm_program_from_image(const vm_image *image, analysis_result *error)
+{
+    if (!(image->flags & VM_IMAGE_VERIFIED))
+        return pvm_program_new(image->code, image->code_len, error);
+
+    /* The writer analysed the code already */
+    pvm_program *program = checked_calloc(1, sizeof(*program));
+    memcpy(program->bytecode, image->code, MAX_CODE_LEN);
+    if (error)
+        *error = ANALYSIS_OK;
+    return program;
+}
+
+pvm_program *pvm_program_clone(const pvm_program *program)
+{
+    /* Fresh pages land on the node of the thread touching them first, the copy is the caller's */
+    pvm_program *clone = checked_calloc(1, sizeof(*clone));
+    memcpy(clone->bytecode, program->bytecode, MAX_CODE_LEN);
+    return clone;
+}
+
+void pvm_program_free(pvm_program *program)
+{
+    free(program);
+}
+
+pvm_context *pvm_context_new(void)
+{
+    pvm_context *context = checked_calloc(1, sizeof(*context));
+    context->owned_memory = checked_calloc(MEMORY_SIZE, sizeof(*context->owned_memory));
+    context->memory = context->owned_memory;
+    context->budget = VM_BUDGET_UNLIMITED;
+    return context;
+}
+
+void pvm_context_free(pvm_context *context)
+{
+    free(context->owned_memory);
+    vm_paged_reset(&context->paged);
+    free(context);
+}
+
+void pvm_context_bind_memory(pvm_context *context, uint64_t *cells)
+{
+    context->memory = cells ? cells : context->owned_memory;
+}
+
+uint64_t *pvm_context_memory(pvm_context *context)
+{
+    return context->memory;
+}
+
+vm_paged_memory *pvm_context_paged_memory(pvm_context *context)
+{
+    return &context->paged;
+}
+
+void pvm_context_set_budget(pvm_context *context, uint64_t budget)
+{
+    context->budget = budget;
+}
+
+uint64_t pvm_context_result(pvm_context *context)
+{
+    return context->result;
+}
+
+#ifdef _MSC_VER
+/* MSVC-compatible versions without GCC statement expressions */
+#define LOAD_REGS()                                     \
+    const uint8_t *ip = context->ip;                    \
+    uint64_t *stack_top = context->stack_top;           \
+    uint64_t acc = context->acc;                        \
+    uint64_t budget = context->budget
+#else
+/* GCC/Clang version with register hints */
+#define LOAD_REGS()                                             \
+    register const uint8_t *ip = context->ip;                   \
+    register uint64_t *stack_top = context->stack_top;          \
+    register uint64_t acc = context->acc;                       \
+    uint64_t budget = context->budget
+#endif
+
+#define STORE_REGS()                            \
+    context->ip = ip;                           \
+    context->stack_top = stack_top;             \
+    context->acc = acc;                         \
+    context->budget = budget
+#define NEXT_OP()                               \
+    (*ip++)
+#define NEXT_ARG()                                      \
+    ((void)(ip += 2), (ip[-2] << 8) + ip[-1])
+/* Stop right before the jump, pvm_resume takes it once the budget is refilled */
+#define CHARGE_JUMP(target)                                     \
+    do {                                                        \
+        if (bytecode + (target) <= ip - 3) {                    \
+            if (budget == 0) {                                  \
+                ip -= 3;                                        \
+                EXIT(ERROR_BUDGET_EXHAUSTED);                   \
+            }                                                   \
+            budget--;                                           \
+        }                                                       \
+    } while (0)
+
+#ifdef _MSC_VER
+static __declspec(thread) uint64_t _pop_tmp;
+#define POP() (_pop_tmp = acc, acc = *(--stack_top), _pop_tmp)
+#else
+#define POP()                                   \
+    ({ uint64_t tmp = acc; acc = *(--stack_top); tmp; })
+#endif
+
+#define PUSH(val)                               \
+    (*stack_top = acc, stack_top++, acc = (val))
+#define TOP()                                  \
+    (acc)
+/* Spill the accumulator so that all arguments are in place, the result replaces them */
+#define CALL_NATIVE(native)                                     \
+    do {                                                        \
+        *stack_top = acc;                                       \
+        uint64_t *args = stack_top + 1 - (native)->arity;       \
+        acc = (native)->function(args);                         \
+        stack_top = args;                                       \
+    } while (0)
+/* Policies of pigletvm-ops.h: the stack-cached engine with all of the state in the context */
+#define IP ip
+#define STATE (*context)
+#define MEMORY memory
+#define PAGED (&context->paged)
+#define EXIT(res)                               \
+    do {                                        \
+        STORE_REGS();                           \
+        return (res);                           \
+    } while (0)
+#define YIELD() ((void)0)
+
+/* Runs are not guarded, so division by zero is always checked */
+#undef VM_TRAP_DIVISION
+#define VM_TRAP_DIVISION 0
+
+static interpret_result context_run_switch(pvm_context *context)
+{
+    const uint8_t *bytecode = context->program->bytecode;
+    uint64_t *memory = context->memory;
+
+    LOAD_REGS();
+
+    for (;;) {
+        uint8_t instruction = NEXT_OP();
+        switch (instruction) {
+#include "pigletvm-ops.h"
+        default:
+            EXIT(ERROR_UNKNOWN_OPCODE);
+        }
+    }
+
+    EXIT(ERROR_END_OF_STREAM);
+}
+
+#if COMPUTED_GOTO_SUPPORTED
+static interpret_result context_run_threaded(pvm_context *context)
+{
+    const uint8_t *bytecode = context->program->bytecode;
+    uint64_t *memory = context->memory;
+
+    LOAD_REGS();
+
+    /* every byte has a label, verification lets unknown opcodes stop the code */
+    static const void *const labels[256] = {
+        PIGLETVM_OPS(PIGLETVM_OPS_LABEL)
+        [OP_NUMBER_OF_OPS ... 255] = &&op_unknown,
+    };
+
+    goto *labels[NEXT_OP()];
+
+#define OPS_THREADED
+#include "pigletvm-ops.h"
+#undef OPS_THREADED
+
+op_unknown:
+    EXIT(ERROR_UNKNOWN_OPCODE);
+}
+#else
+/* Fallback for compilers without computed goto support (e.g., MSVC) */
+static interpret_result context_run_threaded(pvm_context *context)
+{
+    return context_run_switch(context);
+}
+#endif /* COMPUTED_GOTO_SUPPORTED */
+
+#undef LOAD_REGS
+#undef STORE_REGS
+#undef NEXT_OP
+#undef NEXT_ARG
+#undef CHARGE_JUMP
+#undef POP
+#undef PUSH
+#undef TOP
+#undef CALL_NATIVE
+#undef IP
+#undef STATE
+#undef MEMORY
+#undef PAGED
+#undef EXIT
+#undef YIELD
+
+interpret_result pvm_run(pvm_context *context, const pvm_program *program, pvm_engine engine)
+{
+    context->program = program;
+    context->engine = engine;
+    context->ip = program->bytecode;
+    context->stack_top = context->stack;
+    context->acc = 0;
+    context->call_stack_top = context->call_stack;
+    context->result = 0;
+    /* Blocks of the previous run are gone in one go, whatever they hold stays in memory */
+    vm_heap_reset(&context->paged);
+    return pvm_resume(context);
+}
+
+interpret_result pvm_resume(pvm_context *context)
+{
+    switch (context->engine) {
+    case PVM_ENGINE_THREADED:
+        return context_run_threaded(context);
+    case PVM_ENGINE_SWITCH:
+    default:
+        return context_run_switch(context);
+    }
+}
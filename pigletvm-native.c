@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pigletvm.h"
+
+vm_native vm_natives[NATIVE_MAX];
+
+bool vm_register_native(uint16_t index, vm_native_function *function, uint8_t arity)
+{
+    if (index >= NATIVE_MAX)
+        return false;
+    vm_natives[index] = (vm_native){function, arity};
+    return true;
+}
+
+uint64_t vm_call_native(uint16_t index, const uint64_t *args)
+{
+    return vm_natives[index].function(args);
+}
+
+/* The MurmurHash3 finalizer */
+static uint64_t native_hash(const uint64_t *args)
+{
+    uint64_t h = args[0];
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t native_hash_combine(const uint64_t *args)
+{
+    uint64_t seed = args[0];
+    return seed ^ (args[1] + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+void vm_register_standard_natives(void)
+{
+    vm_register_native(NATIVE_HASH, native_hash, 1);
+    vm_register_native(NATIVE_HASH_COMBINE, native_hash_combine, 2);
+}
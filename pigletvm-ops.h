@@ -0,0 +1,415 @@
+/*
+ * Stack engine opcode semantics
+ *
+ * Every switch and threaded stack engine (the plain and stack-cached sets in pigletvm.c and
+ * pigletvm-rcache.c, and the fiber engine) includes this file in the middle of its interpreter
+ * function, so an op is written once and compiled into each engine with that engine's policies.
+ * There is no include guard on purpose, the op list at the top is the only part included once.
+ *
+ * Dispatch: with OPS_THREADED defined an op is a label named op_<NAME> and NEXT() jumps through
+ * the labels table of the engine, otherwise an op is a switch case and NEXT() breaks out of the
+ * switch. The no range check flavour is the switch one, the engine masks the opcode and lists the
+ * unknown cases.
+ *
+ * Stack caching: PUSH(val), POP() and TOP() (an lvalue), CALL_NATIVE(native) calling a native
+ * function with its arguments in place.
+ *
+ * State: IP, MEMORY and PAGED, the flat and the paged memory, and STATE, the struct holding result,
+ * call_stack and call_stack_top.
+ *
+ * Exits: EXIT(res) stops the run saving whatever the engine keeps in locals, CHARGE_JUMP(target)
+ * is the budget check of backward jumps and calls, YIELD() is what OP_YIELD does.
+ * */
+
+#ifndef PIGLETVM_OPS_LIST
+#define PIGLETVM_OPS_LIST
+
+/* Every op implemented below, threaded engines build their labels tables from this */
+#define PIGLETVM_OPS(X)                                                 \
+    X(ABORT) X(PUSHI) X(LOADI) X(LOADADDI) X(STOREI) X(LOAD) X(STORE)   \
+    X(DUP) X(DISCARD) X(ADD) X(ADDI) X(SUB) X(DIV) X(MUL)               \
+    X(JUMP) X(JUMP_IF_TRUE) X(JUMP_IF_FALSE)                            \
+    X(EQUAL) X(LESS) X(LESS_OR_EQUAL) X(GREATER) X(GREATER_OR_EQUAL)    \
+    X(GREATER_OR_EQUALI) X(POP_RES) X(DONE) X(PRINT) X(CALL) X(RET)     \
+    X(LOAD8) X(LOAD16) X(LOAD32) X(STORE8) X(STORE16) X(STORE32)        \
+    X(BIT_TEST) X(BIT_SET)                                              \
+    X(MEMSET) X(MEMCPY) X(MEMSUM) X(MEMMIN) X(MEMMAX) X(MEMCOUNT)       \
+    X(CALLNATIVE) X(YIELD) X(PUSHK)                                     \
+    X(AND) X(OR) X(XOR) X(NOT) X(SHL) X(SHR) X(SAR) X(MOD)              \
+    X(LESS_SIGNED) X(LESS_OR_EQUAL_SIGNED) X(GREATER_SIGNED)            \
+    X(GREATER_OR_EQUAL_SIGNED) X(ALLOC) X(FREE)
+
+#define PIGLETVM_OPS_LABEL(name) [OP_##name] = &&op_##name,
+
+#endif /* PIGLETVM_OPS_LIST */
+
+#ifdef OPS_THREADED
+#define OP(name) op_##name:
+#define NEXT() goto *labels[NEXT_OP()]
+#else
+#define OP(name) case OP_##name:
+#define NEXT() break
+#endif
+
+OP(PUSHI) {
+    /* get the argument, push it onto stack */
+    uint16_t arg = NEXT_ARG();
+    PUSH(arg);
+    NEXT();
+}
+OP(PUSHK) {
+    /* get the argument, push the constant it points to onto stack */
+    uint16_t index = NEXT_ARG();
+    PUSH(vm_const_at(bytecode, index));
+    NEXT();
+}
+OP(LOADI) {
+    /* get the argument, use it to get a value onto stack */
+    uint16_t addr = NEXT_ARG();
+    uint64_t val = MEMORY[addr];
+    PUSH(val);
+    NEXT();
+}
+OP(LOADADDI) {
+    /* get the argument, add the value from the address to the top of the stack */
+    uint16_t addr = NEXT_ARG();
+    uint64_t val = MEMORY[addr];
+    TOP() += val;
+    NEXT();
+}
+OP(STOREI) {
+    /* get the argument, use it to get a value of the stack into a memory cell */
+    uint16_t addr = NEXT_ARG();
+    uint64_t val = POP();
+    MEMORY[addr] = val;
+    NEXT();
+}
+OP(LOAD) {
+    /* replace an address on top of the stack with the value it points to */
+    TOP() = vm_memory_load(MEMORY, PAGED, TOP());
+    NEXT();
+}
+OP(STORE) {
+    /* pop a value, pop an adress, put a value into an address */
+    uint64_t val = POP();
+    uint64_t addr = POP();
+    vm_memory_store(MEMORY, PAGED, addr, val);
+    NEXT();
+}
+OP(DUP) {
+    /* duplicate the top of the stack */
+    PUSH(TOP());
+    NEXT();
+}
+OP(DISCARD) {
+    /* discard the top of the stack */
+    (void)POP();
+    NEXT();
+}
+OP(ADD) {
+    /* Pop 2 values, add 'em, push the result back to the stack */
+    uint64_t arg_right = POP();
+    TOP() += arg_right;
+    NEXT();
+}
+OP(ADDI) {
+    /* Add immediate value to the top of the stack */
+    uint16_t arg_right = NEXT_ARG();
+    TOP() += arg_right;
+    NEXT();
+}
+OP(SUB) {
+    /* Pop 2 values, subtract 'em, push the result back to the stack */
+    uint64_t arg_right = POP();
+    TOP() -= arg_right;
+    NEXT();
+}
+OP(DIV) {
+    /* Pop 2 values, divide 'em, push the result back to the stack */
+    uint64_t arg_right = POP();
+    /* Don't forget to handle the div by zero error, unless it traps */
+    if (!VM_TRAP_DIVISION && arg_right == 0)
+        EXIT(ERROR_DIVISION_BY_ZERO);
+    TOP() /= arg_right;
+    NEXT();
+}
+OP(MUL) {
+    /* Pop 2 values, multiply 'em, push the result back to the stack */
+    uint64_t arg_right = POP();
+    TOP() *= arg_right;
+    NEXT();
+}
+OP(MOD) {
+    /* Pop 2 values, push the remainder of their division back to the stack */
+    uint64_t arg_right = POP();
+    if (!VM_TRAP_DIVISION && arg_right == 0)
+        EXIT(ERROR_DIVISION_BY_ZERO);
+    TOP() %= arg_right;
+    NEXT();
+}
+OP(AND) {
+    uint64_t arg_right = POP();
+    TOP() &= arg_right;
+    NEXT();
+}
+OP(OR) {
+    uint64_t arg_right = POP();
+    TOP() |= arg_right;
+    NEXT();
+}
+OP(XOR) {
+    uint64_t arg_right = POP();
+    TOP() ^= arg_right;
+    NEXT();
+}
+OP(NOT) {
+    TOP() = ~TOP();
+    NEXT();
+}
+OP(SHL) {
+    /* shift counts wrap around the width of a cell */
+    uint64_t count = POP();
+    TOP() <<= count & 63;
+    NEXT();
+}
+OP(SHR) {
+    uint64_t count = POP();
+    TOP() >>= count & 63;
+    NEXT();
+}
+OP(SAR) {
+    uint64_t count = POP();
+    TOP() = (uint64_t)((int64_t)TOP() >> (count & 63));
+    NEXT();
+}
+OP(JUMP) {
+    /* Use arg as a jump target  */
+    uint16_t target = NEXT_ARG();
+    CHARGE_JUMP(target);
+    IP = bytecode + target;
+    NEXT();
+}
+OP(JUMP_IF_TRUE) {
+    /* Use arg as a jump target, only a jump taken gets charged. The condition stays on the stack
+     * until then: a run stopped by the budget resumes with this instruction. */
+    uint16_t target = NEXT_ARG();
+    if (TOP()) {
+        CHARGE_JUMP(target);
+        IP = bytecode + target;
+    }
+    (void)POP();
+    NEXT();
+}
+OP(JUMP_IF_FALSE) {
+    /* Use arg as a jump target, only a jump taken gets charged */
+    uint16_t target = NEXT_ARG();
+    if (!TOP()) {
+        CHARGE_JUMP(target);
+        IP = bytecode + target;
+    }
+    (void)POP();
+    NEXT();
+}
+OP(EQUAL) {
+    uint64_t arg_right = POP();
+    TOP() = TOP() == arg_right;
+    NEXT();
+}
+OP(LESS) {
+    uint64_t arg_right = POP();
+    TOP() = TOP() < arg_right;
+    NEXT();
+}
+OP(LESS_OR_EQUAL) {
+    uint64_t arg_right = POP();
+    TOP() = TOP() <= arg_right;
+    NEXT();
+}
+OP(GREATER) {
+    uint64_t arg_right = POP();
+    TOP() = TOP() > arg_right;
+    NEXT();
+}
+OP(GREATER_OR_EQUAL) {
+    uint64_t arg_right = POP();
+    TOP() = TOP() >= arg_right;
+    NEXT();
+}
+OP(GREATER_OR_EQUALI) {
+    uint64_t arg_right = NEXT_ARG();
+    TOP() = TOP() >= arg_right;
+    NEXT();
+}
+OP(LESS_SIGNED) {
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() < (int64_t)arg_right;
+    NEXT();
+}
+OP(LESS_OR_EQUAL_SIGNED) {
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() <= (int64_t)arg_right;
+    NEXT();
+}
+OP(GREATER_SIGNED) {
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() > (int64_t)arg_right;
+    NEXT();
+}
+OP(GREATER_OR_EQUAL_SIGNED) {
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() >= (int64_t)arg_right;
+    NEXT();
+}
+OP(ALLOC) {
+    /* replace a number of cells with the address of a heap block */
+    TOP() = vm_heap_alloc(PAGED, TOP());
+    NEXT();
+}
+OP(FREE) {
+    uint64_t addr = POP();
+    if (!vm_heap_free(PAGED, addr))
+        EXIT(ERROR_INVALID_FREE);
+    NEXT();
+}
+OP(POP_RES) {
+    /* Pop the top of the stack, set it as a result value */
+    uint64_t res = POP();
+    STATE.result = res;
+    NEXT();
+}
+OP(DONE) {
+    EXIT(SUCCESS);
+}
+OP(PRINT) {
+    uint64_t arg = POP();
+    printf("%" PRIu64 "\n", arg);
+    NEXT();
+}
+OP(CALL) {
+    /* Remember the next instruction, use arg as a jump target */
+    uint16_t target = NEXT_ARG();
+    CHARGE_JUMP(target);
+    if (STATE.call_stack_top == STATE.call_stack + CALL_STACK_MAX)
+        EXIT(ERROR_CALL_STACK_OVERFLOW);
+    *STATE.call_stack_top++ = IP;
+    IP = bytecode + target;
+    NEXT();
+}
+OP(RET) {
+    if (STATE.call_stack_top == STATE.call_stack)
+        EXIT(ERROR_CALL_STACK_UNDERFLOW);
+    IP = *(--STATE.call_stack_top);
+    NEXT();
+}
+OP(LOAD8) {
+    /* replace an element index with the element */
+    TOP() = vm_memory_load8(MEMORY, TOP());
+    NEXT();
+}
+OP(LOAD16) {
+    TOP() = vm_memory_load16(MEMORY, TOP());
+    NEXT();
+}
+OP(LOAD32) {
+    TOP() = vm_memory_load32(MEMORY, TOP());
+    NEXT();
+}
+OP(STORE8) {
+    /* pop a value, pop an element index, store the value into the element */
+    uint64_t val = POP();
+    uint64_t index = POP();
+    vm_memory_store8(MEMORY, index, val);
+    NEXT();
+}
+OP(STORE16) {
+    uint64_t val = POP();
+    uint64_t index = POP();
+    vm_memory_store16(MEMORY, index, val);
+    NEXT();
+}
+OP(STORE32) {
+    uint64_t val = POP();
+    uint64_t index = POP();
+    vm_memory_store32(MEMORY, index, val);
+    NEXT();
+}
+OP(BIT_TEST) {
+    /* replace a bit index with the bit */
+    TOP() = vm_memory_bit_test(MEMORY, TOP());
+    NEXT();
+}
+OP(BIT_SET) {
+    /* pop a bit index, set the bit */
+    uint64_t index = POP();
+    vm_memory_bit_set(MEMORY, index);
+    NEXT();
+}
+OP(MEMSET) {
+    uint64_t count = POP();
+    uint64_t val = POP();
+    uint64_t addr = POP();
+    if (!vm_memory_range_is_valid(addr, count))
+        EXIT(ERROR_MEMORY_OUT_OF_BOUNDS);
+    vm_memory_fill(MEMORY + addr, count, val);
+    NEXT();
+}
+OP(MEMCPY) {
+    uint64_t count = POP();
+    uint64_t src = POP();
+    uint64_t dst = POP();
+    if (!vm_memory_range_is_valid(src, count) || !vm_memory_range_is_valid(dst, count))
+        EXIT(ERROR_MEMORY_OUT_OF_BOUNDS);
+    vm_memory_copy(MEMORY + dst, MEMORY + src, count);
+    NEXT();
+}
+OP(MEMSUM) {
+    /* pop a count, replace an address with the result */
+    uint64_t count = POP();
+    uint64_t addr = TOP();
+    if (!vm_memory_range_is_valid(addr, count))
+        EXIT(ERROR_MEMORY_OUT_OF_BOUNDS);
+    TOP() = vm_memory_sum(MEMORY + addr, count);
+    NEXT();
+}
+OP(MEMMIN) {
+    uint64_t count = POP();
+    uint64_t addr = TOP();
+    if (!vm_memory_range_is_valid(addr, count))
+        EXIT(ERROR_MEMORY_OUT_OF_BOUNDS);
+    TOP() = vm_memory_min(MEMORY + addr, count);
+    NEXT();
+}
+OP(MEMMAX) {
+    uint64_t count = POP();
+    uint64_t addr = TOP();
+    if (!vm_memory_range_is_valid(addr, count))
+        EXIT(ERROR_MEMORY_OUT_OF_BOUNDS);
+    TOP() = vm_memory_max(MEMORY + addr, count);
+    NEXT();
+}
+OP(MEMCOUNT) {
+    uint64_t count = POP();
+    uint64_t addr = TOP();
+    if (!vm_memory_range_is_valid(addr, count))
+        EXIT(ERROR_MEMORY_OUT_OF_BOUNDS);
+    TOP() = vm_memory_count(MEMORY + addr, count);
+    NEXT();
+}
+OP(CALLNATIVE) {
+    /* arguments are passed in place, the result replaces them */
+    const vm_native *native = vm_native_at(NEXT_ARG());
+    if (!native)
+        EXIT(ERROR_UNKNOWN_NATIVE);
+    CALL_NATIVE(native);
+    NEXT();
+}
+OP(YIELD) {
+    YIELD();
+    NEXT();
+}
+OP(ABORT) {
+    EXIT(ERROR_END_OF_STREAM);
+}
+
+#undef OP
+#undef NEXT
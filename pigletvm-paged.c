@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#endif
+
+#include "pigletvm.h"
+
+/*
+ * Paged memory
+ *
+ * An address is split into a table index, a page index within the table and a cell index within
+ * the page. Pages are anonymous mappings, so the OS zeroes them and backs them with physical memory
+ * only as cells get written: a page costs nothing but its page table entry until then. The page
+ * accessed last is remembered, sequential and strided accesses rarely walk the tables.
+ *
+ * Pages get mapped in chunks of 32 aligned to a 2 MiB huge page. Once a program has gone past its
+ * first chunk its memory counts as large: later chunks are advised to be backed by transparent huge
+ * pages (or explicit ones when built with PIGLETVM_HUGETLB), so that a TLB entry covers a chunk
+ * rather than 4 KiB of it. A program storing to cells far apart pays up to a huge page for each.
+ *
+ * The heap allocator is a set of bump allocators with free lists, one per size class, see
+ * pigletvm.h for the layout. A block freed twice gets handed out twice, just like with malloc.
+ *
+ * Hosts without mmap get chunks from the heap.
+ * */
+
+#define PAGE_TABLE_SIZE (1u << VM_PAGE_TABLE_BITS)
+#define PAGE_BYTES (VM_PAGE_CELLS * sizeof(uint64_t))
+
+static void allocation_failure(void)
+{
+    fprintf(stderr, "Memory allocation failure\n");
+    exit(EXIT_FAILURE);
+}
+
+#define CHUNK_PAGES VM_CHUNK_PAGES
+#define HUGE_PAGE_BYTES (CHUNK_PAGES * PAGE_BYTES)
+
+#ifndef _MSC_VER
+
+static uint64_t *chunk_map(bool is_large)
+{
+#if defined(PIGLETVM_HUGETLB) && defined(MAP_HUGETLB)
+    /* Explicit huge pages come from a pool reserved by the admin, there may be none left */
+    if (is_large) {
+        void *chunk = mmap(NULL, HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk != MAP_FAILED)
+            return chunk;
+    }
+#endif
+
+    /* Map twice the size and trim it down to the aligned chunk, the kernel only puts huge pages at
+     * huge page boundaries */
+    uint8_t *mapping = mmap(NULL, 2 * HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        allocation_failure();
+    uintptr_t offset = (uintptr_t)mapping & (HUGE_PAGE_BYTES - 1);
+    uint8_t *chunk = offset ? mapping + HUGE_PAGE_BYTES - offset : mapping;
+    if (chunk != mapping)
+        munmap(mapping, (size_t)(chunk - mapping));
+    munmap(chunk + HUGE_PAGE_BYTES, HUGE_PAGE_BYTES - (size_t)(chunk - mapping));
+
+#ifdef MADV_HUGEPAGE
+    if (is_large)
+        madvise(chunk, HUGE_PAGE_BYTES, MADV_HUGEPAGE);
+#endif
+    return (uint64_t *)chunk;
+}
+
+static void chunk_unmap(uint64_t *chunk)
+{
+    munmap(chunk, HUGE_PAGE_BYTES);
+}
+
+#else
+
+static uint64_t *chunk_map(bool is_large)
+{
+    (void) is_large;
+
+    uint64_t *chunk = calloc(CHUNK_PAGES * VM_PAGE_CELLS, sizeof(*chunk));
+    if (!chunk)
+        allocation_failure();
+    return chunk;
+}
+
+static void chunk_unmap(uint64_t *chunk)
+{
+    free(chunk);
+}
+
+#endif /* _MSC_VER */
+
+/* The page holding the cell, NULL if no cell of its chunk was ever stored to */
+static uint64_t *page_find(vm_paged_memory *paged, uint32_t page_index)
+{
+    if (paged->cached_page && paged->cached_index == page_index)
+        return paged->cached_page;
+
+    uint64_t **table = paged->tables[page_index >> VM_PAGE_TABLE_BITS];
+    uint64_t *page = table ? table[page_index & (PAGE_TABLE_SIZE - 1)] : NULL;
+    if (page) {
+        paged->cached_page = page;
+        paged->cached_index = page_index;
+    }
+    return page;
+}
+
+uint64_t vm_paged_load(vm_paged_memory *paged, uint32_t addr)
+{
+    uint64_t *page = page_find(paged, addr >> VM_PAGE_BITS);
+    return page ? page[addr & (VM_PAGE_CELLS - 1)] : 0;
+}
+
+void vm_paged_store(vm_paged_memory *paged, uint32_t addr, uint64_t val)
+{
+    uint32_t page_index = addr >> VM_PAGE_BITS;
+    uint64_t *page = page_find(paged, page_index);
+    if (!page) {
+        uint64_t ***table = &paged->tables[page_index >> VM_PAGE_TABLE_BITS];
+        if (!*table) {
+            *table = calloc(PAGE_TABLE_SIZE, sizeof(**table));
+            if (!*table)
+                allocation_failure();
+        }
+
+        /* All the pages of the chunk get their entries at once */
+        uint32_t first_i = page_index & (PAGE_TABLE_SIZE - 1) & ~(CHUNK_PAGES - 1);
+        uint64_t *chunk = chunk_map(paged->page_num >= CHUNK_PAGES);
+        for (uint32_t page_i = 0; page_i < CHUNK_PAGES; page_i++)
+            (*table)[first_i + page_i] = chunk + page_i * VM_PAGE_CELLS;
+        paged->page_num += CHUNK_PAGES;
+
+        page = (*table)[page_index & (PAGE_TABLE_SIZE - 1)];
+        paged->cached_page = page;
+        paged->cached_index = page_index;
+    }
+    page[addr & (VM_PAGE_CELLS - 1)] = val;
+}
+
+void vm_paged_reset(vm_paged_memory *paged)
+{
+    /* Nothing to walk for programs that never left the flat memory */
+    for (size_t table_i = 0; paged->page_num && table_i < VM_PAGE_TABLES; table_i++) {
+        uint64_t **table = paged->tables[table_i];
+        if (!table)
+            continue;
+        for (size_t page_i = 0; page_i < PAGE_TABLE_SIZE; page_i += CHUNK_PAGES)
+            if (table[page_i])
+                chunk_unmap(table[page_i]);
+        free(table);
+    }
+    memset(paged, 0, sizeof(*paged));
+}
+
+#define HEAP_REGION_CELLS (UINT32_C(1) << VM_HEAP_REGION_BITS)
+
+static uint32_t heap_region(size_t class_i)
+{
+    return VM_HEAP_BASE + (uint32_t)class_i * HEAP_REGION_CELLS;
+}
+
+/* Is the address a block of the class handed out at some point? */
+static bool heap_block_is_valid(vm_paged_memory *paged, size_t class_i, uint64_t addr)
+{
+    uint64_t offset = addr - heap_region(class_i);
+    return addr >= heap_region(class_i) && offset < paged->heap_used[class_i] &&
+        (offset & ((UINT64_C(1) << class_i) - 1)) == 0;
+}
+
+uint64_t vm_heap_alloc(vm_paged_memory *paged, uint64_t cells)
+{
+    size_t class_i = 0;
+    while (class_i < VM_HEAP_CLASSES && (UINT64_C(1) << class_i) < cells)
+        class_i++;
+    if (class_i == VM_HEAP_CLASSES)
+        return 0;
+
+    uint32_t block = paged->heap_free[class_i];
+    if (block) {
+        /* The link lives in VM memory, a program writing to a free block may have broken it: the
+         * rest of the list gets dropped rather than handing out something else */
+        uint64_t next = vm_paged_load(paged, block);
+        paged->heap_free[class_i] = heap_block_is_valid(paged, class_i, next) ? (uint32_t)next : 0;
+        return block;
+    }
+
+    uint32_t block_cells = UINT32_C(1) << class_i;
+    if (paged->heap_used[class_i] > HEAP_REGION_CELLS - block_cells)
+        return 0;
+    block = heap_region(class_i) + paged->heap_used[class_i];
+    paged->heap_used[class_i] += block_cells;
+    return block;
+}
+
+bool vm_heap_free(vm_paged_memory *paged, uint64_t addr)
+{
+    if (addr == 0)
+        return true;
+    if (addr < VM_HEAP_BASE || addr >= heap_region(VM_HEAP_CLASSES))
+        return false;
+
+    size_t class_i = (addr - VM_HEAP_BASE) >> VM_HEAP_REGION_BITS;
+    if (!heap_block_is_valid(paged, class_i, addr))
+        return false;
+
+    vm_paged_store(paged, (uint32_t)addr, paged->heap_free[class_i]);
+    paged->heap_free[class_i] = (uint32_t)addr;
+    return true;
+}
+
+void vm_heap_reset(vm_paged_memory *paged)
+{
+    memset(paged->heap_used, 0, sizeof(paged->heap_used));
+    memset(paged->heap_free, 0, sizeof(paged->heap_free));
+}
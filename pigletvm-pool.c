@@ -0,0 +1,471 @@
+#ifdef __linux__
+/* sched_setaffinity and the CPU_ macros */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#include "compat.h"
+#include "pigletvm.h"
+
+/*
+ * Worker pool
+ *
+ * Workers are threads pinned to a CPU each, spread over the NUMA nodes of the CPUs the process may
+ * run on. A worker creates its context after pinning itself, and Linux puts pages on the node of
+ * the thread touching them first, so the memory and the stack a worker runs programs with are
+ * local to it. Programs are read by every run: each node gets a replica of its own, copied by the
+ * first worker of the node running the program.
+ *
+ * Jobs of a batch are split into runs of neighbouring jobs, one per worker, so that the jobs of a
+ * program listed together mostly run on the same worker. A worker takes jobs from the front of its
+ * run; once it is out of them it steals the back half of another worker's run, so workers done
+ * early take over from the slow ones. A run is a begin and an end packed into one word: both the
+ * owner and thieves take jobs with a compare and swap, and a job belongs to a single run until it
+ * gets taken.
+ *
+ * Without Linux there is a single node and workers are not pinned; without threads (MSVC) the
+ * caller runs the jobs itself.
+ * */
+
+#define POOL_NODES_MAX 64
+#define POOL_CPUS_MAX 1024
+
+struct pvm_pool_program {
+    const pvm_program *original;
+    /* copies local to the node, created on first use */
+    const pvm_program *replicas[POOL_NODES_MAX];
+    struct pvm_pool_program *next;
+};
+
+typedef struct pool_worker {
+    pvm_pool *pool;
+    size_t index;
+    /* -1 for workers left to the scheduler */
+    int cpu;
+    size_t node;
+    /* Created by the worker thread itself */
+    pvm_context *context;
+    /* Jobs of the batch left to the worker, see RUN() */
+    uint64_t run;
+#ifndef _MSC_VER
+    pthread_t thread;
+#endif
+} pool_worker;
+
+struct pvm_pool {
+    pool_worker *workers;
+    size_t worker_num;
+    size_t node_num;
+
+    /* Every program of the pool, freed with it */
+    pvm_pool_program *programs;
+
+    /* The batch being run */
+    pvm_job *jobs;
+    size_t job_num;
+
+#ifndef _MSC_VER
+    pthread_mutex_t lock;
+    /* Workers wait for a new batch, the caller waits for all of them to finish it */
+    pthread_cond_t batch_started;
+    pthread_cond_t batch_finished;
+    uint64_t batch_num;
+    size_t busy_num;
+    bool is_stopping;
+#endif
+};
+
+static void *checked_calloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+#ifdef __linux__
+
+/* The node is a nodeN entry of the CPU's sysfs directory, kernels without NUMA have none */
+static size_t cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    unsigned node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+        if (sscanf(entry->d_name, "node%u", &node) == 1)
+            break;
+    closedir(dir);
+    return node < POOL_NODES_MAX ? node : 0;
+}
+
+/* CPUs the process may run on, interleaved by node: the first CPU of every node, then the second
+ * ones and so on, so that any number of workers spreads evenly */
+static size_t pool_cpus(pvm_pool *pool, int *cpus, size_t *nodes)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return 0;
+
+    int allowed_cpus[POOL_CPUS_MAX];
+    size_t allowed_nodes[POOL_CPUS_MAX];
+    size_t allowed_num = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu < POOL_CPUS_MAX; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        allowed_cpus[allowed_num] = cpu;
+        allowed_nodes[allowed_num] = cpu_node(cpu);
+        if (allowed_nodes[allowed_num] + 1 > pool->node_num)
+            pool->node_num = allowed_nodes[allowed_num] + 1;
+        allowed_num++;
+    }
+
+    /* Every round takes the next CPU of each node */
+    size_t node_taken[POOL_NODES_MAX] = {0};
+    size_t cpu_num = 0;
+    while (cpu_num < allowed_num) {
+        for (size_t node = 0; node < pool->node_num; node++) {
+            size_t seen = 0;
+            for (size_t cpu_i = 0; cpu_i < allowed_num; cpu_i++) {
+                if (allowed_nodes[cpu_i] != node)
+                    continue;
+                if (seen++ == node_taken[node]) {
+                    cpus[cpu_num] = allowed_cpus[cpu_i];
+                    nodes[cpu_num] = node;
+                    cpu_num++;
+                    node_taken[node]++;
+                    break;
+                }
+            }
+        }
+    }
+    return cpu_num;
+}
+
+static void worker_pin(pool_worker *worker)
+{
+    if (worker->cpu < 0)
+        return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    /* A worker left unpinned still runs, just not necessarily close to its memory */
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+#else
+
+static size_t pool_cpus(pvm_pool *pool, int *cpus, size_t *nodes)
+{
+    (void) pool;
+    (void) cpus;
+    (void) nodes;
+
+    return 0;
+}
+
+static void worker_pin(pool_worker *worker)
+{
+    (void) worker;
+}
+
+#endif /* __linux__ */
+
+static size_t default_worker_num(void)
+{
+#if defined(_MSC_VER)
+    return 1;
+#else
+    long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpu_num > 0 ? (size_t)cpu_num : 1;
+#endif
+}
+
+static const pvm_program *program_replica(pvm_pool *pool, pvm_pool_program *program, size_t node)
+{
+#ifndef _MSC_VER
+    const pvm_program *replica = __atomic_load_n(&program->replicas[node], __ATOMIC_ACQUIRE);
+    if (replica)
+        return replica;
+
+    /* Copied by the worker asking, so the pages are its node's */
+    pthread_mutex_lock(&pool->lock);
+    replica = program->replicas[node];
+    if (!replica) {
+        replica = pvm_program_clone(program->original);
+        __atomic_store_n(&program->replicas[node], replica, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return replica;
+#else
+    (void) pool;
+    (void) node;
+
+    return program->original;
+#endif
+}
+
+static void job_run(pool_worker *worker, pvm_job *job)
+{
+    pvm_context *context = worker->context;
+
+    job->worker = worker->index;
+    job->result = 0;
+    if (job->input_len > MEMORY_SIZE) {
+        job->status = ERROR_MEMORY_OUT_OF_BOUNDS;
+        return;
+    }
+
+    /* Every job starts with zeroed memory, the input at its start */
+    uint64_t *memory = pvm_context_memory(context);
+    memset(memory, 0, MEMORY_SIZE * sizeof(*memory));
+    if (job->input_len)
+        memcpy(memory, job->input, job->input_len * sizeof(*memory));
+    vm_paged_reset(pvm_context_paged_memory(context));
+    pvm_context_set_budget(context, VM_BUDGET_UNLIMITED);
+
+    const pvm_program *program = program_replica(worker->pool, job->program, worker->node);
+    compat_timer timer;
+    compat_timer_init(&timer);
+    compat_timer_start(&timer);
+    job->status = pvm_run(context, program, job->engine);
+    job->elapsed_us = compat_timer_elapsed_us(&timer);
+    if (job->status == SUCCESS)
+        job->result = pvm_context_result(context);
+}
+
+#ifndef _MSC_VER
+
+/* Jobs [begin, end) of a batch */
+#define RUN(begin, end) (((uint64_t)(begin) << 32) | (uint32_t)(end))
+#define RUN_BEGIN(run) ((uint32_t)((run) >> 32))
+#define RUN_END(run) ((uint32_t)(run))
+/* Runs are 32-bit, longer batches go in parts */
+#define BATCH_MAX UINT32_MAX
+
+static bool batch_take(pool_worker *worker, size_t *job_i)
+{
+    uint64_t run = __atomic_load_n(&worker->run, __ATOMIC_ACQUIRE);
+    while (RUN_BEGIN(run) < RUN_END(run)) {
+        uint64_t rest = RUN(RUN_BEGIN(run) + 1, RUN_END(run));
+        if (__atomic_compare_exchange_n(&worker->run, &run, rest, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *job_i = RUN_BEGIN(run);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The back half of the first run found, the thief runs its first job right away and the others
+ * become its own run. Only the owner refills an empty run, so a worker giving up leaves no jobs
+ * behind. */
+static bool batch_steal(pool_worker *thief, size_t *job_i)
+{
+    pvm_pool *pool = thief->pool;
+    for (size_t step = 1; step < pool->worker_num; step++) {
+        pool_worker *victim = &pool->workers[(thief->index + step) % pool->worker_num];
+        uint64_t run = __atomic_load_n(&victim->run, __ATOMIC_ACQUIRE);
+        while (RUN_BEGIN(run) < RUN_END(run)) {
+            uint32_t first = RUN_END(run) - (RUN_END(run) - RUN_BEGIN(run) + 1) / 2;
+            if (__atomic_compare_exchange_n(&victim->run, &run, RUN(RUN_BEGIN(run), first), false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&thief->run, RUN(first + 1, RUN_END(run)), __ATOMIC_RELEASE);
+                *job_i = first;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void *worker_main(void *arg)
+{
+    pool_worker *worker = arg;
+    pvm_pool *pool = worker->pool;
+
+    worker_pin(worker);
+    worker->context = pvm_context_new();
+
+    uint64_t batch_seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->batch_num == batch_seen && !pool->is_stopping)
+            pthread_cond_wait(&pool->batch_started, &pool->lock);
+        if (pool->is_stopping)
+            break;
+        batch_seen = pool->batch_num;
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t job_i;
+        while (batch_take(worker, &job_i) || batch_steal(worker, &job_i))
+            job_run(worker, &pool->jobs[job_i]);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_num == 0)
+            pthread_cond_signal(&pool->batch_finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pvm_context_free(worker->context);
+    return NULL;
+}
+
+#endif /* _MSC_VER */
+
+pvm_pool *pvm_pool_new(size_t worker_num)
+{
+    pvm_pool *pool = checked_calloc(1, sizeof(*pool));
+    pool->node_num = 1;
+
+    int cpus[POOL_CPUS_MAX];
+    size_t nodes[POOL_CPUS_MAX];
+    size_t cpu_num = pool_cpus(pool, cpus, nodes);
+
+    if (worker_num == 0)
+        worker_num = cpu_num ? cpu_num : default_worker_num();
+#ifdef _MSC_VER
+    /* The caller is the only worker */
+    worker_num = 1;
+#endif
+
+    pool->workers = checked_calloc(worker_num, sizeof(*pool->workers));
+    pool->worker_num = worker_num;
+    for (size_t worker_i = 0; worker_i < worker_num; worker_i++) {
+        pool_worker *worker = &pool->workers[worker_i];
+        worker->pool = pool;
+        worker->index = worker_i;
+        worker->cpu = cpu_num ? cpus[worker_i % cpu_num] : -1;
+        worker->node = cpu_num ? nodes[worker_i % cpu_num] : 0;
+    }
+
+#ifndef _MSC_VER
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->batch_started, NULL);
+    pthread_cond_init(&pool->batch_finished, NULL);
+    for (size_t worker_i = 0; worker_i < worker_num; worker_i++) {
+        pool_worker *worker = &pool->workers[worker_i];
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start a pool worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#else
+    pool->workers[0].context = pvm_context_new();
+#endif
+
+    return pool;
+}
+
+void pvm_pool_free(pvm_pool *pool)
+{
+#ifndef _MSC_VER
+    pthread_mutex_lock(&pool->lock);
+    pool->is_stopping = true;
+    pthread_cond_broadcast(&pool->batch_started);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t worker_i = 0; worker_i < pool->worker_num; worker_i++)
+        pthread_join(pool->workers[worker_i].thread, NULL);
+    pthread_cond_destroy(&pool->batch_finished);
+    pthread_cond_destroy(&pool->batch_started);
+    pthread_mutex_destroy(&pool->lock);
+#else
+    pvm_context_free(pool->workers[0].context);
+#endif
+
+    pvm_pool_program *program = pool->programs;
+    while (program) {
+        pvm_pool_program *next = program->next;
+        for (size_t node = 0; node < POOL_NODES_MAX; node++)
+            pvm_program_free((pvm_program *)program->replicas[node]);
+        free(program);
+        program = next;
+    }
+
+    free(pool->workers);
+    free(pool);
+}
+
+size_t pvm_pool_worker_num(const pvm_pool *pool)
+{
+    return pool->worker_num;
+}
+
+size_t pvm_pool_node_num(const pvm_pool *pool)
+{
+    return pool->node_num;
+}
+
+size_t pvm_pool_worker_node(const pvm_pool *pool, size_t worker)
+{
+    return pool->workers[worker].node;
+}
+
+pvm_pool_program *pvm_pool_program_new(pvm_pool *pool, const pvm_program *program)
+{
+    pvm_pool_program *pool_program = checked_calloc(1, sizeof(*pool_program));
+    pool_program->original = program;
+    pool_program->next = pool->programs;
+    pool->programs = pool_program;
+    return pool_program;
+}
+
+size_t pvm_pool_program_replica_num(const pvm_pool_program *program)
+{
+    size_t replica_num = 0;
+    for (size_t node = 0; node < POOL_NODES_MAX; node++)
+        if (program->replicas[node])
+            replica_num++;
+    return replica_num;
+}
+
+void pvm_pool_run(pvm_pool *pool, pvm_job *jobs, size_t job_num)
+{
+#ifndef _MSC_VER
+    while (job_num > BATCH_MAX) {
+        pvm_pool_run(pool, jobs, BATCH_MAX);
+        jobs += BATCH_MAX;
+        job_num -= BATCH_MAX;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs = jobs;
+    pool->job_num = job_num;
+    for (size_t worker_i = 0; worker_i < pool->worker_num; worker_i++) {
+        size_t begin = job_num * worker_i / pool->worker_num;
+        size_t end = job_num * (worker_i + 1) / pool->worker_num;
+        __atomic_store_n(&pool->workers[worker_i].run, RUN(begin, end), __ATOMIC_RELAXED);
+    }
+    pool->busy_num = pool->worker_num;
+    pool->batch_num++;
+    pthread_cond_broadcast(&pool->batch_started);
+    while (pool->busy_num > 0)
+        pthread_cond_wait(&pool->batch_finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+#else
+    for (size_t job_i = 0; job_i < job_num; job_i++)
+        job_run(&pool->workers[0], &jobs[job_i]);
+#endif
+}
@@ -3,15 +3,14 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
-#include <setjmp.h>
 #include <string.h>
 
 #include "compat.h"
 #include "pigletvm.h"
 
 #define MAX_TRACE_LEN 16
+#define MAX_INLINE_DEPTH 4
 #define STACK_MAX 256
-#define MEMORY_SIZE 65536
 
 #ifdef _MSC_VER
 /* MSVC-compatible versions without GCC statement expressions */
@@ -35,14 +34,9 @@
     (*ip++)
 #define NEXT_ARG()                                      \
     ((void)(ip += 2), (ip[-2] << 8) + ip[-1])
-#define PEEK_ARG()                              \
-    ((ip[0] << 8) + ip[1])
 
 #ifdef _MSC_VER
-/* MSVC: Use a helper to avoid statement expressions.
-   POP_TO(var) assigns the popped value to var */
-#define POP_TO(var) do { (var) = acc; acc = *(--stack_top); } while(0)
-/* For cases where we just want to discard, we need a temp */
+/* MSVC: a helper to avoid statement expressions */
 static uint64_t _pop_tmp;
 #define POP() (_pop_tmp = acc, acc = *(--stack_top), _pop_tmp)
 #else
@@ -55,6 +49,39 @@ static uint64_t _pop_tmp;
     (*stack_top = acc, stack_top++, acc = (val))
 #define TOP()                                  \
     (acc)
+/* Spill the accumulator so that all arguments are in place, the result replaces them */
+#define CALL_NATIVE(native)                                     \
+    do {                                                        \
+        *stack_top = acc;                                       \
+        uint64_t *args = stack_top + 1 - (native)->arity;       \
+        acc = (native)->function(args);                         \
+        stack_top = args;                                       \
+    } while (0)
+/* Backward jumps and calls cost a unit of budget, running out of it stops the vm right before the
+ * jump instruction */
+#define CHARGE_JUMP(target)                             \
+    do {                                                \
+        if (bytecode + (target) <= ip - 3) {            \
+            if (vm_budget == 0) {                       \
+                ip -= 3;                                \
+                STORE_REGS();                           \
+                return ERROR_BUDGET_EXHAUSTED;          \
+            }                                           \
+            vm_budget--;                                \
+        }                                               \
+    } while (0)
+/* Policies of pigletvm-ops.h: registers live in locals and go back to the struct on exit */
+#define IP ip
+#define STATE vm_rcache
+#define MEMORY vm_rcache.memory
+#define PAGED (&vm_rcache.paged)
+#define EXIT(res)                               \
+    do {                                        \
+        STORE_REGS();                           \
+        return (res);                           \
+    } while (0)
+/* there is nothing to switch to */
+#define YIELD() ((void)0)
 
 
 /*
@@ -63,567 +90,132 @@ static uint64_t _pop_tmp;
 
 static struct {
     /* Current instruction pointer */
-    uint8_t *ip;
+    VM_ALIGNED(VM_CACHE_LINE) uint8_t *ip;
 
     /* Accumulator register */
     uint64_t acc;
 
-    /* Fixed-size stack */
-    uint64_t stack[STACK_MAX];
+    /* Fixed-size stack between guard pages */
     uint64_t *stack_top;
+    uint64_t *stack;
 
-    /* Operational memory */
-    uint64_t memory[MEMORY_SIZE];
+    uint8_t **call_stack_top;
+    uint8_t *bytecode;
 
     /* A single register containing the result */
     uint64_t result;
+
+    /* Return addresses of active calls */
+    VM_ALIGNED(VM_CACHE_LINE) uint8_t *call_stack[CALL_STACK_MAX];
+
+    /* Operational memory, cells past MEMORY_SIZE are paged */
+    VM_ALIGNED(VM_PAGE_BYTES) uint64_t memory[MEMORY_SIZE];
+    vm_paged_memory paged;
 } vm_rcache;
 
 static void vm_rcache_reset(uint8_t *bytecode)
 {
+    uint64_t *stack = vm_rcache.stack ? vm_rcache.stack : vm_guarded_stack_new(STACK_MAX);
+    vm_paged_reset(&vm_rcache.paged);
     memset(&vm_rcache, 0, sizeof(vm_rcache));
+    memset(stack, 0, STACK_MAX * sizeof(*stack));
+    vm_rcache.stack = stack;
     vm_rcache.acc = 0;
     vm_rcache.stack_top = vm_rcache.stack;
+    vm_rcache.call_stack_top = vm_rcache.call_stack;
+    vm_rcache.bytecode = bytecode;
     vm_rcache.ip = bytecode;
 }
 
 interpret_result vm_rcache_interpret(uint8_t *bytecode)
 {
     vm_rcache_reset(bytecode);
+    return vm_rcache_interpret_resume();
+}
+
+static interpret_result rcache_interpret_run(void);
+
+interpret_result vm_rcache_interpret_resume(void)
+{
+    return vm_guarded_run(rcache_interpret_run);
+}
+
+static interpret_result rcache_interpret_run(void)
+{
+    uint8_t *bytecode = vm_rcache.bytecode;
 
     LOAD_REGS();
 
     for (;;) {
         uint8_t instruction = NEXT_OP();
         switch (instruction) {
-        case OP_PUSHI: {
-            /* get the argument, push it onto stack */
-            uint16_t arg = NEXT_ARG();
-            PUSH(arg);
-            break;
-        }
-        case OP_LOADI: {
-            /* get the argument, use it to get a value onto stack */
-            uint16_t addr = NEXT_ARG();
-            uint64_t val = vm_rcache.memory[addr];
-            PUSH(val);
-            break;
-        }
-        case OP_LOADADDI: {
-            /* get the argument, add the value from the address to the top of the stack */
-            uint16_t addr = NEXT_ARG();
-            uint64_t val = vm_rcache.memory[addr];
-            TOP() += val;
-            break;
-        }
-        case OP_STOREI: {
-            /* get the argument, use it to get a value of the stack into a memory cell */
-            uint16_t addr = NEXT_ARG();
-            uint64_t val = POP();
-            vm_rcache.memory[addr] = val;
-            break;
-        }
-        case OP_LOAD: {
-            /* pop an address, use it to get a value onto stack */
-            TOP() = vm_rcache.memory[TOP()];
-            break;
-        }
-        case OP_STORE: {
-            /* pop a value, pop an adress, put a value into an address */
-            uint64_t val = POP();
-            uint16_t addr = POP();
-            vm_rcache.memory[addr] = val;
-            break;
-        }
-        case OP_DUP:{
-            /* duplicate the top of the stack */
-            PUSH(TOP());
-            break;
-        }
-        case OP_DISCARD: {
-            /* discard the top of the stack */
-            (void)POP();
-            break;
-        }
-        case OP_ADD: {
-            /* Pop 2 values, add 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            TOP() += arg_right;
-            break;
-        }
-        case OP_ADDI: {
-            /* Add immediate value to the top of the stack */
-            uint16_t arg_right = NEXT_ARG();
-            TOP() += arg_right;
-            break;
-        }
-        case OP_SUB: {
-            /* Pop 2 values, subtract 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            TOP() -= arg_right;
-            break;
-        }
-        case OP_DIV: {
-            /* Pop 2 values, divide 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            /* Don't forget to handle the div by zero error */
-            if (arg_right == 0) {
-                STORE_REGS();
-                return ERROR_DIVISION_BY_ZERO;
-            }
-            TOP() /= arg_right;
-            break;
-        }
-        case OP_MUL: {
-            /* Pop 2 values, multiply 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            TOP() *= arg_right;
-            break;
-        }
-        case OP_JUMP:{
-            /* Use arg as a jump target  */
-            uint16_t target = PEEK_ARG();
-            ip = bytecode + target;
-            break;
-        }
-        case OP_JUMP_IF_TRUE:{
-            /* Use arg as a jump target  */
-            uint16_t target = NEXT_ARG();
-            if (POP())
-                ip = bytecode + target;
-            break;
-        }
-        case OP_JUMP_IF_FALSE:{
-            /* Use arg as a jump target  */
-            uint16_t target = NEXT_ARG();
-            if (!POP())
-                ip = bytecode + target;
-            break;
-        }
-        case OP_EQUAL:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() == arg_right;
-            break;
-        }
-        case OP_LESS:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() < arg_right;
-            break;
-        }
-        case OP_LESS_OR_EQUAL:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() <= arg_right;
-            break;
-        }
-        case OP_GREATER:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() > arg_right;
-            break;
-        }
-        case OP_GREATER_OR_EQUAL:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() >= arg_right;
-            break;
-        }
-        case OP_GREATER_OR_EQUALI:{
-            uint64_t arg_right = NEXT_ARG();
-            TOP() = TOP() >= arg_right;
-            break;
-        }
-        case OP_POP_RES: {
-            /* Pop the top of the stack, set it as a result value */
-            uint64_t res = POP();
-            vm_rcache.result = res;
-            break;
-        }
-        case OP_DONE: {
-            STORE_REGS();
-            return SUCCESS;
-        }
-        case OP_PRINT:{
-            uint64_t arg = POP();
-            printf("%" PRIu64 "\n", arg);
-            break;
-        }
-        case OP_ABORT: {
-            STORE_REGS();
-            return ERROR_END_OF_STREAM;
-        }
+#include "pigletvm-ops.h"
         default:
-            STORE_REGS();
-            return ERROR_UNKNOWN_OPCODE;
+            EXIT(ERROR_UNKNOWN_OPCODE);
         }
     }
 
-    STORE_REGS();
-    return ERROR_END_OF_STREAM;
+    EXIT(ERROR_END_OF_STREAM);
 }
 
 interpret_result vm_rcache_interpret_no_range_check(uint8_t *bytecode)
 {
     vm_rcache_reset(bytecode);
+    return vm_rcache_interpret_no_range_check_resume();
+}
+
+static interpret_result rcache_interpret_no_range_check_run(void);
+
+interpret_result vm_rcache_interpret_no_range_check_resume(void)
+{
+    return vm_guarded_run(rcache_interpret_no_range_check_run);
+}
+
+static interpret_result rcache_interpret_no_range_check_run(void)
+{
+    uint8_t *bytecode = vm_rcache.bytecode;
 
     LOAD_REGS();
 
     for (;;) {
         uint8_t instruction = NEXT_OP();
-        switch (instruction & 0x1f) {
-        case OP_PUSHI: {
-            /* get the argument, push it onto stack */
-            uint16_t arg = NEXT_ARG();
-            PUSH(arg);
-            break;
-        }
-        case OP_LOADI: {
-            /* get the argument, use it to get a value onto stack */
-            uint16_t addr = NEXT_ARG();
-            uint64_t val = vm_rcache.memory[addr];
-            PUSH(val);
-            break;
-        }
-        case OP_LOADADDI: {
-            /* get the argument, add the value from the address to the top of the stack */
-            uint16_t addr = NEXT_ARG();
-            uint64_t val = vm_rcache.memory[addr];
-            TOP() += val;
-            break;
-        }
-        case OP_STOREI: {
-            /* get the argument, use it to get a value of the stack into a memory cell */
-            uint16_t addr = NEXT_ARG();
-            uint64_t val = POP();
-            vm_rcache.memory[addr] = val;
-            break;
-        }
-        case OP_LOAD: {
-            /* pop an address, use it to get a value onto stack */
-            TOP() = vm_rcache.memory[TOP()];
-            break;
-        }
-        case OP_STORE: {
-            /* pop a value, pop an adress, put a value into an address */
-            uint64_t val = POP();
-            uint16_t addr = POP();
-            vm_rcache.memory[addr] = val;
-            break;
-        }
-        case OP_DUP:{
-            /* duplicate the top of the stack */
-            PUSH(TOP());
-            break;
-        }
-        case OP_DISCARD: {
-            /* discard the top of the stack */
-            (void)POP();
-            break;
-        }
-        case OP_ADD: {
-            /* Pop 2 values, add 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            TOP() += arg_right;
-            break;
-        }
-        case OP_ADDI: {
-            /* Add immediate value to the top of the stack */
-            uint16_t arg_right = NEXT_ARG();
-            TOP() += arg_right;
-            break;
-        }
-        case OP_SUB: {
-            /* Pop 2 values, subtract 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            TOP() -= arg_right;
-            break;
-        }
-        case OP_DIV: {
-            /* Pop 2 values, divide 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            /* Don't forget to handle the div by zero error */
-            if (arg_right == 0) {
-                STORE_REGS();
-                return ERROR_DIVISION_BY_ZERO;
-            }
-            TOP() /= arg_right;
-            break;
-        }
-        case OP_MUL: {
-            /* Pop 2 values, multiply 'em, push the result back to the stack */
-            uint64_t arg_right = POP();
-            TOP() *= arg_right;
-            break;
-        }
-        case OP_JUMP:{
-            /* Use arg as a jump target  */
-            uint16_t target = PEEK_ARG();
-            ip = bytecode + target;
-            break;
-        }
-        case OP_JUMP_IF_TRUE:{
-            /* Use arg as a jump target  */
-            uint16_t target = NEXT_ARG();
-            if (POP())
-                ip = bytecode + target;
-            break;
-        }
-        case OP_JUMP_IF_FALSE:{
-            /* Use arg as a jump target  */
-            uint16_t target = NEXT_ARG();
-            if (!POP())
-                ip = bytecode + target;
-            break;
-        }
-        case OP_EQUAL:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() == arg_right;
-            break;
-        }
-        case OP_LESS:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() < arg_right;
-            break;
-        }
-        case OP_LESS_OR_EQUAL:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() <= arg_right;
-            break;
-        }
-        case OP_GREATER:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() > arg_right;
-            break;
-        }
-        case OP_GREATER_OR_EQUAL:{
-            uint64_t arg_right = POP();
-            TOP() = TOP() >= arg_right;
-            break;
-        }
-        case OP_GREATER_OR_EQUALI:{
-            uint64_t arg_right = NEXT_ARG();
-            TOP() = TOP() >= arg_right;
-            break;
-        }
-        case OP_POP_RES: {
-            /* Pop the top of the stack, set it as a result value */
-            uint64_t res = POP();
-            vm_rcache.result = res;
-            break;
-        }
-        case OP_DONE: {
-            STORE_REGS();
-            return SUCCESS;
-        }
-        case OP_PRINT:{
-            uint64_t arg = POP();
-            printf("%" PRIu64 "\n", arg);
-            break;
-        }
-        case OP_ABORT: {
-            STORE_REGS();
-            return ERROR_END_OF_STREAM;
-        }
-        case 26: case 27: case 28: case 29: case 30: case 31:
-            STORE_REGS();
-            return ERROR_UNKNOWN_OPCODE;
+        switch (instruction & 0x3f) {
+#include "pigletvm-ops.h"
+        case 59: case 60: case 61: case 62: case 63:
+            EXIT(ERROR_UNKNOWN_OPCODE);
         }
     }
 
-    STORE_REGS();
-    return ERROR_END_OF_STREAM;
+    EXIT(ERROR_END_OF_STREAM);
 }
 
 #if COMPUTED_GOTO_SUPPORTED
 interpret_result vm_rcache_interpret_threaded(uint8_t *bytecode)
 {
     vm_rcache_reset(bytecode);
+    return vm_rcache_interpret_threaded_resume();
+}
+
+static interpret_result rcache_interpret_threaded_run(void);
+
+interpret_result vm_rcache_interpret_threaded_resume(void)
+{
+    return vm_guarded_run(rcache_interpret_threaded_run);
+}
+
+static interpret_result rcache_interpret_threaded_run(void)
+{
+    uint8_t *bytecode = vm_rcache.bytecode;
 
     LOAD_REGS();
 
-    const void *labels[] = {
-        [OP_PUSHI] = &&op_pushi,
-        [OP_LOADI] = &&op_loadi,
-        [OP_LOADADDI] = &&op_loadaddi,
-        [OP_STORE] = &&op_store,
-        [OP_STOREI] = &&op_storei,
-        [OP_LOAD] = &&op_load,
-        [OP_DUP] = &&op_dup,
-        [OP_DISCARD] = &&op_discard,
-        [OP_ADD] = &&op_add,
-        [OP_ADDI] = &&op_addi,
-        [OP_SUB] = &&op_sub,
-        [OP_DIV] = &&op_div,
-        [OP_MUL] = &&op_mul,
-        [OP_JUMP] = &&op_jump,
-        [OP_JUMP_IF_TRUE] = &&op_jump_if_true,
-        [OP_JUMP_IF_FALSE] = &&op_jump_if_false,
-        [OP_EQUAL] = &&op_equal,
-        [OP_LESS] = &&op_less,
-        [OP_LESS_OR_EQUAL] = &&op_less_or_equal,
-        [OP_GREATER] = &&op_greater,
-        [OP_GREATER_OR_EQUAL] = &&op_greater_or_equal,
-        [OP_GREATER_OR_EQUALI] = &&op_greater_or_equali,
-        [OP_POP_RES] = &&op_pop_res,
-        [OP_DONE] = &&op_done,
-        [OP_PRINT] = &&op_print,
-        [OP_ABORT] = &&op_abort,
-    };
+    static const void *const labels[] = { PIGLETVM_OPS(PIGLETVM_OPS_LABEL) };
 
     goto *labels[NEXT_OP()];
 
-op_pushi: {
-        /* get the argument, push it onto stack */
-        uint16_t arg = NEXT_ARG();
-        PUSH(arg);
-        goto *labels[NEXT_OP()];
-    }
-op_loadi: {
-    /* get the argument, use it to get a value onto stack */
-        uint16_t addr = NEXT_ARG();
-        uint64_t val = vm_rcache.memory[addr];
-        PUSH(val);
-        goto *labels[NEXT_OP()];
-    }
-op_loadaddi: {
-        /* get the argument, add the value from the address to the top of the stack */
-        uint16_t addr = NEXT_ARG();
-        uint64_t val = vm_rcache.memory[addr];
-        TOP() += val;
-        goto *labels[NEXT_OP()];
-    }
-op_storei: {
-        /* get the argument, use it to get a value of the stack into a memory cell */
-        uint16_t addr = NEXT_ARG();
-        uint64_t val = POP();
-        vm_rcache.memory[addr] = val;
-        goto *labels[NEXT_OP()];
-    }
-op_load: {
-        /* pop an address, use it to get a value onto stack */
-        TOP() = vm_rcache.memory[TOP()];
-        goto *labels[NEXT_OP()];
-    }
-op_store: {
-        /* pop a value, pop an adress, put a value into an address */
-        uint64_t val = POP();
-        uint16_t addr = POP();
-        vm_rcache.memory[addr] = val;
-        goto *labels[NEXT_OP()];
-    }
-op_dup:{
-        /* duplicate the top of the stack */
-        PUSH(TOP());
-        goto *labels[NEXT_OP()];
-    }
-op_discard: {
-        /* discard the top of the stack */
-        (void)POP();
-        goto *labels[NEXT_OP()];
-    }
-op_add: {
-        /* Pop 2 values, add 'em, push the result back to the stack */
-        uint64_t arg_right = POP();
-        TOP() += arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_addi: {
-        /* Add immediate value to the top of the stack */
-        uint16_t arg_right = NEXT_ARG();
-        TOP() += arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_sub: {
-        /* Pop 2 values, subtract 'em, push the result back to the stack */
-        uint64_t arg_right = POP();
-        TOP() -= arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_div: {
-        /* Pop 2 values, divide 'em, push the result back to the stack */
-        uint64_t arg_right = POP();
-        /* Don't forget to handle the div by zero error */
-        if (arg_right == 0) {
-            STORE_REGS();
-            return ERROR_DIVISION_BY_ZERO;
-        }
-        TOP() /= arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_mul: {
-        /* Pop 2 values, multiply 'em, push the result back to the stack */
-        uint64_t arg_right = POP();
-        TOP() *= arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_jump:{
-        /* Use arg as a jump target  */
-        uint16_t target = PEEK_ARG();
-        ip = bytecode + target;
-        goto *labels[NEXT_OP()];
-    }
-op_jump_if_true:{
-        /* Use arg as a jump target  */
-        uint16_t target = NEXT_ARG();
-        if (POP())
-            ip = bytecode + target;
-        goto *labels[NEXT_OP()];
-    }
-op_jump_if_false:{
-        /* Use arg as a jump target  */
-        uint16_t target = NEXT_ARG();
-        if (!POP())
-            ip = bytecode + target;
-        goto *labels[NEXT_OP()];
-    }
-op_equal:{
-        uint64_t arg_right = POP();
-        TOP() = TOP() == arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_less:{
-        uint64_t arg_right = POP();
-        TOP() = TOP() < arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_less_or_equal:{
-        uint64_t arg_right = POP();
-        TOP() = TOP() <= arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_greater:{
-        uint64_t arg_right = POP();
-        TOP() = TOP() > arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_greater_or_equal:{
-        uint64_t arg_right = POP();
-        TOP() = TOP() >= arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_greater_or_equali:{
-        uint64_t arg_right = NEXT_ARG();
-        TOP() = TOP() >= arg_right;
-        goto *labels[NEXT_OP()];
-    }
-op_pop_res: {
-        /* Pop the top of the stack, set it as a result value */
-        uint64_t res = POP();
-        vm_rcache.result = res;
-        goto *labels[NEXT_OP()];
-    }
-op_done: {
-        goto end;
-    }
-op_print:{
-        uint64_t arg = POP();
-        printf("%" PRIu64 "\n", arg);
-        goto *labels[NEXT_OP()];
-    }
-op_abort: {
-        STORE_REGS();
-        return ERROR_END_OF_STREAM;
-    }
-end:
-    STORE_REGS();
-    return SUCCESS;
+#define OPS_THREADED
+#include "pigletvm-ops.h"
+#undef OPS_THREADED
 }
 #else
 /* Fallback for compilers without computed goto support (e.g., MSVC) */
@@ -632,6 +224,11 @@ interpret_result vm_rcache_interpret_threaded(uint8_t *bytecode)
     /* On MSVC, fall back to switch-based interpreter */
     return vm_rcache_interpret(bytecode);
 }
+
+interpret_result vm_rcache_interpret_threaded_resume(void)
+{
+    return vm_rcache_interpret_resume();
+}
 #endif /* COMPUTED_GOTO_SUPPORTED */
 
 
@@ -644,10 +241,17 @@ uint64_t vm_rcache_get_result(void)
 #undef STORE_REGS
 #undef NEXT_OP
 #undef NEXT_ARG
-#undef PEEK_ARG
+#undef CHARGE_JUMP
 #undef POP
 #undef PUSH
 #undef TOP
+#undef CALL_NATIVE
+#undef IP
+#undef STATE
+#undef MEMORY
+#undef PAGED
+#undef EXIT
+#undef YIELD
 
 /*
  * trace-based vm_rcache interpreter
@@ -659,16 +263,14 @@ uint64_t vm_rcache_get_result(void)
     (*stack_top = (val), stack_top++)
 #define TOP()                                   \
     (*(stack_top - 1))
-#define NEXT_HANDLER(code, stack_top)                      \
-    (((code)++), (code)->handler((code), (stack_top)))
+#define NEXT_HANDLER(code, stack_top, cell)                     \
+    (((code)++), (code)->handler((code), (stack_top), (cell)))
 #define END_TRACE(code, stack_top)              \
-    { vm_rcache_trace.stack_top = (stack_top); return; }
-#define ARG_AT_PC(bytecode, pc)                                         \
-    (((uint64_t)(bytecode)[(pc) + 1] << 8) + (bytecode)[(pc) + 2])
+    { vm_rcache_trace.stack_top = (stack_top); return cell; }
 
 typedef struct scode scode;
 
-typedef void trace_op_handler(scode *code, uint64_t *stack_top);
+typedef uint64_t trace_op_handler(scode *code, uint64_t *stack_top, uint64_t cell);
 
 struct scode {
     uint64_t arg;
@@ -677,28 +279,47 @@ struct scode {
 
 typedef scode trace[MAX_TRACE_LEN];
 
+#define NO_CELL UINT64_MAX
+
 static struct {
-    uint8_t *bytecode;
-    size_t pc;
-    jmp_buf buf;
+    VM_ALIGNED(VM_CACHE_LINE) size_t pc;
     bool is_running;
     interpret_result error;
 
-    trace trace_cache[MAX_CODE_LEN];
+    /* Address of the memory cell promoted to a register, the value itself travels through handler
+     * arguments */
+    uint64_t cell_addr;
 
-    /* Fixed-size stack */
-    uint64_t stack[STACK_MAX];
+    /* Fixed-size stack between guard pages */
     uint64_t *stack_top;
+    uint64_t *stack;
 
-    /* Operational memory */
-    uint64_t memory[MEMORY_SIZE];
+    size_t *call_stack_top;
+    uint8_t *bytecode;
 
     /* A single register containing the result */
     uint64_t result;
 
+    /* Return addresses of active calls, calls inlined into traces only push them when leaving the
+     * trace */
+    VM_ALIGNED(VM_CACHE_LINE) size_t call_stack[CALL_STACK_MAX];
+
+    VM_ALIGNED(VM_CACHE_LINE) trace trace_cache[MAX_CODE_LEN];
+
+    /* Operational memory, cells past MEMORY_SIZE are paged */
+    VM_ALIGNED(VM_PAGE_BYTES) uint64_t memory[MEMORY_SIZE];
+    vm_paged_memory paged;
 } vm_rcache_trace;
 
-static void op_abort_handler(scode *code, uint64_t *stack_top)
+static void trace_cell_flush(uint64_t cell)
+{
+    if (vm_rcache_trace.cell_addr != NO_CELL) {
+        vm_rcache_trace.memory[vm_rcache_trace.cell_addr] = cell;
+        vm_rcache_trace.cell_addr = NO_CELL;
+    }
+}
+
+static uint64_t op_abort_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     (void) code;
 
@@ -708,121 +329,168 @@ static void op_abort_handler(scode *code, uint64_t *stack_top)
     END_TRACE(code, stack_top);
 }
 
-static void op_pushi_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_pushi_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     PUSH(code->arg);
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_loadi_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_loadi_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t addr = code->arg;
     uint64_t val = vm_rcache_trace.memory[addr];
     PUSH(val);
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_loadaddi_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_loadaddi_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t addr = code->arg;
     uint64_t val = vm_rcache_trace.memory[addr];
     TOP() += val;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_storei_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_storei_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint16_t addr = code->arg;
     uint64_t val = POP();
     vm_rcache_trace.memory[addr] = val;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_load_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_load_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
-    uint16_t addr = POP();
-    uint64_t val = vm_rcache_trace.memory[addr];
+    uint64_t addr = POP();
+    uint64_t val = vm_memory_load(vm_rcache_trace.memory, &vm_rcache_trace.paged, addr);
     PUSH(val);
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 
 }
 
-static void op_store_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_store_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t val = POP();
-    uint16_t addr = POP();
-    vm_rcache_trace.memory[addr] = val;
+    uint64_t addr = POP();
+    vm_memory_store(vm_rcache_trace.memory, &vm_rcache_trace.paged, addr, val);
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_dup_handler(scode *code, uint64_t *stack_top)
+/* Memory ops of a trace with a promoted cell: the cell lives in the handler argument and the
+ * address is in code->arg */
+
+static uint64_t op_loadi_cell_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    PUSH(cell);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_loadaddi_cell_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    TOP() += cell;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_storei_cell_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    cell = POP();
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_load_cell_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t addr = POP();
+    uint64_t val = cell;
+    if ((uint32_t)addr != code->arg)
+        val = vm_memory_load(vm_rcache_trace.memory, &vm_rcache_trace.paged, addr);
+    PUSH(val);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_store_cell_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t val = POP();
+    uint64_t addr = POP();
+    if ((uint32_t)addr == code->arg)
+        cell = val;
+    else
+        vm_memory_store(vm_rcache_trace.memory, &vm_rcache_trace.paged, addr, val);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_dup_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     PUSH(TOP());
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_discard_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_discard_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     (void) POP();
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_add_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_add_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() += arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_addi_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_addi_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint16_t arg_right = code->arg;
     TOP() += arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_sub_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_sub_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() -= arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_div_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_div_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
-    /* Don't forget to handle the div by zero error */
-    if (arg_right != 0) {
-        TOP() /= arg_right;
-    } else {
+    /* Don't forget to handle the div by zero error, unless it traps */
+    if (!VM_TRAP_DIVISION && arg_right == 0) {
         vm_rcache_trace.is_running = false;
         vm_rcache_trace.error = ERROR_DIVISION_BY_ZERO;
-        longjmp(vm_rcache_trace.buf, 1);
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
     }
+    TOP() /= arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_mul_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_mul_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() *= arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_jump_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_jump_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t target = code->arg;
     vm_rcache_trace.pc = target;
@@ -830,7 +498,7 @@ static void op_jump_handler(scode *code, uint64_t *stack_top)
     END_TRACE(code, stack_top);
 }
 
-static void op_jump_if_true_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_jump_if_true_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     if (POP()) {
         uint64_t target = code->arg;
@@ -839,7 +507,7 @@ static void op_jump_if_true_handler(scode *code, uint64_t *stack_top)
     END_TRACE(code, stack_top);
 }
 
-static void op_jump_if_false_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_jump_if_false_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     if (!POP()) {
         uint64_t target = code->arg;
@@ -848,62 +516,62 @@ static void op_jump_if_false_handler(scode *code, uint64_t *stack_top)
     END_TRACE(code, stack_top);
 }
 
-static void op_equal_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_equal_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() = TOP() == arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_less_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_less_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() = TOP() < arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_less_or_equal_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_less_or_equal_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() = TOP() <= arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
-static void op_greater_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_greater_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() = TOP() > arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_greater_or_equal_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_greater_or_equal_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = POP();
     TOP() = TOP() >= arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_greater_or_equali_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_greater_or_equali_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg_right = code->arg;
     TOP() = TOP() >= arg_right;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_pop_res_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_pop_res_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t res = POP();
     vm_rcache_trace.result = res;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void op_done_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_done_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     (void) code;
 
@@ -913,12 +581,332 @@ static void op_done_handler(scode *code, uint64_t *stack_top)
     END_TRACE(code, stack_top);
 }
 
-static void op_print_handler(scode *code, uint64_t *stack_top)
+static uint64_t op_print_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     uint64_t arg = POP();
     printf("%" PRIu64 "\n", arg);
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_ret_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    (void) code;
+
+    if (vm_rcache_trace.call_stack_top == vm_rcache_trace.call_stack) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_CALL_STACK_UNDERFLOW;
+        END_TRACE(code, stack_top);
+    }
+    vm_rcache_trace.pc = *(--vm_rcache_trace.call_stack_top);
+
+    END_TRACE(code, stack_top);
+}
+
+static uint64_t op_load8_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t index = POP();
+    PUSH(vm_memory_load8(vm_rcache_trace.memory, index));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_load16_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t index = POP();
+    PUSH(vm_memory_load16(vm_rcache_trace.memory, index));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_load32_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t index = POP();
+    PUSH(vm_memory_load32(vm_rcache_trace.memory, index));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_store8_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t val = POP();
+    uint64_t index = POP();
+    vm_memory_store8(vm_rcache_trace.memory, index, val);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_store16_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t val = POP();
+    uint64_t index = POP();
+    vm_memory_store16(vm_rcache_trace.memory, index, val);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_store32_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t val = POP();
+    uint64_t index = POP();
+    vm_memory_store32(vm_rcache_trace.memory, index, val);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_bit_test_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t index = POP();
+    PUSH(vm_memory_bit_test(vm_rcache_trace.memory, index));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_bit_set_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t index = POP();
+    vm_memory_bit_set(vm_rcache_trace.memory, index);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_memset_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t count = POP();
+    uint64_t val = POP();
+    uint64_t addr = POP();
+    if (!vm_memory_range_is_valid(addr, count)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_MEMORY_OUT_OF_BOUNDS;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    vm_memory_fill(vm_rcache_trace.memory + addr, count, val);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_memcpy_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t count = POP();
+    uint64_t src = POP();
+    uint64_t dst = POP();
+    if (!vm_memory_range_is_valid(src, count) || !vm_memory_range_is_valid(dst, count)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_MEMORY_OUT_OF_BOUNDS;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    vm_memory_copy(vm_rcache_trace.memory + dst, vm_rcache_trace.memory + src, count);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_memsum_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t count = POP();
+    uint64_t addr = POP();
+    if (!vm_memory_range_is_valid(addr, count)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_MEMORY_OUT_OF_BOUNDS;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    PUSH(vm_memory_sum(vm_rcache_trace.memory + addr, count));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_memmin_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t count = POP();
+    uint64_t addr = POP();
+    if (!vm_memory_range_is_valid(addr, count)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_MEMORY_OUT_OF_BOUNDS;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    PUSH(vm_memory_min(vm_rcache_trace.memory + addr, count));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_memmax_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t count = POP();
+    uint64_t addr = POP();
+    if (!vm_memory_range_is_valid(addr, count)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_MEMORY_OUT_OF_BOUNDS;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    PUSH(vm_memory_max(vm_rcache_trace.memory + addr, count));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_memcount_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t count = POP();
+    uint64_t addr = POP();
+    if (!vm_memory_range_is_valid(addr, count)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_MEMORY_OUT_OF_BOUNDS;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    PUSH(vm_memory_count(vm_rcache_trace.memory + addr, count));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_callnative_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    const vm_native *native = (const vm_native *)(uintptr_t)code->arg;
+    uint64_t *args = stack_top - native->arity;
+    uint64_t res = native->function(args);
+    stack_top = args;
+    PUSH(res);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_callnative_unknown_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    (void) code;
+
+    vm_rcache_trace.is_running = false;
+    vm_rcache_trace.error = ERROR_UNKNOWN_NATIVE;
+
+    END_TRACE(code, stack_top);
+}
+
+static uint64_t op_yield_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_mod_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    if (!VM_TRAP_DIVISION && arg_right == 0) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_DIVISION_BY_ZERO;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    TOP() %= arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_and_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() &= arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_or_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() |= arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_xor_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() ^= arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_not_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    TOP() = ~TOP();
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_shl_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() <<= arg_right & 63;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_shr_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() >>= arg_right & 63;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_sar_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() = (uint64_t)((int64_t)TOP() >> (arg_right & 63));
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_less_signed_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() < (int64_t)arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_less_or_equal_signed_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() <= (int64_t)arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_greater_signed_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() > (int64_t)arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_greater_or_equal_signed_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t arg_right = POP();
+    TOP() = (int64_t)TOP() >= (int64_t)arg_right;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_alloc_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    TOP() = vm_heap_alloc(&vm_rcache_trace.paged, TOP());
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+static uint64_t op_free_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t addr = POP();
+    if (!vm_heap_free(&vm_rcache_trace.paged, addr)) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_INVALID_FREE;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
 typedef struct trace_opinfo {
@@ -956,45 +944,215 @@ static const trace_opinfo trace_opcode_to_opinfo[] = {
     [OP_POP_RES] = {false, false, false, false, op_pop_res_handler},
     [OP_DONE] = {false, false, false, true, op_done_handler},
     [OP_PRINT] = {false, false, false, false, op_print_handler},
+    /* calls are inlined by the trace compiler */
+    [OP_CALL] = {true, false, false, false, NULL},
+    [OP_RET] = {false, false, false, true, op_ret_handler},
+    [OP_LOAD8] = {false, false, false, false, op_load8_handler},
+    [OP_LOAD16] = {false, false, false, false, op_load16_handler},
+    [OP_LOAD32] = {false, false, false, false, op_load32_handler},
+    [OP_STORE8] = {false, false, false, false, op_store8_handler},
+    [OP_STORE16] = {false, false, false, false, op_store16_handler},
+    [OP_STORE32] = {false, false, false, false, op_store32_handler},
+    [OP_BIT_TEST] = {false, false, false, false, op_bit_test_handler},
+    [OP_BIT_SET] = {false, false, false, false, op_bit_set_handler},
+    [OP_MEMSET] = {false, false, false, false, op_memset_handler},
+    [OP_MEMCPY] = {false, false, false, false, op_memcpy_handler},
+    [OP_MEMSUM] = {false, false, false, false, op_memsum_handler},
+    [OP_MEMMIN] = {false, false, false, false, op_memmin_handler},
+    [OP_MEMMAX] = {false, false, false, false, op_memmax_handler},
+    [OP_MEMCOUNT] = {false, false, false, false, op_memcount_handler},
+    [OP_CALLNATIVE] = {true, false, false, false, op_callnative_handler},
+    [OP_YIELD] = {false, false, false, false, op_yield_handler},
+    [OP_PUSHK] = {true, false, false, false, op_pushi_handler},
+    [OP_AND] = {false, false, false, false, op_and_handler},
+    [OP_OR] = {false, false, false, false, op_or_handler},
+    [OP_XOR] = {false, false, false, false, op_xor_handler},
+    [OP_NOT] = {false, false, false, false, op_not_handler},
+    [OP_SHL] = {false, false, false, false, op_shl_handler},
+    [OP_SHR] = {false, false, false, false, op_shr_handler},
+    [OP_SAR] = {false, false, false, false, op_sar_handler},
+    [OP_MOD] = {false, false, false, false, op_mod_handler},
+    [OP_LESS_SIGNED] = {false, false, false, false, op_less_signed_handler},
+    [OP_LESS_OR_EQUAL_SIGNED] = {false, false, false, false, op_less_or_equal_signed_handler},
+    [OP_GREATER_SIGNED] = {false, false, false, false, op_greater_signed_handler},
+    [OP_GREATER_OR_EQUAL_SIGNED] = {false, false, false, false, op_greater_or_equal_signed_handler},
+    [OP_ALLOC] = {false, false, false, false, op_alloc_handler},
+    [OP_FREE] = {false, false, false, false, op_free_handler},
 };
 
-static void trace_tail_handler(scode *code, uint64_t* stack_top)
+static uint64_t trace_tail_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     vm_rcache_trace.pc = code->arg;
 
     END_TRACE(code, stack_top);
 }
 
-static void trace_prejump_handler(scode *code, uint64_t* stack_top)
+static uint64_t trace_prejump_handler(scode *code, uint64_t *stack_top, uint64_t cell)
 {
     vm_rcache_trace.pc = code->arg;
 
-    NEXT_HANDLER(code, stack_top);
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+/* The trace leaves an inlined callee before it returns, the return address is needed after all */
+static uint64_t trace_push_frame_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    if (vm_rcache_trace.call_stack_top == vm_rcache_trace.call_stack + CALL_STACK_MAX) {
+        vm_rcache_trace.is_running = false;
+        vm_rcache_trace.error = ERROR_CALL_STACK_OVERFLOW;
+        trace_cell_flush(cell);
+        vm_guarded_fail(vm_rcache_trace.error);
+    }
+    *vm_rcache_trace.call_stack_top++ = code->arg;
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+/* Make the cell used by the trace the promoted one, traces sharing the cell keep it in a
+ * register */
+static uint64_t trace_cell_enter_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    uint64_t addr = code->arg;
+    if (vm_rcache_trace.cell_addr != addr) {
+        trace_cell_flush(cell);
+        cell = vm_rcache_trace.memory[addr];
+        vm_rcache_trace.cell_addr = addr;
+    }
+
+    return NEXT_HANDLER(code, stack_top, cell);
 }
 
-static void trace_compile_handler(scode *trace_head, uint64_t *stack_top)
+/* Traces accessing memory by dynamic addresses only need the promoted cell back in memory */
+static uint64_t trace_cell_flush_handler(scode *code, uint64_t *stack_top, uint64_t cell)
+{
+    trace_cell_flush(cell);
+
+    return NEXT_HANDLER(code, stack_top, cell);
+}
+
+/* Sized and bulk memory ops access any cell */
+static bool is_raw_memory_handler(trace_op_handler *handler)
+{
+    return handler == op_load8_handler || handler == op_load16_handler ||
+        handler == op_load32_handler || handler == op_store8_handler ||
+        handler == op_store16_handler || handler == op_store32_handler ||
+        handler == op_bit_test_handler || handler == op_bit_set_handler ||
+        handler == op_memset_handler || handler == op_memcpy_handler ||
+        handler == op_memsum_handler || handler == op_memmin_handler ||
+        handler == op_memmax_handler || handler == op_memcount_handler;
+}
+
+/* Choose a memory cell to be promoted to a register for the trace: the constant address used most
+ * often. Returns the head handler the trace needs, or NULL. Traces using sized or bulk memory ops
+ * get no promoted cell. */
+static trace_op_handler *trace_promote_cell(scode *trace_body, scode *trace_end, uint64_t *cell_addr)
+{
+    bool has_dynamic_access = false;
+    size_t best_uses = 0;
+
+    for (scode *code = trace_body; code < trace_end; code++)
+        if (is_raw_memory_handler(code->handler))
+            return trace_cell_flush_handler;
+
+    for (scode *code = trace_body; code < trace_end; code++) {
+        if (code->handler == op_load_handler || code->handler == op_store_handler) {
+            has_dynamic_access = true;
+            continue;
+        }
+        if (code->handler != op_loadi_handler && code->handler != op_storei_handler &&
+            code->handler != op_loadaddi_handler)
+            continue;
+
+        /* Traces are short, quadratic counting is fine */
+        size_t uses = 0;
+        for (scode *other = trace_body; other < trace_end; other++)
+            if ((other->handler == op_loadi_handler || other->handler == op_storei_handler ||
+                 other->handler == op_loadaddi_handler) && other->arg == code->arg)
+                uses++;
+        if (uses > best_uses) {
+            best_uses = uses;
+            *cell_addr = code->arg;
+        }
+    }
+
+    if (!best_uses)
+        return has_dynamic_access ? trace_cell_flush_handler : NULL;
+
+    for (scode *code = trace_body; code < trace_end; code++) {
+        if (code->handler == op_load_handler) {
+            code->handler = op_load_cell_handler;
+            code->arg = *cell_addr;
+        } else if (code->handler == op_store_handler) {
+            code->handler = op_store_cell_handler;
+            code->arg = *cell_addr;
+        } else if (code->arg == *cell_addr) {
+            if (code->handler == op_loadi_handler)
+                code->handler = op_loadi_cell_handler;
+            else if (code->handler == op_storei_handler)
+                code->handler = op_storei_cell_handler;
+            else if (code->handler == op_loadaddi_handler)
+                code->handler = op_loadaddi_cell_handler;
+        }
+    }
+
+    return trace_cell_enter_handler;
+}
+
+static uint64_t trace_compile_handler(scode *trace_head, uint64_t *stack_top, uint64_t cell)
 {
     uint8_t *bytecode = vm_rcache_trace.bytecode;
     size_t pc = vm_rcache_trace.pc;
     size_t trace_size = 0;
 
+    /* Leave room for a cell promotion head */
+    scode *trace_body = trace_head + 1;
+
+    /* Return addresses of the calls inlined so far */
+    size_t inline_stack[MAX_INLINE_DEPTH];
+    size_t inline_depth = 0;
+
     const trace_opinfo *info = &trace_opcode_to_opinfo[bytecode[pc]];
-    scode *trace_tail = trace_head;
-    while (!info->is_final && !info->is_branch && trace_size < MAX_TRACE_LEN - 2) {
-        if (info->is_abs_jump) {
+    scode *trace_tail = trace_body;
+    /* Every inlined call might need a slot for pushing its return address */
+    while (!info->is_branch && trace_size < MAX_TRACE_LEN - 3 - inline_depth) {
+        if (bytecode[pc] == OP_CALL) {
+            if (inline_depth == MAX_INLINE_DEPTH)
+                break;
+            /* Calls are inlined: continue parsing the callee, remember where to return */
+            inline_stack[inline_depth++] = pc + 3;
+            pc = ARG_AT_PC(bytecode, pc);
+        } else if (bytecode[pc] == OP_RET && inline_depth > 0) {
+            /* Returning from an inlined call needs no call stack at all */
+            pc = inline_stack[--inline_depth];
+        } else if (info->is_final) {
+            break;
+        } else if (info->is_abs_jump) {
             /* Absolute jumps need special care: we just jump continue parsing starting with the
              * target pc of the instruction*/
             uint64_t target = ARG_AT_PC(bytecode, pc);
             pc = target;
+            /* Followed jumps count towards the trace length, so jumping in place ends a trace */
+            trace_size++;
         } else {
             /* For usual handlers we just set the handler and optionally skip argument bytes*/
             trace_tail->handler = info->handler;
 
             if (info->has_arg) {
                 uint64_t arg = ARG_AT_PC(bytecode, pc);
+                /* Constants are fetched once, the trace pushes them like immediates */
+                if (bytecode[pc] == OP_PUSHK)
+                    arg = vm_const_at(bytecode, arg);
                 trace_tail->arg = arg;
                 pc += 2;
             }
+            /* Native functions are looked up once, the handler calls through a pointer */
+            if (trace_tail->handler == op_callnative_handler) {
+                const vm_native *native = vm_native_at(trace_tail->arg);
+                if (native)
+                    trace_tail->arg = (uintptr_t)native;
+                else
+                    trace_tail->handler = op_callnative_unknown_handler;
+            }
             pc++;
 
             trace_size++;
@@ -1005,6 +1163,13 @@ static void trace_compile_handler(scode *trace_head, uint64_t *stack_top)
         info = &trace_opcode_to_opinfo[bytecode[pc]];
     }
 
+    /* The trace ends within inlined callees, they return to their callers later */
+    for (size_t frame_i = 0; frame_i < inline_depth; frame_i++) {
+        trace_tail->handler = trace_push_frame_handler;
+        trace_tail->arg = inline_stack[frame_i];
+        trace_tail++;
+    }
+
     if (info->is_final) {
         /* last instruction */
         trace_tail->handler = info->handler;
@@ -1025,16 +1190,32 @@ static void trace_compile_handler(scode *trace_head, uint64_t *stack_top)
         trace_tail->arg = pc;
     }
 
+    /* Only ops before the final one access memory */
+    uint64_t cell_addr = NO_CELL;
+    trace_op_handler *head_handler = trace_promote_cell(trace_body, trace_tail, &cell_addr);
+    if (head_handler) {
+        trace_head->handler = head_handler;
+        trace_head->arg = cell_addr;
+    } else {
+        memmove(trace_head, trace_body, (trace_tail - trace_body + 1) * sizeof(*trace_head));
+    }
+
     /* now, run the chain */
-    trace_head->handler(trace_head, stack_top);
+    return trace_head->handler(trace_head, stack_top, cell);
 }
 
 static void vm_rcache_trace_reset(uint8_t *bytecode)
 {
+    uint64_t *stack = vm_rcache_trace.stack ? vm_rcache_trace.stack : vm_guarded_stack_new(STACK_MAX);
+    vm_paged_reset(&vm_rcache_trace.paged);
     memset(&vm_rcache_trace, 0, sizeof(vm_rcache_trace));
+    memset(stack, 0, STACK_MAX * sizeof(*stack));
+    vm_rcache_trace.stack = stack;
     vm_rcache_trace.stack_top = vm_rcache_trace.stack;
     vm_rcache_trace.bytecode = bytecode;
     vm_rcache_trace.is_running = true;
+    vm_rcache_trace.cell_addr = NO_CELL;
+    vm_rcache_trace.call_stack_top = vm_rcache_trace.call_stack;
     for (size_t trace_i = 0; trace_i < MAX_CODE_LEN; trace_i++ )
         vm_rcache_trace.trace_cache[trace_i][0].handler = trace_compile_handler;
 }
@@ -1042,13 +1223,37 @@ static void vm_rcache_trace_reset(uint8_t *bytecode)
 interpret_result vm_rcache_interpret_trace(uint8_t *bytecode)
 {
     vm_rcache_trace_reset(bytecode);
+    return vm_rcache_interpret_trace_resume();
+}
 
-    if (!setjmp(vm_rcache_trace.buf)) {
-        while(vm_rcache_trace.is_running) {
-            scode *code = &vm_rcache_trace.trace_cache[vm_rcache_trace.pc][0];
-            code->handler(code, vm_rcache_trace.stack_top);
+static interpret_result rcache_interpret_trace_run(void);
+
+interpret_result vm_rcache_interpret_trace_resume(void)
+{
+    return vm_guarded_run(rcache_interpret_trace_run);
+}
+
+static interpret_result rcache_interpret_trace_run(void)
+{
+    if (vm_rcache_trace.error == ERROR_BUDGET_EXHAUSTED)
+        vm_rcache_trace.error = SUCCESS;
+
+    uint64_t cell = 0;
+    while(vm_rcache_trace.is_running) {
+        size_t pc = vm_rcache_trace.pc;
+        scode *code = &vm_rcache_trace.trace_cache[pc][0];
+        cell = code->handler(code, vm_rcache_trace.stack_top, cell);
+
+        /* Traces only get charged when control goes back to an earlier trace */
+        if (vm_rcache_trace.pc <= pc && vm_rcache_trace.is_running) {
+            if (vm_budget == 0) {
+                vm_rcache_trace.error = ERROR_BUDGET_EXHAUSTED;
+                break;
+            }
+            vm_budget--;
         }
     }
+    trace_cell_flush(cell);
 
     return vm_rcache_trace.error;
 }
@@ -0,0 +1,1178 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "compat.h"
+#include "pigletvm.h"
+
+#define STACK_MAX 256
+
+/*
+ * register vm: stack bytecode translated into three-address register code
+ *
+ * Static stack depths (see vm_analyze) turn stack slot N into virtual register rN. DUP does not
+ * copy anything: the new slot just becomes an alias of the register it duplicates and DISCARD only
+ * forgets a slot. Aliases get materialized with moves at the end of every basic block so all the
+ * incoming paths of a block agree on slot N living in rN. Depths count from a function's first
+ * argument, so a call moves the registers' window up to the callee's arguments and a return moves
+ * it back. Calls need no register saving.
+ * */
+
+typedef enum reg_opcode {
+    /* stop with ERROR_END_OF_STREAM */
+    ROP_ABORT,
+    /* stop with ERROR_UNKNOWN_OPCODE */
+    ROP_UNKNOWN,
+    /* stop with ERROR_UNKNOWN_NATIVE */
+    ROP_UNKNOWN_NATIVE,
+
+    /* dst = arg */
+    ROP_MOVI,
+    /* dst = a 64-bit constant, the lower half in arg and the upper one in target */
+    ROP_MOVK,
+    /* dst = src1 */
+    ROP_MOV,
+    /* dst = memory[arg] */
+    ROP_LOADI,
+    /* dst = src1 + memory[arg] */
+    ROP_LOADADDI,
+    /* memory[arg] = src1 */
+    ROP_STOREI,
+    /* dst = memory[src1], a 32-bit address */
+    ROP_LOAD,
+    /* memory[src1] = src2 */
+    ROP_STORE,
+    /* sized memory access: dst = element src1 */
+    ROP_LOAD8,
+    ROP_LOAD16,
+    ROP_LOAD32,
+    /* element src1 = src2 */
+    ROP_STORE8,
+    ROP_STORE16,
+    ROP_STORE32,
+    /* dst = bit src1 */
+    ROP_BIT_TEST,
+    /* set bit src1 */
+    ROP_BIT_SET,
+    /* fill cells at src1 with src2, arg is the register holding the cell count */
+    ROP_MEMSET,
+    /* copy cells from src2 to src1, arg is the register holding the cell count */
+    ROP_MEMCPY,
+    /* dst = the result over src2 cells at src1 */
+    ROP_MEMSUM,
+    ROP_MEMMIN,
+    ROP_MEMMAX,
+    ROP_MEMCOUNT,
+    /* dst = native function arg called with registers starting at src1 as arguments */
+    ROP_CALLNATIVE,
+    /* dst = the address of a heap block of src1 cells */
+    ROP_ALLOC,
+    /* give the heap block at src1 back */
+    ROP_FREE,
+
+    /* dst = src1 op src2 */
+    ROP_ADD,
+    ROP_SUB,
+    ROP_DIV,
+    ROP_MUL,
+    ROP_EQUAL,
+    ROP_LESS,
+    ROP_LESS_OR_EQUAL,
+    ROP_GREATER,
+    ROP_GREATER_OR_EQUAL,
+    ROP_MOD,
+    ROP_AND,
+    ROP_OR,
+    ROP_XOR,
+    ROP_SHL,
+    ROP_SHR,
+    ROP_SAR,
+    ROP_LESS_SIGNED,
+    ROP_LESS_OR_EQUAL_SIGNED,
+    ROP_GREATER_SIGNED,
+    ROP_GREATER_OR_EQUAL_SIGNED,
+    /* dst = ~src1 */
+    ROP_NOT,
+
+    /* dst = src1 op arg */
+    ROP_ADDI,
+    ROP_GREATER_OR_EQUALI,
+
+    /* jump to instruction number target, unconditionally or depending on src1 */
+    ROP_JUMP,
+    ROP_JUMP_IF_TRUE,
+    ROP_JUMP_IF_FALSE,
+
+    /* a comparison fused with the conditional jump consuming it: jump if src1 op src2 */
+    ROP_JUMP_IF_EQUAL,
+    ROP_JUMP_IF_NOT_EQUAL,
+    ROP_JUMP_IF_LESS,
+    ROP_JUMP_IF_LESS_OR_EQUAL,
+    ROP_JUMP_IF_GREATER,
+    ROP_JUMP_IF_GREATER_OR_EQUAL,
+    ROP_JUMP_IF_LESS_SIGNED,
+    ROP_JUMP_IF_LESS_OR_EQUAL_SIGNED,
+    ROP_JUMP_IF_GREATER_SIGNED,
+    ROP_JUMP_IF_GREATER_OR_EQUAL_SIGNED,
+    /* jump if src1 op arg */
+    ROP_JUMP_IF_LESSI,
+    ROP_JUMP_IF_GREATER_OR_EQUALI,
+    /* push instruction number arg onto the call stack, move the registers dst up, jump to target */
+    ROP_CALL,
+    /* pop an instruction number and the registers off the call stack, jump to the instruction */
+    ROP_RET,
+
+    /* result = src1 */
+    ROP_POP_RES,
+    ROP_DONE,
+    /* print src1 */
+    ROP_PRINT,
+} reg_opcode;
+
+typedef struct reg_instr {
+    /* handler address for direct threading, filled in by the interpreter */
+    const void *handler;
+    uint8_t op;
+    uint8_t dst;
+    uint8_t src1;
+    uint8_t src2;
+    /* an immediate value or a memory address */
+    uint32_t arg;
+    /* jump target, an instruction number */
+    uint32_t target;
+} reg_instr;
+
+/* What a return gets back to */
+typedef struct reg_frame {
+    uint32_t return_instr;
+    /* the caller's first register */
+    uint32_t reg_base;
+} reg_frame;
+
+struct vm_register_program {
+    reg_instr *code;
+    size_t code_len;
+    /* Handlers are filled in on the first run */
+    bool is_threaded;
+};
+
+static struct {
+    /* Register file, one register per stack slot */
+    VM_ALIGNED(VM_CACHE_LINE) uint64_t reg[STACK_MAX];
+
+    /* The code being run: either the code just translated or a cached program */
+    vm_register_program *program;
+
+    /* Where a run stopped by the budget continues */
+    size_t ip;
+    size_t call_depth;
+    size_t reg_base;
+
+    /* A single register containing the result */
+    uint64_t result;
+
+    /* Instructions to return to */
+    VM_ALIGNED(VM_CACHE_LINE) reg_frame call_stack[CALL_STACK_MAX];
+
+    /* Translated code */
+    reg_instr *code;
+    size_t code_len;
+    size_t code_capacity;
+    vm_register_program translated;
+
+    /* Bytecode pc to instruction number, jumps get patched using this */
+    uint32_t pc_to_instr[MAX_CODE_LEN];
+
+    /* Operational memory, cells past MEMORY_SIZE are paged */
+    VM_ALIGNED(VM_PAGE_BYTES) uint64_t memory[MEMORY_SIZE];
+    vm_paged_memory paged;
+} vm_reg;
+
+typedef struct translator {
+    vm_analysis analysis;
+    /* register currently holding the value of each stack slot */
+    uint8_t slot_reg[STACK_MAX + 1];
+    /* number of the first instruction emitted for the current basic block */
+    size_t block_first_instr;
+} translator;
+
+typedef struct fused_jump {
+    /* the fused op if the comparison result is true, and if it's false */
+    reg_opcode if_true;
+    reg_opcode if_false;
+} fused_jump;
+
+static const fused_jump compare_to_fused_jump[] = {
+    [ROP_EQUAL] = {ROP_JUMP_IF_EQUAL, ROP_JUMP_IF_NOT_EQUAL},
+    [ROP_LESS] = {ROP_JUMP_IF_LESS, ROP_JUMP_IF_GREATER_OR_EQUAL},
+    [ROP_LESS_OR_EQUAL] = {ROP_JUMP_IF_LESS_OR_EQUAL, ROP_JUMP_IF_GREATER},
+    [ROP_GREATER] = {ROP_JUMP_IF_GREATER, ROP_JUMP_IF_LESS_OR_EQUAL},
+    [ROP_GREATER_OR_EQUAL] = {ROP_JUMP_IF_GREATER_OR_EQUAL, ROP_JUMP_IF_LESS},
+    [ROP_LESS_SIGNED] = {ROP_JUMP_IF_LESS_SIGNED, ROP_JUMP_IF_GREATER_OR_EQUAL_SIGNED},
+    [ROP_LESS_OR_EQUAL_SIGNED] = {ROP_JUMP_IF_LESS_OR_EQUAL_SIGNED, ROP_JUMP_IF_GREATER_SIGNED},
+    [ROP_GREATER_SIGNED] = {ROP_JUMP_IF_GREATER_SIGNED, ROP_JUMP_IF_LESS_OR_EQUAL_SIGNED},
+    [ROP_GREATER_OR_EQUAL_SIGNED] = {ROP_JUMP_IF_GREATER_OR_EQUAL_SIGNED, ROP_JUMP_IF_LESS_SIGNED},
+    [ROP_GREATER_OR_EQUALI] = {ROP_JUMP_IF_GREATER_OR_EQUALI, ROP_JUMP_IF_LESSI},
+};
+
+static reg_instr *emit(reg_opcode op, uint8_t dst, uint8_t src1, uint8_t src2, uint32_t arg,
+                       uint32_t target)
+{
+    if (vm_reg.code_len == vm_reg.code_capacity) {
+        size_t capacity = vm_reg.code_capacity ? vm_reg.code_capacity * 2 : MAX_CODE_LEN;
+        reg_instr *code = realloc(vm_reg.code, capacity * sizeof(*code));
+        if (!code) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(EXIT_FAILURE);
+        }
+        vm_reg.code = code;
+        vm_reg.code_capacity = capacity;
+    }
+
+    reg_instr *instr = &vm_reg.code[vm_reg.code_len++];
+    *instr = (reg_instr){.handler = NULL, .op = op, .dst = dst, .src1 = src1, .src2 = src2,
+                         .arg = arg, .target = target};
+    return instr;
+}
+
+/* Put every slot back into its own register */
+static void materialize(translator *t, int depth)
+{
+    for (int slot = 0; slot < depth; slot++) {
+        if (t->slot_reg[slot] != slot) {
+            emit(ROP_MOV, slot, t->slot_reg[slot], 0, 0, 0);
+            t->slot_reg[slot] = slot;
+        }
+    }
+}
+
+static void reset_slots(translator *t)
+{
+    for (int slot = 0; slot <= STACK_MAX; slot++)
+        t->slot_reg[slot] = slot;
+}
+
+static void translate_jump_if(translator *t, int top, bool sense, uint16_t target)
+{
+    /* The condition register survives materializing: only alias slots get written */
+    uint8_t cond = t->slot_reg[top];
+    materialize(t, top);
+
+    /* A comparison right before the jump within the same block only feeds the jump if its result
+     * is not duplicated, so both get fused into a single instruction */
+    if (cond == top && vm_reg.code_len > t->block_first_instr) {
+        reg_instr *prev = &vm_reg.code[vm_reg.code_len - 1];
+        if (prev->dst == cond && prev->op < sizeof(compare_to_fused_jump) / sizeof(fused_jump) &&
+            compare_to_fused_jump[prev->op].if_true) {
+            const fused_jump *fused = &compare_to_fused_jump[prev->op];
+            prev->op = sense ? fused->if_true : fused->if_false;
+            prev->dst = 0;
+            prev->target = target;
+            return;
+        }
+    }
+
+    emit(sense ? ROP_JUMP_IF_TRUE : ROP_JUMP_IF_FALSE, 0, cond, 0, 0, target);
+}
+
+static bool translate_instruction(translator *t, uint8_t *bytecode, size_t pc)
+{
+    int depth = t->analysis.depth[pc];
+    int top = depth - 1;
+    int below = depth - 2;
+    uint16_t arg = vm_instruction_arg(bytecode, pc);
+    uint8_t *slot_reg = t->slot_reg;
+
+    /* Binary ops read both slots from wherever they live and write the lower slot's own
+     * register, this never clobbers an alias as aliases only point to lower slots */
+#define BINARY(rop)                                                     \
+    emit((rop), below, slot_reg[below], slot_reg[top], 0, 0);           \
+    slot_reg[below] = below
+
+    switch (bytecode[pc]) {
+    case OP_PUSHI:
+        emit(ROP_MOVI, depth, 0, 0, arg, 0);
+        slot_reg[depth] = depth;
+        break;
+    case OP_PUSHK:{
+        uint64_t val = vm_const_at(bytecode, arg);
+        emit(ROP_MOVK, depth, 0, 0, (uint32_t)val, (uint32_t)(val >> 32));
+        slot_reg[depth] = depth;
+        break;
+    }
+    case OP_LOADI:
+        emit(ROP_LOADI, depth, 0, 0, arg, 0);
+        slot_reg[depth] = depth;
+        break;
+    case OP_LOADADDI:
+        emit(ROP_LOADADDI, top, slot_reg[top], 0, arg, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_STOREI:
+        emit(ROP_STOREI, 0, slot_reg[top], 0, arg, 0);
+        break;
+    case OP_LOAD:
+        emit(ROP_LOAD, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_STORE:
+        emit(ROP_STORE, 0, slot_reg[below], slot_reg[top], 0, 0);
+        break;
+    case OP_LOAD8:
+        emit(ROP_LOAD8, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_LOAD16:
+        emit(ROP_LOAD16, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_LOAD32:
+        emit(ROP_LOAD32, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_STORE8:
+        emit(ROP_STORE8, 0, slot_reg[below], slot_reg[top], 0, 0);
+        break;
+    case OP_STORE16:
+        emit(ROP_STORE16, 0, slot_reg[below], slot_reg[top], 0, 0);
+        break;
+    case OP_STORE32:
+        emit(ROP_STORE32, 0, slot_reg[below], slot_reg[top], 0, 0);
+        break;
+    case OP_BIT_TEST:
+        emit(ROP_BIT_TEST, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_BIT_SET:
+        emit(ROP_BIT_SET, 0, slot_reg[top], 0, 0, 0);
+        break;
+    case OP_MEMSET:
+        emit(ROP_MEMSET, 0, slot_reg[depth - 3], slot_reg[below], slot_reg[top], 0);
+        break;
+    case OP_MEMCPY:
+        emit(ROP_MEMCPY, 0, slot_reg[depth - 3], slot_reg[below], slot_reg[top], 0);
+        break;
+    case OP_MEMSUM:
+        BINARY(ROP_MEMSUM);
+        break;
+    case OP_MEMMIN:
+        BINARY(ROP_MEMMIN);
+        break;
+    case OP_MEMMAX:
+        BINARY(ROP_MEMMAX);
+        break;
+    case OP_MEMCOUNT:
+        BINARY(ROP_MEMCOUNT);
+        break;
+    case OP_CALLNATIVE: {
+        const vm_native *native = vm_native_at(arg);
+        int first = depth;
+        if (!native) {
+            emit(ROP_UNKNOWN_NATIVE, 0, 0, 0, 0, 0);
+        } else {
+            /* Arguments are passed in place, so they have to be in their slots' own registers */
+            first = depth - native->arity;
+            materialize(t, depth);
+            emit(ROP_CALLNATIVE, first, first, 0, arg, 0);
+        }
+        slot_reg[first] = first;
+        break;
+    }
+    case OP_YIELD:
+        /* there is nothing to switch to */
+        break;
+    case OP_DUP:
+        slot_reg[depth] = slot_reg[top];
+        break;
+    case OP_DISCARD:
+        break;
+    case OP_ADD:
+        BINARY(ROP_ADD);
+        break;
+    case OP_ADDI:
+        emit(ROP_ADDI, top, slot_reg[top], 0, arg, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_SUB:
+        BINARY(ROP_SUB);
+        break;
+    case OP_DIV:
+        BINARY(ROP_DIV);
+        break;
+    case OP_MUL:
+        BINARY(ROP_MUL);
+        break;
+    case OP_EQUAL:
+        BINARY(ROP_EQUAL);
+        break;
+    case OP_LESS:
+        BINARY(ROP_LESS);
+        break;
+    case OP_LESS_OR_EQUAL:
+        BINARY(ROP_LESS_OR_EQUAL);
+        break;
+    case OP_GREATER:
+        BINARY(ROP_GREATER);
+        break;
+    case OP_GREATER_OR_EQUAL:
+        BINARY(ROP_GREATER_OR_EQUAL);
+        break;
+    case OP_MOD:
+        BINARY(ROP_MOD);
+        break;
+    case OP_AND:
+        BINARY(ROP_AND);
+        break;
+    case OP_OR:
+        BINARY(ROP_OR);
+        break;
+    case OP_XOR:
+        BINARY(ROP_XOR);
+        break;
+    case OP_NOT:
+        emit(ROP_NOT, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_SHL:
+        BINARY(ROP_SHL);
+        break;
+    case OP_SHR:
+        BINARY(ROP_SHR);
+        break;
+    case OP_SAR:
+        BINARY(ROP_SAR);
+        break;
+    case OP_LESS_SIGNED:
+        BINARY(ROP_LESS_SIGNED);
+        break;
+    case OP_LESS_OR_EQUAL_SIGNED:
+        BINARY(ROP_LESS_OR_EQUAL_SIGNED);
+        break;
+    case OP_GREATER_SIGNED:
+        BINARY(ROP_GREATER_SIGNED);
+        break;
+    case OP_GREATER_OR_EQUAL_SIGNED:
+        BINARY(ROP_GREATER_OR_EQUAL_SIGNED);
+        break;
+    case OP_ALLOC:
+        emit(ROP_ALLOC, top, slot_reg[top], 0, 0, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_FREE:
+        emit(ROP_FREE, 0, slot_reg[top], 0, 0, 0);
+        break;
+    case OP_GREATER_OR_EQUALI:
+        emit(ROP_GREATER_OR_EQUALI, top, slot_reg[top], 0, arg, 0);
+        slot_reg[top] = top;
+        break;
+    case OP_JUMP:
+        materialize(t, depth);
+        emit(ROP_JUMP, 0, 0, 0, 0, arg);
+        return false;
+    case OP_JUMP_IF_TRUE:
+        translate_jump_if(t, top, true, arg);
+        break;
+    case OP_JUMP_IF_FALSE:
+        translate_jump_if(t, top, false, arg);
+        break;
+    case OP_POP_RES:
+        emit(ROP_POP_RES, 0, slot_reg[top], 0, 0, 0);
+        break;
+    case OP_DONE:
+        emit(ROP_DONE, 0, 0, 0, 0, 0);
+        return false;
+    case OP_PRINT:
+        emit(ROP_PRINT, 0, slot_reg[top], 0, 0, 0);
+        break;
+    case OP_CALL:
+        /* The return address is a block of its own, see the analysis. The callee's first argument
+         * becomes its r0. A frame starting at STACK_MAX holds no registers, so wrapping the window
+         * move around does not matter. */
+        materialize(t, depth);
+        emit(ROP_CALL, (uint8_t)(depth - t->analysis.depth[arg]), 0, 0, pc + 3, arg);
+        return false;
+    case OP_RET:
+        materialize(t, depth);
+        emit(ROP_RET, 0, 0, 0, 0, 0);
+        return false;
+    case OP_ABORT:
+        emit(ROP_ABORT, 0, 0, 0, 0, 0);
+        return false;
+    default:
+        emit(ROP_UNKNOWN, 0, 0, 0, 0, 0);
+        return false;
+    }
+
+#undef BINARY
+
+    /* the instruction falls through */
+    return true;
+}
+
+static bool translate(uint8_t *bytecode)
+{
+    translator *t = malloc(sizeof(*t));
+    if (!t) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm_analyze(bytecode, &t->analysis) != ANALYSIS_OK) {
+        free(t);
+        return false;
+    }
+
+    vm_analysis *analysis = &t->analysis;
+    vm_reg.code_len = 0;
+    reset_slots(t);
+
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+        if (analysis->depth[pc] == VM_UNREACHABLE)
+            continue;
+
+        if (analysis->is_block_start[pc]) {
+            reset_slots(t);
+            t->block_first_instr = vm_reg.code_len;
+        }
+
+        vm_reg.pc_to_instr[pc] = vm_reg.code_len;
+        if (!translate_instruction(t, bytecode, pc))
+            continue;
+
+        /* Leaving the block by falling through, the next block wants canonical registers. A
+         * fall-through into overlapping code also needs an explicit jump. */
+        size_t next_pc = pc + vm_instruction_len(bytecode, pc);
+        if (analysis->is_block_start[next_pc])
+            materialize(t, analysis->depth[next_pc]);
+
+        for (size_t skipped = pc + 1; skipped < next_pc; skipped++) {
+            if (analysis->depth[skipped] != VM_UNREACHABLE) {
+                emit(ROP_JUMP, 0, 0, 0, 0, next_pc);
+                break;
+            }
+        }
+    }
+
+    /* Jump targets and return addresses are bytecode addresses so far. Calls to functions never
+     * returning have unreachable return addresses. */
+    for (size_t instr_i = 0; instr_i < vm_reg.code_len; instr_i++) {
+        reg_instr *instr = &vm_reg.code[instr_i];
+        if (instr->op >= ROP_JUMP && instr->op <= ROP_CALL)
+            instr->target = vm_reg.pc_to_instr[instr->target];
+        if (instr->op == ROP_CALL)
+            instr->arg = analysis->depth[instr->arg] != VM_UNREACHABLE ?
+                vm_reg.pc_to_instr[instr->arg] : 0;
+    }
+
+    free(t);
+    return true;
+}
+
+static void vm_reg_reset(void)
+{
+    memset(vm_reg.reg, 0, sizeof(vm_reg.reg));
+    memset(vm_reg.memory, 0, sizeof(vm_reg.memory));
+    vm_paged_reset(&vm_reg.paged);
+    vm_reg.result = 0;
+    vm_reg.ip = 0;
+    vm_reg.call_depth = 0;
+    vm_reg.reg_base = 0;
+}
+
+interpret_result vm_register_interpret_threaded(uint8_t *bytecode)
+{
+    vm_reg_reset();
+    if (!translate(bytecode))
+        return ERROR_INVALID_BYTECODE;
+    vm_reg.translated = (vm_register_program){
+        .code = vm_reg.code, .code_len = vm_reg.code_len, .is_threaded = false
+    };
+    vm_reg.program = &vm_reg.translated;
+    return vm_register_interpret_threaded_resume();
+}
+
+vm_register_program *vm_register_program_new(uint8_t *bytecode)
+{
+    if (!translate(bytecode))
+        return NULL;
+
+    vm_register_program *program = malloc(sizeof(*program));
+    reg_instr *code = malloc(vm_reg.code_len * sizeof(*code));
+    if (!program || !code) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(code, vm_reg.code, vm_reg.code_len * sizeof(*code));
+
+    *program = (vm_register_program){
+        .code = code, .code_len = vm_reg.code_len, .is_threaded = false
+    };
+    return program;
+}
+
+void vm_register_program_free(vm_register_program *program)
+{
+    if (vm_reg.program == program)
+        vm_reg.program = NULL;
+    free(program->code);
+    free(program);
+}
+
+interpret_result vm_register_program_run(vm_register_program *program, const uint64_t *input,
+                                         size_t input_len)
+{
+    vm_reg_reset();
+    memcpy(vm_reg.memory, input, input_len * sizeof(*input));
+    vm_reg.program = program;
+    return vm_register_interpret_threaded_resume();
+}
+
+/* Backward jumps and calls are the ones charged from the budget: conditional jumps once taken
+ * (see JUMP_IF), the rest before they run */
+static bool is_charged_first(reg_instr *code, reg_instr *instr)
+{
+    return (instr->op == ROP_JUMP || instr->op == ROP_CALL) && instr->target <= instr - code;
+}
+
+#if COMPUTED_GOTO_SUPPORTED
+interpret_result vm_register_interpret_threaded_resume(void)
+{
+    const void *labels[] = {
+        [ROP_ABORT] = &&op_abort,
+        [ROP_UNKNOWN] = &&op_unknown,
+        [ROP_UNKNOWN_NATIVE] = &&op_unknown_native,
+        [ROP_MOVI] = &&op_movi,
+        [ROP_MOVK] = &&op_movk,
+        [ROP_MOV] = &&op_mov,
+        [ROP_LOADI] = &&op_loadi,
+        [ROP_LOADADDI] = &&op_loadaddi,
+        [ROP_STOREI] = &&op_storei,
+        [ROP_LOAD] = &&op_load,
+        [ROP_STORE] = &&op_store,
+        [ROP_LOAD8] = &&op_load8,
+        [ROP_LOAD16] = &&op_load16,
+        [ROP_LOAD32] = &&op_load32,
+        [ROP_STORE8] = &&op_store8,
+        [ROP_STORE16] = &&op_store16,
+        [ROP_STORE32] = &&op_store32,
+        [ROP_BIT_TEST] = &&op_bit_test,
+        [ROP_BIT_SET] = &&op_bit_set,
+        [ROP_MEMSET] = &&op_memset,
+        [ROP_MEMCPY] = &&op_memcpy,
+        [ROP_MEMSUM] = &&op_memsum,
+        [ROP_MEMMIN] = &&op_memmin,
+        [ROP_MEMMAX] = &&op_memmax,
+        [ROP_MEMCOUNT] = &&op_memcount,
+        [ROP_CALLNATIVE] = &&op_callnative,
+        [ROP_ALLOC] = &&op_alloc,
+        [ROP_FREE] = &&op_free,
+        [ROP_ADD] = &&op_add,
+        [ROP_SUB] = &&op_sub,
+        [ROP_DIV] = &&op_div,
+        [ROP_MUL] = &&op_mul,
+        [ROP_EQUAL] = &&op_equal,
+        [ROP_LESS] = &&op_less,
+        [ROP_LESS_OR_EQUAL] = &&op_less_or_equal,
+        [ROP_GREATER] = &&op_greater,
+        [ROP_GREATER_OR_EQUAL] = &&op_greater_or_equal,
+        [ROP_MOD] = &&op_mod,
+        [ROP_AND] = &&op_and,
+        [ROP_OR] = &&op_or,
+        [ROP_XOR] = &&op_xor,
+        [ROP_SHL] = &&op_shl,
+        [ROP_SHR] = &&op_shr,
+        [ROP_SAR] = &&op_sar,
+        [ROP_LESS_SIGNED] = &&op_less_signed,
+        [ROP_LESS_OR_EQUAL_SIGNED] = &&op_less_or_equal_signed,
+        [ROP_GREATER_SIGNED] = &&op_greater_signed,
+        [ROP_GREATER_OR_EQUAL_SIGNED] = &&op_greater_or_equal_signed,
+        [ROP_NOT] = &&op_not,
+        [ROP_ADDI] = &&op_addi,
+        [ROP_GREATER_OR_EQUALI] = &&op_greater_or_equali,
+        [ROP_JUMP] = &&op_jump,
+        [ROP_JUMP_IF_TRUE] = &&op_jump_if_true,
+        [ROP_JUMP_IF_FALSE] = &&op_jump_if_false,
+        [ROP_JUMP_IF_EQUAL] = &&op_jump_if_equal,
+        [ROP_JUMP_IF_NOT_EQUAL] = &&op_jump_if_not_equal,
+        [ROP_JUMP_IF_LESS] = &&op_jump_if_less,
+        [ROP_JUMP_IF_LESS_OR_EQUAL] = &&op_jump_if_less_or_equal,
+        [ROP_JUMP_IF_GREATER] = &&op_jump_if_greater,
+        [ROP_JUMP_IF_GREATER_OR_EQUAL] = &&op_jump_if_greater_or_equal,
+        [ROP_JUMP_IF_LESS_SIGNED] = &&op_jump_if_less_signed,
+        [ROP_JUMP_IF_LESS_OR_EQUAL_SIGNED] = &&op_jump_if_less_or_equal_signed,
+        [ROP_JUMP_IF_GREATER_SIGNED] = &&op_jump_if_greater_signed,
+        [ROP_JUMP_IF_GREATER_OR_EQUAL_SIGNED] = &&op_jump_if_greater_or_equal_signed,
+        [ROP_JUMP_IF_LESSI] = &&op_jump_if_lessi,
+        [ROP_JUMP_IF_GREATER_OR_EQUALI] = &&op_jump_if_greater_or_equali,
+        [ROP_POP_RES] = &&op_pop_res,
+        [ROP_DONE] = &&op_done,
+        [ROP_PRINT] = &&op_print,
+        [ROP_CALL] = &&op_call,
+        [ROP_RET] = &&op_ret,
+    };
+
+    vm_register_program *program = vm_reg.program;
+    reg_instr *code = program->code;
+    reg_instr *ip = code + vm_reg.ip;
+    uint64_t *reg = vm_reg.reg + vm_reg.reg_base;
+    uint64_t *memory = vm_reg.memory;
+    vm_paged_memory *paged = &vm_reg.paged;
+    reg_frame *call_stack_top = vm_reg.call_stack + vm_reg.call_depth;
+
+    /* Direct threading: no table lookup on dispatch. Backward jumps get to the budget check first,
+     * the rest never see it. */
+    if (!program->is_threaded) {
+        for (size_t instr_i = 0; instr_i < program->code_len; instr_i++) {
+            reg_instr *instr = &code[instr_i];
+            instr->handler = is_charged_first(code, instr) ? &&op_charge_jump : labels[instr->op];
+        }
+        program->is_threaded = true;
+    }
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define JUMP_IF(cond)                           \
+    do {                                        \
+        if (cond) {                             \
+            if (ip->target <= ip - code)        \
+                goto op_charge_jump_taken;      \
+            ip = code + ip->target;             \
+            DISPATCH();                         \
+        }                                       \
+        NEXT();                                 \
+    } while (0)
+
+    DISPATCH();
+
+op_movi:
+    reg[ip->dst] = ip->arg;
+    NEXT();
+op_movk:
+    reg[ip->dst] = (uint64_t)ip->target << 32 | ip->arg;
+    NEXT();
+op_mov:
+    reg[ip->dst] = reg[ip->src1];
+    NEXT();
+op_loadi:
+    reg[ip->dst] = memory[ip->arg];
+    NEXT();
+op_loadaddi:
+    reg[ip->dst] = reg[ip->src1] + memory[ip->arg];
+    NEXT();
+op_storei:
+    memory[ip->arg] = reg[ip->src1];
+    NEXT();
+op_load:
+    reg[ip->dst] = vm_memory_load(memory, paged, reg[ip->src1]);
+    NEXT();
+op_store:
+    vm_memory_store(memory, paged, reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_load8:
+    reg[ip->dst] = vm_memory_load8(memory, reg[ip->src1]);
+    NEXT();
+op_load16:
+    reg[ip->dst] = vm_memory_load16(memory, reg[ip->src1]);
+    NEXT();
+op_load32:
+    reg[ip->dst] = vm_memory_load32(memory, reg[ip->src1]);
+    NEXT();
+op_store8:
+    vm_memory_store8(memory, reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_store16:
+    vm_memory_store16(memory, reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_store32:
+    vm_memory_store32(memory, reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_bit_test:
+    reg[ip->dst] = vm_memory_bit_test(memory, reg[ip->src1]);
+    NEXT();
+op_bit_set:
+    vm_memory_bit_set(memory, reg[ip->src1]);
+    NEXT();
+op_memset:
+    if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->arg]))
+        return ERROR_MEMORY_OUT_OF_BOUNDS;
+    vm_memory_fill(memory + reg[ip->src1], reg[ip->arg], reg[ip->src2]);
+    NEXT();
+op_memcpy:
+    if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->arg]) ||
+        !vm_memory_range_is_valid(reg[ip->src2], reg[ip->arg]))
+        return ERROR_MEMORY_OUT_OF_BOUNDS;
+    vm_memory_copy(memory + reg[ip->src1], memory + reg[ip->src2], reg[ip->arg]);
+    NEXT();
+op_memsum:
+    if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+        return ERROR_MEMORY_OUT_OF_BOUNDS;
+    reg[ip->dst] = vm_memory_sum(memory + reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_memmin:
+    if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+        return ERROR_MEMORY_OUT_OF_BOUNDS;
+    reg[ip->dst] = vm_memory_min(memory + reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_memmax:
+    if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+        return ERROR_MEMORY_OUT_OF_BOUNDS;
+    reg[ip->dst] = vm_memory_max(memory + reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_memcount:
+    if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+        return ERROR_MEMORY_OUT_OF_BOUNDS;
+    reg[ip->dst] = vm_memory_count(memory + reg[ip->src1], reg[ip->src2]);
+    NEXT();
+op_add:
+    reg[ip->dst] = reg[ip->src1] + reg[ip->src2];
+    NEXT();
+op_sub:
+    reg[ip->dst] = reg[ip->src1] - reg[ip->src2];
+    NEXT();
+op_div:
+    /* Don't forget to handle the div by zero error */
+    if (reg[ip->src2] == 0)
+        return ERROR_DIVISION_BY_ZERO;
+    reg[ip->dst] = reg[ip->src1] / reg[ip->src2];
+    NEXT();
+op_mul:
+    reg[ip->dst] = reg[ip->src1] * reg[ip->src2];
+    NEXT();
+op_equal:
+    reg[ip->dst] = reg[ip->src1] == reg[ip->src2];
+    NEXT();
+op_less:
+    reg[ip->dst] = reg[ip->src1] < reg[ip->src2];
+    NEXT();
+op_less_or_equal:
+    reg[ip->dst] = reg[ip->src1] <= reg[ip->src2];
+    NEXT();
+op_greater:
+    reg[ip->dst] = reg[ip->src1] > reg[ip->src2];
+    NEXT();
+op_greater_or_equal:
+    reg[ip->dst] = reg[ip->src1] >= reg[ip->src2];
+    NEXT();
+op_mod:
+    if (reg[ip->src2] == 0)
+        return ERROR_DIVISION_BY_ZERO;
+    reg[ip->dst] = reg[ip->src1] % reg[ip->src2];
+    NEXT();
+op_and:
+    reg[ip->dst] = reg[ip->src1] & reg[ip->src2];
+    NEXT();
+op_or:
+    reg[ip->dst] = reg[ip->src1] | reg[ip->src2];
+    NEXT();
+op_xor:
+    reg[ip->dst] = reg[ip->src1] ^ reg[ip->src2];
+    NEXT();
+op_shl:
+    reg[ip->dst] = reg[ip->src1] << (reg[ip->src2] & 63);
+    NEXT();
+op_shr:
+    reg[ip->dst] = reg[ip->src1] >> (reg[ip->src2] & 63);
+    NEXT();
+op_sar:
+    reg[ip->dst] = (uint64_t)((int64_t)reg[ip->src1] >> (reg[ip->src2] & 63));
+    NEXT();
+op_less_signed:
+    reg[ip->dst] = (int64_t)reg[ip->src1] < (int64_t)reg[ip->src2];
+    NEXT();
+op_less_or_equal_signed:
+    reg[ip->dst] = (int64_t)reg[ip->src1] <= (int64_t)reg[ip->src2];
+    NEXT();
+op_greater_signed:
+    reg[ip->dst] = (int64_t)reg[ip->src1] > (int64_t)reg[ip->src2];
+    NEXT();
+op_greater_or_equal_signed:
+    reg[ip->dst] = (int64_t)reg[ip->src1] >= (int64_t)reg[ip->src2];
+    NEXT();
+op_not:
+    reg[ip->dst] = ~reg[ip->src1];
+    NEXT();
+op_addi:
+    reg[ip->dst] = reg[ip->src1] + ip->arg;
+    NEXT();
+op_greater_or_equali:
+    reg[ip->dst] = reg[ip->src1] >= ip->arg;
+    NEXT();
+op_jump:
+    ip = code + ip->target;
+    DISPATCH();
+op_jump_if_true:
+    JUMP_IF(reg[ip->src1]);
+op_jump_if_false:
+    JUMP_IF(!reg[ip->src1]);
+op_jump_if_equal:
+    JUMP_IF(reg[ip->src1] == reg[ip->src2]);
+op_jump_if_not_equal:
+    JUMP_IF(reg[ip->src1] != reg[ip->src2]);
+op_jump_if_less:
+    JUMP_IF(reg[ip->src1] < reg[ip->src2]);
+op_jump_if_less_or_equal:
+    JUMP_IF(reg[ip->src1] <= reg[ip->src2]);
+op_jump_if_greater:
+    JUMP_IF(reg[ip->src1] > reg[ip->src2]);
+op_jump_if_greater_or_equal:
+    JUMP_IF(reg[ip->src1] >= reg[ip->src2]);
+op_jump_if_less_signed:
+    JUMP_IF((int64_t)reg[ip->src1] < (int64_t)reg[ip->src2]);
+op_jump_if_less_or_equal_signed:
+    JUMP_IF((int64_t)reg[ip->src1] <= (int64_t)reg[ip->src2]);
+op_jump_if_greater_signed:
+    JUMP_IF((int64_t)reg[ip->src1] > (int64_t)reg[ip->src2]);
+op_jump_if_greater_or_equal_signed:
+    JUMP_IF((int64_t)reg[ip->src1] >= (int64_t)reg[ip->src2]);
+op_jump_if_lessi:
+    JUMP_IF(reg[ip->src1] < ip->arg);
+op_jump_if_greater_or_equali:
+    JUMP_IF(reg[ip->src1] >= ip->arg);
+op_call:
+    if (call_stack_top == vm_reg.call_stack + CALL_STACK_MAX)
+        return ERROR_CALL_STACK_OVERFLOW;
+    *call_stack_top++ = (reg_frame){.return_instr = ip->arg, .reg_base = reg - vm_reg.reg};
+    reg += ip->dst;
+    ip = code + ip->target;
+    DISPATCH();
+op_ret:
+    if (call_stack_top == vm_reg.call_stack)
+        return ERROR_CALL_STACK_UNDERFLOW;
+    call_stack_top--;
+    reg = vm_reg.reg + call_stack_top->reg_base;
+    ip = code + call_stack_top->return_instr;
+    DISPATCH();
+op_pop_res:
+    vm_reg.result = reg[ip->src1];
+    NEXT();
+op_print:
+    printf("%" PRIu64 "\n", reg[ip->src1]);
+    NEXT();
+op_callnative:
+    reg[ip->dst] = vm_natives[ip->arg].function(&reg[ip->src1]);
+    NEXT();
+op_alloc:
+    reg[ip->dst] = vm_heap_alloc(paged, reg[ip->src1]);
+    NEXT();
+op_free:
+    if (!vm_heap_free(paged, reg[ip->src1]))
+        return ERROR_INVALID_FREE;
+    NEXT();
+op_done:
+    return SUCCESS;
+op_abort:
+    return ERROR_END_OF_STREAM;
+op_unknown:
+    return ERROR_UNKNOWN_OPCODE;
+op_unknown_native:
+    return ERROR_UNKNOWN_NATIVE;
+op_charge_jump:
+    /* Running out of budget stops the vm right before the jump */
+    if (vm_budget == 0)
+        goto budget_exhausted;
+    vm_budget--;
+    goto *labels[ip->op];
+op_charge_jump_taken:
+    /* Conditions are in registers, a run resumed at the jump tests them again */
+    if (vm_budget == 0)
+        goto budget_exhausted;
+    vm_budget--;
+    ip = code + ip->target;
+    DISPATCH();
+budget_exhausted:
+    vm_reg.ip = ip - code;
+    vm_reg.call_depth = call_stack_top - vm_reg.call_stack;
+    vm_reg.reg_base = reg - vm_reg.reg;
+    return ERROR_BUDGET_EXHAUSTED;
+
+#undef JUMP_IF
+#undef NEXT
+#undef DISPATCH
+}
+#else
+/* Fallback for compilers without computed goto support (e.g., MSVC) */
+interpret_result vm_register_interpret_threaded_resume(void)
+{
+    reg_instr *code = vm_reg.program->code;
+    reg_instr *ip = code + vm_reg.ip;
+    uint64_t *reg = vm_reg.reg + vm_reg.reg_base;
+    uint64_t *memory = vm_reg.memory;
+    vm_paged_memory *paged = &vm_reg.paged;
+    reg_frame *call_stack_top = vm_reg.call_stack + vm_reg.call_depth;
+
+    /* the loop increments ip after every instruction, so jumps land right before the target */
+#define JUMP_IF(cond)                                   \
+    if (cond) {                                         \
+        if (ip->target <= ip - code) {                  \
+            if (vm_budget == 0)                         \
+                goto budget_exhausted;                  \
+            vm_budget--;                                \
+        }                                               \
+        ip = code + ip->target - 1;                     \
+    }
+
+    for (;; ip++) {
+        if (is_charged_first(code, ip)) {
+            if (vm_budget == 0)
+                goto budget_exhausted;
+            vm_budget--;
+        }
+        switch (ip->op) {
+        case ROP_MOVI: reg[ip->dst] = ip->arg; break;
+        case ROP_MOVK: reg[ip->dst] = (uint64_t)ip->target << 32 | ip->arg; break;
+        case ROP_MOV: reg[ip->dst] = reg[ip->src1]; break;
+        case ROP_LOADI: reg[ip->dst] = memory[ip->arg]; break;
+        case ROP_LOADADDI: reg[ip->dst] = reg[ip->src1] + memory[ip->arg]; break;
+        case ROP_STOREI: memory[ip->arg] = reg[ip->src1]; break;
+        case ROP_LOAD: reg[ip->dst] = vm_memory_load(memory, paged, reg[ip->src1]); break;
+        case ROP_STORE: vm_memory_store(memory, paged, reg[ip->src1], reg[ip->src2]); break;
+        case ROP_LOAD8: reg[ip->dst] = vm_memory_load8(memory, reg[ip->src1]); break;
+        case ROP_LOAD16: reg[ip->dst] = vm_memory_load16(memory, reg[ip->src1]); break;
+        case ROP_LOAD32: reg[ip->dst] = vm_memory_load32(memory, reg[ip->src1]); break;
+        case ROP_STORE8: vm_memory_store8(memory, reg[ip->src1], reg[ip->src2]); break;
+        case ROP_STORE16: vm_memory_store16(memory, reg[ip->src1], reg[ip->src2]); break;
+        case ROP_STORE32: vm_memory_store32(memory, reg[ip->src1], reg[ip->src2]); break;
+        case ROP_BIT_TEST: reg[ip->dst] = vm_memory_bit_test(memory, reg[ip->src1]); break;
+        case ROP_BIT_SET: vm_memory_bit_set(memory, reg[ip->src1]); break;
+        case ROP_MEMSET:
+            if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->arg]))
+                return ERROR_MEMORY_OUT_OF_BOUNDS;
+            vm_memory_fill(memory + reg[ip->src1], reg[ip->arg], reg[ip->src2]);
+            break;
+        case ROP_MEMCPY:
+            if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->arg]) ||
+                !vm_memory_range_is_valid(reg[ip->src2], reg[ip->arg]))
+                return ERROR_MEMORY_OUT_OF_BOUNDS;
+            vm_memory_copy(memory + reg[ip->src1], memory + reg[ip->src2], reg[ip->arg]);
+            break;
+        case ROP_MEMSUM:
+            if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+                return ERROR_MEMORY_OUT_OF_BOUNDS;
+            reg[ip->dst] = vm_memory_sum(memory + reg[ip->src1], reg[ip->src2]);
+            break;
+        case ROP_MEMMIN:
+            if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+                return ERROR_MEMORY_OUT_OF_BOUNDS;
+            reg[ip->dst] = vm_memory_min(memory + reg[ip->src1], reg[ip->src2]);
+            break;
+        case ROP_MEMMAX:
+            if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+                return ERROR_MEMORY_OUT_OF_BOUNDS;
+            reg[ip->dst] = vm_memory_max(memory + reg[ip->src1], reg[ip->src2]);
+            break;
+        case ROP_MEMCOUNT:
+            if (!vm_memory_range_is_valid(reg[ip->src1], reg[ip->src2]))
+                return ERROR_MEMORY_OUT_OF_BOUNDS;
+            reg[ip->dst] = vm_memory_count(memory + reg[ip->src1], reg[ip->src2]);
+            break;
+        case ROP_ADD: reg[ip->dst] = reg[ip->src1] + reg[ip->src2]; break;
+        case ROP_SUB: reg[ip->dst] = reg[ip->src1] - reg[ip->src2]; break;
+        case ROP_DIV:
+            if (reg[ip->src2] == 0)
+                return ERROR_DIVISION_BY_ZERO;
+            reg[ip->dst] = reg[ip->src1] / reg[ip->src2];
+            break;
+        case ROP_MUL: reg[ip->dst] = reg[ip->src1] * reg[ip->src2]; break;
+        case ROP_EQUAL: reg[ip->dst] = reg[ip->src1] == reg[ip->src2]; break;
+        case ROP_LESS: reg[ip->dst] = reg[ip->src1] < reg[ip->src2]; break;
+        case ROP_LESS_OR_EQUAL: reg[ip->dst] = reg[ip->src1] <= reg[ip->src2]; break;
+        case ROP_GREATER: reg[ip->dst] = reg[ip->src1] > reg[ip->src2]; break;
+        case ROP_GREATER_OR_EQUAL: reg[ip->dst] = reg[ip->src1] >= reg[ip->src2]; break;
+        case ROP_MOD:
+            if (reg[ip->src2] == 0)
+                return ERROR_DIVISION_BY_ZERO;
+            reg[ip->dst] = reg[ip->src1] % reg[ip->src2];
+            break;
+        case ROP_AND: reg[ip->dst] = reg[ip->src1] & reg[ip->src2]; break;
+        case ROP_OR: reg[ip->dst] = reg[ip->src1] | reg[ip->src2]; break;
+        case ROP_XOR: reg[ip->dst] = reg[ip->src1] ^ reg[ip->src2]; break;
+        case ROP_SHL: reg[ip->dst] = reg[ip->src1] << (reg[ip->src2] & 63); break;
+        case ROP_SHR: reg[ip->dst] = reg[ip->src1] >> (reg[ip->src2] & 63); break;
+        case ROP_SAR:
+            reg[ip->dst] = (uint64_t)((int64_t)reg[ip->src1] >> (reg[ip->src2] & 63));
+            break;
+        case ROP_LESS_SIGNED:
+            reg[ip->dst] = (int64_t)reg[ip->src1] < (int64_t)reg[ip->src2];
+            break;
+        case ROP_LESS_OR_EQUAL_SIGNED:
+            reg[ip->dst] = (int64_t)reg[ip->src1] <= (int64_t)reg[ip->src2];
+            break;
+        case ROP_GREATER_SIGNED:
+            reg[ip->dst] = (int64_t)reg[ip->src1] > (int64_t)reg[ip->src2];
+            break;
+        case ROP_GREATER_OR_EQUAL_SIGNED:
+            reg[ip->dst] = (int64_t)reg[ip->src1] >= (int64_t)reg[ip->src2];
+            break;
+        case ROP_NOT: reg[ip->dst] = ~reg[ip->src1]; break;
+        case ROP_ADDI: reg[ip->dst] = reg[ip->src1] + ip->arg; break;
+        case ROP_GREATER_OR_EQUALI: reg[ip->dst] = reg[ip->src1] >= ip->arg; break;
+        case ROP_JUMP: ip = code + ip->target - 1; break;
+        case ROP_JUMP_IF_TRUE: JUMP_IF(reg[ip->src1]); break;
+        case ROP_JUMP_IF_FALSE: JUMP_IF(!reg[ip->src1]); break;
+        case ROP_JUMP_IF_EQUAL: JUMP_IF(reg[ip->src1] == reg[ip->src2]); break;
+        case ROP_JUMP_IF_NOT_EQUAL: JUMP_IF(reg[ip->src1] != reg[ip->src2]); break;
+        case ROP_JUMP_IF_LESS: JUMP_IF(reg[ip->src1] < reg[ip->src2]); break;
+        case ROP_JUMP_IF_LESS_OR_EQUAL: JUMP_IF(reg[ip->src1] <= reg[ip->src2]); break;
+        case ROP_JUMP_IF_GREATER: JUMP_IF(reg[ip->src1] > reg[ip->src2]); break;
+        case ROP_JUMP_IF_GREATER_OR_EQUAL: JUMP_IF(reg[ip->src1] >= reg[ip->src2]); break;
+        case ROP_JUMP_IF_LESS_SIGNED:
+            JUMP_IF((int64_t)reg[ip->src1] < (int64_t)reg[ip->src2]);
+            break;
+        case ROP_JUMP_IF_LESS_OR_EQUAL_SIGNED:
+            JUMP_IF((int64_t)reg[ip->src1] <= (int64_t)reg[ip->src2]);
+            break;
+        case ROP_JUMP_IF_GREATER_SIGNED:
+            JUMP_IF((int64_t)reg[ip->src1] > (int64_t)reg[ip->src2]);
+            break;
+        case ROP_JUMP_IF_GREATER_OR_EQUAL_SIGNED:
+            JUMP_IF((int64_t)reg[ip->src1] >= (int64_t)reg[ip->src2]);
+            break;
+        case ROP_JUMP_IF_LESSI: JUMP_IF(reg[ip->src1] < ip->arg); break;
+        case ROP_JUMP_IF_GREATER_OR_EQUALI: JUMP_IF(reg[ip->src1] >= ip->arg); break;
+        case ROP_CALL:
+            if (call_stack_top == vm_reg.call_stack + CALL_STACK_MAX)
+                return ERROR_CALL_STACK_OVERFLOW;
+            *call_stack_top++ = (reg_frame){.return_instr = ip->arg, .reg_base = reg - vm_reg.reg};
+            reg += ip->dst;
+            ip = code + ip->target - 1;
+            break;
+        case ROP_RET:
+            if (call_stack_top == vm_reg.call_stack)
+                return ERROR_CALL_STACK_UNDERFLOW;
+            call_stack_top--;
+            reg = vm_reg.reg + call_stack_top->reg_base;
+            ip = code + call_stack_top->return_instr - 1;
+            break;
+        case ROP_POP_RES: vm_reg.result = reg[ip->src1]; break;
+        case ROP_PRINT: printf("%" PRIu64 "\n", reg[ip->src1]); break;
+        case ROP_CALLNATIVE:
+            reg[ip->dst] = vm_natives[ip->arg].function(&reg[ip->src1]);
+            break;
+        case ROP_ALLOC: reg[ip->dst] = vm_heap_alloc(paged, reg[ip->src1]); break;
+        case ROP_FREE:
+            if (!vm_heap_free(paged, reg[ip->src1]))
+                return ERROR_INVALID_FREE;
+            break;
+        case ROP_DONE: return SUCCESS;
+        case ROP_ABORT: return ERROR_END_OF_STREAM;
+        case ROP_UNKNOWN_NATIVE: return ERROR_UNKNOWN_NATIVE;
+        default: return ERROR_UNKNOWN_OPCODE;
+        }
+    }
+
+budget_exhausted:
+    vm_reg.ip = ip - code;
+    vm_reg.call_depth = call_stack_top - vm_reg.call_stack;
+    vm_reg.reg_base = reg - vm_reg.reg;
+    return ERROR_BUDGET_EXHAUSTED;
+
+#undef JUMP_IF
+}
+#endif /* COMPUTED_GOTO_SUPPORTED */
+
+uint64_t vm_register_get_result(void)
+{
+    return vm_reg.result;
+}
@@ -0,0 +1,88 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pigletvm.h"
+
+#ifdef _MSC_VER
+#define popen _popen
+#define pclose _pclose
+#define PIPE_MODE "wb"
+#else
+#define PIPE_MODE "w"
+#endif
+
+/* What 'pigletvm serve' answers for program ids it was not given */
+#define SERVE_UNKNOWN_PROGRAM UINT32_MAX
+
+#define JOB_NUM 3
+
+static void write_job(FILE *jobs, uint32_t program_id, const uint64_t *input, uint32_t input_len)
+{
+    uint32_t header[2] = {program_id, input_len};
+    fwrite(header, sizeof(header), 1, jobs);
+    if (input_len)
+        fwrite(input, sizeof(*input), input_len, jobs);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <path/to/pigletvm> <path/to/bytecode>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    vm_image image;
+    if (vm_image_map(argv[2], &image) != IMAGE_OK) {
+        fprintf(stderr, "Failed to load: %s\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+    vm_register_standard_natives();
+
+    /* The served program should behave exactly like the interpreted one */
+    interpret_result expected_res = vm_interpret(image.code);
+    uint64_t expected_value = vm_get_result();
+    vm_image_unmap(&image);
+
+    char replies_path[1024];
+    snprintf(replies_path, sizeof(replies_path), "%s.replies", argv[2]);
+    char command[4096];
+    snprintf(command, sizeof(command), "\"%s\" serve \"%s\" > \"%s\"", argv[1], argv[2],
+             replies_path);
+
+    FILE *jobs = popen(command, PIPE_MODE);
+    assert(jobs);
+    const uint64_t input[2] = {0};
+    write_job(jobs, 0, NULL, 0);
+    write_job(jobs, 0, input, 2);
+    write_job(jobs, 1, NULL, 0);
+    int status = pclose(jobs);
+    assert(status == 0);
+
+    /* Nothing the program prints gets between the results */
+    struct {
+        uint32_t status;
+        uint64_t value;
+    } replies[JOB_NUM];
+    uint8_t data[JOB_NUM * 12 + 1];
+    FILE *file = fopen(replies_path, "rb");
+    assert(file);
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    remove(replies_path);
+    assert(size == JOB_NUM * 12);
+
+    for (size_t job_i = 0; job_i < JOB_NUM; job_i++) {
+        memcpy(&replies[job_i].status, data + job_i * 12, sizeof(replies[job_i].status));
+        memcpy(&replies[job_i].value, data + job_i * 12 + 4, sizeof(replies[job_i].value));
+    }
+    for (size_t job_i = 0; job_i < 2; job_i++) {
+        assert(replies[job_i].status == (uint32_t)expected_res);
+        assert(replies[job_i].value == expected_value);
+    }
+    assert(replies[2].status == SERVE_UNKNOWN_PROGRAM);
+    assert(replies[2].value == 0);
+
+    return EXIT_SUCCESS;
+}
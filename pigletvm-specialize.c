@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pigletvm.h"
+
+#define STACK_MAX 256
+
+/*
+ * Specialization
+ *
+ * A partial evaluator for code run with some memory cells set to the same values every time. Every
+ * basic block is evaluated with a virtual stack of values known at specialization time: pushes of
+ * immediates, constants and constant cells go there instead of into the code, pure ops with known
+ * operands are computed right away, and branches on known conditions turn into jumps or disappear.
+ * Whatever the rest of the code needs gets materialized as pushes right before it, always at the
+ * end of a block, so blocks are entered with nothing known on the stack.
+ *
+ * Blocks no longer reachable are dropped and the rest is laid out again in the original order with
+ * jumps retargeted. The constant pool keeps the original constants at their indices, new wide
+ * values get appended to it.
+ *
+ * A constant cell stored to with STOREI is not constant and does not get folded. Other stores to
+ * constant cells are not looked for: declaring a cell constant is a promise that the code never
+ * writes it.
+ * */
+
+typedef struct specializer {
+    uint8_t *bytecode;
+    vm_analysis analysis;
+
+    /* Sorted by address */
+    const vm_const_cell *cells;
+    size_t cell_num;
+    /* cells STOREI writes to, never folded */
+    bool is_stored[MEMORY_SIZE];
+
+    bool is_reached[MAX_CODE_LEN];
+    uint16_t worklist[MAX_CODE_LEN];
+    size_t worklist_len;
+
+    /* Values known at specialization time on top of the run time stack */
+    uint64_t known[STACK_MAX];
+    size_t known_len;
+
+    /* The output, NULL while looking for reachable blocks */
+    uint8_t *out;
+    size_t out_len;
+    bool is_overflown;
+    /* Block starts in the output */
+    uint16_t new_pc[MAX_CODE_LEN];
+    /* Output positions of jump arguments still holding original targets */
+    uint16_t patches[MAX_CODE_LEN];
+    size_t patch_num;
+
+    uint64_t consts[VM_CONSTS_MAX];
+    size_t consts_len;
+} specializer;
+
+static const vm_const_cell *const_cell(specializer *s, uint16_t addr)
+{
+    if (s->is_stored[addr])
+        return NULL;
+
+    size_t low = 0, high = s->cell_num;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (s->cells[mid].addr < addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < s->cell_num && s->cells[low].addr == addr ? &s->cells[low] : NULL;
+}
+
+static void reach(specializer *s, size_t pc)
+{
+    if (!s->is_reached[pc]) {
+        s->is_reached[pc] = true;
+        s->worklist[s->worklist_len++] = (uint16_t)pc;
+    }
+}
+
+static void emit_byte(specializer *s, uint8_t byte)
+{
+    if (!s->out)
+        return;
+    if (s->out_len == MAX_CODE_LEN) {
+        s->is_overflown = true;
+        return;
+    }
+    s->out[s->out_len++] = byte;
+}
+
+static void emit_op(specializer *s, uint8_t op)
+{
+    emit_byte(s, op);
+}
+
+static void emit_op_arg(specializer *s, uint8_t op, uint16_t arg)
+{
+    emit_byte(s, op);
+    emit_byte(s, (uint8_t)(arg >> 8));
+    emit_byte(s, (uint8_t)arg);
+}
+
+static void emit_jump(specializer *s, uint8_t op, uint16_t target)
+{
+    if (s->out && s->out_len + 3 <= MAX_CODE_LEN)
+        s->patches[s->patch_num++] = (uint16_t)(s->out_len + 1);
+    emit_op_arg(s, op, target);
+}
+
+/* Blocks are laid out in order, a jump to the next block left is a fallthrough */
+static void emit_goto(specializer *s, size_t pc, uint16_t target)
+{
+    size_t next_pc = pc + 1;
+    while (next_pc < target && !s->is_reached[next_pc])
+        next_pc++;
+    if (next_pc != target || target <= pc)
+        emit_jump(s, OP_JUMP, target);
+}
+
+static void emit_push(specializer *s, uint64_t val)
+{
+    if (!s->out)
+        return;
+    if (val <= UINT16_MAX) {
+        emit_op_arg(s, OP_PUSHI, (uint16_t)val);
+        return;
+    }
+
+    size_t const_i = 0;
+    while (const_i < s->consts_len && s->consts[const_i] != val)
+        const_i++;
+    if (const_i == s->consts_len) {
+        if (s->consts_len == VM_CONSTS_MAX) {
+            s->is_overflown = true;
+            return;
+        }
+        s->consts[s->consts_len++] = val;
+    }
+    emit_op_arg(s, OP_PUSHK, (uint16_t)const_i);
+}
+
+/* Put the known values on the run time stack */
+static void materialize(specializer *s)
+{
+    for (size_t known_i = 0; known_i < s->known_len; known_i++)
+        emit_push(s, s->known[known_i]);
+    s->known_len = 0;
+}
+
+static void push_known(specializer *s, uint64_t val)
+{
+    s->known[s->known_len++] = val;
+}
+
+/* Computes a pure op of known operands, false if it has to be left to run time */
+static bool fold(uint8_t op, uint64_t left, uint64_t right, uint64_t *res)
+{
+    switch (op) {
+    case OP_ADD: *res = left + right; return true;
+    case OP_SUB: *res = left - right; return true;
+    case OP_MUL: *res = left * right; return true;
+    /* division by zero stays an error of the run */
+    case OP_DIV: *res = right ? left / right : 0; return right != 0;
+    case OP_MOD: *res = right ? left % right : 0; return right != 0;
+    case OP_AND: *res = left & right; return true;
+    case OP_OR: *res = left | right; return true;
+    case OP_XOR: *res = left ^ right; return true;
+    case OP_SHL: *res = left << (right & 63); return true;
+    case OP_SHR: *res = left >> (right & 63); return true;
+    case OP_SAR: *res = (uint64_t)((int64_t)left >> (right & 63)); return true;
+    case OP_EQUAL: *res = left == right; return true;
+    case OP_LESS: *res = left < right; return true;
+    case OP_LESS_OR_EQUAL: *res = left <= right; return true;
+    case OP_GREATER: *res = left > right; return true;
+    case OP_GREATER_OR_EQUAL: *res = left >= right; return true;
+    case OP_LESS_SIGNED: *res = (int64_t)left < (int64_t)right; return true;
+    case OP_LESS_OR_EQUAL_SIGNED: *res = (int64_t)left <= (int64_t)right; return true;
+    case OP_GREATER_SIGNED: *res = (int64_t)left > (int64_t)right; return true;
+    case OP_GREATER_OR_EQUAL_SIGNED: *res = (int64_t)left >= (int64_t)right; return true;
+    default: return false;
+    }
+}
+
+/* Evaluate a block, emitting it if there is output, and reach the blocks it goes to */
+static void specialize_block(specializer *s, size_t pc)
+{
+    uint8_t *bytecode = s->bytecode;
+    s->known_len = 0;
+    if (s->out)
+        s->new_pc[pc] = (uint16_t)s->out_len;
+
+    for (;;) {
+        uint8_t op = bytecode[pc];
+        size_t len = vm_instruction_len(bytecode, pc);
+        uint16_t arg = vm_instruction_arg(bytecode, pc);
+        size_t next_pc = pc + len;
+        const vm_const_cell *cell = NULL;
+        uint64_t res;
+
+        switch (op) {
+        case OP_PUSHI:
+            push_known(s, arg);
+            goto next;
+        case OP_PUSHK:
+            push_known(s, vm_const_at(bytecode, arg));
+            goto next;
+        case OP_LOADI:
+            if (!(cell = const_cell(s, arg)))
+                break;
+            push_known(s, cell->value);
+            goto next;
+        case OP_LOADADDI:
+            if (!(cell = const_cell(s, arg)))
+                break;
+            if (s->known_len > 0) {
+                s->known[s->known_len - 1] += cell->value;
+            } else if (cell->value <= UINT16_MAX) {
+                emit_op_arg(s, OP_ADDI, (uint16_t)cell->value);
+            } else {
+                emit_push(s, cell->value);
+                emit_op(s, OP_ADD);
+            }
+            goto next;
+        case OP_ADDI:
+            if (s->known_len == 0)
+                break;
+            s->known[s->known_len - 1] += arg;
+            goto next;
+        case OP_GREATER_OR_EQUALI:
+            if (s->known_len == 0)
+                break;
+            s->known[s->known_len - 1] = s->known[s->known_len - 1] >= arg;
+            goto next;
+        case OP_NOT:
+            if (s->known_len == 0)
+                break;
+            s->known[s->known_len - 1] = ~s->known[s->known_len - 1];
+            goto next;
+        case OP_DUP:
+            if (s->known_len == 0)
+                break;
+            push_known(s, s->known[s->known_len - 1]);
+            goto next;
+        case OP_DISCARD:
+            if (s->known_len == 0)
+                break;
+            s->known_len--;
+            goto next;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:{
+            if (s->known_len == 0)
+                break;
+            bool is_taken = (s->known[--s->known_len] != 0) == (op == OP_JUMP_IF_TRUE);
+            if (!is_taken)
+                goto next;
+            materialize(s);
+            emit_goto(s, pc, arg);
+            reach(s, arg);
+            return;
+        }
+        default:
+            if (s->known_len >= 2 &&
+                fold(op, s->known[s->known_len - 2], s->known[s->known_len - 1], &res)) {
+                s->known_len--;
+                s->known[s->known_len - 1] = res;
+                goto next;
+            }
+            /* x + small constant */
+            if (op == OP_ADD && s->known_len == 1 && s->known[0] <= UINT16_MAX) {
+                s->known_len = 0;
+                emit_op_arg(s, OP_ADDI, (uint16_t)s->known[0]);
+                goto next;
+            }
+            break;
+        }
+
+        /* Left to run time, with everything known so far in place */
+        materialize(s);
+        switch (op) {
+        case OP_JUMP:
+            emit_goto(s, pc, arg);
+            reach(s, arg);
+            return;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+            emit_jump(s, op, arg);
+            reach(s, arg);
+            reach(s, next_pc);
+            return;
+        case OP_CALL:
+            emit_jump(s, op, arg);
+            reach(s, arg);
+            /* Callees that never return have no return site */
+            if (s->analysis.depth[next_pc] != VM_UNREACHABLE)
+                reach(s, next_pc);
+            return;
+        default:
+            break;
+        }
+
+        for (size_t byte_i = 0; byte_i < len; byte_i++)
+            emit_byte(s, bytecode[pc + byte_i]);
+        if (op == OP_RET || op == OP_DONE || op == OP_ABORT || op >= OP_NUMBER_OF_OPS)
+            return;
+
+    next:
+        pc = next_pc;
+        if (s->analysis.is_block_start[pc]) {
+            materialize(s);
+            reach(s, pc);
+            return;
+        }
+    }
+}
+
+static int compare_cells(const void *left, const void *right)
+{
+    const vm_const_cell *left_cell = left, *right_cell = right;
+    return (left_cell->addr > right_cell->addr) - (left_cell->addr < right_cell->addr);
+}
+
+analysis_result vm_specialize(uint8_t *bytecode, const vm_const_cell *cells, size_t cell_num,
+                              uint8_t *specialized, size_t *code_len, size_t *consts_len)
+{
+    specializer *s = calloc(1, sizeof(*s));
+    vm_const_cell *sorted = malloc((cell_num ? cell_num : 1) * sizeof(*sorted));
+    if (!s || !sorted) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    analysis_result res = vm_analyze(bytecode, &s->analysis);
+    if (res != ANALYSIS_OK)
+        goto out;
+
+    /* Cells of flat memory only, LOADI cannot reach the rest */
+    size_t sorted_num = 0;
+    for (size_t cell_i = 0; cell_i < cell_num; cell_i++)
+        if (cells[cell_i].addr < MEMORY_SIZE)
+            sorted[sorted_num++] = cells[cell_i];
+    qsort(sorted, sorted_num, sizeof(*sorted), compare_cells);
+    s->bytecode = bytecode;
+    s->cells = sorted;
+    s->cell_num = sorted_num;
+
+    /* Original constants keep their indices */
+    for (size_t pc = 0; pc < MAX_CODE_LEN; pc++) {
+        if (s->analysis.depth[pc] == VM_UNREACHABLE)
+            continue;
+        if (bytecode[pc] == OP_STOREI)
+            s->is_stored[ARG_AT_PC(bytecode, pc)] = true;
+        if (bytecode[pc] == OP_PUSHK) {
+            size_t const_i = ARG_AT_PC(bytecode, pc) & (VM_CONSTS_MAX - 1);
+            if (const_i + 1 > s->consts_len)
+                s->consts_len = const_i + 1;
+        }
+    }
+    for (size_t const_i = 0; const_i < s->consts_len; const_i++)
+        s->consts[const_i] = vm_const_at(bytecode, const_i);
+
+    /* Find the blocks still reachable, then emit them in their original order */
+    reach(s, 0);
+    while (s->worklist_len > 0)
+        specialize_block(s, s->worklist[--s->worklist_len]);
+
+    memset(specialized, 0, MAX_CODE_LEN);
+    s->out = specialized;
+    for (size_t pc = 0; pc < MAX_CODE_LEN && !s->is_overflown; pc++)
+        if (s->is_reached[pc])
+            specialize_block(s, pc);
+    s->worklist_len = 0;
+
+    if (s->is_overflown || s->out_len > MAX_CODE_LEN - s->consts_len * 8) {
+        res = ANALYSIS_ERROR_CODE_OVERFLOW;
+        goto out;
+    }
+
+    for (size_t patch_i = 0; patch_i < s->patch_num; patch_i++) {
+        uint8_t *arg = specialized + s->patches[patch_i];
+        uint16_t target = s->new_pc[((uint16_t)arg[0] << 8) + arg[1]];
+        arg[0] = (uint8_t)(target >> 8);
+        arg[1] = (uint8_t)target;
+    }
+    for (size_t const_i = 0; const_i < s->consts_len; const_i++)
+        vm_const_set(specialized, const_i, s->consts[const_i]);
+
+    if (code_len)
+        *code_len = s->out_len;
+    if (consts_len)
+        *consts_len = s->consts_len;
+
+out:
+    free(sorted);
+    free(s);
+    return res;
+}
+
+
+/*
+ * Specialized code cache
+ *
+ * A hash table of constant sets, chained. Sets are kept sorted by address, so the order cells are
+ * given in does not matter.
+ * */
+
+#define CACHE_BUCKETS 64
+
+typedef struct cache_entry {
+    uint64_t hash;
+    vm_const_cell *cells;
+    size_t cell_num;
+    /* NULL if the code could not be specialized */
+    uint8_t *bytecode;
+    struct cache_entry *next;
+} cache_entry;
+
+struct vm_specializer {
+    uint8_t bytecode[MAX_CODE_LEN];
+    cache_entry *buckets[CACHE_BUCKETS];
+    size_t entry_num;
+};
+
+static void *checked_malloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static bool cells_are_equal(const vm_const_cell *left, const vm_const_cell *right, size_t cell_num)
+{
+    for (size_t cell_i = 0; cell_i < cell_num; cell_i++)
+        if (left[cell_i].addr != right[cell_i].addr || left[cell_i].value != right[cell_i].value)
+            return false;
+    return true;
+}
+
+static uint64_t cells_hash(const vm_const_cell *cells, size_t cell_num)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t cell_i = 0; cell_i < cell_num; cell_i++) {
+        hash = (hash ^ cells[cell_i].addr) * 0x100000001b3ULL;
+        hash = (hash ^ cells[cell_i].value) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+vm_specializer *vm_specializer_new(const uint8_t *bytecode)
+{
+    vm_specializer *specializer = checked_malloc(sizeof(*specializer));
+    memset(specializer, 0, sizeof(*specializer));
+    memcpy(specializer->bytecode, bytecode, MAX_CODE_LEN);
+    return specializer;
+}
+
+void vm_specializer_free(vm_specializer *specializer)
+{
+    for (size_t bucket_i = 0; bucket_i < CACHE_BUCKETS; bucket_i++) {
+        cache_entry *entry = specializer->buckets[bucket_i];
+        while (entry) {
+            cache_entry *next = entry->next;
+            free(entry->cells);
+            free(entry->bytecode);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(specializer);
+}
+
+uint8_t *vm_specializer_get(vm_specializer *specializer, const vm_const_cell *cells,
+                            size_t cell_num)
+{
+    vm_const_cell *sorted = checked_malloc(cell_num * sizeof(*sorted));
+    if (cell_num)
+        memcpy(sorted, cells, cell_num * sizeof(*sorted));
+    qsort(sorted, cell_num, sizeof(*sorted), compare_cells);
+    uint64_t hash = cells_hash(sorted, cell_num);
+
+    cache_entry **bucket = &specializer->buckets[hash % CACHE_BUCKETS];
+    for (cache_entry *entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->cell_num == cell_num &&
+            cells_are_equal(entry->cells, sorted, cell_num)) {
+            free(sorted);
+            return entry->bytecode;
+        }
+    }
+
+    cache_entry *entry = checked_malloc(sizeof(*entry));
+    entry->hash = hash;
+    entry->cells = sorted;
+    entry->cell_num = cell_num;
+    entry->bytecode = checked_malloc(MAX_CODE_LEN);
+    if (vm_specialize(specializer->bytecode, sorted, cell_num, entry->bytecode, NULL, NULL) !=
+        ANALYSIS_OK) {
+        free(entry->bytecode);
+        entry->bytecode = NULL;
+    }
+    entry->next = *bucket;
+    *bucket = entry;
+    specializer->entry_num++;
+    return entry->bytecode;
+}
+
+size_t vm_specializer_size(const vm_specializer *specializer)
+{
+    return specializer->entry_num;
+}
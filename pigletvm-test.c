@@ -1,9 +1,40 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pigletvm.h"
 
+static uint64_t test_native_mul_add(const uint64_t *args)
+{
+    return args[0] * args[1] + args[2];
+}
+
+static uint64_t test_native_answer(const uint64_t *args)
+{
+    (void) args;
+    return 42;
+}
+
+/* Run the code refilling the budget after every stop, returns the number of stops */
+static size_t run_with_budget(uint8_t *code, interpret_result (*interpret)(uint8_t *bytecode),
+                              interpret_result (*resume)(void), uint64_t budget)
+{
+    size_t stops = 0;
+
+    vm_budget = budget;
+    interpret_result result = interpret(code);
+    while (result == ERROR_BUDGET_EXHAUSTED) {
+        stops++;
+        vm_budget = budget;
+        result = resume();
+    }
+    assert(result == SUCCESS);
+
+    vm_budget = VM_BUDGET_UNLIMITED;
+    return stops;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -27,6 +58,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 0);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 0);
     }
 
     {
@@ -44,6 +79,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == ERROR_END_OF_STREAM);
         assert(vm_trace_get_result() == 0);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_END_OF_STREAM);
+        assert(vm_register_get_result() == 0);
     }
 
     {
@@ -61,6 +100,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 5);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 5);
     }
 
     {
@@ -84,6 +127,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 10);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 10);
     }
 
     {
@@ -106,6 +153,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 5);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 5);
     }
 
     {
@@ -122,6 +173,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 15);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 15);
     }
 
     {
@@ -138,6 +193,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 15);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 15);
     }
 
     {
@@ -160,6 +219,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 111);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 111);
     }
 
     {
@@ -183,6 +246,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 114);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 114);
     }
 
     {
@@ -199,6 +266,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 4);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 4);
     }
 
     {
@@ -215,6 +286,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 2);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 2);
     }
 
     {
@@ -233,6 +308,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 20);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 20);
     }
 
     {
@@ -257,6 +336,10 @@ int main(int argc, char *argv[])
         vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 112);
+
+        vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 112);
     }
 
     {
@@ -281,6 +364,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 28);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 28);
     }
 
     {
@@ -293,8 +380,23 @@ int main(int argc, char *argv[])
         result = vm_interpret_threaded(code);
         assert(result == ERROR_DIVISION_BY_ZERO);
 
+        result = vm_interpret_no_range_check(code);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+
         result = vm_interpret_trace(code);
         assert(result == ERROR_DIVISION_BY_ZERO);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_DIVISION_BY_ZERO);
     }
 
     {
@@ -325,6 +427,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 4);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 4);
     }
 
     {
@@ -348,6 +454,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
     }
 
     {
@@ -371,6 +481,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 0);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 0);
     }
 
 
@@ -395,6 +509,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
     }
 
     {
@@ -418,6 +536,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
     }
 
     {
@@ -441,6 +563,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
     }
 
     {
@@ -464,6 +590,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
     }
 
     {
@@ -486,6 +616,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
     }
 
     {
@@ -509,6 +643,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 2);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 2);
     }
 
 
@@ -538,6 +676,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 13);
+
+        /* The stack depth at the join point depends on the branch taken */
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_INVALID_BYTECODE);
     }
 
     {
@@ -566,6 +708,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 2);
+
+        /* The stack depth at the join point depends on the branch taken */
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_INVALID_BYTECODE);
     }
 
     {
@@ -594,6 +740,10 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 13);
+
+        /* The stack depth at the join point depends on the branch taken */
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_INVALID_BYTECODE);
     }
 
     {
@@ -622,6 +772,2037 @@ int main(int argc, char *argv[])
         result = vm_interpret_trace(code);
         assert(result == SUCCESS);
         assert(vm_trace_get_result() == 2);
+
+        /* The stack depth at the join point depends on the branch taken */
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_INVALID_BYTECODE);
+    }
+
+    {
+        /* Modify a duplicate, the original should stay intact */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_DUP,
+            OP_ADDI, ENCODE_ARG(1),
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 11);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 11);
+    }
+
+    {
+        /* A duplicate crossing a block boundary */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(7),
+            OP_DUP,
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_JUMP_IF_TRUE, ENCODE_ARG(13),
+            OP_ADDI, ENCODE_ARG(1),
+
+            /* jump here (byte No 13)*/
+            OP_MUL,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 49);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 49);
+    }
+
+    {
+        /* Stack depth differs depending on the path taken, cannot be translated into registers */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_JUMP_IF_TRUE, ENCODE_ARG(9),
+            OP_PUSHI, ENCODE_ARG(1),
+
+            /* jump here (byte No 9)*/
+            OP_DONE
+        };
+
+        interpret_result result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_INVALID_BYTECODE);
+    }
+
+    {
+        /* Memory cells promoted to registers in traces, accessed by dynamic addresses as well */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(3),
+            OP_STOREI, ENCODE_ARG(5),
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_PUSHI, ENCODE_ARG(4),
+            OP_STORE,
+            OP_LOADI, ENCODE_ARG(5),
+            OP_LOADADDI, ENCODE_ARG(5),
+            OP_STOREI, ENCODE_ARG(5),
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_JUMP_IF_TRUE, ENCODE_ARG(28),
+
+            /* jump here (byte No 28), a new trace promotes another cell */
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_LOAD,
+            OP_STOREI, ENCODE_ARG(6),
+            OP_LOADI, ENCODE_ARG(6),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 8);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 8);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 8);
+    }
+
+    {
+        /* Call a function */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_CALL, ENCODE_ARG(8),
+            OP_POP_RES,
+            OP_DONE,
+
+            /* square the top of the stack (byte No 8) */
+            OP_DUP,
+            OP_MUL,
+            OP_RET
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 25);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 25);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 25);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 25);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 25);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 25);
+    }
+
+    {
+        /* Nested calls in a loop, traces inline the callees */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(0),
+
+            /* loop (byte No 3) */
+            OP_CALL, ENCODE_ARG(15),
+            OP_DUP,
+            OP_GREATER_OR_EQUALI, ENCODE_ARG(300),
+            OP_JUMP_IF_FALSE, ENCODE_ARG(3),
+            OP_POP_RES,
+            OP_DONE,
+
+            /* add 3 (byte No 15) */
+            OP_CALL, ENCODE_ARG(22),
+            OP_ADDI, ENCODE_ARG(2),
+            OP_RET,
+
+            /* add 1 (byte No 22) */
+            OP_ADDI, ENCODE_ARG(1),
+            OP_RET
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 300);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 300);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 300);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 300);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 300);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 300);
+    }
+
+    {
+        /* One function called with different depths of stack below its argument */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(3),
+            OP_CALL, ENCODE_ARG(15),
+            OP_PUSHI, ENCODE_ARG(4),
+            OP_CALL, ENCODE_ARG(15),
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE,
+
+            /* square the top of the stack (byte No 15) */
+            OP_DUP,
+            OP_MUL,
+            OP_RET
+        };
+
+        /* Depths count from the argument, the deeper call stacks the square's frame higher */
+        vm_analysis analysis;
+        analysis_result res = vm_analyze(code, &analysis);
+        assert(res == ANALYSIS_OK);
+        assert(analysis.depth[15] == 1 && analysis.depth[16] == 2);
+        assert(analysis.func[15] == 15 && analysis.func[12] == 0);
+        assert(analysis.depth[6] == 1 && analysis.depth[12] == 2);
+        assert(analysis.max_depth == 3);
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 25);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 25);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 25);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 25);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 25);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 25);
+
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == 25);
+        pvm_context_free(context);
+        pvm_program_free(program);
+    }
+
+    {
+        /* A run stopped by the budget inside a function resumes with the function's frame */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(7),
+            OP_PUSHI, ENCODE_ARG(4),
+            OP_CALL, ENCODE_ARG(12),
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE,
+
+            /* sum 1..n (byte No 12) */
+            OP_STOREI, ENCODE_ARG(1),
+            OP_PUSHI, ENCODE_ARG(0),
+            /* loop (byte No 18) */
+            OP_LOADADDI, ENCODE_ARG(1),
+            OP_LOADI, ENCODE_ARG(1),
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_SUB,
+            OP_DUP,
+            OP_STOREI, ENCODE_ARG(1),
+            OP_JUMP_IF_TRUE, ENCODE_ARG(18),
+            OP_RET
+        };
+
+        size_t stop_num = run_with_budget(code, vm_interpret, vm_interpret_resume, 1);
+        assert(stop_num == 2);
+        assert(vm_get_result() == 17);
+
+        stop_num = run_with_budget(code, vm_register_interpret_threaded,
+                                   vm_register_interpret_threaded_resume, 1);
+        assert(stop_num == 2);
+        assert(vm_register_get_result() == 17);
+    }
+
+    {
+        /* A function taking more than its callers have, and recursion growing the stack */
+        uint8_t underflow[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_CALL, ENCODE_ARG(7),
+            OP_DONE,
+
+            /* add two cells (byte No 7) */
+            OP_ADD,
+            OP_RET
+        };
+        vm_analysis analysis;
+        analysis_result res = vm_analyze(underflow, &analysis);
+        assert(res == ANALYSIS_ERROR_STACK_UNDERFLOW);
+        assert(analysis.error_pc == 3);
+
+        uint8_t overflow[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_CALL, ENCODE_ARG(0)
+        };
+        res = vm_analyze(overflow, &analysis);
+        assert(res == ANALYSIS_ERROR_STACK_OVERFLOW);
+        assert(analysis.error_pc == 3);
+    }
+
+    {
+        /* Endless recursion */
+        uint8_t code[] = {
+            OP_CALL, ENCODE_ARG(0)
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_CALL_STACK_OVERFLOW);
+
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_CALL_STACK_OVERFLOW);
+
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_CALL_STACK_OVERFLOW);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_CALL_STACK_OVERFLOW);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_CALL_STACK_OVERFLOW);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_CALL_STACK_OVERFLOW);
+    }
+
+    {
+        /* Return without a call */
+        uint8_t code[] = {
+            OP_RET
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_CALL_STACK_UNDERFLOW);
+
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_CALL_STACK_UNDERFLOW);
+
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_CALL_STACK_UNDERFLOW);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_CALL_STACK_UNDERFLOW);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_CALL_STACK_UNDERFLOW);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_CALL_STACK_UNDERFLOW);
+    }
+
+    {
+        /* Sized memory ops truncate stored values, bits are set and tested */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_PUSHI, ENCODE_ARG(0x1ff),
+            OP_STORE8,
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_LOAD8,
+            OP_PUSHI, ENCODE_ARG(3),
+            OP_PUSHI, ENCODE_ARG(0xbeef),
+            OP_STORE16,
+            OP_PUSHI, ENCODE_ARG(3),
+            OP_LOAD16,
+            OP_ADD,
+            OP_PUSHI, ENCODE_ARG(7),
+            OP_PUSHI, ENCODE_ARG(0xffff),
+            OP_STORE32,
+            OP_PUSHI, ENCODE_ARG(7),
+            OP_LOAD32,
+            OP_ADD,
+            OP_PUSHI, ENCODE_ARG(100),
+            OP_BIT_SET,
+            OP_PUSHI, ENCODE_ARG(100),
+            OP_BIT_TEST,
+            OP_ADD,
+            OP_PUSHI, ENCODE_ARG(101),
+            OP_BIT_TEST,
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 114670);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 114670);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 114670);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 114670);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 114670);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 114670);
+    }
+
+    {
+        /* A byte store changes the cell it belongs to, promoted cells included */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(0),
+            OP_STOREI, ENCODE_ARG(0),
+            OP_PUSHI, ENCODE_ARG(0),
+            OP_PUSHI, ENCODE_ARG(7),
+            OP_STORE8,
+            OP_LOADI, ENCODE_ARG(0),
+            OP_PUSHI, ENCODE_ARG(0),
+            OP_GREATER,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 1);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 1);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 1);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 1);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 1);
+    }
+
+    {
+        /* Bulk ops: fill, copy, then fold the copy with a couple of cells changed */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(290),
+            OP_PUSHI, ENCODE_ARG(0),
+            OP_PUSHI, ENCODE_ARG(10),
+            OP_MEMSET,
+            OP_PUSHI, ENCODE_ARG(100),
+            OP_PUSHI, ENCODE_ARG(3),
+            OP_PUSHI, ENCODE_ARG(100),
+            OP_MEMSET,
+            OP_PUSHI, ENCODE_ARG(300),
+            OP_PUSHI, ENCODE_ARG(100),
+            OP_PUSHI, ENCODE_ARG(50),
+            OP_MEMCPY,
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_STOREI, ENCODE_ARG(310),
+            OP_PUSHI, ENCODE_ARG(9),
+            OP_STOREI, ENCODE_ARG(320),
+            /* sum: 48 * 3 + 1 + 9 */
+            OP_PUSHI, ENCODE_ARG(300),
+            OP_PUSHI, ENCODE_ARG(50),
+            OP_MEMSUM,
+            /* min * 1000 */
+            OP_PUSHI, ENCODE_ARG(300),
+            OP_PUSHI, ENCODE_ARG(50),
+            OP_MEMMIN,
+            OP_PUSHI, ENCODE_ARG(1000),
+            OP_MUL,
+            OP_ADD,
+            /* max * 10000 */
+            OP_PUSHI, ENCODE_ARG(300),
+            OP_PUSHI, ENCODE_ARG(50),
+            OP_MEMMAX,
+            OP_PUSHI, ENCODE_ARG(10000),
+            OP_MUL,
+            OP_ADD,
+            /* nonzero cells * 1000000, the 10 cleared ones not counted */
+            OP_PUSHI, ENCODE_ARG(290),
+            OP_PUSHI, ENCODE_ARG(60),
+            OP_MEMCOUNT,
+            OP_PUSHI, ENCODE_ARG(1000),
+            OP_MUL,
+            OP_PUSHI, ENCODE_ARG(1000),
+            OP_MUL,
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 50091154);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 50091154);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 50091154);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 50091154);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 50091154);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 50091154);
+    }
+
+    {
+        /* A range running past the end of memory */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(65530),
+            OP_PUSHI, ENCODE_ARG(10),
+            OP_MEMSUM,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_MEMORY_OUT_OF_BOUNDS);
+
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_MEMORY_OUT_OF_BOUNDS);
+
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_MEMORY_OUT_OF_BOUNDS);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_MEMORY_OUT_OF_BOUNDS);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_MEMORY_OUT_OF_BOUNDS);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_MEMORY_OUT_OF_BOUNDS);
+    }
+
+    {
+        /* Native functions get their arguments in place, the deepest one first */
+        bool is_registered = vm_register_native(10, test_native_mul_add, 3);
+        assert(is_registered);
+        is_registered = vm_register_native(11, test_native_answer, 0);
+        assert(is_registered);
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(6),
+            OP_PUSHI, ENCODE_ARG(7),
+            OP_PUSHI, ENCODE_ARG(8),
+            OP_CALLNATIVE, ENCODE_ARG(10),
+            OP_CALLNATIVE, ENCODE_ARG(11),
+            OP_ADD,
+            /* arguments aliasing the same register */
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_DUP,
+            OP_DUP,
+            OP_CALLNATIVE, ENCODE_ARG(10),
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 122);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 122);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 122);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 122);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 122);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 122);
+    }
+
+    {
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_CALLNATIVE, ENCODE_ARG(200),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_UNKNOWN_NATIVE);
+
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_UNKNOWN_NATIVE);
+
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_UNKNOWN_NATIVE);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_UNKNOWN_NATIVE);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_UNKNOWN_NATIVE);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_UNKNOWN_NATIVE);
+    }
+
+    {
+        /* Fibers take turns incrementing a shared counter until it reaches 30, each one sums the
+         * values it got */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(0),
+            /* 3 */
+            OP_LOADI, ENCODE_ARG(0),
+            OP_ADDI, ENCODE_ARG(1),
+            OP_DUP,
+            OP_STOREI, ENCODE_ARG(0),
+            OP_ADD,
+            OP_YIELD,
+            OP_LOADI, ENCODE_ARG(0),
+            OP_GREATER_OR_EQUALI, ENCODE_ARG(30),
+            OP_JUMP_IF_FALSE, ENCODE_ARG(3),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *fibers[3];
+        for (size_t fiber_i = 0; fiber_i < 3; fiber_i++)
+            fibers[fiber_i] = vm_fiber_spawn(scheduler, code);
+
+        /* Fiber k gets 3 * (round - 1) + k + 1 in every round */
+        vm_scheduler_run(scheduler);
+        for (size_t fiber_i = 0; fiber_i < 3; fiber_i++) {
+            assert(vm_fiber_is_finished(fibers[fiber_i]));
+            assert(vm_fiber_status(fibers[fiber_i]) == SUCCESS);
+            assert(vm_fiber_result(fibers[fiber_i]) == 145 + 10 * fiber_i);
+        }
+        assert(vm_scheduler_memory(scheduler)[0] == 30);
+        vm_scheduler_free(scheduler);
+
+        /* A single instance gets all the numbers */
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 465);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 465);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == 465);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 465);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 465);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 465);
+    }
+
+    {
+        /* Fibers are not run guarded, division by zero fails the fiber in any build */
+        uint8_t div[] = {
+            OP_PUSHI, ENCODE_ARG(10), OP_PUSHI, ENCODE_ARG(0), OP_DIV, OP_POP_RES, OP_DONE
+        };
+        uint8_t mod[] = {
+            OP_PUSHI, ENCODE_ARG(10), OP_PUSHI, ENCODE_ARG(0), OP_MOD, OP_POP_RES, OP_DONE
+        };
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *div_fiber = vm_fiber_spawn(scheduler, div);
+        vm_fiber *mod_fiber = vm_fiber_spawn(scheduler, mod);
+        vm_scheduler_run(scheduler);
+        assert(vm_fiber_is_finished(div_fiber) && vm_fiber_is_finished(mod_fiber));
+        assert(vm_fiber_status(div_fiber) == ERROR_DIVISION_BY_ZERO);
+        assert(vm_fiber_status(mod_fiber) == ERROR_DIVISION_BY_ZERO);
+        vm_scheduler_free(scheduler);
+    }
+
+    {
+        /* Sum 1..100, the loop jump executes 100 times */
+        uint8_t code[] = {
+            /* 0 */
+            OP_LOADI, ENCODE_ARG(1),
+            OP_ADDI, ENCODE_ARG(1),
+            OP_DUP,
+            OP_STOREI, ENCODE_ARG(1),
+            OP_LOADADDI, ENCODE_ARG(0),
+            OP_STOREI, ENCODE_ARG(0),
+            OP_LOADI, ENCODE_ARG(1),
+            OP_GREATER_OR_EQUALI, ENCODE_ARG(100),
+            OP_JUMP_IF_FALSE, ENCODE_ARG(0),
+            OP_LOADI, ENCODE_ARG(0),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        /* Stops right before the 11th, 21st, ... 91st jump */
+        size_t stop_num = run_with_budget(code, vm_interpret, vm_interpret_resume, 10);
+        assert(stop_num == 9);
+        assert(vm_get_result() == 5050);
+
+        stop_num = run_with_budget(code, vm_interpret_threaded, vm_interpret_threaded_resume, 10);
+        assert(stop_num == 9);
+        assert(vm_get_result() == 5050);
+
+        /* Traces only pay when going back to an earlier trace */
+        stop_num = run_with_budget(code, vm_interpret_trace, vm_interpret_trace_resume, 10);
+        assert(stop_num > 0);
+        assert(vm_trace_get_result() == 5050);
+
+        stop_num = run_with_budget(code, vm_rcache_interpret, vm_rcache_interpret_resume, 10);
+        assert(stop_num == 9);
+        assert(vm_rcache_get_result() == 5050);
+
+        stop_num = run_with_budget(code, vm_rcache_interpret_trace,
+                                   vm_rcache_interpret_trace_resume, 10);
+        assert(stop_num > 0);
+        assert(vm_rcache_trace_get_result() == 5050);
+
+        stop_num = run_with_budget(code, vm_register_interpret_threaded,
+                                   vm_register_interpret_threaded_resume, 10);
+        assert(stop_num == 9);
+        assert(vm_register_get_result() == 5050);
+    }
+
+    {
+        /* A do-while loop: the backward branch is taken 4 times, falling through costs nothing */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_STOREI, ENCODE_ARG(0),
+            /* 6 */
+            OP_LOADI, ENCODE_ARG(1),
+            OP_ADDI, ENCODE_ARG(1),
+            OP_STOREI, ENCODE_ARG(1),
+            OP_LOADI, ENCODE_ARG(0),
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_SUB,
+            OP_DUP,
+            OP_STOREI, ENCODE_ARG(0),
+            OP_JUMP_IF_TRUE, ENCODE_ARG(6),
+            OP_LOADI, ENCODE_ARG(1),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        vm_budget = 4;
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 5);
+        assert(vm_budget == 0);
+
+        vm_budget = 4;
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 5);
+        assert(vm_budget == 0);
+
+        vm_budget = 4;
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == 5);
+        assert(vm_budget == 0);
+
+        vm_budget = 4;
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 5);
+        assert(vm_budget == 0);
+        vm_budget = VM_BUDGET_UNLIMITED;
+
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        pvm_context_set_budget(context, 4);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == 5);
+        pvm_context_free(context);
+        pvm_program_free(program);
+
+        /* One short: the run stops at the branch with its condition still to be tested */
+        size_t stop_num = run_with_budget(code, vm_interpret, vm_interpret_resume, 3);
+        assert(stop_num == 1);
+        assert(vm_get_result() == 5);
+
+        stop_num = run_with_budget(code, vm_rcache_interpret, vm_rcache_interpret_resume, 3);
+        assert(stop_num == 1);
+        assert(vm_rcache_get_result() == 5);
+
+        stop_num = run_with_budget(code, vm_register_interpret_threaded,
+                                   vm_register_interpret_threaded_resume, 3);
+        assert(stop_num == 1);
+        assert(vm_register_get_result() == 5);
+    }
+
+    {
+        /* An endless loop stops once the budget is gone */
+        uint8_t code[] = {
+            OP_JUMP, ENCODE_ARG(0),
+        };
+
+        vm_budget = 1000;
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_BUDGET_EXHAUSTED);
+
+        vm_budget = 1000;
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_BUDGET_EXHAUSTED);
+
+        vm_budget = 1000;
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_BUDGET_EXHAUSTED);
+
+        vm_budget = 1000;
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_BUDGET_EXHAUSTED);
+
+        vm_budget = 1000;
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_BUDGET_EXHAUSTED);
+
+        vm_budget = 1000;
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_BUDGET_EXHAUSTED);
+
+        vm_budget = VM_BUDGET_UNLIMITED;
+    }
+
+    {
+        /* A fiber busy waiting for another one without yielding gets preempted */
+        uint8_t waiter[] = {
+            OP_LOADI, ENCODE_ARG(1),
+            OP_JUMP_IF_FALSE, ENCODE_ARG(0),
+            OP_DONE
+        };
+        uint8_t setter[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_STOREI, ENCODE_ARG(1),
+            OP_DONE
+        };
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_scheduler_set_slice(scheduler, 100);
+        vm_fiber *waiting = vm_fiber_spawn(scheduler, waiter);
+        vm_fiber *setting = vm_fiber_spawn(scheduler, setter);
+        vm_scheduler_run(scheduler);
+        assert(vm_fiber_status(waiting) == SUCCESS);
+        assert(vm_fiber_status(setting) == SUCCESS);
+        vm_scheduler_free(scheduler);
+    }
+
+    {
+        /* A translated program runs many times on different inputs */
+        uint8_t code[] = {
+            OP_LOADI, ENCODE_ARG(0),
+            OP_LOADADDI, ENCODE_ARG(1),
+            OP_DUP,
+            OP_STOREI, ENCODE_ARG(1),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        vm_register_program *program = vm_register_program_new(code);
+        assert(program);
+
+        uint64_t input[] = {40, 2};
+        interpret_result result = vm_register_program_run(program, input, 2);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 42);
+
+        /* memory left over from the previous run is gone */
+        result = vm_register_program_run(program, input, 1);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == 40);
+
+        vm_register_program_free(program);
+
+        uint8_t invalid[] = {
+            OP_DISCARD,
+            OP_DONE
+        };
+        vm_register_program *invalid_program = vm_register_program_new(invalid);
+        assert(!invalid_program);
+    }
+
+    {
+        /* Runaway pushes hit the guard page instead of the memory next to the stack */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_JUMP, ENCODE_ARG(0),
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_interpret_no_range_check(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_rcache_interpret_no_range_check(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_STACK_OVERFLOW);
+
+        /* the register engine rejects code with unbounded stack depths up front */
+        result = vm_register_interpret_threaded(code);
+        assert(result == ERROR_INVALID_BYTECODE);
+
+        /* the vms are still usable afterwards */
+        uint8_t ok[] = {
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_POP_RES,
+            OP_DONE
+        };
+        result = vm_interpret(ok);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 5);
+
+        result = vm_rcache_interpret_trace(ok);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == 5);
+    }
+
+    {
+        /* Popping off an empty stack */
+        uint8_t code[] = {
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == ERROR_STACK_UNDERFLOW);
+
+        result = vm_interpret_threaded(code);
+        assert(result == ERROR_STACK_UNDERFLOW);
+
+        result = vm_interpret_trace(code);
+        assert(result == ERROR_STACK_UNDERFLOW);
+
+        result = vm_rcache_interpret(code);
+        assert(result == ERROR_STACK_UNDERFLOW);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == ERROR_STACK_UNDERFLOW);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == ERROR_STACK_UNDERFLOW);
+    }
+
+    {
+        /* Embedding: one verified program, contexts with memory of their own or bound to the
+         * caller's cells */
+        uint8_t code[] = {
+            /* 0 */
+            OP_LOADI, ENCODE_ARG(1),
+            OP_ADDI, ENCODE_ARG(1),
+            OP_DUP,
+            OP_STOREI, ENCODE_ARG(1),
+            OP_LOADADDI, ENCODE_ARG(0),
+            OP_STOREI, ENCODE_ARG(0),
+            OP_LOADI, ENCODE_ARG(1),
+            OP_GREATER_OR_EQUALI, ENCODE_ARG(100),
+            OP_JUMP_IF_FALSE, ENCODE_ARG(0),
+            OP_LOADI, ENCODE_ARG(0),
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        analysis_result error;
+        pvm_program *program = pvm_program_new(code, sizeof(code), &error);
+        assert(program);
+        assert(error == ANALYSIS_OK);
+
+        pvm_context *context = pvm_context_new();
+        interpret_result result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == 5050);
+        assert(pvm_context_memory(context)[0] == 5050);
+
+        /* the program writes straight into bound cells, a second sum starts from the first */
+        uint64_t *cells = calloc(MEMORY_SIZE, sizeof(*cells));
+        assert(cells);
+        pvm_context_bind_memory(context, cells);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(cells[0] == 5050 && cells[1] == 100);
+
+        cells[1] = 0;
+        result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == 10100);
+
+        /* stops right before the 11th, 21st, ... 91st jump, the same as the vm_ engines */
+        pvm_context *budgeted = pvm_context_new();
+        size_t stops = 0;
+        pvm_context_set_budget(budgeted, 10);
+        result = pvm_run(budgeted, program, PVM_ENGINE_THREADED);
+        while (result == ERROR_BUDGET_EXHAUSTED) {
+            stops++;
+            pvm_context_set_budget(budgeted, 10);
+            result = pvm_resume(budgeted);
+        }
+        assert(result == SUCCESS);
+        assert(stops == 9);
+        assert(pvm_context_result(budgeted) == 5050);
+
+        /* contexts do not share memory */
+        assert(pvm_context_memory(budgeted)[0] == 5050);
+        pvm_context_bind_memory(context, NULL);
+        assert(pvm_context_memory(context)[0] == 5050);
+
+        pvm_context_free(budgeted);
+        pvm_context_free(context);
+        free(cells);
+        pvm_program_free(program);
+
+        uint8_t invalid[] = {
+            OP_DISCARD,
+            OP_DONE
+        };
+        pvm_program *invalid_program = pvm_program_new(invalid, sizeof(invalid), &error);
+        assert(!invalid_program);
+        assert(error == ANALYSIS_ERROR_STACK_UNDERFLOW);
+    }
+
+    {
+        /* Failing runs of library contexts */
+        uint8_t code[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_PUSHI, ENCODE_ARG(0),
+            OP_DIV,
+            OP_POP_RES,
+            OP_DONE
+        };
+        uint8_t unknown[] = {
+            OP_NUMBER_OF_OPS
+        };
+
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        pvm_program *unknown_program = pvm_program_new(unknown, sizeof(unknown), NULL);
+        assert(program && unknown_program);
+
+        pvm_context *context = pvm_context_new();
+        interpret_result result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+        result = pvm_run(context, unknown_program, PVM_ENGINE_SWITCH);
+        assert(result == ERROR_UNKNOWN_OPCODE);
+        result = pvm_run(context, unknown_program, PVM_ENGINE_THREADED);
+        assert(result == ERROR_UNKNOWN_OPCODE);
+
+        pvm_context_free(context);
+        pvm_program_free(unknown_program);
+        pvm_program_free(program);
+    }
+
+    {
+        /* Images carry the analysis results, corruption gets caught */
+        uint8_t code[] = {
+            /* 0 */
+            OP_PUSHI, ENCODE_ARG(3),
+            /* 3 */
+            OP_DUP,
+            OP_JUMP_IF_FALSE, ENCODE_ARG(14),
+            /* 7 */
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_SUB,
+            OP_JUMP, ENCODE_ARG(3),
+            /* 14 */
+            OP_POP_RES,
+            OP_DONE
+        };
+
+        FILE *file = tmpfile();
+        assert(file);
+        analysis_result written = vm_image_write(code, sizeof(code), 0, file);
+        assert(written == ANALYSIS_OK);
+        size_t size = (size_t)ftell(file);
+        rewind(file);
+        uint8_t *data = malloc(size);
+        assert(data);
+        size_t read_size = fread(data, 1, size, file);
+        assert(read_size == size);
+        fclose(file);
+
+        /* sections are aligned for running in place */
+        vm_image image;
+        image_result parsed = vm_image_parse(data, size, &image);
+        assert(parsed == IMAGE_OK);
+        assert(image.flags & VM_IMAGE_VERIFIED);
+        assert(image.code_len == sizeof(code));
+        assert((uintptr_t)image.code % 8 == 0);
+        assert(memcmp(image.code, code, sizeof(code)) == 0);
+        assert(image.code[MAX_CODE_LEN - 1] == OP_ABORT);
+        assert(image.consts_len == 0);
+        assert(image.max_depth == 2);
+        assert(vm_image_bit(image.block_starts, 0) && vm_image_bit(image.block_starts, 7));
+        assert(!vm_image_bit(image.block_starts, 1));
+        assert(vm_image_bit(image.jump_targets, 3) && vm_image_bit(image.jump_targets, 14));
+        assert(!vm_image_bit(image.jump_targets, 7));
+
+        interpret_result result = vm_interpret(image.code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == 0);
+
+        pvm_program *program = pvm_program_from_image(&image, NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        pvm_context_free(context);
+        pvm_program_free(program);
+
+        data[size - 1] ^= 1;
+        parsed = vm_image_parse(data, size, &image);
+        assert(parsed == IMAGE_ERROR_CHECKSUM);
+        data[size - 1] ^= 1;
+        parsed = vm_image_parse(data, size - 8, &image);
+        assert(parsed == IMAGE_ERROR_TRUNCATED);
+        parsed = vm_image_parse(code, sizeof(code), &image);
+        assert(parsed == IMAGE_ERROR_MAGIC);
+        free(data);
+    }
+
+    {
+        /* Wide constants come from the pool at the end of the code area */
+        uint8_t code[MAX_CODE_LEN] = {
+            OP_PUSHK, ENCODE_ARG(0),
+            OP_PUSHK, ENCODE_ARG(1),
+            OP_ADD,
+            OP_PUSHK, ENCODE_ARG(0),
+            OP_SUB,
+            OP_POP_RES,
+            OP_DONE
+        };
+        vm_const_set(code, 0, 0x123456789abcdefULL);
+        vm_const_set(code, 1, UINT64_MAX - 1);
+        assert(vm_const_at(code, 1) == UINT64_MAX - 1);
+        assert(code[MAX_CODE_LEN - 8] == 0xef);
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == UINT64_MAX - 1);
+
+        result = vm_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == UINT64_MAX - 1);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == UINT64_MAX - 1);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == UINT64_MAX - 1);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == UINT64_MAX - 1);
+
+        result = vm_rcache_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == UINT64_MAX - 1);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == UINT64_MAX - 1);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == UINT64_MAX - 1);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == UINT64_MAX - 1);
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *fiber = vm_fiber_spawn(scheduler, code);
+        vm_scheduler_run(scheduler);
+        assert(vm_fiber_status(fiber) == SUCCESS);
+        assert(vm_fiber_result(fiber) == UINT64_MAX - 1);
+        vm_scheduler_free(scheduler);
+
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == UINT64_MAX - 1);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == UINT64_MAX - 1);
+        pvm_context_free(context);
+        pvm_program_free(program);
+
+        /* images keep the pool */
+        FILE *file = tmpfile();
+        assert(file);
+        analysis_result written = vm_image_write(code, 12, 2, file);
+        assert(written == ANALYSIS_OK);
+        size_t size = (size_t)ftell(file);
+        rewind(file);
+        uint8_t *data = malloc(size);
+        assert(data);
+        size_t read_size = fread(data, 1, size, file);
+        assert(read_size == size);
+        fclose(file);
+
+        vm_image image;
+        image_result parsed = vm_image_parse(data, size, &image);
+        assert(parsed == IMAGE_OK);
+        assert(image.consts_len == 2);
+        assert(vm_const_at(image.code, 0) == 0x123456789abcdefULL);
+        assert(vm_const_at(image.code, 1) == UINT64_MAX - 1);
+        free(data);
+    }
+
+    {
+        /* Bitwise ops, shifts, modulo and signed comparisons; the loop counts up from -5 */
+        uint8_t code[MAX_CODE_LEN] = {
+            OP_PUSHI, ENCODE_ARG(0xf0), OP_PUSHI, ENCODE_ARG(0x3c), OP_AND,
+            OP_PUSHI, ENCODE_ARG(1), OP_OR, OP_PUSHI, ENCODE_ARG(3), OP_XOR,
+            OP_PUSHI, ENCODE_ARG(0), OP_NOT, OP_PUSHI, ENCODE_ARG(60), OP_SHR, OP_ADD,
+            OP_PUSHI, ENCODE_ARG(1), OP_PUSHI, ENCODE_ARG(4), OP_SHL, OP_ADD,
+            OP_PUSHI, ENCODE_ARG(47), OP_PUSHI, ENCODE_ARG(10), OP_MOD, OP_ADD,
+            OP_PUSHK, ENCODE_ARG(0), OP_PUSHI, ENCODE_ARG(1), OP_SAR,
+            OP_DUP, OP_PUSHI, ENCODE_ARG(1), OP_LESS_SIGNED, OP_ADD, OP_ADD,
+            OP_PUSHI, ENCODE_ARG(1), OP_PUSHK, ENCODE_ARG(0), OP_GREATER_SIGNED, OP_ADD,
+            OP_PUSHK, ENCODE_ARG(0), OP_PUSHK, ENCODE_ARG(0), OP_LESS_OR_EQUAL_SIGNED, OP_ADD,
+            OP_PUSHK, ENCODE_ARG(0), OP_PUSHI, ENCODE_ARG(1), OP_GREATER_OR_EQUAL_SIGNED, OP_ADD,
+            OP_PUSHK, ENCODE_ARG(0),
+            /* 81 */
+            OP_DUP, OP_PUSHI, ENCODE_ARG(2), OP_LESS_SIGNED, OP_JUMP_IF_FALSE, ENCODE_ARG(95),
+            OP_ADDI, ENCODE_ARG(1), OP_JUMP, ENCODE_ARG(81),
+            /* 95 */
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+        vm_const_set(code, 0, (uint64_t)-5);
+        /* 50 + 15 + 16 + 7 - 3 + 1 + 1 + 1 + 0 + 2 */
+        const uint64_t expected = 90;
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+
+        result = vm_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == expected);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+
+        result = vm_rcache_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == expected);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == expected);
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *fiber = vm_fiber_spawn(scheduler, code);
+        vm_scheduler_run(scheduler);
+        assert(vm_fiber_status(fiber) == SUCCESS);
+        assert(vm_fiber_result(fiber) == expected);
+        vm_scheduler_free(scheduler);
+
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected);
+
+        /* MOD checks its divisor the way DIV does */
+        uint8_t mod_zero[] = {
+            OP_PUSHI, ENCODE_ARG(1),
+            OP_PUSHI, ENCODE_ARG(0),
+            OP_MOD,
+            OP_DONE
+        };
+        pvm_program *mod_zero_program = pvm_program_new(mod_zero, sizeof(mod_zero), NULL);
+        assert(mod_zero_program);
+        result = pvm_run(context, mod_zero_program, PVM_ENGINE_SWITCH);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+        result = pvm_run(context, mod_zero_program, PVM_ENGINE_THREADED);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+        result = vm_register_interpret_threaded(mod_zero);
+        assert(result == ERROR_DIVISION_BY_ZERO);
+
+        pvm_program_free(mod_zero_program);
+        pvm_context_free(context);
+        pvm_program_free(program);
+    }
+
+    {
+        /* Addresses past the flat memory go to pages mapped on the first store; runs start with
+         * the pages gone, so the far cell loaded first reads zero every time */
+        uint8_t code[MAX_CODE_LEN] = {
+            OP_PUSHK, ENCODE_ARG(0), OP_LOAD,
+            OP_PUSHK, ENCODE_ARG(0), OP_PUSHI, ENCODE_ARG(7000), OP_STORE,
+            /* addresses are 32-bit, this one is flat cell 3 */
+            OP_PUSHK, ENCODE_ARG(1), OP_PUSHI, ENCODE_ARG(5), OP_STORE,
+            OP_PUSHK, ENCODE_ARG(0), OP_LOAD, OP_ADD,
+            OP_LOADI, ENCODE_ARG(3), OP_ADD,
+            /* never stored to */
+            OP_PUSHK, ENCODE_ARG(2), OP_LOAD, OP_ADD,
+            OP_PUSHK, ENCODE_ARG(0), OP_ADDI, ENCODE_ARG(1), OP_LOAD, OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+        const uint32_t far_addr = 1u << 28;
+        vm_const_set(code, 0, far_addr);
+        vm_const_set(code, 1, (UINT64_C(1) << 32) + 3);
+        vm_const_set(code, 2, UINT32_MAX);
+        const uint64_t expected = 7005;
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+
+        result = vm_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == expected);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+
+        result = vm_rcache_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == expected);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == expected);
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == expected);
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *fiber = vm_fiber_spawn(scheduler, code);
+        vm_scheduler_run(scheduler);
+        assert(vm_fiber_status(fiber) == SUCCESS);
+        assert(vm_fiber_result(fiber) == expected);
+        vm_scheduler_free(scheduler);
+
+        /* Contexts keep their memory between runs, hosts can reach the pages */
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        vm_paged_memory *paged = pvm_context_paged_memory(context);
+        result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected);
+        assert(paged->page_num == VM_CHUNK_PAGES);
+        assert(vm_paged_load(paged, far_addr) == 7000);
+        assert(pvm_context_memory(context)[3] == 5);
+
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected + 7000);
+
+        vm_paged_reset(paged);
+        assert(paged->page_num == 0);
+        assert(vm_paged_load(paged, far_addr) == 0);
+        vm_paged_store(paged, far_addr, 1);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected + 1);
+
+        pvm_context_free(context);
+        pvm_program_free(program);
+    }
+
+    {
+        /* A list of 100 heap nodes {value, next} gets built, summed and freed; the next ALLOC of
+         * the size reuses the block freed last, the first one the class handed out */
+        uint8_t code[MAX_CODE_LEN] = {
+            OP_PUSHI, ENCODE_ARG(100), OP_STOREI, ENCODE_ARG(1),
+            /* 6 */
+            OP_LOADI, ENCODE_ARG(1), OP_JUMP_IF_FALSE, ENCODE_ARG(45),
+            OP_PUSHI, ENCODE_ARG(2), OP_ALLOC,
+            OP_DUP, OP_LOADI, ENCODE_ARG(1), OP_STORE,
+            OP_DUP, OP_ADDI, ENCODE_ARG(1), OP_LOADI, ENCODE_ARG(0), OP_STORE,
+            OP_STOREI, ENCODE_ARG(0),
+            OP_LOADI, ENCODE_ARG(1), OP_PUSHI, ENCODE_ARG(1), OP_SUB, OP_STOREI, ENCODE_ARG(1),
+            OP_JUMP, ENCODE_ARG(6),
+            /* 45 */
+            OP_PUSHI, ENCODE_ARG(0),
+            /* 48 */
+            OP_LOADI, ENCODE_ARG(0), OP_JUMP_IF_FALSE, ENCODE_ARG(74),
+            OP_LOADI, ENCODE_ARG(0), OP_LOAD, OP_ADD,
+            OP_LOADI, ENCODE_ARG(0), OP_DUP, OP_ADDI, ENCODE_ARG(1), OP_LOAD, OP_STOREI, ENCODE_ARG(0),
+            OP_FREE,
+            OP_JUMP, ENCODE_ARG(48),
+            /* 74 */
+            OP_PUSHI, ENCODE_ARG(2), OP_ALLOC, OP_PUSHK, ENCODE_ARG(0), OP_EQUAL, OP_ADD,
+            /* too large for any class */
+            OP_PUSHK, ENCODE_ARG(1), OP_ALLOC, OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+        vm_const_set(code, 0, VM_HEAP_BASE + (UINT32_C(1) << VM_HEAP_REGION_BITS));
+        vm_const_set(code, 1, (UINT64_C(1) << (VM_HEAP_CLASSES - 1)) + 1);
+        const uint64_t expected = 5051;
+
+        uint8_t bad_free[] = {
+            OP_PUSHI, ENCODE_ARG(5),
+            OP_FREE,
+            OP_DONE
+        };
+
+        interpret_result result = vm_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+        result = vm_interpret(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+        result = vm_interpret_no_range_check(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_get_result() == expected);
+        result = vm_interpret_threaded(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_trace_get_result() == expected);
+        result = vm_interpret_trace(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_rcache_interpret(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+        result = vm_rcache_interpret(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_rcache_interpret_no_range_check(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+        result = vm_rcache_interpret_no_range_check(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_rcache_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_get_result() == expected);
+        result = vm_rcache_interpret_threaded(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_rcache_interpret_trace(code);
+        assert(result == SUCCESS);
+        assert(vm_rcache_trace_get_result() == expected);
+        result = vm_rcache_interpret_trace(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        result = vm_register_interpret_threaded(code);
+        assert(result == SUCCESS);
+        assert(vm_register_get_result() == expected);
+        result = vm_register_interpret_threaded(bad_free);
+        assert(result == ERROR_INVALID_FREE);
+
+        vm_scheduler *scheduler = vm_scheduler_new();
+        vm_fiber *fiber = vm_fiber_spawn(scheduler, code);
+        vm_fiber *bad_fiber = vm_fiber_spawn(scheduler, bad_free);
+        vm_scheduler_run(scheduler);
+        assert(vm_fiber_status(fiber) == SUCCESS);
+        assert(vm_fiber_result(fiber) == expected);
+        assert(vm_fiber_status(bad_fiber) == ERROR_INVALID_FREE);
+        vm_scheduler_free(scheduler);
+
+        /* Every run starts with an empty heap, reset in O(1) */
+        pvm_program *program = pvm_program_new(code, sizeof(code), NULL);
+        assert(program);
+        pvm_context *context = pvm_context_new();
+        result = pvm_run(context, program, PVM_ENGINE_SWITCH);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected);
+        result = pvm_run(context, program, PVM_ENGINE_THREADED);
+        assert(result == SUCCESS);
+        assert(pvm_context_result(context) == expected);
+
+        vm_paged_memory *paged = pvm_context_paged_memory(context);
+        uint64_t block = vm_heap_alloc(paged, 3);
+        assert(block == VM_HEAP_BASE + (UINT32_C(2) << VM_HEAP_REGION_BITS));
+        uint64_t next_block = vm_heap_alloc(paged, 4);
+        assert(next_block == block + 4);
+        bool is_freed = vm_heap_free(paged, block + 1);
+        assert(!is_freed);
+        is_freed = vm_heap_free(paged, block);
+        assert(is_freed);
+        next_block = vm_heap_alloc(paged, 4);
+        assert(next_block == block);
+        vm_heap_reset(paged);
+        next_block = vm_heap_alloc(paged, 4);
+        assert(next_block == block);
+        is_freed = vm_heap_free(paged, block + 4);
+        assert(!is_freed);
+
+        pvm_context_free(context);
+        pvm_program_free(program);
+    }
+
+    {
+        /* Paged memory comes in chunks of pages, one chunk per huge page */
+        vm_paged_memory paged;
+        memset(&paged, 0, sizeof(paged));
+
+        uint32_t chunk_cells = VM_CHUNK_PAGES * VM_PAGE_CELLS;
+        uint32_t first = 4 * chunk_cells;
+        vm_paged_store(&paged, first, 1);
+        vm_paged_store(&paged, first + chunk_cells - 1, 2);
+        assert(paged.page_num == VM_CHUNK_PAGES);
+        assert(vm_paged_load(&paged, first + VM_PAGE_CELLS) == 0);
+
+        /* Chunks past the first are advised to use huge pages, cells work the same */
+        vm_paged_store(&paged, first + chunk_cells, 3);
+        vm_paged_store(&paged, UINT32_MAX, 4);
+        assert(paged.page_num == 3 * VM_CHUNK_PAGES);
+        assert(vm_paged_load(&paged, first) == 1);
+        assert(vm_paged_load(&paged, first + chunk_cells - 1) == 2);
+        assert(vm_paged_load(&paged, first + chunk_cells) == 3);
+        assert(vm_paged_load(&paged, UINT32_MAX) == 4);
+        assert(vm_paged_load(&paged, first - 1) == 0);
+
+        vm_paged_reset(&paged);
+        assert(paged.page_num == 0);
+        assert(vm_paged_load(&paged, first + chunk_cells) == 0);
+    }
+
+    {
+        /* A pool of workers runs batches of jobs, each on fresh memory */
+        uint8_t square[] = {
+            OP_LOADI, ENCODE_ARG(0),
+            OP_LOADI, ENCODE_ARG(0),
+            OP_MUL,
+            OP_LOADI, ENCODE_ARG(1),
+            OP_ADD,
+            OP_POP_RES,
+            OP_DONE
+        };
+        /* Cell 2 is never an input, jobs seeing a previous job's 9 there would be off by 9 */
+        uint8_t leftover[] = {
+            OP_LOADI, ENCODE_ARG(2),
+            OP_LOADI, ENCODE_ARG(0),
+            OP_ADD,
+            OP_POP_RES,
+            OP_PUSHI, ENCODE_ARG(9),
+            OP_STOREI, ENCODE_ARG(2),
+            OP_DONE
+        };
+        pvm_program *square_program = pvm_program_new(square, sizeof(square), NULL);
+        pvm_program *leftover_program = pvm_program_new(leftover, sizeof(leftover), NULL);
+        assert(square_program && leftover_program);
+
+        pvm_pool *pool = pvm_pool_new(4);
+        assert(pvm_pool_worker_num(pool) == 4);
+        assert(pvm_pool_node_num(pool) >= 1);
+        for (size_t worker_i = 0; worker_i < 4; worker_i++)
+            assert(pvm_pool_worker_node(pool, worker_i) < pvm_pool_node_num(pool));
+
+        pvm_pool_program *pool_square = pvm_pool_program_new(pool, square_program);
+        pvm_pool_program *pool_leftover = pvm_pool_program_new(pool, leftover_program);
+        assert(pvm_pool_program_replica_num(pool_square) == 0);
+
+        uint64_t inputs[100][2];
+        pvm_job jobs[100];
+        for (size_t batch_i = 0; batch_i < 2; batch_i++) {
+            for (size_t job_i = 0; job_i < 100; job_i++) {
+                inputs[job_i][0] = job_i;
+                inputs[job_i][1] = batch_i;
+                jobs[job_i] = (pvm_job) {
+                    .program = job_i % 3 ? pool_square : pool_leftover,
+                    .engine = job_i % 2 ? PVM_ENGINE_THREADED : PVM_ENGINE_SWITCH,
+                    .input = inputs[job_i],
+                    .input_len = 2,
+                };
+            }
+            pvm_pool_run(pool, jobs, 100);
+
+            for (size_t job_i = 0; job_i < 100; job_i++) {
+                assert(jobs[job_i].status == SUCCESS);
+                assert(jobs[job_i].worker < 4);
+                uint64_t expected = job_i % 3 ? job_i * job_i + batch_i : job_i;
+                assert(jobs[job_i].result == expected);
+            }
+        }
+        assert(pvm_pool_program_replica_num(pool_square) >= 1);
+        assert(pvm_pool_program_replica_num(pool_square) <= pvm_pool_node_num(pool));
+
+        pvm_job too_large = {.program = pool_square, .input = inputs[0], .input_len = MEMORY_SIZE + 1};
+        pvm_pool_run(pool, &too_large, 1);
+        assert(too_large.status == ERROR_MEMORY_OUT_OF_BOUNDS);
+        pvm_pool_run(pool, NULL, 0);
+
+        pvm_pool_free(pool);
+        pvm_program_free(leftover_program);
+        pvm_program_free(square_program);
+    }
+
+    {
+        /* Specialization for configuration cells: 0 picks the loop body, 1 is a wide factor, 2 the
+         * count and 3 gets added at the end */
+        uint8_t code[MAX_CODE_LEN] = {
+            OP_PUSHI, ENCODE_ARG(0), OP_STOREI, ENCODE_ARG(10),
+            OP_LOADI, ENCODE_ARG(2), OP_STOREI, ENCODE_ARG(11),
+            /* 12 */
+            OP_LOADI, ENCODE_ARG(11), OP_JUMP_IF_FALSE, ENCODE_ARG(64),
+            OP_LOADI, ENCODE_ARG(0), OP_JUMP_IF_FALSE, ENCODE_ARG(41),
+            OP_LOADI, ENCODE_ARG(10), OP_LOADI, ENCODE_ARG(11), OP_LOADI, ENCODE_ARG(1), OP_MUL,
+            OP_ADD, OP_STOREI, ENCODE_ARG(10),
+            OP_JUMP, ENCODE_ARG(51),
+            /* 41 */
+            OP_LOADI, ENCODE_ARG(10), OP_LOADI, ENCODE_ARG(11), OP_ADD, OP_STOREI, ENCODE_ARG(10),
+            /* 51 */
+            OP_LOADI, ENCODE_ARG(11), OP_PUSHI, ENCODE_ARG(1), OP_SUB, OP_STOREI, ENCODE_ARG(11),
+            OP_JUMP, ENCODE_ARG(12),
+            /* 64 */
+            OP_LOADI, ENCODE_ARG(10), OP_LOADADDI, ENCODE_ARG(3),
+            OP_POP_RES,
+            OP_DONE
+        };
+        const uint64_t scale = UINT64_C(1) << 40;
+        vm_const_cell scaled_cells[] = {{3, 7}, {0, 1}, {2, 10}, {1, scale}};
+        vm_const_cell plain_cells[] = {{0, 0}, {2, 10}, {3, 7}, {1, scale}};
+        uint64_t scaled_input[] = {1, scale, 10, 7};
+        uint64_t plain_input[] = {0, scale, 10, 7};
+        const uint64_t scaled_expected = 55 * scale + 7;
+        const uint64_t plain_expected = 55 + 7;
+
+        uint8_t specialized[MAX_CODE_LEN];
+        size_t code_len = 0, consts_len = 0;
+        analysis_result res = vm_specialize(code, plain_cells, 4, specialized, &code_len,
+                                            &consts_len);
+        assert(res == ANALYSIS_OK);
+        /* The scaled loop body is gone, the cells are never loaded */
+        assert(code_len < 52);
+        assert(consts_len == 0);
+        for (size_t pc = 0; pc < code_len; pc += vm_instruction_len(specialized, pc)) {
+            assert(specialized[pc] != OP_LOADADDI && specialized[pc] != OP_MUL);
+            if (specialized[pc] == OP_LOADI)
+                assert(specialized[pc + 2] >= 10);
+        }
+
+        /* Wide values go to the constant pool */
+        res = vm_specialize(code, scaled_cells, 4, specialized, &code_len, &consts_len);
+        assert(res == ANALYSIS_OK);
+        assert(consts_len == 1);
+        assert(vm_const_at(specialized, 0) == scale);
+
+        vm_specializer *specializer = vm_specializer_new(code);
+        uint8_t *scaled = vm_specializer_get(specializer, scaled_cells, 4);
+        uint8_t *plain = vm_specializer_get(specializer, plain_cells, 4);
+        assert(scaled && plain && scaled != plain);
+        vm_const_cell reordered[] = {{1, scale}, {2, 10}, {3, 7}, {0, 1}};
+        uint8_t *cached = vm_specializer_get(specializer, reordered, 4);
+        assert(cached == scaled);
+        assert(vm_specializer_size(specializer) == 2);
+
+        /* Cells STOREI writes to are not constant */
+        vm_const_cell stored_cells[] = {{0, 0}, {2, 10}, {3, 7}, {11, 5}};
+        uint8_t *stored = vm_specializer_get(specializer, stored_cells, 4);
+        assert(stored);
+        assert(vm_specializer_size(specializer) == 3);
+
+        struct {
+            uint8_t *code;
+            uint64_t *input;
+            uint64_t expected;
+        } runs[] = {
+            {code, scaled_input, scaled_expected},
+            {code, plain_input, plain_expected},
+            {scaled, scaled_input, scaled_expected},
+            {plain, plain_input, plain_expected},
+            {stored, plain_input, plain_expected},
+        };
+        for (size_t run_i = 0; run_i < sizeof(runs) / sizeof(runs[0]); run_i++) {
+            vm_register_program *program = vm_register_program_new(runs[run_i].code);
+            assert(program);
+            interpret_result result = vm_register_program_run(program, runs[run_i].input, 4);
+            assert(result == SUCCESS);
+            assert(vm_register_get_result() == runs[run_i].expected);
+            vm_register_program_free(program);
+
+            pvm_program *pvm = pvm_program_new(runs[run_i].code, MAX_CODE_LEN, NULL);
+            assert(pvm);
+            pvm_context *context = pvm_context_new();
+            memcpy(pvm_context_memory(context), runs[run_i].input, 4 * sizeof(uint64_t));
+            result = pvm_run(context, pvm, PVM_ENGINE_SWITCH);
+            assert(result == SUCCESS);
+            assert(pvm_context_result(context) == runs[run_i].expected);
+            pvm_context_free(context);
+            pvm_program_free(pvm);
+        }
+
+        /* Code failing the analysis cannot be specialized */
+        uint8_t bad[MAX_CODE_LEN] = {OP_ADD, OP_DONE};
+        res = vm_specialize(bad, NULL, 0, specialized, NULL, NULL);
+        assert(res == ANALYSIS_ERROR_STACK_UNDERFLOW);
+        vm_specializer *bad_specializer = vm_specializer_new(bad);
+        cached = vm_specializer_get(bad_specializer, NULL, 0);
+        assert(cached == NULL);
+        vm_specializer_free(bad_specializer);
+
+        vm_specializer_free(specializer);
+    }
+
+    {
+        /* Squares of 0..9 summed into cell 1 with a call, the loop body out of line. The entry
+         * block stores 7 to cell 1 for nothing and branches on a constant to a block never run. */
+        uint8_t code[MAX_CODE_LEN] = {
+            OP_PUSHI, ENCODE_ARG(0), OP_STOREI, ENCODE_ARG(0),
+            OP_PUSHI, ENCODE_ARG(7), OP_STOREI, ENCODE_ARG(1),
+            OP_PUSHI, ENCODE_ARG(0), OP_STOREI, ENCODE_ARG(1),
+            OP_PUSHI, ENCODE_ARG(1), OP_JUMP_IF_FALSE, ENCODE_ARG(76),
+            /* 24 */
+            OP_LOADI, ENCODE_ARG(0), OP_GREATER_OR_EQUALI, ENCODE_ARG(10),
+            OP_JUMP_IF_TRUE, ENCODE_ARG(36),
+            OP_JUMP, ENCODE_ARG(41),
+            /* 36 */
+            OP_LOADI, ENCODE_ARG(1), OP_POP_RES, OP_DONE,
+            /* 41 */
+            OP_LOADI, ENCODE_ARG(0), OP_CALL, ENCODE_ARG(73),
+            /* 47 */
+            OP_LOADADDI, ENCODE_ARG(1), OP_STOREI, ENCODE_ARG(1),
+            OP_LOADI, ENCODE_ARG(0), OP_LOADI, ENCODE_ARG(1), OP_ADD, OP_DISCARD,
+            OP_LOADI, ENCODE_ARG(0), OP_ADDI, ENCODE_ARG(1), OP_STOREI, ENCODE_ARG(0),
+            OP_JUMP, ENCODE_ARG(24),
+            /* 73 */
+            OP_DUP, OP_MUL, OP_RET,
+            /* 76 */
+            OP_PUSHI, ENCODE_ARG(99), OP_STOREI, ENCODE_ARG(1),
+            OP_JUMP, ENCODE_ARG(24),
+        };
+        const size_t code_len = 85;
+        const uint64_t expected = 285;
+
+        vm_cfg cfg;
+        analysis_result res = vm_cfg_lift(code, &cfg);
+        assert(res == ANALYSIS_OK);
+        assert(cfg.block_num == 8 && cfg.order_len == 8);
+        size_t block_at[MAX_CODE_LEN];
+        for (size_t block_i = 0; block_i < cfg.block_num; block_i++)
+            block_at[cfg.blocks[block_i].pc] = block_i;
+        const size_t entry = block_at[0], loop = block_at[24], outlined = block_at[33],
+            done = block_at[36], body = block_at[41], return_site = block_at[47],
+            square = block_at[73], never = block_at[76];
+        assert(entry == 0);
+
+        assert(cfg.blocks[entry].instr_num == 7);
+        assert(cfg.blocks[entry].exit_op == OP_JUMP_IF_FALSE);
+        assert(cfg.blocks[entry].target == never && cfg.blocks[entry].next == loop);
+        assert(cfg.blocks[outlined].instr_num == 0 && cfg.blocks[outlined].exit_op == OP_JUMP);
+        assert(cfg.blocks[body].exit_op == OP_CALL);
+        assert(cfg.blocks[body].target == square && cfg.blocks[body].next == return_site);
+        assert(cfg.blocks[square].depth == 1 && cfg.blocks[return_site].depth == 1);
+        assert(cfg.blocks[loop].depth == 0);
+        size_t successors[2];
+        size_t successor_num = vm_cfg_successors(&cfg, body, successors);
+        assert(successor_num == 2);
+        successor_num = vm_cfg_successors(&cfg, done, successors);
+        assert(successor_num == 0);
+
+        /* The loop is 8 times heavier than the code around it, the callee is weighed on its own */
+        assert(cfg.blocks[loop].weight == 8 && cfg.blocks[return_site].weight == 8);
+        assert(cfg.blocks[entry].weight == 1 && cfg.blocks[done].weight == 1);
+        assert(cfg.blocks[square].weight == 1);
+
+        /* Both cells get stored to before the entry block reads them, the rest of memory is never
+         * looked at */
+        vm_cfg_liveness liveness;
+        vm_cfg_liveness_compute(&cfg, &liveness);
+        assert(liveness.cell_num == 2);
+        assert(liveness.live_in[entry * liveness.set_words] == 0);
+        assert(vm_cfg_is_live_out(&liveness, return_site, 0));
+        assert(vm_cfg_is_live_out(&liveness, return_site, 1));
+        assert(vm_cfg_is_live_out(&liveness, entry, 5));
+        vm_cfg_liveness_free(&liveness);
+
+        /* Sums read at the end come from the entry block, the loop or the block never run; the
+         * store of 7 never gets there */
+        vm_cfg_reaching reaching;
+        vm_cfg_reaching_compute(&cfg, &reaching);
+        assert(reaching.def_num == 2 + 6);
+        size_t defs[8];
+        size_t def_num = vm_cfg_reaching_at(&cfg, &reaching, done, 0, 1, defs, 8);
+        assert(def_num == 3);
+        for (size_t def_i = 0; def_i < 3; def_i++) {
+            const vm_cfg_def *def = &reaching.defs[defs[def_i]];
+            assert(def->addr == 1 && def->instr_i != VM_CFG_NONE);
+            assert(def->block_i != entry || def->instr_i == 5);
+        }
+        /* The callee might store anywhere, but the loop stores the counter after the call */
+        def_num = vm_cfg_reaching_at(&cfg, &reaching, loop, 0, 0, defs, 8);
+        assert(def_num == 2);
+        def_num = vm_cfg_reaching_at(&cfg, &reaching, return_site, 0, 0, defs, 8);
+        assert(def_num == 3);
+        assert(reaching.defs[defs[0]].instr_i == VM_CFG_NONE);
+        def_num = vm_cfg_reaching_at(&cfg, &reaching, return_site, 9, 0, defs, 1);
+        assert(def_num == 1);
+        assert(reaching.defs[defs[0]].block_i == return_site);
+        assert(reaching.defs[defs[0]].instr_i == 8);
+        vm_cfg_reaching_free(&reaching);
+
+        /* The dead store, the sum computed for nothing and the constant branch go away, and with
+         * the branch the block never run */
+        bool is_changed = vm_cfg_eliminate_dead_code(&cfg);
+        assert(is_changed);
+        assert(cfg.blocks[entry].instr_num == 4);
+        assert(cfg.blocks[entry].exit_op == OP_JUMP && cfg.blocks[entry].target == loop);
+        assert(cfg.blocks[return_site].instr_num == 5);
+        is_changed = vm_cfg_eliminate_dead_code(&cfg);
+        assert(!is_changed);
+        is_changed = vm_cfg_remove_unreachable(&cfg);
+        assert(is_changed);
+        assert(!cfg.blocks[never].is_reachable && cfg.order_len == 7);
+        is_changed = vm_cfg_remove_unreachable(&cfg);
+        assert(!is_changed);
+
+        /* The loop body follows the loop test, the exit goes after the loop */
+        is_changed = vm_cfg_reorder_blocks(&cfg);
+        assert(is_changed);
+        const size_t expected_order[] = {entry, loop, outlined, body, return_site, done, square};
+        assert(memcmp(cfg.order, expected_order, sizeof(expected_order)) == 0);
+        is_changed = vm_cfg_reorder_blocks(&cfg);
+        assert(!is_changed);
+
+        uint8_t lowered[MAX_CODE_LEN];
+        size_t lowered_len = 0, consts_len = 1;
+        res = vm_cfg_lower(&cfg, lowered, &lowered_len, &consts_len);
+        assert(res == ANALYSIS_OK);
+        assert(consts_len == 0);
+        assert(lowered_len < code_len - 20);
+        size_t jump_num = 0;
+        for (size_t pc = 0; pc < lowered_len; pc += vm_instruction_len(lowered, pc)) {
+            assert(lowered[pc] != OP_DISCARD && lowered[pc] != OP_JUMP_IF_FALSE);
+            jump_num += lowered[pc] == OP_JUMP;
+        }
+        assert(jump_num == 1);
+
+        uint8_t optimized[MAX_CODE_LEN];
+        size_t optimized_len = 0;
+        res = vm_optimize(code, optimized, &optimized_len, NULL);
+        assert(res == ANALYSIS_OK);
+        assert(optimized_len == lowered_len);
+        assert(memcmp(optimized, lowered, MAX_CODE_LEN) == 0);
+
+        /* Lowering flips a branch whose taken side follows it */
+        uint8_t flipped[MAX_CODE_LEN];
+        const size_t flipped_order[] = {entry, loop, done, outlined, body, return_site, square};
+        memcpy(cfg.order, flipped_order, sizeof(flipped_order));
+        res = vm_cfg_lower(&cfg, flipped, NULL, NULL);
+        assert(res == ANALYSIS_OK);
+        bool is_flipped = false;
+        for (size_t pc = 0; pc < MAX_CODE_LEN && flipped[pc] != OP_DONE;
+             pc += vm_instruction_len(flipped, pc))
+            is_flipped |= flipped[pc] == OP_JUMP_IF_FALSE;
+        assert(is_flipped);
+
+        uint8_t *runs[] = {code, lowered, flipped};
+        const uint64_t input[2] = {0};
+        for (size_t run_i = 0; run_i < sizeof(runs) / sizeof(runs[0]); run_i++) {
+            vm_register_program *program = vm_register_program_new(runs[run_i]);
+            assert(program);
+            interpret_result result = vm_register_program_run(program, input, 2);
+            assert(result == SUCCESS);
+            assert(vm_register_get_result() == expected);
+            vm_register_program_free(program);
+
+            pvm_program *pvm = pvm_program_new(runs[run_i], MAX_CODE_LEN, NULL);
+            assert(pvm);
+            pvm_context *context = pvm_context_new();
+            result = pvm_run(context, pvm, PVM_ENGINE_THREADED);
+            assert(result == SUCCESS);
+            assert(pvm_context_result(context) == expected);
+            pvm_context_free(context);
+            pvm_program_free(pvm);
+        }
+
+        /* Jumps to blocks left out have nowhere to go */
+        cfg.order_len--;
+        res = vm_cfg_lower(&cfg, flipped, NULL, NULL);
+        assert(res == ANALYSIS_ERROR_CODE_OVERFLOW);
+        vm_cfg_free(&cfg);
+
+        uint8_t bad[MAX_CODE_LEN] = {OP_ADD, OP_DONE};
+        res = vm_cfg_lift(bad, &cfg);
+        assert(res == ANALYSIS_ERROR_STACK_UNDERFLOW);
+        assert(cfg.block_num == 0);
+        vm_cfg_free(&cfg);
+        res = vm_optimize(bad, optimized, NULL, NULL);
+        assert(res == ANALYSIS_ERROR_STACK_UNDERFLOW);
+    }
+
+    {
+        /* Uneven batches: the first job counts down a long way, the workers done with their own
+         * runs steal the rest of the first worker's jobs */
+        uint8_t countdown[] = {
+            /* 0 */
+            OP_LOADI, ENCODE_ARG(0), OP_JUMP_IF_FALSE, ENCODE_ARG(19),
+            OP_LOADI, ENCODE_ARG(0), OP_PUSHI, ENCODE_ARG(1), OP_SUB, OP_STOREI, ENCODE_ARG(0),
+            OP_JUMP, ENCODE_ARG(0),
+            /* 19 */
+            OP_LOADI, ENCODE_ARG(1),
+            OP_POP_RES,
+            OP_DONE
+        };
+        pvm_program *program = pvm_program_new(countdown, sizeof(countdown), NULL);
+        assert(program);
+
+        pvm_pool *pool = pvm_pool_new(3);
+        pvm_pool_program *pool_program = pvm_pool_program_new(pool, program);
+
+        uint64_t inputs[60][2];
+        pvm_job jobs[60];
+        for (size_t job_i = 0; job_i < 60; job_i++) {
+            inputs[job_i][0] = job_i == 0 ? 20000000 : job_i;
+            inputs[job_i][1] = job_i;
+            jobs[job_i] = (pvm_job) {
+                .program = pool_program,
+                .engine = PVM_ENGINE_THREADED,
+                .input = inputs[job_i],
+                .input_len = 2,
+            };
+        }
+        pvm_pool_run(pool, jobs, 60);
+
+        size_t stolen_num = 0;
+        for (size_t job_i = 0; job_i < 60; job_i++) {
+            assert(jobs[job_i].status == SUCCESS);
+            assert(jobs[job_i].result == job_i);
+            /* The first worker starts with jobs 0 to 19 */
+            if (job_i < 20 && jobs[job_i].worker != 0)
+                stolen_num++;
+        }
+        assert(stolen_num > 0);
+        assert(jobs[0].elapsed_us > 0);
+
+        pvm_pool_free(pool);
+        pvm_program_free(program);
     }
 
     return EXIT_SUCCESS;
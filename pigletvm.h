@@ -1,6 +1,22 @@
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 #define MAX_CODE_LEN 4096
+/* the number of 64-bit memory cells */
+#define MEMORY_SIZE 65536
+/* nesting limit of CALL instructions */
+#define CALL_STACK_MAX 256
+
+/* Engine state layout: registers the dispatch loop touches get a cache line of their own, arrays
+ * written by programs start on lines and pages of their own */
+#define VM_CACHE_LINE 64
+#define VM_PAGE_BYTES 4096
+#ifdef _MSC_VER
+#define VM_ALIGNED(bytes) __declspec(align(bytes))
+#else
+#define VM_ALIGNED(bytes) __attribute__((aligned(bytes)))
+#endif
 
 typedef enum interpret_result {
     SUCCESS,
@@ -8,6 +24,24 @@ typedef enum interpret_result {
     ERROR_RUNTIME_EXCEPTION,
     ERROR_UNKNOWN_OPCODE,
     ERROR_END_OF_STREAM,
+    /* bytecode rejected by a translating engine, e.g. inconsistent stack depths */
+    ERROR_INVALID_BYTECODE,
+    /* too many nested calls */
+    ERROR_CALL_STACK_OVERFLOW,
+    /* RET without a matching CALL */
+    ERROR_CALL_STACK_UNDERFLOW,
+    /* a bulk memory op range does not fit into memory */
+    ERROR_MEMORY_OUT_OF_BOUNDS,
+    /* CALLNATIVE of a function missing from the native function table */
+    ERROR_UNKNOWN_NATIVE,
+    /* vm_budget ran out, the run can be resumed */
+    ERROR_BUDGET_EXHAUSTED,
+    /* a push hit the guard page past the end of the stack */
+    ERROR_STACK_OVERFLOW,
+    /* a pop hit the guard page below the bottom of the stack */
+    ERROR_STACK_UNDERFLOW,
+    /* FREE of an address ALLOC never returned */
+    ERROR_INVALID_FREE,
 } interpret_result;
 
 typedef enum {
@@ -23,7 +57,8 @@ typedef enum {
     OP_LOADADDI,
     /* pop a value and store it into a memory cell addressed by an immediate argument  */
     OP_STOREI,
-    /* pop an address of the stack, use it to get a value from a memory cell */
+    /* pop an address of the stack, use it to get a value from a memory cell; addresses are 32-bit,
+     * see paged memory */
     OP_LOAD,
     /* pop an address of the stack, pop a value from the stack, store into the address */
     OP_STORE,
@@ -69,32 +104,888 @@ typedef enum {
     OP_DONE,
     /* pop the top of the stack and print it */
     OP_PRINT,
+
+    /* push the address of the next instruction onto the call stack, jump to an absolute bytecode
+     * address (the immediate argument) */
+    OP_CALL,
+    /* pop an address off the call stack and jump to it */
+    OP_RET,
+
+    /* sized memory ops, see vm_memory_load8 and friends: pop an element index, push the element */
+    OP_LOAD8,
+    OP_LOAD16,
+    OP_LOAD32,
+    /* pop a value, pop an element index, store the lower bits of the value into the element */
+    OP_STORE8,
+    OP_STORE16,
+    OP_STORE32,
+    /* pop a bit index, push the bit (0/1) */
+    OP_BIT_TEST,
+    /* pop a bit index, set the bit */
+    OP_BIT_SET,
+
+    /* bulk memory ops over cell ranges, the range must fit into memory */
+    /* pop a count, pop a value, pop an address, fill count cells with the value */
+    OP_MEMSET,
+    /* pop a count, pop a source address, pop a destination address, copy count cells */
+    OP_MEMCPY,
+    /* pop a count, pop an address, push the sum/minimum/maximum of count cells, or the number of
+     * nonzero ones */
+    OP_MEMSUM,
+    OP_MEMMIN,
+    OP_MEMMAX,
+    OP_MEMCOUNT,
+
+    /* pop the arguments of a native function (the immediate argument is its index in the native
+     * function table), call it, push the result */
+    OP_CALLNATIVE,
+
+    /* suspend the fiber running the code, a no-op for the other engines */
+    OP_YIELD,
+
+    /* push a constant from the constant pool, the immediate argument is its index, see
+     * vm_const_at */
+    OP_PUSHK,
+
+    /* bitwise ops: pop 2 values, push the result; NOT replaces the top of the stack with its
+     * complement */
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_NOT,
+    /* pop a shift count, shift the top of the stack by it; counts are taken modulo 64, SAR shifts
+     * the sign bit in */
+    OP_SHL,
+    OP_SHR,
+    OP_SAR,
+    /* pop 2 values from the stack, push the remainder of their division */
+    OP_MOD,
+    /* comparisons of values as two's complement signed numbers, otherwise the same as OP_LESS and
+     * friends */
+    OP_LESS_SIGNED,
+    OP_LESS_OR_EQUAL_SIGNED,
+    OP_GREATER_SIGNED,
+    OP_GREATER_OR_EQUAL_SIGNED,
+
+    /* pop a number of cells, push the address of a heap block of at least that many cells or 0 if
+     * there is no room, see the heap */
+    OP_ALLOC,
+    /* pop an address ALLOC returned and give the block back, FREE of 0 does nothing */
+    OP_FREE,
+
     /* just a helper to count operation number */
     OP_NUMBER_OF_OPS
 } opcode;
 
 
+/*
+ * Sized memory access
+ *
+ * The memory cells are also arrays of 8, 16 and 32-bit elements and an array of bits packed into
+ * the same bytes. Elements are little-endian, i.e. they overlap cells the natural way on
+ * little-endian hosts. Indices wrap around the flat memory size.
+ *
+ * Building values from bytes keeps narrow accesses to 64-bit cells legal C, compilers merge the
+ * byte accesses into single loads and stores anyway.
+ * */
+
+#define VM_MEMORY_BYTES (MEMORY_SIZE * 8)
+
+static inline uint64_t vm_memory_load8(uint64_t *memory, uint64_t index)
+{
+    uint8_t *bytes = (uint8_t *)memory;
+    return bytes[index & (VM_MEMORY_BYTES - 1)];
+}
+
+static inline uint64_t vm_memory_load16(uint64_t *memory, uint64_t index)
+{
+    uint8_t *bytes = (uint8_t *)memory + ((index * 2) & (VM_MEMORY_BYTES - 1));
+    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8;
+}
+
+static inline uint64_t vm_memory_load32(uint64_t *memory, uint64_t index)
+{
+    uint8_t *bytes = (uint8_t *)memory + ((index * 4) & (VM_MEMORY_BYTES - 1));
+    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8 | (uint64_t)bytes[2] << 16 |
+        (uint64_t)bytes[3] << 24;
+}
+
+static inline void vm_memory_store8(uint64_t *memory, uint64_t index, uint64_t val)
+{
+    uint8_t *bytes = (uint8_t *)memory;
+    bytes[index & (VM_MEMORY_BYTES - 1)] = (uint8_t)val;
+}
+
+static inline void vm_memory_store16(uint64_t *memory, uint64_t index, uint64_t val)
+{
+    uint8_t *bytes = (uint8_t *)memory + ((index * 2) & (VM_MEMORY_BYTES - 1));
+    bytes[0] = (uint8_t)val;
+    bytes[1] = (uint8_t)(val >> 8);
+}
+
+static inline void vm_memory_store32(uint64_t *memory, uint64_t index, uint64_t val)
+{
+    uint8_t *bytes = (uint8_t *)memory + ((index * 4) & (VM_MEMORY_BYTES - 1));
+    bytes[0] = (uint8_t)val;
+    bytes[1] = (uint8_t)(val >> 8);
+    bytes[2] = (uint8_t)(val >> 16);
+    bytes[3] = (uint8_t)(val >> 24);
+}
+
+static inline uint64_t vm_memory_bit_test(uint64_t *memory, uint64_t index)
+{
+    uint8_t *bytes = (uint8_t *)memory;
+    index &= VM_MEMORY_BYTES * 8 - 1;
+    return (bytes[index >> 3] >> (index & 7)) & 1;
+}
+
+static inline void vm_memory_bit_set(uint64_t *memory, uint64_t index)
+{
+    uint8_t *bytes = (uint8_t *)memory;
+    index &= VM_MEMORY_BYTES * 8 - 1;
+    bytes[index >> 3] |= (uint8_t)(1u << (index & 7));
+}
+
+
+/*
+ * Paged memory (pigletvm-paged.c)
+ *
+ * LOAD and STORE take 32-bit addresses. The first MEMORY_SIZE cells are the flat memory all the
+ * other ops work with, cells past it live in pages mapped on the first store to them, so programs
+ * fitting into the flat memory only pay for a compare. Loads from pages never stored to read zeros
+ * without mapping anything, and a reset unmaps just the pages in use: programs pay for the cells
+ * they touch rather than for the whole address space.
+ *
+ * A zeroed vm_paged_memory is an empty one.
+ * */
+
+/* 8192 cells per page, 1024 pages per table, 512 tables cover 2^32 cells */
+#define VM_PAGE_BITS 13
+#define VM_PAGE_CELLS (1u << VM_PAGE_BITS)
+#define VM_PAGE_TABLE_BITS 10
+#define VM_PAGE_TABLES (1u << (32 - VM_PAGE_BITS - VM_PAGE_TABLE_BITS))
+/* pages get mapped 32 at a time, a chunk per 2 MiB huge page */
+#define VM_CHUNK_PAGES 32u
+
+/*
+ * The heap of ALLOC and FREE is the upper half of the address space. Size class N has blocks of 2^N
+ * cells carved out of a region of its own, so FREE tells the class from the address alone and
+ * blocks need no headers. A freed block links to the next free one of its class through its first
+ * cell. Resetting the heap only forgets the blocks, it costs the same whatever was allocated.
+ * */
+#define VM_HEAP_BASE (UINT32_C(1) << 31)
+/* blocks of 1 to 2^20 cells, 2^26 cells of address space for each class */
+#define VM_HEAP_CLASSES 21
+#define VM_HEAP_REGION_BITS 26
+
+typedef struct vm_paged_memory {
+    /* tables of page pointers, allocated along with the first page they point to */
+    uint64_t **tables[VM_PAGE_TABLES];
+    /* the page accessed last, lookups of the same page skip the tables */
+    uint64_t *cached_page;
+    uint32_t cached_index;
+    /* pages mapped, whole chunks of them */
+    size_t page_num;
+
+    /* heap size classes: cells handed out from the class region and the first free block */
+    uint32_t heap_used[VM_HEAP_CLASSES];
+    uint32_t heap_free[VM_HEAP_CLASSES];
+} vm_paged_memory;
+
+/* The slow path, compilers keep it out of the way of the flat memory one */
+#ifdef __GNUC__
+#define VM_PAGED_COLD __attribute__((cold))
+#else
+#define VM_PAGED_COLD
+#endif
+
+VM_PAGED_COLD uint64_t vm_paged_load(vm_paged_memory *paged, uint32_t addr);
+
+VM_PAGED_COLD void vm_paged_store(vm_paged_memory *paged, uint32_t addr, uint64_t val);
+
+/* Unmap all the pages and reset the heap, every cell reads zero again */
+void vm_paged_reset(vm_paged_memory *paged);
+
+/* The address of a block of at least cells cells, 0 if the class of the size has no room left */
+uint64_t vm_heap_alloc(vm_paged_memory *paged, uint64_t cells);
+
+/* false if the address is not the start of a heap block; 0 is fine */
+bool vm_heap_free(vm_paged_memory *paged, uint64_t addr);
+
+/* Forget all the blocks at once, the pages and what is in them stay */
+void vm_heap_reset(vm_paged_memory *paged);
+
+static inline uint64_t vm_memory_load(uint64_t *memory, vm_paged_memory *paged, uint64_t addr)
+{
+    uint32_t cell = (uint32_t)addr;
+    if (cell < MEMORY_SIZE)
+        return memory[cell];
+    return vm_paged_load(paged, cell);
+}
+
+static inline void vm_memory_store(uint64_t *memory, vm_paged_memory *paged, uint64_t addr,
+                                   uint64_t val)
+{
+    uint32_t cell = (uint32_t)addr;
+    if (cell < MEMORY_SIZE)
+        memory[cell] = val;
+    else
+        vm_paged_store(paged, cell, val);
+}
+
+
+/*
+ * Constant pool
+ *
+ * Constants wider than a 16-bit immediate live at the end of the code area: constant N takes the 8
+ * bytes ending 8 * N bytes before MAX_CODE_LEN, little-endian. Code and constants share the code
+ * area, so code using PUSHK has to come in a buffer of MAX_CODE_LEN bytes. Indices wrap around the
+ * pool capacity just like sized memory indices do, any index stays within the code area.
+ * */
+
+#define VM_CONSTS_MAX (MAX_CODE_LEN / 8)
+
+static inline uint64_t vm_const_at(const uint8_t *bytecode, uint64_t index)
+{
+    const uint8_t *bytes = bytecode + MAX_CODE_LEN - 8 * ((index & (VM_CONSTS_MAX - 1)) + 1);
+    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8 | (uint64_t)bytes[2] << 16 |
+        (uint64_t)bytes[3] << 24 | (uint64_t)bytes[4] << 32 | (uint64_t)bytes[5] << 40 |
+        (uint64_t)bytes[6] << 48 | (uint64_t)bytes[7] << 56;
+}
+
+static inline void vm_const_set(uint8_t *bytecode, uint64_t index, uint64_t val)
+{
+    uint8_t *bytes = bytecode + MAX_CODE_LEN - 8 * ((index & (VM_CONSTS_MAX - 1)) + 1);
+    for (int byte_i = 0; byte_i < 8; byte_i++)
+        bytes[byte_i] = (uint8_t)(val >> (byte_i * 8));
+}
+
+
+/*
+ * Bulk memory kernels (pigletvm-bulk.c)
+ *
+ * Kernels do no range checks, ops check the whole range once instead of checking every cell. The
+ * minimum of no cells is UINT64_MAX, the maximum is 0.
+ * */
+
+static inline bool vm_memory_range_is_valid(uint64_t addr, uint64_t count)
+{
+    return addr <= MEMORY_SIZE && count <= MEMORY_SIZE - addr;
+}
+
+void vm_memory_fill(uint64_t *cells, uint64_t count, uint64_t val);
+
+void vm_memory_copy(uint64_t *dst, const uint64_t *src, uint64_t count);
+
+uint64_t vm_memory_sum(const uint64_t *cells, uint64_t count);
+
+uint64_t vm_memory_min(const uint64_t *cells, uint64_t count);
+
+uint64_t vm_memory_max(const uint64_t *cells, uint64_t count);
+
+uint64_t vm_memory_count(const uint64_t *cells, uint64_t count);
+
+
+/*
+ * Native functions (pigletvm-native.c)
+ *
+ * CALLNATIVE calls host functions from a process-wide table. Arguments are not copied: a function
+ * gets a pointer to the stack slots holding them, the deepest one first, and its result replaces
+ * them. The arity of a function determines stack depths, so functions should be registered before
+ * any code using them gets analysed, compiled or run.
+ * */
+
+#define NATIVE_MAX 256
+
+/* indices of the functions registered by vm_register_standard_natives */
+#define NATIVE_HASH 0
+#define NATIVE_HASH_COMBINE 1
+
+typedef uint64_t vm_native_function(const uint64_t *args);
+
+typedef struct vm_native {
+    vm_native_function *function;
+    uint8_t arity;
+} vm_native;
+
+extern vm_native vm_natives[NATIVE_MAX];
+
+/* NULL for unregistered functions */
+static inline const vm_native *vm_native_at(uint64_t index)
+{
+    return index < NATIVE_MAX && vm_natives[index].function ? &vm_natives[index] : NULL;
+}
+
+bool vm_register_native(uint16_t index, vm_native_function *function, uint8_t arity);
+
+/* hash(value) and hash_combine(seed, hash) */
+void vm_register_standard_natives(void);
+
+/* Entry point for compiled code, the function has to be registered */
+uint64_t vm_call_native(uint16_t index, const uint64_t *args);
+
+
+/*
+ * Fibers (pigletvm-fiber.c)
+ *
+ * A fiber is a lightweight VM instance with its own instruction pointer, stack, accumulator and
+ * call stack. A scheduler multiplexes any number of fibers on the calling thread, switching to the
+ * next one round-robin whenever a fiber executes YIELD. Fibers of a scheduler share its memory:
+ * cells are how fibers talk to each other and to the host, e.g. a fiber waiting for a host event
+ * can poll a cell and yield until the host sets it between scheduler steps.
+ * */
+
+typedef struct vm_fiber vm_fiber;
+
+typedef struct vm_scheduler vm_scheduler;
+
+vm_scheduler *vm_scheduler_new(void);
+
+/* Frees the fibers as well */
+void vm_scheduler_free(vm_scheduler *scheduler);
+
+uint64_t *vm_scheduler_memory(vm_scheduler *scheduler);
+
+/* Preempt fibers after this many backward jumps or calls per turn, fibers are never preempted by
+ * default; vm_budget does not apply to fibers */
+void vm_scheduler_set_slice(vm_scheduler *scheduler, uint64_t slice);
+
+/* A new fiber starting with the first instruction, owned by the scheduler */
+vm_fiber *vm_fiber_spawn(vm_scheduler *scheduler, uint8_t *bytecode);
+
+/* Resume every live fiber once, returns the number of fibers still live */
+size_t vm_scheduler_step(vm_scheduler *scheduler);
+
+/* Step until all the fibers finish */
+void vm_scheduler_run(vm_scheduler *scheduler);
+
+bool vm_fiber_is_finished(vm_fiber *fiber);
+
+/* How a finished fiber stopped */
+interpret_result vm_fiber_status(vm_fiber *fiber);
+
+uint64_t vm_fiber_result(vm_fiber *fiber);
+
+
+/*
+ * Guarded stacks (pigletvm-guard.c)
+ *
+ * Stack engines keep their stacks between inaccessible guard pages instead of checking every push
+ * and pop. Hitting a guard page faults and the fault handler stops the run with
+ * ERROR_STACK_OVERFLOW or ERROR_STACK_UNDERFLOW. The check is on the page granularity, so a stack
+ * holds at least the requested number of cells.
+ * */
+
+/* Never freed, there is a handful of these per process */
+uint64_t *vm_guarded_stack_new(size_t cells);
+
+/* Run an engine so that guard page hits during the run return an error */
+interpret_result vm_guarded_run(interpret_result (*run)(void));
+
+/* Stop the current guarded run with an error, engines deep in nested handlers use this */
+void vm_guarded_fail(interpret_result error);
+
+/* x86 division traps on a zero divisor. Built with PIGLETVM_TRAP_DIVISION guarded runs divide
+ * without checking and the SIGFPE handler stops the run with ERROR_DIVISION_BY_ZERO instead. */
+#if defined(PIGLETVM_TRAP_DIVISION) && !defined(_MSC_VER) &&     \
+    (defined(__x86_64__) || defined(__i386__))
+#define VM_TRAP_DIVISION 1
+#else
+#define VM_TRAP_DIVISION 0
+#endif
+
+
+/*
+ * Budget
+ *
+ * Every backward jump taken or call costs a unit of vm_budget, a conditional jump falling through
+ * costs nothing. Once the budget is 0 the next backward jump stops the run with
+ * ERROR_BUDGET_EXHAUSTED, and the run continues from there with the _resume function of the same
+ * engine after the budget gets refilled. Trace engines only check the budget when control goes
+ * back to an earlier trace, so they may take a few more iterations per unit. Forward code never
+ * pays for the check.
+ * */
+
+#define VM_BUDGET_UNLIMITED UINT64_MAX
+
+extern uint64_t vm_budget;
+
+
 interpret_result vm_interpret(uint8_t *bytecode);
 
+interpret_result vm_interpret_resume(void);
+
 interpret_result vm_interpret_no_range_check(uint8_t *bytecode);
 
+interpret_result vm_interpret_no_range_check_resume(void);
+
 interpret_result vm_interpret_threaded(uint8_t *bytecode);
 
+interpret_result vm_interpret_threaded_resume(void);
+
 uint64_t vm_get_result(void);
 
 interpret_result vm_interpret_trace(uint8_t *bytecode);
 
+interpret_result vm_interpret_trace_resume(void);
+
 uint64_t vm_trace_get_result(void);
 
 
 interpret_result vm_rcache_interpret(uint8_t *bytecode);
 
+interpret_result vm_rcache_interpret_resume(void);
+
 interpret_result vm_rcache_interpret_no_range_check(uint8_t *bytecode);
 
+interpret_result vm_rcache_interpret_no_range_check_resume(void);
+
 interpret_result vm_rcache_interpret_threaded(uint8_t *bytecode);
 
+interpret_result vm_rcache_interpret_threaded_resume(void);
+
 uint64_t vm_rcache_get_result(void);
 
 interpret_result vm_rcache_interpret_trace(uint8_t *bytecode);
 
+interpret_result vm_rcache_interpret_trace_resume(void);
+
 uint64_t vm_rcache_trace_get_result(void);
+
+
+interpret_result vm_register_interpret_threaded(uint8_t *bytecode);
+
+interpret_result vm_register_interpret_threaded_resume(void);
+
+uint64_t vm_register_get_result(void);
+
+/* Bytecode translated once and run by the register engine any number of times, translation costs
+ * more than running a short program */
+typedef struct vm_register_program vm_register_program;
+
+/* NULL for bytecode rejected by the analysis */
+vm_register_program *vm_register_program_new(uint8_t *bytecode);
+
+void vm_register_program_free(vm_register_program *program);
+
+/* Run with the first input_len memory cells set to input and the rest zeroed, input_len is at most
+ * MEMORY_SIZE. The result and the resume function are the ones of
+ * vm_register_interpret_threaded. */
+interpret_result vm_register_program_run(vm_register_program *program, const uint64_t *input,
+                                         size_t input_len);
+
+
+/*
+ * Static analysis and ahead-of-time compilation
+ * */
+
+/* depth value for instructions never reached from the entry point */
+#define VM_UNREACHABLE -1
+
+typedef enum analysis_result {
+    ANALYSIS_OK,
+    /* two paths reach the same instruction with different stack depths */
+    ANALYSIS_ERROR_STACK_MISMATCH,
+    ANALYSIS_ERROR_STACK_UNDERFLOW,
+    ANALYSIS_ERROR_STACK_OVERFLOW,
+    /* control flow leaves the MAX_CODE_LEN code area */
+    ANALYSIS_ERROR_CODE_OVERFLOW,
+    /* an instruction is reachable from more than one function, the main code included */
+    ANALYSIS_ERROR_CALL_MISMATCH,
+} analysis_result;
+
+typedef struct vm_analysis {
+    /* stack depth right before the instruction at pc, VM_UNREACHABLE for dead code and arguments.
+     * Depths are counted within the function the instruction belongs to, starting from the first of
+     * the function's arguments: a function is entered with a depth of its argument count. */
+    int16_t depth[MAX_CODE_LEN];
+    /* the entry point of the function the instruction at pc belongs to, 0 for the main code */
+    uint16_t func[MAX_CODE_LEN];
+    /* the first instruction of a basic block */
+    bool is_block_start[MAX_CODE_LEN];
+    /* an instruction some jump, call or return goes to */
+    bool is_jump_target[MAX_CODE_LEN];
+    /* maximum stack depth over all reachable instructions, callees' frames stacked on their
+     * callers' ones */
+    int16_t max_depth;
+    /* the offending instruction if the analysis failed */
+    size_t error_pc;
+} vm_analysis;
+
+/* The big endian argument of the 3 byte instruction at pc, see vm_instruction_len */
+#define ARG_AT_PC(bytecode, pc)                                         \
+    (((uint16_t)(bytecode)[(pc) + 1] << 8) + (bytecode)[(pc) + 2])
+
+/* Instructions are 1 byte long, or 3 with an argument */
+size_t vm_instruction_len(uint8_t *bytecode, size_t pc);
+
+/* The argument of the instruction at pc, 0 for instructions without one */
+uint16_t vm_instruction_arg(uint8_t *bytecode, size_t pc);
+
+/* Stack cells the instruction at pc pops and pushes */
+void vm_instruction_stack_effect(uint8_t *bytecode, size_t pc, int *pops, int *pushes);
+
+analysis_result vm_analyze(uint8_t *bytecode, vm_analysis *analysis);
+
+analysis_result vm_compile_to_c(uint8_t *bytecode, const char *func_name, FILE *out);
+
+
+/*
+ * Specialization (pigletvm-specialize.c)
+ *
+ * Code run with configuration cells set to the same values every time can be specialized for
+ * them: loads of the cells become constants, arithmetic on constants gets computed and branches on
+ * it decided, code left unreachable goes away. The cells still have to hold the values when the
+ * specialized code runs, LOAD with a computed address reads memory as usual. Code must not store to
+ * the cells other than with STOREI, cells written by STOREI are left alone.
+ * */
+
+typedef struct vm_const_cell {
+    uint32_t addr;
+    uint64_t value;
+} vm_const_cell;
+
+/* Specialized code into a MAX_CODE_LEN buffer, its length and the size of its constant pool (both
+ * optional) for vm_image_write. Fails for code failing vm_analyze or not fitting the code area. */
+analysis_result vm_specialize(uint8_t *bytecode, const vm_const_cell *cells, size_t cell_num,
+                              uint8_t *specialized, size_t *code_len, size_t *consts_len);
+
+/* A cache of code specialized for different sets of cells, one per program */
+typedef struct vm_specializer vm_specializer;
+
+/* Copies the MAX_CODE_LEN code area */
+vm_specializer *vm_specializer_new(const uint8_t *bytecode);
+
+void vm_specializer_free(vm_specializer *specializer);
+
+/* Code specialized for the cells, the same for the same cells and values in any order. NULL if the
+ * code cannot be specialized. The code belongs to the specializer. */
+uint8_t *vm_specializer_get(vm_specializer *specializer, const vm_const_cell *cells,
+                            size_t cell_num);
+
+/* Sets of cells specialized for so far */
+size_t vm_specializer_size(const vm_specializer *specializer);
+
+
+/*
+ * Control flow graphs (pigletvm-cfg.c)
+ *
+ * Code lifted into basic blocks, so that optimization passes work on instructions and edges
+ * rather than on byte offsets. Blocks keep the stack depth they are entered with; jumps, branches
+ * and calls ending them point to blocks. Lowering lays the blocks out in the order given,
+ * relocating jumps, dropping the ones to the block that follows and adding ones where a
+ * fallthrough no longer does.
+ * Budgets count the backward jumps of the lowered code.
+ * */
+
+/* no block */
+#define VM_CFG_NONE SIZE_MAX
+
+/* An instruction of a block body, never a jump */
+typedef struct vm_cfg_instr {
+    uint8_t op;
+    /* the immediate argument if the op has one */
+    uint16_t arg;
+} vm_cfg_instr;
+
+typedef struct vm_cfg_block {
+    vm_cfg_instr *instrs;
+    size_t instr_num;
+    size_t instr_cap;
+    /* How the block ends: OP_JUMP to target (falling through is a jump to the next block),
+     * OP_JUMP_IF_TRUE or OP_JUMP_IF_FALSE to target or next, OP_CALL to target returning to next
+     * (VM_CFG_NONE if the callee never returns), or OP_RET, OP_DONE, OP_ABORT and unknown ops
+     * stopping the block with no successors. */
+    uint8_t exit_op;
+    size_t target;
+    size_t next;
+    /* where the block started in the lifted code */
+    uint16_t pc;
+    /* stack depth on entry */
+    int16_t depth;
+    /* how often the block runs compared to others, guessed from loop nesting by lifting, hosts with
+     * a profile can set their own */
+    uint64_t weight;
+    bool is_reachable;
+} vm_cfg_block;
+
+typedef struct vm_cfg {
+    vm_cfg_block *blocks;
+    size_t block_num;
+    /* blocks to lower and their order, the entry block 0 first */
+    size_t *order;
+    size_t order_len;
+    /* the lifted code area, the constant pool comes from there */
+    uint8_t bytecode[MAX_CODE_LEN];
+} vm_cfg;
+
+/* Blocks of code passing vm_analyze into the graph, in code order. Fails as vm_analyze does. */
+analysis_result vm_cfg_lift(uint8_t *bytecode, vm_cfg *cfg);
+
+void vm_cfg_free(vm_cfg *cfg);
+
+/* Lowered code into a MAX_CODE_LEN buffer, its length and the size of its constant pool (both
+ * optional) for vm_image_write. Fails for code not fitting the code area. */
+analysis_result vm_cfg_lower(const vm_cfg *cfg, uint8_t *bytecode, size_t *code_len,
+                             size_t *consts_len);
+
+/* Blocks control can go to from the block, returns their number */
+size_t vm_cfg_successors(const vm_cfg *cfg, size_t block_i, size_t successors[2]);
+
+/*
+ * Dataflow over memory cells
+ *
+ * Cells LOADI, LOADADDI and STOREI name are tracked, in sets of one bit per cell in the order of
+ * the cells array. Loads through computed addresses, bulk ops, calls, returns, yields and stopping
+ * count as reading every cell; stores through computed addresses and calls as possibly writing any.
+ * */
+
+typedef struct vm_cfg_liveness {
+    uint16_t *cells;
+    size_t cell_num;
+    size_t set_words;
+    /* set_words words for each block: cells that may be read before being stored to, from the
+     * start and from the end of the block */
+    uint64_t *live_in;
+    uint64_t *live_out;
+} vm_cfg_liveness;
+
+void vm_cfg_liveness_compute(const vm_cfg *cfg, vm_cfg_liveness *liveness);
+
+void vm_cfg_liveness_free(vm_cfg_liveness *liveness);
+
+/* Can the cell be read after the block before being stored to? Untracked cells always can. */
+bool vm_cfg_is_live_out(const vm_cfg_liveness *liveness, size_t block_i, uint16_t addr);
+
+/* A definition of a cell: a STOREI, or for instr_i VM_CFG_NONE whatever the cell held on entry or
+ * got from a store through a computed address */
+typedef struct vm_cfg_def {
+    uint16_t addr;
+    size_t block_i;
+    size_t instr_i;
+} vm_cfg_def;
+
+typedef struct vm_cfg_reaching {
+    uint16_t *cells;
+    size_t cell_num;
+    /* the unknown definitions first, one per cell in the order of cells */
+    vm_cfg_def *defs;
+    size_t def_num;
+    size_t set_words;
+    /* set_words words for each block: definitions reaching the start and the end of the block */
+    uint64_t *reach_in;
+    uint64_t *reach_out;
+} vm_cfg_reaching;
+
+void vm_cfg_reaching_compute(const vm_cfg *cfg, vm_cfg_reaching *reaching);
+
+void vm_cfg_reaching_free(vm_cfg_reaching *reaching);
+
+/* Definitions of the cell reaching the instruction of the block, indices into defs. Up to def_max
+ * of them go to defs_out, returns how many there are. */
+size_t vm_cfg_reaching_at(const vm_cfg *cfg, const vm_cfg_reaching *reaching, size_t block_i,
+                          size_t instr_i, uint16_t addr, size_t *defs_out, size_t def_max);
+
+/*
+ * Passes
+ * */
+
+/* Rewrites the graph in place, true if anything changed */
+typedef bool vm_cfg_pass(vm_cfg *cfg);
+
+/* Drops blocks no longer reachable from the entry block from the order */
+bool vm_cfg_remove_unreachable(vm_cfg *cfg);
+
+/* Removes pure computations of values only discarded, STOREIs to cells stored to again before
+ * being read, and branches on constants */
+bool vm_cfg_eliminate_dead_code(vm_cfg *cfg);
+
+/* Orders blocks so that the heaviest edges become fallthroughs */
+bool vm_cfg_reorder_blocks(vm_cfg *cfg);
+
+/* Runs the passes in turn until a round changes nothing, true if anything changed */
+bool vm_cfg_run_passes(vm_cfg *cfg, vm_cfg_pass *const *passes, size_t pass_num);
+
+/* Lifts, runs all of the passes above and lowers, see vm_cfg_lower */
+analysis_result vm_optimize(uint8_t *bytecode, uint8_t *optimized, size_t *code_len,
+                            size_t *consts_len);
+
+/*
+ * Program images (pigletvm-image.c)
+ *
+ * The file format written by the assembler: a versioned header with a checksum followed by
+ * sections holding the code with its constants and the analysis results, see pigletvm-image.c for
+ * the layout. Images are meant to be mapped and used in place, loaders of verified images can skip
+ * the analysis. The checksum catches corruption, not forgery: images are as trusted as code.
+ * */
+
+#define VM_IMAGE_VERSION 1
+
+/* the code passed vm_analyze when written, the tables and the depth are valid */
+#define VM_IMAGE_VERIFIED 0x1
+
+typedef enum image_result {
+    IMAGE_OK,
+    /* failed to open, map or read the file */
+    IMAGE_ERROR_IO,
+    /* not an image at all */
+    IMAGE_ERROR_MAGIC,
+    IMAGE_ERROR_VERSION,
+    /* the image is shorter than its header says or a section is out of bounds */
+    IMAGE_ERROR_TRUNCATED,
+    IMAGE_ERROR_CHECKSUM,
+    /* a section is missing or malformed */
+    IMAGE_ERROR_SECTION,
+} image_result;
+
+/* A view of an image, pointers are into the image itself */
+typedef struct vm_image {
+    uint32_t flags;
+    /* MAX_CODE_LEN bytes, the code padded with ABORT, ready to run in place */
+    uint8_t *code;
+    /* the length of the code before the padding */
+    size_t code_len;
+    /* constants at the end of the code area, see vm_const_at */
+    size_t consts_len;
+    /* bitmaps of MAX_CODE_LEN bits, see vm_image_bit */
+    const uint8_t *block_starts;
+    const uint8_t *jump_targets;
+    uint16_t max_depth;
+
+    /* the memory vm_image_map got the image into */
+    void *mapping;
+    size_t mapping_size;
+} vm_image;
+
+static inline bool vm_image_bit(const uint8_t *bitmap, size_t pc)
+{
+    return (bitmap[pc / 8] >> (pc % 8)) & 1;
+}
+
+/* Written whatever the analysis says, code failing it just gets no metadata. With constants the
+ * bytecode has to be a whole code area of MAX_CODE_LEN bytes. */
+analysis_result vm_image_write(const uint8_t *bytecode, size_t code_len, size_t consts_len,
+                               FILE *out);
+
+/* The image has to stay around as long as the view is used */
+image_result vm_image_parse(uint8_t *data, size_t size, vm_image *image);
+
+/* Map a file and parse it, pages are private to the process and copied on write */
+image_result vm_image_map(const char *path, vm_image *image);
+
+void vm_image_unmap(vm_image *image);
+
+
+/*
+ * Embedding (pigletvm-lib.c)
+ *
+ * The API for hosts running the VM as a library. A program is loaded and verified once and then
+ * shared read-only by any number of contexts. A context is the state of a single run, contexts are
+ * independent of each other and of the vm_ engines above, so threads can run a context each at
+ * the same time. Native functions are the only shared state: register them before loading
+ * programs using them.
+ * */
+
+typedef struct pvm_program pvm_program;
+
+typedef struct pvm_context pvm_context;
+
+typedef enum pvm_engine {
+    PVM_ENGINE_SWITCH,
+    /* the switch one on compilers without computed goto */
+    PVM_ENGINE_THREADED,
+} pvm_engine;
+
+/* Copies len bytes of code, at most MAX_CODE_LEN. NULL for code failing vm_analyze, error (unless
+ * NULL) gets the reason. */
+pvm_program *pvm_program_new(const uint8_t *bytecode, size_t len, analysis_result *error);
+
+/* A program from an image, without analysing verified images again. NULL for unverified code
+ * failing vm_analyze. */
+pvm_program *pvm_program_from_image(const vm_image *image, analysis_result *error);
+
+/* A copy sharing nothing with the original, for threads on another NUMA node */
+pvm_program *pvm_program_clone(const pvm_program *program);
+
+void pvm_program_free(pvm_program *program);
+
+/* A context with zeroed memory of its own and an unlimited budget */
+pvm_context *pvm_context_new(void);
+
+/* Bound memory stays the caller's */
+void pvm_context_free(pvm_context *context);
+
+/* Run with the caller's MEMORY_SIZE cells as memory, no copies made; NULL goes back to the memory
+ * of the context. Memory is never cleared between runs. */
+void pvm_context_bind_memory(pvm_context *context, uint64_t *cells);
+
+uint64_t *pvm_context_memory(pvm_context *context);
+
+/* Cells past MEMORY_SIZE, for hosts passing data larger than the flat memory; never cleared
+ * between runs either */
+vm_paged_memory *pvm_context_paged_memory(pvm_context *context);
+
+/* Backward jumps and calls the context may take, see vm_budget; runs use up the budget */
+void pvm_context_set_budget(pvm_context *context, uint64_t budget);
+
+/* Run the program from the start with an empty heap, the program has to outlive the run and its
+ * resumes */
+interpret_result pvm_run(pvm_context *context, const pvm_program *program, pvm_engine engine);
+
+/* Continue a run stopped with ERROR_BUDGET_EXHAUSTED */
+interpret_result pvm_resume(pvm_context *context);
+
+uint64_t pvm_context_result(pvm_context *context);
+
+
+/*
+ * Worker pool (pigletvm-pool.c)
+ *
+ * Threads running batches of jobs with a context each. Workers are pinned to the CPUs of the
+ * process spread over NUMA nodes, their contexts live on their nodes and every node gets a replica
+ * of the programs it runs, so memory-bound programs keep to local memory. Workers out of jobs
+ * steal them from the others.
+ * */
+
+typedef struct pvm_pool pvm_pool;
+
+/* A program as known to the pool, freed along with it */
+typedef struct pvm_pool_program pvm_pool_program;
+
+typedef struct pvm_job {
+    /* Filled in by the caller */
+    pvm_pool_program *program;
+    pvm_engine engine;
+    /* at most MEMORY_SIZE cells put at the start of zeroed memory */
+    const uint64_t *input;
+    size_t input_len;
+
+    /* Filled in by the pool */
+    interpret_result status;
+    uint64_t result;
+    size_t worker;
+    /* time spent in pvm_run */
+    uint64_t elapsed_us;
+} pvm_job;
+
+/* Starts worker_num workers, 0 for a worker per CPU */
+pvm_pool *pvm_pool_new(size_t worker_num);
+
+/* Waits for the workers to stop */
+void pvm_pool_free(pvm_pool *pool);
+
+size_t pvm_pool_worker_num(const pvm_pool *pool);
+
+/* Nodes of the CPUs the process may run on, 1 on hosts without NUMA */
+size_t pvm_pool_node_num(const pvm_pool *pool);
+
+size_t pvm_pool_worker_node(const pvm_pool *pool, size_t worker);
+
+/* The program has to outlive the pool */
+pvm_pool_program *pvm_pool_program_new(pvm_pool *pool, const pvm_program *program);
+
+/* Nodes the program got copied to so far */
+size_t pvm_pool_program_replica_num(const pvm_pool_program *program);
+
+/* Runs all the jobs, each on a fresh memory, and returns once they are done */
+void pvm_pool_run(pvm_pool *pool, pvm_job *jobs, size_t job_num);